@@ -8,9 +8,9 @@ info: demo-info
 #                                                        Configuration
 # --------------------------------------------------------------------
 
-DEMO_CFLAGS := $(CFLAGS) -g -Wall -std=c++0x -O3 \
+DEMO_CFLAGS := $(CFLAGS) -g -Wall -std=c++0x -O3 -pthread \
 				-I$(VLROOT) -I$(EIGENROOT) -I$(SIREENROOT)/include
-DEMO_LDFLAGS := $(LDFLAGS) -L$(LIBDIR) -L$(VLLIB) -lopencv_core \
+DEMO_LDFLAGS := $(LDFLAGS) -pthread -L$(LIBDIR) -L$(VLLIB) -lopencv_core \
 				-lopencv_imgproc -lopencv_highgui -lopencv_contrib -lvl
 
 # Mac OS X Intel 32
@@ -1,8 +1,10 @@
 #include <unistd.h>
 #include <ctime>
 #include <vector>
+#include <sstream>
+#include <cstdlib>
 #include "sireen/file_utility.hpp"
-#include "sireen/image_feature_extract.hpp"
+#include "sireen/batch_encoder.hpp"
 
 /*
  * Main
@@ -15,10 +17,12 @@ int main(int argc, char * argv[]) {
     char result_buf[256]= "res/llc/caltech101.txt";
     char codebook_buf[256]= "res/codebooks/caltech101/cbcaltech101.txt";
     char image_dir_buf[256]= "res/images/caltech101";
+    // number of encoding threads, 0 for all cores
+    int n_threads = 0;
     /*	CHECK THE INPUT OPTIONS	*/
     //initialize the arg options
     int opt;
-    while ((opt = getopt(argc, argv, "r:c:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "r:c:i:t:")) != -1) {
         switch (opt) {
         case 'r':
             sprintf(result_buf, "%s", optarg);
@@ -29,11 +33,15 @@ int main(int argc, char * argv[]) {
         case 'i':
             sprintf(image_dir_buf, "%s", optarg);
             break;
+        case 't':
+            n_threads = atoi(optarg);
+            break;
         default: /* '?' */
             fprintf(stderr, "Usage: %s [options]\n", argv[0]);
             fprintf(stderr, "	-i :PATH to image directory\n");
             fprintf(stderr, "	-r :PATH to result\n");
             fprintf(stderr, "	-c :PATH to codebook\n");
+            fprintf(stderr, "	-t :number of encoding threads, 0 for all cores\n");
 
             return -1;
         }
@@ -56,14 +64,12 @@ int main(int argc, char * argv[]) {
      *	VARIABLE READ & WRITE CACHE
      --------------------------------------------*/
     FILE * outfile;
-    float *codebook = new float[128 * CB_SIZE];
+    // codes with their precomputed norms
+    Codebook codebook;
 
     //counter for reading lines;
     unsigned int done=0;
 
-    // Initiation
-    ImageCoder icoder;
-
 
     /*********************************************
      *  Step 1 - Loading & Check everything
@@ -73,9 +79,7 @@ int main(int argc, char * argv[]) {
         cerr << "codebook not found!" << endl;
         return -1;
     }
-    char delim[2] = ",";
-    futil::file_to_pointer(codebook_path.c_str(), codebook,delim);
-    if (codebook == NULL) {
+    if (!codebook.load(codebook_path, CB_SIZE)) {
         cerr << "codebook error!" << endl;
         return -1;
     }
@@ -88,56 +92,46 @@ int main(int argc, char * argv[]) {
     }
 
     vector<string> all_images;
-    string imgfile;
-    string llcstr;
     futil::get_files_in_dir(all_images,image_dir);
+    // Initiation, one ImageCoder per thread inside the encoder
+    BatchEncoder encoder(codebook, 5);
+    encoder.set_threads(0, n_threads);
     /*********************************************
-     *  Step 2 - Traverse the image directory
+     *  Step 2 - Encode the image directory
      *********************************************/
-    clock_t start = clock();
-    for(unsigned int n = 0; n < all_images.size(); ++n)
+    // wall time, since all cores work
+    time_t start = time(NULL);
+    // results come in the order of the files, written by this thread
+    encoder.encode(all_images, [&](const EncodedImage& image)
     {
-        // load image source to Mat format(opencv2.4.9)
-        // using the simple llcDescripter interface from
-        // ImageCoder
-        imgfile = all_images[n];
-        try
-        {
-            Mat src_image = imread(imgfile,0);
-            if(!src_image.data)
-            {
-                cout << "\tinvalid source image! --> " << imgfile << endl;
-                continue;
-            }
-            llcstr = icoder.llc_sift(src_image, codebook, CB_SIZE, 5);
-            // cout << llcstr << endl;
-        }
-        catch(...)
+        if(!image.ok)
         {
-            cout << "\tbroken image! --> " << imgfile << endl;
-            continue;
+            cout << "\tinvalid or broken image! --> " << image.path << endl;
+            return;
         }
 
-
         /*********************************************
-         *  Step 4 -  write result to file
+         *  Step 3 -  write result to file
          *********************************************/
 
         // correct file
-        fprintf(outfile, "%s\t", imgfile.c_str());
-        fprintf(outfile, "%s\n", llcstr.c_str());
+        // output the result in squeezed form as ImageCoder::llc_sift
+        fprintf(outfile, "%s\t", image.path.c_str());
+        ostringstream s;
+        s << image.llc[0];
+        for(int i=1; i<CB_SIZE; ++i)
+            s << "," << image.llc[i];
+        fprintf(outfile, "%s\n", s.str().c_str());
         // succeed count
         done++;
         // print info
         if(done % 10== 0){
             cout << "\t" << done << " Processed..." << endl;
         }
-
-    }
+    });
     cout << "\t" << done << " Processed...(done)"
-         << " <Elasped Time: " << float(clock() -start)/CLOCKS_PER_SEC
+         << " <Elasped Time: " << difftime(time(NULL), start)
          << "s>"<< endl;
-    delete codebook;
     fclose(outfile);
 
 }
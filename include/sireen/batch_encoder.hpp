@@ -0,0 +1,160 @@
+// Multi-threaded batch encoding of image files into LLC features
+//
+// An ImageCoder owns the buffers of its sift filters and cannot be
+// shared by threads, so the encoder runs a pipeline of its own:
+//
+// 1. decode threads read an image file, convert it to gray levels and
+//    resize it to the standard frame of the coder;
+// 2. encode threads, each with its own ImageCoder, compute the sift
+//    descriptors and their LLC code;
+// 3. the calling thread hands the results to a sink, either in the
+//    order of the input files or as soon as they are done.
+//
+// Stages are linked by bounded queues, so decoded images never pile
+// up ahead of slow encoders, and in ordered mode the number of images
+// in flight is bounded as well.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+
+#ifndef SIREEN_BATCH_ENCODER_H_
+#define SIREEN_BATCH_ENCODER_H_
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "sireen/image_feature_extract.hpp"
+
+using namespace std;
+
+// Encoded image handed to the sink
+struct EncodedImage
+{
+    /** position of the image in the input list */
+    size_t index;
+    /** image file path */
+    string path;
+    /** false if the image could not be read or encoded */
+    bool ok;
+    /** llc code of codebook size elements, empty if not ok */
+    vector<float> llc;
+};
+
+// Batch Encoder Class
+// Sample Usage:
+//    BatchEncoder encoder(codebook, 500, 5);
+//    encoder.encode(all_images, [&](const EncodedImage& image){
+//        if(image.ok) write(image.path, image.llc);
+//    });
+class BatchEncoder
+{
+public:
+    /** descriptors the llc code is computed from */
+    enum Descriptor
+    {
+        /** sift of detected keypoints, as ImageCoder::llc_sift */
+        SIFT,
+        /** dense sift, as ImageCoder::llc_dense_sift */
+        DENSE_SIFT
+    };
+    /** receiver of encoded images, called by the thread calling encode */
+    typedef function<void(const EncodedImage&)> Sink;
+
+private:
+    /** codebook from sift-kmeans with the norms of its codes */
+    Codebook codebook_;
+    /** top k nearest codes */
+    int k_;
+    Descriptor descriptor_;
+    /** ImageCoder parameters */
+    int std_width_;
+    int std_height_;
+    int step_;
+    int bin_size_;
+    /** number of decode and encode threads, 0 for automatic */
+    size_t n_decoders_;
+    size_t n_encoders_;
+    /** capacity of the queues between stages */
+    size_t queue_capacity_;
+    /** hand images to the sink in input order */
+    bool ordered_;
+
+    /**
+     * read an image file as gray levels in the standard frame, as
+     * ImageCoder::decode_image does
+     *
+     * @param path   image file path
+     * @param pixels output pixel values in row-major order
+     *
+     * @return false if the image cannot be read
+     */
+    bool decode(const string&, vector<float>&) const;
+
+public:
+    /**
+     * Constructor
+     *
+     * @param codebook   codebook from sift-kmeans, copied
+     * @param ncb        dimension of codebook
+     * @param k          get top k nearest codes
+     * @param descriptor descriptors the code is computed from
+     */
+    BatchEncoder(const float*, const int, const int k = 5,
+                 const Descriptor descriptor = SIFT);
+    /**
+     * Constructor Overloading
+     *
+     * @param codebook   codebook from sift-kmeans, copied
+     * @param k          get top k nearest codes
+     * @param descriptor descriptors the code is computed from
+     */
+    BatchEncoder(const Codebook&, const int k = 5,
+                 const Descriptor descriptor = SIFT);
+    /**
+     * set parameters of the ImageCoder of each thread
+     *
+     * @param std_width  standard image resize frame width
+     * @param std_height standard image resize frame height
+     * @param step       VlDsiftFilter step parameter
+     * @param bin_size   VlDsiftFilter binSize parameter
+     */
+    void set_image_params(const int, const int, const int, const int);
+    /**
+     * set the number of threads of the stages
+     *
+     * @param n_decoders threads reading images, 0 for a quarter of
+     *                   the hardware threads
+     * @param n_encoders threads encoding images, 0 for all the
+     *                   hardware threads
+     */
+    void set_threads(const size_t, const size_t);
+    /**
+     * set the capacity of the queues between stages
+     *
+     * @param capacity maximum number of images waiting for a stage
+     */
+    void set_queue_capacity(const size_t);
+    /**
+     * set whether images reach the sink in input order. Otherwise
+     * they come as soon as they are encoded.
+     *
+     * @param ordered true for input order
+     */
+    void set_ordered(const bool ordered) {this->ordered_ = ordered; }
+    /**
+     * Encode image files. The sink is called by the calling thread
+     * for each image, including images that could not be read or
+     * encoded. An exception thrown by the sink stops the pipeline
+     * and is re-thrown.
+     *
+     * @param paths image file paths
+     * @param sink  receiver of the encoded images
+     *
+     * @return number of images encoded
+     */
+    size_t encode(const vector<string>&, const Sink&) const;
+};
+#endif //SIREEN_BATCH_ENCODER_H_
@@ -0,0 +1,84 @@
+// Codebook of sift words for the LLC coding of ImageCoder
+//
+// The codes are kept in one aligned Eigen matrix, a code per column,
+// together with their squared norms, which the distances of every
+// descriptor to the codebook need and which are computed once here
+// instead of once per image.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+
+#ifndef SIREEN_CODEBOOK_H_
+#define SIREEN_CODEBOOK_H_
+#include <string>
+
+// Eigen Linear Algebra
+#include <Eigen/Dense>
+
+using namespace std;
+
+// Codebook Class
+// Sample Usage:
+//    Codebook codebook;
+//    codebook.load(path_to_codebook, 500);
+//    icoder.llc_sift(src_image, codebook, 5);
+class Codebook
+{
+private:
+    /** codes, descriptor size x number of codes */
+    Eigen::MatrixXf words_;
+    /** squared norm of each code */
+    Eigen::VectorXf norms_;
+
+    /** recompute the squared norms of the codes */
+    void update_norms();
+
+public:
+    /** Default Constructor, an empty codebook */
+    Codebook(void);
+    /**
+     * Constructor Overloading, copies the codes
+     *
+     * @param codes      codes in a row, descr_size values each, as
+     *                   written by the codebook training
+     * @param ncb        number of codes
+     * @param descr_size descriptor size
+     */
+    Codebook(const float*, const int, const int descr_size = 128);
+    /**
+     * copy codes into the codebook
+     *
+     * @param codes      codes in a row, descr_size values each
+     * @param ncb        number of codes
+     * @param descr_size descriptor size
+     */
+    void assign(const float*, const int, const int descr_size = 128);
+    /**
+     * read a codebook file of delimited values, codes in a row
+     *
+     * @param filename   codebook file
+     * @param ncb        number of codes
+     * @param descr_size descriptor size
+     * @param delim      delimiter between values, besides white spaces
+     *
+     * @return false if the file cannot be read or holds too few values
+     */
+    bool load(const string&, const int, const int descr_size = 128,
+              const char delim = ',');
+    /** number of codes */
+    int size() const {return this->words_.cols(); }
+    /** descriptor size, i.e. dimension of a code */
+    int descriptor_size() const {return this->words_.rows(); }
+    /** true if the codebook has no code */
+    bool empty() const {return this->words_.size() == 0; }
+    /** codes, one per column */
+    const Eigen::MatrixXf& words() const {return this->words_; }
+    /** squared norm of each code */
+    const Eigen::VectorXf& squared_norms() const {return this->norms_; }
+    /** codes in a row, for functions taking a bare codebook */
+    const float* data() const {return this->words_.data(); }
+};
+#endif //SIREEN_CODEBOOK_H_
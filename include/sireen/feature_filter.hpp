@@ -0,0 +1,177 @@
+// Filters of features by per-item attributes, evaluated by the nearest
+// neighbour indexes on every candidate before its distance is computed.
+//
+// A filtered-out feature never costs a distance computation, and an
+// index keeps searching until k accepted features are found, instead
+// of the caller scoring everything and dropping rows afterwards as
+// lib/nenese does for its constraint and category columns.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_FEATURE_FILTER_H_
+#define SIREEN_FEATURE_FILTER_H_
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Predicate on the index of a feature, as given to build or insert
+    /// of an index.
+    ///
+    class FeatureFilter
+    {
+    public:
+        virtual ~FeatureFilter() {}
+        /**
+         * Whether a feature may be returned by a search
+         *
+         * @param index feature index
+         *
+         * @return true to keep the feature
+         */
+        virtual bool accept(const size_t) const = 0;
+    };
+
+    ///
+    /// One bit per feature index, e.g. the active items of a category.
+    /// Indices beyond the bitmap are rejected.
+    ///
+    /// Usage:
+    ///     BitmapFilter active(n);
+    ///     active.set(index);
+    ///     kdtree.knn_search(feature, 10, 0, EUCLIDEAN, &active);
+    class BitmapFilter : public FeatureFilter
+    {
+    private:
+        /** 64 feature indices per word */
+        vector<uint64_t> bits_;
+        /** number of feature indices covered */
+        size_t size_;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param n     number of feature indices covered
+         * @param value initial bit of all indices
+         */
+        explicit BitmapFilter(const size_t n = 0, const bool value = false);
+        /**
+         * set the bit of a feature index, the bitmap grows if needed
+         *
+         * @param index feature index
+         * @param value true to accept the feature
+         */
+        void set(const size_t, const bool value = true);
+        /** number of accepted features */
+        size_t count() const;
+        /** number of feature indices covered */
+        size_t size() const {return this->size_; }
+        bool accept(const size_t index) const
+        {
+            return index < this->size_
+                && (this->bits_[index >> 6] >> (index & 63)) & 1;
+        }
+    };
+
+    ///
+    /// Column store of small attribute codes, one column per attribute
+    /// (e.g. state, merchant or category id) and one code per feature
+    /// index. A feature is accepted if, for every column with allowed
+    /// codes, its code is one of them. Columns without allowed codes
+    /// do not constrain.
+    ///
+    /// Usage:
+    ///     AttributeFilter filter;
+    ///     size_t state = filter.add_column(states, n);
+    ///     size_t category = filter.add_column(categories, n);
+    ///     filter.allow(state, 1);
+    ///     filter.allow(category, 12);
+    ///     filter.allow(category, 13);
+    class AttributeFilter : public FeatureFilter
+    {
+    private:
+        /** attribute codes of each column, by feature index */
+        vector<vector<uint32_t> > columns_;
+        /** bitmap of the allowed codes of each column */
+        vector<vector<uint64_t> > allowed_;
+
+    public:
+        /**
+         * add an attribute column
+         *
+         * @param codes attribute code of features 0 to n - 1
+         * @param n     number of features
+         *
+         * @return column id
+         */
+        size_t add_column(const uint32_t*, const size_t);
+        /**
+         * set the code of a feature in a column, the column grows if
+         * needed and new features get code 0
+         *
+         * @param column column id
+         * @param index  feature index
+         * @param code   attribute code
+         */
+        void set_code(const size_t, const size_t, const uint32_t);
+        /**
+         * accept features with a code in a column
+         *
+         * @param column column id
+         * @param code   attribute code
+         */
+        void allow(const size_t, const uint32_t);
+        /**
+         * remove all allowed codes of a column, so it does not
+         * constrain any more
+         *
+         * @param column column id
+         */
+        void clear_allowed(const size_t);
+        /** number of columns */
+        size_t n_columns() const {return this->columns_.size(); }
+        bool accept(const size_t) const;
+    };
+
+    ///
+    /// Any callable on a feature index as a filter, e.g. a threshold
+    /// on a column of scores.
+    ///
+    /// Usage:
+    ///     auto filter = make_filter([&](size_t i){return rate[i] > 0.5;});
+    template <class F>
+    class PredicateFilter : public FeatureFilter
+    {
+    private:
+        F predicate_;
+
+    public:
+        explicit PredicateFilter(const F& predicate) : predicate_(predicate){}
+        bool accept(const size_t index) const {return this->predicate_(index); }
+    };
+
+    /**
+     * wrap a callable on a feature index as a filter
+     *
+     * @param predicate callable returning true to keep a feature
+     *
+     * @return filter calling predicate
+     */
+    template <class F>
+    inline PredicateFilter<F> make_filter(const F& predicate)
+    {
+        return PredicateFilter<F>(predicate);
+    }
+}
+#endif //SIREEN_FEATURE_FILTER_H_
@@ -0,0 +1,151 @@
+// IEEE 754 half precision storage type. Only the storage is in half
+// precision, all arithmetic is done after converting to float.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_FLOAT16_H_
+#define SIREEN_FLOAT16_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// spatial
+namespace spat
+{
+    /**
+     * Convert a single precision value to half precision bits with
+     * round-to-nearest-even. Overflow goes to infinity and values
+     * below the smallest subnormal go to (signed) zero.
+     *
+     * @param f single precision value
+     *
+     * @return half precision bits
+     */
+    inline uint16_t float_to_half_bits(const float f)
+    {
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        const uint32_t sign = (x >> 16) & 0x8000;
+        uint32_t mant = x & 0x7fffff;
+        const int exp = (x >> 23) & 0xff;
+
+        // inf and nan, keep nan quiet
+        if(exp == 0xff)
+            return sign | 0x7c00 | (mant ? 0x200 : 0);
+        // re-bias the exponent
+        const int e = exp - 127 + 15;
+        if(e >= 0x1f)
+            return sign | 0x7c00;
+        // subnormal half or zero
+        if(e <= 0)
+        {
+            if(e < -10)
+                return sign;
+            mant |= 0x800000;
+            const int shift = 14 - e;
+            uint32_t h = mant >> shift;
+            const uint32_t rem = mant & ((1u << shift) - 1);
+            const uint32_t halfway = 1u << (shift - 1);
+            if(rem > halfway || (rem == halfway && (h & 1)))
+                ++h;
+            return sign | h;
+        }
+        // normal half, a carry of the rounding goes into the exponent
+        // which is exactly what we want
+        uint32_t h = sign | (e << 10) | (mant >> 13);
+        const uint32_t rem = mant & 0x1fff;
+        if(rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+            ++h;
+        return h;
+    }
+
+    /**
+     * Convert half precision bits to single precision value, this is
+     * exact for every half value.
+     *
+     * @param h half precision bits
+     *
+     * @return single precision value
+     */
+    inline float half_bits_to_float(const uint16_t h)
+    {
+        const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        uint32_t x;
+
+        if(exp == 0)
+        {
+            if(mant == 0)
+            {
+                x = sign;
+            }
+            else
+            {
+                // normalize the subnormal value
+                exp = 127 - 15 + 1;
+                while(!(mant & 0x400))
+                {
+                    mant <<= 1;
+                    --exp;
+                }
+                x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+            }
+        }
+        else if(exp == 0x1f)
+        {
+            x = sign | 0x7f800000 | (mant << 13);
+        }
+        else
+        {
+            x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        }
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    /// Half precision storage type. Converts implicitly to float, so
+    /// the templated metrics and kd-tree code work on it with float
+    /// accumulation.
+    struct float16
+    {
+        /** raw IEEE 754 binary16 bits */
+        uint16_t bits;
+
+        float16() : bits(0) {}
+        float16(const float f) : bits(float_to_half_bits(f)) {}
+        operator float() const {return half_bits_to_float(bits); }
+    };
+
+    /**
+     * convert an array of single precision values to half precision
+     *
+     * @param src single precision values
+     * @param dst half precision output
+     * @param n   number of values
+     */
+    inline void float_to_half(const float* src, float16* dst, const size_t n)
+    {
+        for(size_t i = 0; i < n; ++i)
+            dst[i] = float16(src[i]);
+    }
+
+    /**
+     * convert an array of half precision values to single precision
+     *
+     * @param src half precision values
+     * @param dst single precision output
+     * @param n   number of values
+     */
+    inline void half_to_float(const float16* src, float* dst, const size_t n)
+    {
+        for(size_t i = 0; i < n; ++i)
+            dst[i] = src[i];
+    }
+}
+#endif //SIREEN_FLOAT16_H_
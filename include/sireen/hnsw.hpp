@@ -0,0 +1,342 @@
+// Hierarchical Navigable Small World graph for approximate nearest
+// neighbour search of high dimensional features. This implementation
+// has following features:
+//
+// 1. Features are linked on layers of proximity graphs, the upper
+//    layers hold exponentially fewer features and long links, so a
+//    search descends greedily from the top layer and only explores a
+//    bounded candidate list on the bottom layer.
+// 2. M, efConstruction and efSearch are configurable, links are chosen
+//    by the neighbour selection heuristic of Malkov and Yashunin.
+// 3. Features are inserted by all threads of a pool, each feature is
+//    guarded by its own lock while the graph is built. Searching a
+//    built graph takes no lock.
+// 4. Save and load in a versioned binary format.
+// 5. Searches may be filtered by a predicate on feature indices. The
+//    bottom layer still walks through rejected features, which keeps
+//    the graph connected, but only accepted ones enter the candidate
+//    list of ef results, so the search goes on until it finds them.
+//
+// For details, refer to:
+//
+// Malkov, Y. A.; Yashunin, D. A., "Efficient and robust approximate
+// nearest neighbor search using Hierarchical Navigable Small World
+// graphs, " IEEE Transactions on Pattern Analysis and Machine
+// Intelligence, 2018
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_HNSW_H_
+#define SIREEN_HNSW_H_
+
+#include <vector>
+#include <string>
+#include <mutex>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Hierarchical navigable small world graph. T is the type of
+    /// feature elements, instantiated for double (HNSW) and float
+    /// (HNSWF).
+    ///
+    /// Usage:
+    ///     // 500 dimension, M = 16, efConstruction = 200
+    ///     HNSW graph(500, 16, 200);
+    ///     // from a row-major 300 x 500 matrix
+    ///     graph.build(matrix, 300);
+    ///     graph.set_ef_search(100);
+    ///     // top 5 closest features
+    ///     graph.knn(feature, 5);
+    ///     graph.save("graph.hnsw");
+    template <class T>
+    class BasicHNSW
+    {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances and queries */
+        typedef T dist_type;
+        typedef BasicFeature<T> Feature;
+    private:
+        // row of the feature matrix bound with its distance
+        typedef KeyValue<uint32_t, dist_type> RowBind;
+        /// Buffers of a search kept between queries
+        struct SearchScratch
+        {
+            /** visit tag of each row, a row is visited if its tag is
+             *  the current one */
+            vector<uint32_t> visited;
+            /** current visit tag */
+            uint32_t tag;
+            /** min-heap of candidates to expand */
+            vector<RowBind> candidates;
+            /** bounded max-heap of the closest rows found */
+            vector<RowBind> results;
+            /** neighbour list copied under lock while building */
+            vector<uint32_t> links;
+            SearchScratch() : tag(0) {}
+        };
+        /** row-major feature matrix in insertion order */
+        T* data_;
+        /** whether data_ is allocated by the graph */
+        bool owns_data_;
+        /** feature index of each row of data_ */
+        vector<size_t> index_;
+        /** feature dimension */
+        size_t dimension_;
+        /** number of links of a feature on the upper layers */
+        size_t m_;
+        /** number of links of a feature on the bottom layer, 2M */
+        size_t m0_;
+        /** candidate list size of insertion */
+        size_t ef_construction_;
+        /** candidate list size of search */
+        size_t ef_search_;
+        /** top layer of each row */
+        vector<uint32_t> levels_;
+        /** bottom layer links, row i owns m0_ + 1 slots from
+         *  i * (m0_ + 1), the first one is the number of links */
+        vector<uint32_t> links0_;
+        /** upper layer links of each row, layer l in [1, levels_[i]]
+         *  owns m_ + 1 slots from (l - 1) * (m_ + 1) */
+        vector<vector<uint32_t> > links_;
+        /** row to start searches from, on the top layer */
+        uint32_t entry_point_;
+        /** top layer of the graph */
+        uint32_t max_level_;
+        /** one lock per row while building */
+        mutable vector<mutex> row_locks_;
+        /** guards entry_point_ and max_level_ while building */
+        mutex entry_lock_;
+
+        // non-copyable, the graph may own its feature matrix
+        BasicHNSW(const BasicHNSW&);
+        BasicHNSW& operator=(const BasicHNSW&);
+
+        /** Release the feature matrix if it is owned by the graph */
+        void release_data();
+        /**
+         * Draw the layers of the rows and insert them into the graph
+         *
+         * @param n    number of features
+         * @param pool thread pool for the insertion, NULL for the global
+         *             pool
+         */
+        void build_graph(const size_t, putil::ThreadPool*);
+        /** links of a row on a layer, the first slot is the count */
+        uint32_t* links(const uint32_t row, const uint32_t level)
+        {
+            return level == 0 ? &this->links0_[row * (this->m0_ + 1)]
+                : &this->links_[row][(level - 1) * (this->m_ + 1)];
+        }
+        const uint32_t* links(const uint32_t row, const uint32_t level) const
+        {
+            return level == 0 ? &this->links0_[row * (this->m0_ + 1)]
+                : &this->links_[row][(level - 1) * (this->m_ + 1)];
+        }
+        /**
+         * Links of a row on a layer. While building, they are copied
+         * into the scratch under the row lock.
+         *
+         * @param row     row of the links
+         * @param level   layer of the links
+         * @param locked  whether links are read under row locks
+         * @param scratch search buffers
+         *
+         * @return links, the first one is the number of links
+         */
+        const uint32_t* read_links(const uint32_t, const uint32_t,
+                                   const bool, SearchScratch&) const;
+        /** squared euclidean distance between a query and a row */
+        dist_type distance(const dist_type* feature, const uint32_t row) const
+        {
+            return spat::squared_euclidean(this->data_ + row * this->dimension_,
+                                           feature, this->dimension_);
+        }
+        /**
+         * Insert a row into the graph, the row must have its layer
+         * drawn and its links allocated.
+         *
+         * @param row     row to insert
+         * @param scratch search buffers
+         */
+        void insert(const uint32_t, SearchScratch&);
+        /**
+         * Greedy search of the closest row on a layer
+         *
+         * @param feature query feature data in array form
+         * @param entry   row to start from
+         * @param level   layer to search
+         * @param locked  whether links are read under row locks
+         * @param scratch search buffers
+         *
+         * @return the closest row found bound with its distance
+         */
+        RowBind search_greedy(const dist_type*, RowBind, const uint32_t,
+                              const bool, SearchScratch&) const;
+        /**
+         * Best first search of a layer with a candidate list of ef rows,
+         * the result is a max-heap of the ef closest rows found.
+         *
+         * @param feature query feature data in array form
+         * @param entry   row to start from
+         * @param ef      size of the candidate list
+         * @param level   layer to search
+         * @param locked  whether links are read under row locks
+         * @param scratch search buffers, scratch.results takes the result
+         * @param filter  features a result must be accepted by, NULL for
+         *                all. Rejected rows are expanded but never results.
+         */
+        void search_layer(const dist_type*, const RowBind, const size_t,
+                          const uint32_t, const bool, SearchScratch&,
+                          const FeatureFilter* filter = NULL) const;
+        /**
+         * Select at most max_links neighbours among candidates by the
+         * heuristic of Malkov and Yashunin: a candidate is kept only if
+         * it is closer to the base than to every kept one, so links
+         * spread over directions instead of one dense cluster.
+         *
+         * @param candidates candidates bound with their distances to the
+         *                   base, re-ordered and truncated to the result
+         * @param max_links  greatest number of neighbours
+         */
+        void select_neighbours(vector<RowBind>&, const size_t) const;
+        /**
+         * Add a link from row to neighbour on a layer, the links of the
+         * row are shrunk by the heuristic if it is full. The row must
+         * be locked by the caller.
+         *
+         * @param row       row to link from
+         * @param neighbour row to link to
+         * @param level     layer of the link
+         */
+        void add_link(const uint32_t, const uint32_t, const uint32_t);
+        /**
+         * k-nearest-neighbour search core
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour searched
+         * @param scratch search buffers, scratch.results takes the
+         *                result as a max-heap of squared distances
+         * @param filter  features a result must be accepted by, NULL for
+         *                all
+         */
+        void search(const dist_type*, const size_t, SearchScratch&,
+                    const FeatureFilter* filter = NULL) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d               feature dimension
+         * @param m               number of links of a feature on the
+         *                        upper layers, 2M on the bottom layer
+         * @param ef_construction candidate list size of insertion
+         */
+        BasicHNSW(const size_t, const size_t m = 16,
+                  const size_t ef_construction = 200);
+        /** Destructor */
+        ~BasicHNSW();
+        /**
+         * set the candidate list size of search, a larger one gives
+         * a better recall but slower search. The list is never shorter
+         * than the number of neighbours searched.
+         *
+         * @param ef candidate list size
+         */
+        void set_ef_search(const size_t ef) {this->ef_search_ = ef; }
+        /**
+         * build the graph from input features, the features are copied
+         * into one matrix.
+         *
+         * @param features an array of features
+         * @param n        number of features
+         * @param pool     thread pool for the insertion, NULL for the
+         *                 global pool
+         */
+        void build(Feature*, const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * build the graph from a row-major feature matrix. The i-th row
+         * gets feature index i.
+         *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param copy  if true, the graph builds on its own copy of the
+         *              matrix. Otherwise data is used as is, it is never
+         *              modified but must outlive the graph.
+         * @param pool  thread pool for the insertion, NULL for the global
+         *              pool
+         */
+        void build(T*, const size_t, const bool copy = true,
+                   putil::ThreadPool* pool = NULL);
+        /** number of features indexed */
+        size_t size() const {return this->index_.size(); }
+        /**
+         * Search for approximate k nearest neighbours. Results are in
+         * the same order as BasicKDTree::knn_bbf_opt.
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour returned
+         * @param filter  features a result must be accepted by, NULL for
+         *                all
+         *
+         * @return
+         */
+        std::vector<Feature> knn(const dist_type*, size_t,
+                                 const FeatureFilter* filter = NULL) const;
+        /**
+         * Search k nearest neighbours of many queries at once, see
+         * BasicKDTree::knn_batch.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output euclidean distances, nq x k, may be
+         *                   NULL if not needed
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const dist_type*, const size_t, const size_t,
+                       size_t*, dist_type*,
+                       const FeatureFilter* filter = NULL,
+                       putil::ThreadPool* pool = NULL) const;
+        /**
+         * Save the graph and its features to a binary file. Numbers are
+         * stored in the byte order of the machine.
+         *
+         * @param path file path
+         *
+         * @return true on success, false if the graph is not built
+         */
+        bool save(const string&) const;
+        /**
+         * Load a graph saved by save, the graph owns the loaded
+         * features. The feature type and dimension must match.
+         *
+         * @param path file path
+         *
+         * @return true on success, false if the file is not a valid graph
+         *         of this type and dimension
+         */
+        bool load(const string&);
+    };
+
+    typedef BasicHNSW<double> HNSW;
+    typedef BasicHNSW<float> HNSWF;
+
+    extern template class BasicHNSW<double>;
+    extern template class BasicHNSW<float>;
+}
+#endif //SIREEN_HNSW_H_
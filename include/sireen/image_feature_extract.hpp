@@ -27,6 +27,8 @@
 // Eigen Linear Algebra
 #include <Eigen/Dense>
 
+#include "sireen/codebook.hpp"
+
 using namespace cv;
 using namespace std;
 using namespace Eigen;
@@ -37,6 +39,67 @@ extern "C" {
 #include <vl/dsift.h>
 };
 
+// Accumulated time of the encoding stages in seconds
+struct EncodeTimes
+{
+    /** sift or dense sift descriptors */
+    double descriptor;
+    /** descriptor normalization and distances to the codebook */
+    double distance;
+    /** k nearest codes of each descriptor */
+    double selection;
+    /** llc weights of each descriptor */
+    double solve;
+    /** pooling and normalization of the code */
+    double pooling;
+    /** number of images encoded */
+    size_t images;
+    EncodeTimes() : descriptor(0), distance(0), selection(0), solve(0),
+                    pooling(0), images(0) {}
+};
+
+// Pooling of the llc weights of the descriptors into the image code
+enum LLCPooling
+{
+    /** largest weight of each code, as Jinjun Wang et al.(2010) */
+    MAX_POOLING,
+    /** sum of the weights of each code */
+    SUM_POOLING
+};
+
+// Buffers of the llc coding kept by ImageCoder between images, they
+// are only reallocated when the number of keypoints, the codebook
+// size or k changes
+struct LLCWorkspace
+{
+    /** distances of each descriptor to the codes, ncb x keypoints */
+    MatrixXf cdist;
+    /** k nearest codes of each descriptor, k x keypoints */
+    MatrixXi knn_idx;
+    /** sorted k smallest distances of a descriptor */
+    VectorXf best;
+    /** number of descriptors weighting each code, ncb */
+    VectorXi hits;
+    /** differences between a descriptor and its k nearest codes */
+    MatrixXf U;
+    /** covariance of the differences, k x k */
+    MatrixXf covariance;
+    /** decomposition of the covariance */
+    LDLT<MatrixXf> ldlt;
+    /** llc weights of a descriptor */
+    VectorXf c_hat;
+    /** packed covariance triangles of the batched solvers */
+    ArrayXXf lower;
+    /** llc weights of each descriptor, keypoints x k */
+    ArrayXXf weights;
+    /** squared norms of a codebook given as a bare array */
+    VectorXf cb_norms;
+    /** sift descriptors of the keypoints */
+    vector<float> sift_descr;
+    /** llc code of the image */
+    VectorXf llc;
+};
+
 // Image Coder Class
 // Sample Usage:
 //    ImageCoder icoder;
@@ -67,6 +130,13 @@ private:
     // sift filter
     VlSiftFilt* sift_filter_;
 
+    // time of the encoding stages
+    EncodeTimes times_;
+    // buffers of the llc coding
+    LLCWorkspace workspace_;
+    // pooling of the llc weights
+    LLCPooling pooling_;
+
     /**
      * set parameters for ImageCoder
      *
@@ -86,17 +156,66 @@ private:
     float* decode_image(Mat);
     /**
      * compute linear local constraint coding descriptor from dsift
-     * descriptors
+     * descriptors, in the buffers of the workspace
      *
-     * @param dsift_descr dsift descriptors
+     * @param dsift_descr dsift descriptors, normalized in place
      * @param codebook    codebook from sift-kmeans
+     * @param cb_norms    squared norms of the codes, NULL to compute them
      * @param ncb         dimension of codebook
      * @param k           get top k nearest codes
-     * @param out         output vector will take the llc result
+     * @param descr_size  descriptor size
+     * @param n_keypoints number of descriptors
+     *
+     * @return Eigen vector take the llc value, valid until the next call
+     */
+    const VectorXf& llc_process(float*, const float*, const float*, const int,
+                                const int, const int, const int);
+    /**
+     * llc code of the dense sift of an image
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param cb_norms   squared norms of the codes, NULL to compute them
+     * @param ncb        dimension of codebook
+     * @param k          get top k nearest codes
+     *
+     * @return llc code, valid until the next call
+     */
+    const VectorXf& dense_llc(float*, const float*, const float*, const int,
+                              const int);
+    /**
+     * llc code of the sift keypoints of an image
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param cb_norms   squared norms of the codes, NULL to compute them
+     * @param ncb        dimension of codebook
+     * @param k          get top k nearest codes
      *
-     * @return Eigen vector take the llc valuex
+     * @return llc code, valid until the next call
      */
-    VectorXf llc_process(float*, float*, const int, const int, const int, const int);
+    const VectorXf& sift_llc(float*, const float*, const float*, const int,
+                             const int);
+    /**
+     * output the llc code in squeezed form
+     * (i.e. bis after floating points are omitted)
+     *
+     * @param llc llc code
+     *
+     * @return comma separated values
+     */
+    static string llc_to_string(const VectorXf&);
+    /**
+     * sift feature improvement and normalization in place
+     *
+     * @param descriptors sift descriptors
+     * @param row         number of rows
+     * @param col         number of column
+     * @param normalized  flag for normalized input
+     */
+    void normalize_sift(float *, int, int, const bool);
 
 
 public:
@@ -117,6 +236,19 @@ public:
     ImageCoder(VlDsiftFilter*);
     /** Destructor */
     ~ImageCoder(void);
+    /**
+     * decode image to graylevel values resized to a frame by
+     * row-order, shared by decode_image and the BatchEncoder
+     * decoders.
+     *
+     * @param src_image opencv Mat image
+     * @param width     frame width
+     * @param height    frame height
+     * @param pixels    output array of width x height values
+     *
+     * @return false if the image has no data
+     */
+    static bool decode_image(Mat, const int, const int, float*);
     /**
      * encode dense-sift descriptors
      *
@@ -137,6 +269,29 @@ public:
      * @return a conversion from llc feature to string
      */
     string llc_dense_sift(float* , float*, const int, const int, vector<float> &);
+    /**
+     * compute linear local constraint coding descriptor into a
+     * caller's array, without the string conversion
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param ncb        dimension of codebook
+     * @param k          get top k nearest codes
+     * @param out        output array of ncb elements
+     */
+    void llc_dense_sift(float*, float*, const int, const int, float*);
+    /**
+     * compute linear local constraint coding descriptor into a
+     * caller's array, with the precomputed norms of a codebook
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param k          get top k nearest codes
+     * @param out        output array of codebook size elements
+     */
+    void llc_dense_sift(float*, const Codebook&, const int, float*);
     /**
      * compute linear local constraint coding descriptor
      *
@@ -148,7 +303,53 @@ public:
      * @return a conversion from llc feature to string
      */
     string llc_dense_sift(Mat, float*, const int, const int);
+    /**
+     * compute linear local constraint coding descriptor, with the
+     * precomputed norms of a codebook
+     *
+     * @param src_image source image in opencv mat format
+     * @param codebook  codebook from sift-kmeans
+     * @param k         get top k nearest codes
+     *
+     * @return a conversion from llc feature to string
+     */
+    string llc_dense_sift(Mat, const Codebook&, const int);
     string llc_sift(Mat, float*, const int, const int);
+    /**
+     * compute linear local constraint coding descriptor of sift
+     * keypoints, with the precomputed norms of a codebook
+     *
+     * @param src_image source image in opencv mat format
+     * @param codebook  codebook from sift-kmeans
+     * @param k         get top k nearest codes
+     *
+     * @return a conversion from llc feature to string
+     */
+    string llc_sift(Mat, const Codebook&, const int);
+    /**
+     * compute linear local constraint coding descriptor of sift
+     * keypoints into a caller's array
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param ncb        dimension of codebook
+     * @param k          get top k nearest codes
+     * @param out        output array of ncb elements
+     */
+    void llc_sift(float*, float*, const int, const int, float*);
+    /**
+     * compute linear local constraint coding descriptor of sift
+     * keypoints into a caller's array, with the precomputed norms of
+     * a codebook
+     *
+     * @param image_data pixel values of a std_width x std_height image
+     *                   in row-major order
+     * @param codebook   codebook from sift-kmeans
+     * @param k          get top k nearest codes
+     * @param out        output array of codebook size elements
+     */
+    void llc_sift(float*, const Codebook&, const int, float*);
 
     /**
      * Optimized sift feature improvement and normalization
@@ -161,6 +362,18 @@ public:
      * @return MatrixXf normalized dsift descripters in Eigen::MatrixXf form
      */
     Eigen::MatrixXf norm_sift(float *, int, int, const bool);
+    /**
+     * set the pooling of the llc weights of the descriptors
+     *
+     * @param pooling MAX_POOLING (default) or SUM_POOLING
+     */
+    void set_pooling(const LLCPooling pooling) {this->pooling_ = pooling; }
+    /** pooling of the llc weights of the descriptors */
+    LLCPooling pooling() const {return this->pooling_; }
+    /** accumulated time of the encoding stages */
+    const EncodeTimes& encode_times() const {return this->times_; }
+    /** reset the time of the encoding stages */
+    void reset_encode_times() {this->times_ = EncodeTimes(); }
 
 };
 #endif //SIREEN_IMAGE_FEATURE_EXTRACT_H_
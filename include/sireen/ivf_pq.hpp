@@ -0,0 +1,242 @@
+// Inverted file index with product quantization (IVF-PQ) for
+// approximate nearest neighbour search of large feature collections
+// kept compressed in memory. This implementation has following
+// features:
+//
+// 1. A coarse quantizer trained by k-means splits the features into
+//    inverted lists, the residual of a feature to its list center is
+//    product quantized into m bytes, one 8-bit code per subspace, e.g.
+//    32 to 64 bytes instead of 2KB for a 500 dimension double feature.
+// 2. The lists are kept in contiguous arrays of rows and codes, the
+//    codes of a list are scanned linearly.
+// 3. Asymmetric distance computation: a query builds one lookup table
+//    of the squared distances from its residual to every sub-codeword
+//    per probed list, so the distance to a code is m table lookups.
+// 4. Optional exact re-ranking of the best candidates against the
+//    original features, if they are kept by the caller.
+// 5. Quantizers are trained and features encoded on a thread pool.
+// 6. Searches may be filtered by a predicate on feature indices, a
+//    rejected code is never looked up and lists without accepted
+//    features do not count as probes.
+//
+// For details, refer to:
+//
+// Jegou, H.; Douze, M.; Schmid, C., "Product Quantization for Nearest
+// Neighbor Search, " IEEE Transactions on Pattern Analysis and Machine
+// Intelligence, vol.33, no.1, pp.117-128, Jan. 2011
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_IVF_PQ_H_
+#define SIREEN_IVF_PQ_H_
+
+#include <vector>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Inverted file index with product quantized residuals. T is the
+    /// type of feature elements, instantiated for double (IVFPQ) and
+    /// float (IVFPQF).
+    ///
+    /// Usage:
+    ///     // 500 dimension, 1024 lists, 32 bytes per feature
+    ///     IVFPQ index(500, 1024, 32);
+    ///     // from a row-major n x 500 matrix kept for re-ranking
+    ///     index.build(matrix, n, true);
+    ///     index.set_n_probe(16);
+    ///     index.set_rerank(100);
+    ///     // top 5 closest features
+    ///     index.knn(feature, 5);
+    template <class T>
+    class BasicIVFPQ
+    {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances and queries */
+        typedef T dist_type;
+        typedef BasicFeature<T> Feature;
+        /** number of codewords of a subspace, one byte per code */
+        static const size_t N_CODES = 256;
+    private:
+        // row of the feature matrix bound with its distance
+        typedef KeyValue<uint32_t, dist_type> RowBind;
+        /// Buffers of a search kept between queries
+        struct SearchScratch
+        {
+            /** lists bound with their center distances */
+            vector<RowBind> lists;
+            /** residual of the query to a list center */
+            vector<dist_type> residual;
+            /** squared distances from the residual to the codewords,
+             *  m x N_CODES */
+            vector<dist_type> table;
+            /** bounded max-heap of approximate squared distances */
+            vector<RowBind> candidates;
+            /** bounded max-heap of the result */
+            vector<RowBind> heap;
+        };
+        /** row-major features kept for re-ranking, NULL if not kept */
+        T* data_;
+        /** feature dimension */
+        size_t dimension_;
+        /** number of inverted lists */
+        size_t n_lists_;
+        /** number of subspaces, i.e. bytes per code */
+        size_t m_;
+        /** first dimension of each subspace, m + 1 entries */
+        vector<size_t> sub_offsets_;
+        /** number of lists searched */
+        size_t n_probe_;
+        /** number of candidates re-ranked exactly, 0 for none */
+        size_t rerank_;
+        /** row-major n_lists x dimension list centers */
+        vector<T> coarse_;
+        /** codewords of subspace s are the N_CODES rows of width
+         *  sub_offsets_[s+1] - sub_offsets_[s] from
+         *  N_CODES * sub_offsets_[s] */
+        vector<T> codebooks_;
+        /** list l owns the entries [list_offsets_[l], list_offsets_[l+1])
+         *  of rows_ and codes_ */
+        vector<size_t> list_offsets_;
+        /** feature row of each entry, in list order */
+        vector<uint32_t> rows_;
+        /** m bytes of each entry, in list order */
+        vector<uint8_t> codes_;
+
+        // non-copyable, the index may borrow the feature matrix
+        BasicIVFPQ(const BasicIVFPQ&);
+        BasicIVFPQ& operator=(const BasicIVFPQ&);
+
+        /**
+         * Train the coarse quantizer and the sub-quantizers on a random
+         * sample of the features.
+         *
+         * @param data row-major n x dimension matrix
+         * @param n    number of features
+         * @param pool thread pool for k-means
+         */
+        void train(const T*, const size_t, putil::ThreadPool&);
+        /**
+         * Encode the residuals of features to their list centers
+         *
+         * @param data   row-major n x dimension matrix
+         * @param labels list of each feature
+         * @param n      number of features
+         * @param codes  output m bytes per feature
+         * @param pool   thread pool for the encoding
+         */
+        void encode(const T*, const vector<uint32_t>&, const size_t,
+                    vector<uint8_t>&, putil::ThreadPool&) const;
+        /**
+         * k-nearest-neighbour search core
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour searched
+         * @param scratch search buffers, scratch.heap takes the result
+         *                as a max-heap of squared distances
+         * @param filter  features a result must be accepted by, NULL for
+         *                all
+         */
+        void search(const dist_type*, const size_t, SearchScratch&,
+                    const FeatureFilter* filter = NULL) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d       feature dimension
+         * @param n_lists number of inverted lists
+         * @param m       number of subspaces, i.e. bytes per feature.
+         *                Subspaces differ by at most one dimension if d
+         *                is not a multiple of m.
+         */
+        BasicIVFPQ(const size_t, const size_t n_lists = 1024,
+                   const size_t m = 32);
+        /**
+         * set the number of lists searched, a larger one gives a
+         * better recall but slower search.
+         *
+         * @param n_probe number of lists
+         */
+        void set_n_probe(const size_t n_probe)
+        {this->n_probe_ = n_probe > 0 ? n_probe : 1; }
+        /**
+         * set the number of candidates ranked by approximate distances
+         * that are re-ranked by exact ones. Only used if the features
+         * are kept by build.
+         *
+         * @param n_candidates number of candidates, 0 for no re-ranking
+         */
+        void set_rerank(const size_t n_candidates)
+        {this->rerank_ = n_candidates; }
+        /**
+         * build the index from a row-major feature matrix. The i-th row
+         * gets feature index i.
+         *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param keep  if true, data is kept for exact re-ranking, it
+         *              is never modified but must outlive the index.
+         *              Otherwise only the codes are kept.
+         * @param pool  thread pool for training and encoding, NULL for
+         *              the global pool
+         */
+        void build(T*, const size_t, const bool keep = false,
+                   putil::ThreadPool* pool = NULL);
+        /** number of features indexed */
+        size_t size() const {return this->rows_.size(); }
+        /** bytes of the code of one feature */
+        size_t code_size() const {return this->m_; }
+        /**
+         * Search for approximate k nearest neighbours. Results are in
+         * the same order as BasicKDTree::knn_bbf_opt, features point
+         * into the kept matrix or have no data if it is not kept.
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour returned
+         * @param filter  features a result must be accepted by, NULL for
+         *                all
+         *
+         * @return
+         */
+        std::vector<Feature> knn(const dist_type*, size_t,
+                                 const FeatureFilter* filter = NULL) const;
+        /**
+         * Search k nearest neighbours of many queries at once, see
+         * BasicKDTree::knn_batch. Distances are approximate unless
+         * re-ranked.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output euclidean distances, nq x k, may be
+         *                   NULL if not needed
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const dist_type*, const size_t, const size_t,
+                       size_t*, dist_type*,
+                       const FeatureFilter* filter = NULL,
+                       putil::ThreadPool* pool = NULL) const;
+    };
+
+    typedef BasicIVFPQ<double> IVFPQ;
+    typedef BasicIVFPQ<float> IVFPQF;
+
+    extern template class BasicIVFPQ<double>;
+    extern template class BasicIVFPQ<float>;
+}
+#endif //SIREEN_IVF_PQ_H_
@@ -0,0 +1,263 @@
+// Randomized KD-Forest for approximate nearest neighbour search of
+// high dimensional features. This implementation has following
+// features:
+//
+// 1. Several randomized kd-trees, each splits a node on a dimension
+//    drawn among the few of greatest variance, so the trees partition
+//    the space differently and a query close to a splitting plane of
+//    one tree is likely far from those of the others.
+// 2. All trees are searched together by Best-Bin-First with one
+//    priority queue of branches, the max-epoch parameter bounds the
+//    number of leaves checked over all trees.
+// 3. The trees share one feature matrix in the original order, a
+//    visited set keeps a feature found by several trees from being
+//    compared twice.
+// 4. The trees are built in parallel on a thread pool.
+// 5. Searches may be filtered by a predicate on feature indices, a
+//    rejected feature costs no distance and leaves without accepted
+//    features do not count as epochs.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_KD_FOREST_H_
+#define SIREEN_KD_FOREST_H_
+
+#include <vector>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Forest of randomized kd-trees searched with a shared priority
+    /// queue. T is the type of feature elements as for BasicKDTree.
+    /// Instantiated for double (KDForest), float (KDForestF) and
+    /// spat::float16 (KDForestH).
+    ///
+    /// Usage:
+    ///     KDForest forest(500, 4); // 4 trees, 30 for default leaf size
+    ///     // from a row-major 300 x 500 matrix, copied by the forest
+    ///     forest.build(matrix, 300);
+    ///     // top 5 closest features checking at most 200 leaves
+    ///     forest.knn_bbf_opt(feature, 5, 200);
+    template <class T>
+    class BasicKDForest
+    {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances, partition values and queries */
+        typedef typename BasicKDTree<T>::dist_type dist_type;
+        typedef BasicFeature<T> Feature;
+    private:
+        typedef BasicKDTree<T> Tree;
+        typedef typename Tree::Node Node;
+        typedef typename Tree::RowBind RowBind;
+        /// a branch of a tree bound with the distance from the query
+        /// to its splitting plane
+        struct Branch
+        {
+            uint32_t tree;
+            uint32_t node;
+            dist_type bound;
+            Branch(const uint32_t t, const uint32_t n, const dist_type b)
+                : tree(t), node(n), bound(b) {}
+            // reversed order for a min-heap by std::push_heap
+            bool operator<(const Branch& other) const
+            {return bound > other.bound; }
+        };
+        /// Buffers of a search kept between queries
+        struct SearchScratch
+        {
+            /** min-heap of branches of all trees */
+            vector<Branch> branches;
+            /** bounded max-heap of squared distances to the query */
+            vector<RowBind> heap;
+            /** visit tag of each row, a row is already compared with
+             *  the query if its tag is the current one */
+            vector<uint32_t> visited;
+            /** current visit tag */
+            uint32_t tag;
+            SearchScratch() : tag(0) {}
+        };
+        /** randomized trees sharing data_ */
+        vector<Tree*> trees_;
+        /** row-major feature matrix in the original order */
+        T* data_;
+        /** whether data_ is allocated by the forest */
+        bool owns_data_;
+        /** feature index of each row of data_ */
+        vector<size_t> index_;
+        /** feature dimension */
+        size_t dimension_;
+        /** number of trees */
+        size_t n_trees_;
+        /** leaf size of the trees */
+        size_t leaf_size_;
+        /** number of features sampled for the split variance */
+        size_t split_sample_;
+        /** number of greatest variance dimensions to draw split from */
+        size_t split_candidates_;
+        /** seed of the first tree, tree t uses seed + t */
+        unsigned seed_;
+
+        // non-copyable, the forest may own its feature matrix
+        BasicKDForest(const BasicKDForest&);
+        BasicKDForest& operator=(const BasicKDForest&);
+
+        /** Release the trees and the feature matrix if owned */
+        void release();
+        /**
+         * Build the trees in parallel over data_
+         *
+         * @param n    number of features
+         * @param pool thread pool for the build, NULL for the global pool
+         */
+        void build_trees(const size_t, putil::ThreadPool*);
+        /**
+         * Traverse a tree to a leaf node and compare the query with the
+         * unvisited features of the leaf. Skipped children are pushed
+         * to the shared branch heap.
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour searched
+         * @param tree    tree to traverse
+         * @param node    offset of a start node in the tree
+         * @param scratch search buffers
+         * @param cur_best greatest-smallest squared distance, updated
+         * @param filter  features a result must be accepted by, NULL for
+         *                all
+         *
+         * @return whether the leaf holds an unvisited accepted feature
+         */
+        bool check_branch(const dist_type*, const size_t, const uint32_t,
+                          uint32_t, SearchScratch&, dist_type&,
+                          const FeatureFilter*) const;
+        /**
+         * Best Bin First search over all trees. First, each tree is
+         * traversed from its root. Then, the closest branch of all trees
+         * is checked until max_epoch leaves are checked or no branch
+         * can be closer than the current k-th best.
+         *
+         * @param feature    query feature data in array form
+         * @param k          number of nearest neighbour searched
+         * @param max_epoch  maximum of epoch of search, 0 for the
+         *                   exact search
+         * @param scratch    search buffers, scratch.heap takes the
+         *                   result as a max-heap of squared distances
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         */
+        void search(const dist_type*, const size_t, const size_t,
+                    SearchScratch&, const FeatureFilter* filter = NULL) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d          feature dimension
+         * @param n_trees    number of randomized trees
+         * @param leaf_size  number of features in a leaf
+         */
+        BasicKDForest(const size_t, const size_t n_trees = 4,
+                      const size_t leaf_size = 30);
+        /** Destructor */
+        ~BasicKDForest();
+        /**
+         * Set how the trees choose split dimensions, see
+         * BasicKDTree::set_split_sampling. The default samples 100
+         * features and draws among the 5 dimensions of greatest variance.
+         *
+         * @param sample_size  number of features sampled to estimate the
+         *                     variance, 0 for all features
+         * @param n_candidates the dimension is drawn among so many of
+         *                     greatest variance
+         * @param seed         seed of the first tree
+         */
+        void set_split_sampling(const size_t, const size_t n_candidates = 5,
+                                const unsigned seed = 0);
+        /**
+         * build the forest from input features, the features are
+         * copied into one matrix.
+         *
+         * @param features an array of features
+         * @param n        number of features
+         * @param pool     thread pool for the build, NULL for the global
+         *                 pool
+         */
+        void build(Feature*, const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * build the forest from a row-major feature matrix. The i-th row
+         * gets feature index i.
+         *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param copy  if true, the forest builds on its own copy of the
+         *              matrix. Otherwise data is used as is, it is never
+         *              modified but must outlive the forest.
+         * @param pool  thread pool for the build, NULL for the global pool
+         */
+        void build(T*, const size_t, const bool copy = true,
+                   putil::ThreadPool* pool = NULL);
+        /** number of features indexed */
+        size_t size() const {return this->index_.size(); }
+        /** number of trees */
+        size_t n_trees() const {return this->n_trees_; }
+        /**
+         * Search for approximate k nearest neighbours using the
+         * Best Bin First approach over all trees. Distance comparison
+         * applied an early-stop strategy. Results are in the same order
+         * as BasicKDTree::knn_bbf_opt.
+         *
+         * @param feature    query feture data in array form
+         * @param k          number of nearest neighbour returned
+         * @param max_epoch  maximum of epoch of search, i.e. number of
+         *                   leaves checked over all trees, 0 for the
+         *                   exact search
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         *
+         * @return
+         */
+        std::vector<Feature> knn_bbf_opt(const dist_type*, size_t, size_t,
+                                         const FeatureFilter* filter = NULL) const;
+        /**
+         * Search k nearest neighbours of many queries at once, see
+         * BasicKDTree::knn_batch.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output distances, nq x k, may be NULL if not
+         *                   needed
+         * @param max_epoch  maximum of epoch of search, 0 for the exact
+         *                   search
+         * @param measure    measure written to out_dists
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const dist_type*, const size_t, const size_t,
+                       size_t*, dist_type*, const size_t max_epoch = 0,
+                       const DistanceMeasure measure = EUCLIDEAN,
+                       const FeatureFilter* filter = NULL,
+                       putil::ThreadPool* pool = NULL) const;
+    };
+
+    typedef BasicKDForest<double> KDForest;
+    typedef BasicKDForest<float> KDForestF;
+    typedef BasicKDForest<spat::float16> KDForestH;
+
+    extern template class BasicKDForest<double>;
+    extern template class BasicKDForest<float>;
+    extern template class BasicKDForest<spat::float16>;
+}
+#endif //SIREEN_KD_FOREST_H_
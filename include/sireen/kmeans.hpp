@@ -0,0 +1,80 @@
+// K-means clustering of row-major feature matrices, used to build the
+// k-means tree and to train quantizers.
+//
+// The assignment of features to centers uses the squared euclidean
+// expansion |u-v|^2 = |u|^2 + |v|^2 - 2uv with an Eigen matrix
+// product, as the LLC coding against a codebook does, and is spread
+// over a thread pool for large inputs.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_KMEANS_H_
+#define SIREEN_KMEANS_H_
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sireen/thread_pool.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    /**
+     * Cluster features by Lloyd's k-means from random distinct
+     * features as initial centers. A center losing all its features
+     * stays where it is.
+     *
+     * @param data           row-major feature matrix
+     * @param rows           rows of data to cluster, NULL for the first
+     *                       n rows
+     * @param n              number of features
+     * @param dim            feature dimension
+     * @param n_clusters     number of clusters, at most n
+     * @param max_iterations greatest number of iterations
+     * @param centers        output row-major n_clusters x dim centers
+     * @param labels         output cluster of each feature
+     * @param pool           thread pool for the assignment step
+     * @param seed           seed of the initial centers
+     */
+    template <class T>
+    void kmeans(const T*, const size_t*, const size_t, const size_t,
+                const size_t, const size_t, vector<T>&, vector<uint32_t>&,
+                putil::ThreadPool&, const unsigned seed = 1);
+    /**
+     * Assign each feature to its closest center
+     *
+     * @param data       row-major feature matrix
+     * @param rows       rows of data to assign, NULL for the first n rows
+     * @param n          number of features
+     * @param dim        feature dimension
+     * @param centers    row-major n_clusters x dim centers
+     * @param n_clusters number of centers
+     * @param labels     output closest center of each feature
+     * @param pool       thread pool for large inputs
+     */
+    template <class T>
+    void assign_clusters(const T*, const size_t*, const size_t, const size_t,
+                         const T*, const size_t, vector<uint32_t>&,
+                         putil::ThreadPool&);
+
+    extern template void kmeans<double>(const double*, const size_t*,
+        const size_t, const size_t, const size_t, const size_t,
+        vector<double>&, vector<uint32_t>&, putil::ThreadPool&, const unsigned);
+    extern template void kmeans<float>(const float*, const size_t*,
+        const size_t, const size_t, const size_t, const size_t,
+        vector<float>&, vector<uint32_t>&, putil::ThreadPool&, const unsigned);
+    extern template void assign_clusters<double>(const double*, const size_t*,
+        const size_t, const size_t, const double*, const size_t,
+        vector<uint32_t>&, putil::ThreadPool&);
+    extern template void assign_clusters<float>(const float*, const size_t*,
+        const size_t, const size_t, const float*, const size_t,
+        vector<uint32_t>&, putil::ThreadPool&);
+}
+#endif //SIREEN_KMEANS_H_
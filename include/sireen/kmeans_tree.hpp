@@ -0,0 +1,271 @@
+// Hierarchical k-means tree (vocabulary tree) for nearest neighbour
+// search of high dimensional features. This implementation has
+// following features:
+//
+// 1. Each node is clustered into a configurable number of children by
+//    k-means. The assignment step uses the same squared euclidean
+//    expansion |u-v|^2 = |u|^2 + |v|^2 - 2uv with an Eigen matrix
+//    product as the LLC coding against a codebook, spread over a
+//    thread pool for large nodes.
+// 2. Best-Bin-First search over the cluster centers, the max-epoch
+//    parameter controls the number of leaves checked as for KDTree.
+//    Each node keeps the radius of its cluster, so a branch that can
+//    not hold a closer feature is skipped and max-epoch = 0 gives the
+//    exact search.
+// 3. Nodes and centers are kept in contiguous arrays, features in one
+//    aligned row-major matrix whose rows are permuted into leaf order.
+// 4. Searches may be filtered by a predicate on feature indices, a
+//    rejected feature costs no distance and leaves without accepted
+//    features do not count as epochs.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_KMEANS_TREE_H_
+#define SIREEN_KMEANS_TREE_H_
+
+#include <vector>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    /// Node definitions for k-means tree. The children of a node are
+    /// consecutive in the node array and the center of the i-th node
+    /// is the i-th row of the center matrix.
+    /// V is the type of distances.
+    template <class V>
+    struct KMeansNode
+    {
+        /** greatest distance from the center to a feature of the node */
+        V radius;
+        /** offset of the first child */
+        uint32_t first_child;
+        /** number of children, 0 for leaf node */
+        uint32_t n_children;
+        /** offset of the first feature row of the node */
+        uint32_t begin;
+        /** number of features in the node */
+        uint32_t n;
+
+        bool is_leaf() const {return n_children == 0; }
+    };
+
+    ///
+    /// Hierarchical k-means tree with the same build and search API as
+    /// BasicKDTree. T is the type of feature elements, instantiated for
+    /// double (KMeansTree) and float (KMeansTreeF).
+    ///
+    /// Usage:
+    ///     // 500 dimension, 32 branches, 30 features in a leaf
+    ///     KMeansTree tree(500, 32, 30);
+    ///     // from a row-major 300 x 500 matrix
+    ///     tree.build(matrix, 300);
+    ///     // top 5 closest features checking at most 200 leaves
+    ///     tree.knn_bbf_opt(feature, 5, 200);
+    template <class T>
+    class BasicKMeansTree
+    {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances and queries */
+        typedef T dist_type;
+        typedef BasicFeature<T> Feature;
+    private:
+        typedef KMeansNode<dist_type> Node;
+        typedef KeyValue<uint32_t, dist_type> RowBind;
+        /// a branch bound with the squared distance from the query to
+        /// its center, which orders the search, and the squared lower
+        /// bound of the distance to its features
+        struct Branch
+        {
+            uint32_t node;
+            dist_type dist;
+            dist_type bound;
+            Branch(const uint32_t n, const dist_type d, const dist_type b)
+                : node(n), dist(d), bound(b) {}
+            // reversed order for a min-heap by std::push_heap
+            bool operator<(const Branch& other) const
+            {return dist > other.dist; }
+        };
+        /// Buffers of a search kept between queries
+        struct SearchScratch
+        {
+            /** min-heap of branches by center distance */
+            vector<Branch> branches;
+            /** bounded max-heap of squared distances to the query */
+            vector<RowBind> heap;
+        };
+        /** tree nodes, root at offset 0 */
+        vector<Node> nodes_;
+        /** row-major center matrix, one row per node */
+        vector<T> centers_;
+        /** row-major feature matrix, rows are in leaf order after build */
+        T* data_;
+        /** whether data_ is allocated by the tree */
+        bool owns_data_;
+        /** feature index of each row of data_ */
+        vector<size_t> index_;
+        /** feature dimension */
+        size_t dimension_;
+        /** number of children of a node */
+        size_t branching_;
+        /** greatest number of features in a leaf */
+        size_t leaf_size_;
+        /** greatest number of k-means iterations */
+        size_t max_iterations_;
+
+        // non-copyable, the tree may own its feature matrix
+        BasicKMeansTree(const BasicKMeansTree&);
+        BasicKMeansTree& operator=(const BasicKMeansTree&);
+
+        /** Release the feature matrix if it is owned by the tree */
+        void release_data();
+        /**
+         * Build the nodes over the current feature matrix, then permute
+         * its rows into leaf order.
+         *
+         * @param n    number of features
+         * @param pool thread pool for the build, NULL for the global pool
+         */
+        void build_nodes(const size_t, putil::ThreadPool*);
+        /**
+         * Append a node to the node array and its center to the center
+         * matrix.
+         *
+         * @param begin  offset of the first feature
+         * @param n      number of features
+         * @param center center of the features
+         *
+         * @return offset of the initialized node
+         */
+        uint32_t init_node(const size_t, const size_t, const T*);
+        /**
+         * Expand the subtree. The features of the node are clustered by
+         * k-means and grouped by cluster, each non-empty cluster becomes
+         * a child which is expanded recursively. A node of at most
+         * leaf size features, or whose features fall in one cluster,
+         * stays a leaf.
+         *
+         * @param node offset of the current node
+         * @param pool thread pool for the assignment step
+         */
+        void expand_subtree(const uint32_t, putil::ThreadPool&);
+        /**
+         * Best Bin First search over the cluster centers. A branch whose
+         * lower bound is not closer than the current k-th best is
+         * skipped.
+         *
+         * @param feature    query feature data in array form
+         * @param k          number of nearest neighbour searched
+         * @param max_epoch  maximum of epoch of search, 0 for exact
+         * @param scratch    search buffers, scratch.heap takes the
+         *                   result as a max-heap of squared distances
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         */
+        void search(const dist_type*, const size_t, const size_t,
+                    SearchScratch&, const FeatureFilter* filter = NULL) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d              feature dimension
+         * @param branching      number of children of a node
+         * @param leaf_size      greatest number of features in a leaf
+         * @param max_iterations greatest number of k-means iterations
+         */
+        BasicKMeansTree(const size_t, const size_t branching = 32,
+                        const size_t leaf_size = 30,
+                        const size_t max_iterations = 11);
+        /** Destructor */
+        ~BasicKMeansTree();
+        /**
+         * build the tree from input features, the features are copied
+         * into one matrix.
+         *
+         * @param features an array of features
+         * @param n        number of features
+         * @param pool     thread pool for the build, NULL for the global
+         *                 pool
+         */
+        void build(Feature*, const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * build the tree from a row-major feature matrix. The i-th row
+         * gets feature index i.
+         *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param copy  if true, the tree builds on its own copy of the
+         *              matrix. Otherwise the rows of data are re-ordered
+         *              in place and data must outlive the tree.
+         * @param pool  thread pool for the build, NULL for the global pool
+         */
+        void build(T*, const size_t, const bool copy = true,
+                   putil::ThreadPool* pool = NULL);
+        /** number of features indexed */
+        size_t size() const {return this->index_.size(); }
+        /** the feature matrix in leaf order */
+        const T* data() const {return this->data_; }
+        /**
+         * Exact k-nearest-neighbour search. Results are in the same
+         * order as BasicKDTree::knn_basic_opt.
+         *
+         * @param feature query feature data in array form
+         * @param k       number of nearest neighbour returned
+         *
+         * @return
+         */
+        std::vector<Feature> knn_basic_opt(const dist_type*, size_t) const;
+        /**
+         * Search for approximate k nearest neighbours using the Best
+         * Bin First approach over the cluster centers. Results are in
+         * the same order as BasicKDTree::knn_bbf_opt.
+         *
+         * @param feature    query feture data in array form
+         * @param k          number of nearest neighbour returned
+         * @param max_epoch  maximum of epoch of search
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         *
+         * @return
+         */
+        std::vector<Feature> knn_bbf_opt(const dist_type*, size_t, size_t,
+                                         const FeatureFilter* filter = NULL) const;
+        /**
+         * Search k nearest neighbours of many queries at once, see
+         * BasicKDTree::knn_batch.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output euclidean distances, nq x k, may be
+         *                   NULL if not needed
+         * @param max_epoch  maximum of epoch of Best Bin First search,
+         *                   0 for the exact search
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const dist_type*, const size_t, const size_t,
+                       size_t*, dist_type*, const size_t max_epoch = 0,
+                       const FeatureFilter* filter = NULL,
+                       putil::ThreadPool* pool = NULL) const;
+    };
+
+    typedef BasicKMeansTree<double> KMeansTree;
+    typedef BasicKMeansTree<float> KMeansTreeF;
+
+    extern template class BasicKMeansTree<double>;
+    extern template class BasicKMeansTree<float>;
+}
+#endif //SIREEN_KMEANS_TREE_H_
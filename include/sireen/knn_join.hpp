@@ -0,0 +1,205 @@
+// Exact all-pairs k-nearest-neighbour join of a query matrix against a
+// catalog matrix, the batch job of lib/nenese (X * A.T followed by a
+// top k per row) without the pairwise matrix in memory. This
+// implementation has following features:
+//
+// 1. Queries and catalog are tiled into blocks, the inner products of
+//    a query block and a catalog block are one Eigen matrix product
+//    into a score buffer reused for all blocks.
+// 2. Euclidean distances use the expansion |u-v|^2 = |u|^2 + |v|^2 -
+//    2uv with the catalog norms computed once, cosine similarities are
+//    the inner products of unit length features as nenese computes.
+// 3. Each query keeps a bounded heap of its k best catalog rows, a
+//    score worse than the current k-th best costs one comparison.
+// 4. Query blocks are spread over a thread pool, finished blocks are
+//    either written to the caller's arrays or streamed to a callback,
+//    so results of any number of queries need O(threads) memory.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_KNN_JOIN_H_
+#define SIREEN_KNN_JOIN_H_
+
+#include <vector>
+#include <functional>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Blocked exact kNN join. T is the type of feature elements,
+    /// instantiated for double (KNNJoin) and float (KNNJoinF).
+    ///
+    /// Usage:
+    ///     // 10 nearest catalog rows of each query by cosine similarity
+    ///     KNNJoin join(500, 10, COSINE);
+    ///     // all-pairs on one matrix, an item is not its own neighbour
+    ///     join.set_exclude_self(true);
+    ///     join.join(matrix, n, matrix, n, ids, scores);
+    ///     // or stream results of consecutive queries
+    ///     join.join(queries, nq, catalog, n,
+    ///         [&](size_t first, size_t n, const size_t* ids,
+    ///             const double* scores){...});
+    template <class T>
+    class BasicKNNJoin
+    {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances */
+        typedef T dist_type;
+        /**
+         * receiver of the results of the queries [first, first + n),
+         * row-major n x k ids and distances as the output of join. It
+         * is called by one thread at a time, blocks come in any order.
+         */
+        typedef function<void(size_t, size_t, const size_t*,
+                              const dist_type*)> ResultSink;
+    private:
+        // catalog row bound with its ranking key, smaller is better
+        typedef KeyValue<uint32_t, dist_type> RowBind;
+        /// Buffers of a worker kept between query blocks
+        struct JoinScratch
+        {
+            /** column-major catalog block x query block scores */
+            vector<T> scores;
+            /** bounded max-heaps of keys, k per query of the block */
+            vector<RowBind> heaps;
+            /** number of rows of each heap */
+            vector<size_t> heap_sizes;
+            /** results of the block, for streaming */
+            vector<size_t> ids;
+            vector<dist_type> dists;
+        };
+        /** feature dimension */
+        size_t dimension_;
+        /** number of neighbours of each query */
+        size_t k_;
+        /** measure ranked and reported */
+        DistanceMeasure measure_;
+        /** number of queries of a block */
+        size_t query_block_;
+        /** number of catalog rows of a block */
+        size_t catalog_block_;
+        /** whether query i and catalog row i are the same item */
+        bool exclude_self_;
+
+        /**
+         * Join a block of queries against the whole catalog
+         *
+         * @param queries   row-major query matrix
+         * @param first     first query of the block
+         * @param nq        number of queries of the block
+         * @param catalog   row-major catalog matrix
+         * @param n         number of catalog rows
+         * @param norms     squared norms of the catalog rows, empty for
+         *                  cosine similarity
+         * @param scratch   buffers of the worker
+         * @param out_ids   output ids of the block, nq x k
+         * @param out_dists output distances of the block, nq x k, may
+         *                  be NULL
+         */
+        void join_block(const T*, const size_t, const size_t, const T*,
+                        const size_t, const vector<T>&, JoinScratch&,
+                        size_t*, dist_type*) const;
+        /**
+         * Join all queries block by block, the results of a block are
+         * written to the output arrays or, without them, streamed to
+         * the sink.
+         *
+         * @param queries   row-major nq x dimension query matrix
+         * @param nq        number of queries
+         * @param catalog   row-major n x dimension catalog matrix
+         * @param n         number of catalog rows
+         * @param out_ids   output catalog ids, nq x k, NULL to stream
+         * @param out_dists output distances, nq x k, may be NULL
+         * @param sink      receiver of the results if out_ids is NULL
+         * @param pool      thread pool, NULL for the global pool
+         */
+        void run(const T*, const size_t, const T*, const size_t,
+                 size_t*, dist_type*, const ResultSink&,
+                 putil::ThreadPool*) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d       feature dimension
+         * @param k       number of neighbours of each query
+         * @param measure EUCLIDEAN or SQUARED_EUCLIDEAN ranks by
+         *                ascending distance, COSINE by descending inner
+         *                product, the cosine of unit length features
+         */
+        BasicKNNJoin(const size_t, const size_t,
+                     const DistanceMeasure measure = EUCLIDEAN);
+        /**
+         * set the block sizes. The score buffer of a worker holds
+         * query_block x catalog_block elements and a catalog block is
+         * read once per query block.
+         *
+         * @param query_block   number of queries of a block
+         * @param catalog_block number of catalog rows of a block
+         */
+        void set_block_size(const size_t query_block,
+                            const size_t catalog_block);
+        /**
+         * set whether query i and catalog row i are the same item, so
+         * that an item is never its own neighbour, as the selecter of
+         * nenese does for an all-pairs join of one matrix.
+         *
+         * @param exclude true to skip catalog row i for query i
+         */
+        void set_exclude_self(const bool exclude)
+        {this->exclude_self_ = exclude; }
+        /**
+         * Join queries against a catalog. Each row of the output is
+         * sorted from the best, i.e. by ascending distance or
+         * descending cosine similarity, and padded with NO_INDEX and
+         * the worst distance if the catalog has fewer than k rows.
+         *
+         * @param queries   row-major nq x dimension query matrix
+         * @param nq        number of queries
+         * @param catalog   row-major n x dimension catalog matrix, the
+         *                  i-th row gets id i
+         * @param n         number of catalog rows
+         * @param out_ids   output catalog ids, nq x k
+         * @param out_dists output distances, nq x k, may be NULL if not
+         *                  needed
+         * @param pool      thread pool, NULL for the global pool
+         */
+        void join(const T*, const size_t, const T*, const size_t,
+                  size_t*, dist_type*, putil::ThreadPool* pool = NULL) const;
+        /**
+         * Join queries against a catalog and stream the results of
+         * each finished query block to a callback, e.g. to write them
+         * out without keeping them.
+         *
+         * @param queries row-major nq x dimension query matrix
+         * @param nq      number of queries
+         * @param catalog row-major n x dimension catalog matrix, the
+         *                i-th row gets id i
+         * @param n       number of catalog rows
+         * @param sink    receiver of the results of a query block
+         * @param pool    thread pool, NULL for the global pool
+         */
+        void join(const T*, const size_t, const T*, const size_t,
+                  const ResultSink&, putil::ThreadPool* pool = NULL) const;
+        /** padding id of missing neighbours */
+        static const size_t NO_INDEX = static_cast<size_t>(-1);
+    };
+
+    typedef BasicKNNJoin<double> KNNJoin;
+    typedef BasicKNNJoin<float> KNNJoinF;
+
+    extern template class BasicKNNJoin<double>;
+    extern template class BasicKNNJoin<float>;
+}
+#endif //SIREEN_KNN_JOIN_H_
@@ -8,18 +8,32 @@
 #ifndef SIREEN_METRICS_H_
 #define SIREEN_METRICS_H_
 
+#include <string>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
+
+#include "sireen/float16.hpp"
 //#define NDEBUG
 using namespace std;
 
 // spatial
 namespace spat
 {
+    /// Type used to accumulate distances of a feature element type.
+    /// Storage-only types are accumulated in float.
+    template <class T>
+    struct accumulator {typedef T type; };
+    template <>
+    struct accumulator<float16> {typedef float type; };
+    template <>
+    struct accumulator<int8_t> {typedef float type; };
+
     /**
      * Compute cosine similarity between features. If the input vector
      * is marked as normalized, the simplified computation will be
-     * applied.
+     * applied. The two vectors may have different element types, e.g.
+     * a half precision feature against a float query.
      *
      * @param x         vector x
      * @param y         vector y
@@ -29,24 +43,28 @@ namespace spat
      *
      * @return cosine distance of features
      */
-    template <class T> T
-    cosine(const T* x, const T* y, const size_t dim,
+    template <class T, class U> typename accumulator<T>::type
+    cosine(const T* x, const U* y, const size_t dim,
                  const bool normalized)
     {
-        T similarity = 0;
+        typedef typename accumulator<T>::type A;
+        A similarity = 0;
         if(normalized)
         {
             for(size_t i = 0; i < dim ; ++i)
-                similarity += x[i] * y[i];
+                similarity += A(x[i]) * A(y[i]);
         }
         else
         {
             double x_base = 0, y_base = 0;
+            A xi, yi;
             for(size_t i = 0; i < dim ; ++i)
             {
-                x_base += x[i] * x[i];
-                y_base += y[i] * y[i];
-                similarity += x[i] * y[i];
+                xi = x[i];
+                yi = y[i];
+                x_base += xi * xi;
+                y_base += yi * yi;
+                similarity += xi * yi;
             }
             if(similarity)
                 similarity /= sqrt(x_base) * sqrt(y_base);
@@ -69,21 +87,22 @@ namespace spat
      *
      * @return euclidean distance of features
      */
-    template <class T> T
-    euclidean(const T* x,const T* y, const size_t dim,
+    template <class T, class U> typename accumulator<T>::type
+    euclidean(const T* x,const U* y, const size_t dim,
                     const bool normalized)
     {
+        typedef typename accumulator<T>::type A;
         if(normalized)
         {
             return (2* cosine(x,y,dim,true));
         }
         else
         {
-            T dist = 0 ;
-            T tmp = 0;
+            A dist = 0 ;
+            A tmp = 0;
             for(size_t i = 0; i < dim ; ++i)
             {
-                tmp = x[i] - y[i];
+                tmp = A(x[i]) - A(y[i]);
                 dist += tmp * tmp;
             }
             return sqrt(dist);
@@ -105,21 +124,138 @@ namespace spat
      * @param dist   distance reference
      *
      */
-    template <class T> bool
-    optimize_compare(const T* x,const T* y, const T target,
-                       const size_t dim, T &dist)
+    template <class T, class U> bool
+    optimize_compare(const T* x,const U* y,
+                     const typename accumulator<T>::type target,
+                     const size_t dim, typename accumulator<T>::type &dist)
     {
+        typedef typename accumulator<T>::type A;
         // flush
         dist = 0.0;
-        T tmp = 0;
+        A tmp = 0;
         for(size_t i = 0; i < dim ; ++i)
         {
-            tmp = x[i] - y[i];
+            tmp = A(x[i]) - A(y[i]);
             dist += tmp * tmp;
             if(dist >= target)
                 return false;
         }
         return true;
     }
+
+    /**
+     * Compute inner product between a sparse vector, given by the
+     * ascending indices and the values of its non-zeros, and a dense
+     * vector. Only the non-zeros are visited.
+     *
+     * @param indices indices of the non-zeros of x
+     * @param values  values of the non-zeros of x
+     * @param nnz     number of non-zeros of x
+     * @param y       dense vector y
+     *
+     * @return inner product of features
+     */
+    template <class V, class U> typename accumulator<U>::type
+    sparse_inner_product(const uint32_t* indices, const V* values,
+                         const size_t nnz, const U* y)
+    {
+        typedef typename accumulator<U>::type A;
+        A product = 0;
+        for(size_t i = 0; i < nnz; ++i)
+            product += A(values[i]) * A(y[indices[i]]);
+        return product;
+    }
+
+    /**
+     * Compute inner product between two sparse vectors by merging
+     * their ascending indices, so it costs the sum of their non-zeros.
+     *
+     * @param x_indices indices of the non-zeros of x
+     * @param x_values  values of the non-zeros of x
+     * @param x_nnz     number of non-zeros of x
+     * @param y_indices indices of the non-zeros of y
+     * @param y_values  values of the non-zeros of y
+     * @param y_nnz     number of non-zeros of y
+     *
+     * @return inner product of features
+     */
+    template <class V, class W> typename accumulator<V>::type
+    sparse_inner_product(const uint32_t* x_indices, const V* x_values,
+                         const size_t x_nnz, const uint32_t* y_indices,
+                         const W* y_values, const size_t y_nnz)
+    {
+        typedef typename accumulator<V>::type A;
+        A product = 0;
+        size_t i = 0, j = 0;
+        while(i < x_nnz && j < y_nnz)
+        {
+            if(x_indices[i] < y_indices[j])
+                ++i;
+            else if(y_indices[j] < x_indices[i])
+                ++j;
+            else
+                product += A(x_values[i++]) * A(y_values[j++]);
+        }
+        return product;
+    }
+
+    // Overloads of the metrics above for float, double and half
+    // precision features (against float queries). They are defined in
+    // metrics.cpp by SIMD kernels selected at runtime by the CPU, and
+    // are preferred over the templates by overload resolution, so
+    // callers of these element types use them without changes.
+
+    /**
+     * @return name of the selected instruction set, one of "scalar",
+     *         "sse2", "avx2" and "avx512"
+     */
+    const char* simd_level();
+
+    /**
+     * Compute squared euclidean distance between features
+     *
+     * @param x   vector x
+     * @param y   vector y
+     * @param dim feature dimension
+     *
+     * @return squared euclidean distance of features
+     */
+    float squared_euclidean(const float*, const float*, const size_t);
+    double squared_euclidean(const double*, const double*, const size_t);
+    float squared_euclidean(const float16*, const float*, const size_t);
+
+    /**
+     * Compute inner product between features
+     *
+     * @param x   vector x
+     * @param y   vector y
+     * @param dim feature dimension
+     *
+     * @return inner product of features
+     */
+    float inner_product(const float*, const float*, const size_t);
+    double inner_product(const double*, const double*, const size_t);
+    float inner_product(const float16*, const float*, const size_t);
+
+    float cosine(const float*, const float*, const size_t, const bool);
+    double cosine(const double*, const double*, const size_t, const bool);
+    float cosine(const float16*, const float*, const size_t, const bool);
+
+    float euclidean(const float*, const float*, const size_t, const bool);
+    double euclidean(const double*, const double*, const size_t, const bool);
+    float euclidean(const float16*, const float*, const size_t, const bool);
+
+    /**
+     * Same as the template version, but the cumulative distance is
+     * only checked against the target once per block of 32 (float) or
+     * 16 (double) dimensions, so an abandoned dist may have summed a
+     * few more dimensions.
+     */
+    bool optimize_compare(const float*, const float*, const float,
+                          const size_t, float&);
+    bool optimize_compare(const double*, const double*, const double,
+                          const size_t, double&);
+    bool optimize_compare(const float16*, const float*, const float,
+                          const size_t, float&);
 }
 #endif
@@ -7,6 +7,37 @@
 // 3. Best-Bin-Fisrt search method provide an approximate nearest
 //    neighbour search. The max-epoch parameter can control the precision
 //    as well as the time performance.
+// 4. Tree nodes are kept in one contiguous array in depth-first order
+//    and linked by offsets, no per-node allocation while building or
+//    pointer chasing while searching.
+// 5. Features are stored in one aligned row-major matrix whose rows are
+//    permuted into leaf order, a leaf scan is a linear memory stream.
+// 6. Templated on the feature element type, double, float and half
+//    precision (float accumulation) trees are instantiated.
+// 7. Batched search of many queries on a thread pool, results written
+//    into caller's arrays with no allocation per query.
+// 8. Parallel build, the two subtrees of a large node are expanded as
+//    tasks of a thread pool and the variance of the top nodes is
+//    computed over dimensions in parallel.
+// 9. Optional sampled split selection, the variance is estimated on a
+//    bounded random sample and the dimension drawn among the top few.
+// 10. Save to a versioned binary file and load it back by mmap, the
+//    feature matrix is used in place from the page cache, so processes
+//    loading the same file share one copy and start without parsing.
+// 11. Features can be inserted into and removed from a built tree in
+//    O(log n). A full leaf is split, a removed feature is only marked
+//    and skipped by searches, and the tree is rebuilt once too many
+//    rows are wasted or an insertion goes too deep.
+// 12. Radius search, the squared radius is the initial current best so
+//    branches and distance computations are cut from the first leaf.
+// 13. Search contexts kept by the caller per thread, a query then runs
+//    without any allocation and writes into the caller's buffers.
+// 14. Results as sorted (index, distance) pairs without Feature copies,
+//    the distance reported as euclidean, squared euclidean or cosine
+//    similarity converted from the distance already computed.
+// 15. Filtered search: a predicate on feature indices is evaluated in
+//    the leaf scan before any distance, and Best Bin First only counts
+//    the leaves holding accepted features as epochs.
 //
 // @author: Bingqing Qu
 // @version 0.1.0
@@ -19,6 +50,7 @@
 
 // STL
 #include <vector>
+#include <string>
 #include <iostream>
 #include <algorithm>
 #include <iomanip>
@@ -26,12 +58,19 @@
 #include <queue>
 #include <limits>
 #include <memory>
+#include <random>
+#include <unordered_map>
+
+#include <stdint.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <math.h>
 
+#include "sireen/feature_filter.hpp"
 #include "sireen/metrics.hpp"
+#include "sireen/thread_pool.hpp"
 #define NDEBUG
 using namespace std;
 
@@ -48,13 +87,79 @@ namespace nnse
         KeyValue(const T k, const V v) : key(k), value(v){}
     };
     // Operator overloading
-    template <class T>
-    inline bool operator<(const KeyValue<T>& lhs, const KeyValue<T>& rhs)
+    template <class T, class V>
+    inline bool operator<(const KeyValue<T,V>& lhs, const KeyValue<T,V>& rhs)
     {return lhs.value < rhs.value; }
-    template <class T>
-    inline bool operator>(const KeyValue<T>& lhs, const KeyValue<T>& rhs)
+    template <class T, class V>
+    inline bool operator>(const KeyValue<T,V>& lhs, const KeyValue<T,V>& rhs)
     {return lhs.value > rhs.value; }
 
+    /// Measure reported with the results of a search. The search ranks
+    /// features by euclidean distance whatever the measure.
+    enum DistanceMeasure
+    {
+        /** euclidean distance */
+        EUCLIDEAN,
+        /** squared euclidean distance, no square root taken */
+        SQUARED_EUCLIDEAN,
+        /** cosine similarity 1 - d^2 / 2, exact for features of unit
+         *  length such as the normalized llc codes */
+        COSINE
+    };
+
+    /**
+     * Allocate an uninitialized buffer aligned to cache line, which is
+     * also enough for any SIMD load.
+     *
+     * @param n number of elements
+     *
+     * @return aligned buffer, release it by aligned_free
+     */
+    template <class T>
+    inline T* aligned_malloc(const size_t n)
+    {
+        void* ptr = NULL;
+        if(posix_memalign(&ptr, 64, n * sizeof(T)))
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+    inline void aligned_free(void* ptr) {free(ptr); }
+
+    /**
+     * Permute the rows of a row-major matrix in place so that the i-th
+     * row becomes the former from[i]-th row. Done with a "permute-from"
+     * cycle walk, only one row is buffered at a time.
+     *
+     * @param data row-major n x dim matrix
+     * @param from source row of each row, a permutation of [0,n)
+     * @param dim  number of columns
+     */
+    template <class T>
+    void permute_rows(T* data, const vector<size_t>& from, const size_t dim)
+    {
+        const size_t n = from.size();
+        vector<T> tmp(dim);
+        vector<bool> done(n, false);
+        size_t src, to;
+        for(size_t cur = 0; cur < n; ++cur)
+        {
+            if(done[cur] || from[cur] == cur)
+                continue;
+            memcpy(&tmp[0], data + cur * dim, sizeof(T) * dim);
+            to = cur;
+            src = from[cur];
+            while(src != cur)
+            {
+                memcpy(data + to * dim, data + src * dim, sizeof(T) * dim);
+                done[to] = true;
+                to = src;
+                src = from[src];
+            }
+            memcpy(data + to * dim, &tmp[0], sizeof(T) * dim);
+            done[to] = true;
+        }
+    }
+
     // compute median position of a group of index
     inline size_t get_median_index(const size_t x)
     {return ( (x - 1) / 2); }
@@ -63,19 +168,20 @@ namespace nnse
     template<class T>
     inline T abs(const T x){return (x < 0 ? -x : x);}
 
-    /// Define Feature structure
-    struct Feature
+    /// Define Feature structure, T is the type of feature elements
+    template <class T>
+    struct BasicFeature
     {
         /** feature data */
-        double* data;
+        T* data;
         /** feature dimension */
         size_t dimension;
         /** feature index */
         size_t index;
-        Feature(double* data, const size_t dim, const size_t i) :
+        BasicFeature(T* data, const size_t dim, const size_t i) :
             data(data) , dimension(dim), index(i) {}
-        Feature() : data(),dimension(){}
-        Feature& operator=(Feature other)
+        BasicFeature() : data(),dimension(){}
+        BasicFeature& operator=(BasicFeature other)
         {
             std::swap(data,other.data);
             std::swap(dimension,other.dimension);
@@ -83,25 +189,30 @@ namespace nnse
             return *this;
         }
     };
+    typedef BasicFeature<double> Feature;
 
-    /// Node definitions for kd-tree
+    /// Node definitions for kd-tree. All nodes of a tree live in one
+    /// contiguous array in depth-first order, so children are referred
+    /// to by their offsets in that array instead of pointers. The root
+    /// node is always at offset 0, therefore 0 never refers to a child.
+    /// V is the type of partition value.
+    template <class V>
     struct KDTreeNode
     {
-        /** feature dimension for partition */
-        int pivot_dim;
         /** key value for partition */
-        double pivot_val;
-        /** leaf flag */
-        bool leaf;
-        /** all features at current node */
-        Feature* features;
+        V pivot_val;
+        /** feature dimension for partition, -1 for leaf node */
+        int pivot_dim;
+        /** offset of left child in the node array */
+        uint32_t left;
+        /** offset of right child in the node array */
+        uint32_t right;
+        /** first row of the node in the feature matrix */
+        uint32_t begin;
         /** number of features */
-        size_t n;
-        /** left child */
-        shared_ptr<KDTreeNode> left;
-        /** right child */
-        shared_ptr<KDTreeNode> right;
+        uint32_t n;
 
+        bool is_leaf() const {return pivot_dim < 0; }
     };
 
     ///
@@ -109,27 +220,125 @@ namespace nnse
     /// Parameters can be adjust are feature dimension and number of
     /// features in leaf node.
     ///
+    /// T is the type of feature elements. Distances, partition values
+    /// and queries use spat::accumulator<T>::type, i.e. a tree of
+    /// spat::float16 features stores 2 bytes per element and takes
+    /// float queries. Instantiated for double (KDTree), float (KDTreeF)
+    /// and spat::float16 (KDTreeH).
+    ///
+    /// The features are kept in a single row-major n x dimension matrix
+    /// whose rows are permuted into leaf order by build, so every leaf
+    /// is a contiguous range of rows. The matrix is either owned by the
+    /// tree (copied from the input) or borrowed from the caller.
+    ///
     /// Usage:
     ///     KDTree kdtree(500,30); // 30 is default value for leaf size
     ///     // features is pointer to Feature array
     ///     // 300 is number of features to build the kd-tree
     ///     kdtree.build(features, 300);
+    ///     // or from a row-major 300 x 500 matrix, re-ordered in place
+    ///     kdtree.build(matrix, 300, false);
+    ///     // estimate split dimensions on 100 features per node
+    ///     kdtree.set_split_sampling(100);
     ///     // 5 is to get top 5 closest features
     ///     kdtree.knn_basic(feature, 5);
-    class KDTree
+    ///     // at most 10 closest features within distance 0.7
+    ///     kdtree.knn_radius(feature, 0.7, 10);
+    ///     // no allocation with a context kept by the thread
+    ///     KDTree::SearchContext context;
+    ///     kdtree.knn(feature, 5, context, ids, dists);
+    ///     // sorted (index, cosine similarity) pairs
+    ///     kdtree.knn_search(feature, 5, 0, COSINE);
+    ///     // only among the features set in a bitmap
+    ///     kdtree.knn_search(feature, 5, 0, EUCLIDEAN, &bitmap);
+    ///     // save, then load by mmap in another process
+    ///     kdtree.save("tree.kdt");
+    ///     kdtree.load("tree.kdt");
+    ///     // update a built tree
+    ///     kdtree.insert(row, 301);
+    ///     kdtree.remove(42);
+    template <class T> class BasicKDForest;
+
+    template <class T>
+    class BasicKDTree
     {
+    public:
+        /** type of feature elements */
+        typedef T value_type;
+        /** type of distances, partition values and queries */
+        typedef typename spat::accumulator<T>::type dist_type;
+        typedef BasicFeature<T> Feature;
+        /** feature index bound with its distance to the query */
+        typedef KeyValue<size_t, dist_type> Neighbour;
     private:
-        // smart pointer for safty. I am still exploring the security of
-        // such using.
-        typedef shared_ptr<KDTreeNode> NodePtr;
-        // typedef to avoid ugly long declaration
-        typedef stack<NodePtr> NodeStack;
-        typedef KeyValue<NodePtr> NodeBind;
+        typedef KDTreeNode<dist_type> Node;
+        // typedef to avoid ugly long declaration. Nodes are bound with
+        // the lower bound of their distance to the query on the
+        // backtrack containers.
+        typedef KeyValue<uint32_t, dist_type> NodeBind;
+        typedef stack<NodeBind, vector<NodeBind> > NodeStack;
         typedef priority_queue<NodeBind, vector<NodeBind>, greater<NodeBind> > NodeMinPQ;
-        typedef KeyValue<Feature> FeatureBind;
+        typedef KeyValue<Feature, dist_type> FeatureBind;
         typedef priority_queue<FeatureBind, vector<FeatureBind> > FeatureMaxPQ;
-        /** kd-tree root node */
-        NodePtr root_;
+        // row of the feature matrix bound with its distance
+        typedef KeyValue<uint32_t, dist_type> RowBind;
+    public:
+        /// Buffers of a search kept between queries. A caller keeps one
+        /// per thread and passes it to every search, the buffers only
+        /// grow on the first queries, so later ones never allocate. A
+        /// tree never reaches a leaf twice in one search, so no visited
+        /// set is needed.
+        struct SearchContext
+        {
+            /** branches to backtrack, a stack or a min-heap */
+            vector<NodeBind> branches;
+            /** bounded max-heap of squared distances to the query */
+            vector<RowBind> heap;
+            /**
+             * Allocate the buffers up front
+             *
+             * @param k          number of nearest neighbour searched
+             * @param n_branches number of branches kept, about the
+             *                   depth of the tree for exact search and
+             *                   max epoch times the depth for bbf
+             */
+            void reserve(const size_t k, const size_t n_branches = 256)
+            {
+                this->heap.reserve(k);
+                this->branches.reserve(n_branches);
+            }
+        };
+    private:
+        /** kd-tree nodes in depth-first order, root at offset 0 */
+        vector<Node> nodes_;
+        /** row-major feature matrix, rows are in leaf order after build */
+        T* data_;
+        /** whether data_ is allocated by the tree */
+        bool owns_data_;
+        /** file mapped by load, data_ points into it */
+        void* mapping_;
+        /** size of the mapped file */
+        size_t mapping_size_;
+        /** rows allocated for data_ if it is owned by the tree */
+        size_t capacity_;
+        /** feature index of each row of data_, NO_INDEX for the rows of
+         *  removed features and the rows not in any leaf */
+        vector<size_t> index_;
+        /** number of features indexed */
+        size_t n_live_;
+        /** rows reserved by each leaf from its first row, set up by the
+         *  first update */
+        vector<uint32_t> leaf_capacity_;
+        /** rows reserved by the leaves but not filled yet, not wasted */
+        size_t free_rows_;
+        /** row of each feature index, set up by the first update */
+        unordered_map<size_t, uint32_t> row_of_;
+        /** the tree is rebuilt once the wasted rows exceed so many
+         *  times the features */
+        double rebuild_waste_;
+        /** the tree is rebuilt once an insertion goes so many times
+         *  deeper than a balanced tree */
+        double rebuild_depth_;
         /** kd-tree feature dimension */
         size_t dimension_;
         /**
@@ -139,39 +348,115 @@ namespace nnse
          * i.e. bad searching time.
          */
         size_t leaf_size_;
+        /** number of features sampled for the variance, 0 for all */
+        size_t split_sample_;
+        /** number of greatest variance dimensions to draw split from */
+        size_t split_candidates_;
+        /** seed of the split sampling */
+        unsigned split_seed_;
+        /** nodes of at least so many features expand their subtrees in
+         *  parallel, smaller ones are not worth a task */
+        static const size_t PARALLEL_SUBTREE_MIN = 2048;
+        /** nodes of at least so many feature elements (n x dimension)
+         *  compute the variance of dimensions in parallel */
+        static const size_t PARALLEL_VARIANCE_MIN = 1 << 20;
+
+        // non-copyable, the tree may own its feature matrix
+        BasicKDTree(const BasicKDTree&);
+        BasicKDTree& operator=(const BasicKDTree&);
+        // the trees of a forest share one matrix in the original order
+        friend class BasicKDForest<T>;
 
         /**
-         * Initialization of a kd-tree node, this will set initial position
-         * of feature pointer, the number of feature should be taken and
-         * a default value for patition dimension
+         * Release the feature matrix if it is owned by the tree, or
+         * unmap it if it is mapped from a file
+         */
+        void release_data();
+        /**
+         * Build the nodes over the current feature matrix. The matrix is
+         * addressed through index_ while partitioning, then its rows are
+         * permuted into leaf order in one pass, so index_[i] finally
+         * tells the original row of the i-th row.
          *
-         * @param features an array of features
-         * @param n        number of features
+         * @param n            number of features
+         * @param pool         thread pool for the build, NULL for the
+         *                     global pool
+         * @param permute_rows if false, the rows are not moved and the
+         *                     i-th row of a leaf is data_[index_[i]]
+         */
+        void build_nodes(const size_t, putil::ThreadPool*,
+                         const bool permute_rows = true);
+        /**
+         * build the nodes over a matrix shared with other trees, the
+         * matrix is neither copied nor re-ordered. Leaves address their
+         * rows through index_, so only a KDForest searches such a tree.
+         *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param pool  thread pool for the build, NULL for the global pool
+         */
+        void build_shared(T*, const size_t, putil::ThreadPool*);
+        /**
+         * k-nearest-neighbour search core used by the batch search.
+         * Squared distances are compared with the early-stop strategy
+         * and a branch is skipped if its splitting plane is already
+         * farther than the current best. With max_epoch = 0 the search
+         * is exact and backtracks depth-first, otherwise it is the
+         * Best Bin First search over at most max_epoch leaves.
+         *
+         * @param feature    query feature data in array form
+         * @param k          number of nearest neighbour searched
+         * @param max_epoch  maximum of epoch of search, 0 for exact
+         * @param scratch    search buffers, scratch.heap takes the
+         *                   result as a max-heap of squared distances
+         * @param bound      squared distance results are closer than,
+         *                   the initial current best
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         */
+        void search(const dist_type*, const size_t, const size_t,
+                    SearchContext&,
+                    const dist_type bound = numeric_limits<dist_type>::max(),
+                    const FeatureFilter* filter = NULL) const;
+        /**
+         * Initialization of a kd-tree node, this will append a node to
+         * the node array with the initial offset of features, the number
+         * of feature should be taken and a default value for patition
+         * dimension
          *
-         * @return initialized kd-tree node, furthor expand should be
-         *         followed
+         * @param nodes node array to append to
+         * @param begin offset of the first feature
+         * @param n     number of features
+         *
+         * @return offset of the initialized kd-tree node, furthor expand
+         *         should be followed
          */
-        NodePtr init_node(Feature *, const size_t);
+        static uint32_t init_node(vector<Node>&, const size_t, const size_t);
         /**
          * Expand the subtree. This should be called after a kd-tree
          * node is initialized. If the current node is not a leaf, a
          * partition is applied on features. Then, it expand the two
-         * children recursively.
+         * children recursively. For a large node, the right subtree is
+         * expanded by a task into its own node array meanwhile, which
+         * is appended after the left subtree once both are done. So the
+         * nodes are in the same depth-first order as a serial build.
          *
-         * @param node current kd-tree node
+         * @param nodes node array of the subtree
+         * @param node  offset of current kd-tree node in nodes
+         * @param pool  thread pool for the tasks
          */
-        void expand_subtree(NodePtr);
+        void expand_subtree(vector<Node>&, const uint32_t, putil::ThreadPool&);
         /**
          * Partition features on the current node. Two parts:
          *
          * 1.Determine pivot feature to split to patition the currrent
          * node's features. First, find the dimension with grestest
-         * variance. Second, find the feature with the median of value on
-         * that dimension.
+         * variance, estimated on a sample of features and drawn among the
+         * top candidates if set by set_split_sampling. Second, find the
+         * feature with the median of value on that dimension.
          *
-         * 2.Partition the features by the pivot. This is done by firstly,
-         * get the order vector and secondly, re-order the features by that
-         * order vector.
+         * 2.Partition the features by the pivot. This is done in place by
+         * std::nth_element on the row ids of the node.
          *
          * The result of the partition is the Feature array is re-ordered
          * and a new node contains left child of  features[0:k] and the
@@ -179,40 +464,83 @@ namespace nnse
          * where n is the length of right child. The current root node is
          * features[k]
          *
-         * @param node the current node
+         * @param node current node
+         * @param pool thread pool for the variance of large nodes
          *
+         * @return offset of the median feature inside the node
          */
-        void partition(NodePtr);
+        size_t partition(Node&, putil::ThreadPool&);
         /**
          * Traverse a kd-tree to a leaf node. Path decision are made
          * by comparision of values between the input feature and node
          * on the node's partition dimension. The backtrack path is
-         * recorded by a std::stack
+         * recorded by a std::stack with the distance from the feature
+         * to the splitting plane of each skipped child.
          *
          * @param feature a input feature
-         * @param node a start node
+         * @param node offset of a start node
          *
-         * @return a leaf node with node.leaf=true
+         * @return offset of a leaf node
          */
-        NodePtr traverse_to_leaf(double*, NodePtr, NodeStack&);
+        uint32_t traverse_to_leaf(const dist_type*, uint32_t, NodeStack&);
         /**
          * Traverse a kd-tree to a leaf node. Path decision are made
          * by comparision of values between the input feature and node
          * on the node's partition dimension. The backtrack path is
-         * recorded by a std::priority_queue
+         * recorded by a std::priority_queue ordered by the distance
+         * from the feature to the splitting plane of each skipped child.
          *
          * @param feature a input feature
-         * @param node a start node
+         * @param node offset of a start node
          *
-         * @return a leaf node with node.leaf=true
+         * @return offset of a leaf node
+         */
+        uint32_t traverse_to_leaf(const dist_type*, uint32_t, NodeMinPQ&);
+        /**
+         * Prepare the tree for insert and remove on the first update:
+         * the feature matrix is copied if it is not owned, each leaf
+         * reserves its own rows and feature indices are mapped to rows.
          */
-        NodePtr traverse_to_leaf(double*, NodePtr, NodeMinPQ&);
+        void init_updates();
+        /**
+         * Append free rows to the feature matrix, the matrix grows
+         * geometrically when it is full.
+         *
+         * @param n number of rows
+         *
+         * @return the first appended row
+         */
+        size_t append_rows(const size_t);
+        /**
+         * Move a leaf to the end of the feature matrix with room for
+         * more rows. Its former rows are wasted until the next rebuild.
+         *
+         * @param node     offset of the leaf
+         * @param capacity number of rows reserved by the leaf
+         */
+        void relocate_leaf(const uint32_t, const size_t);
+        /**
+         * Split a leaf as build does, its rows are re-ordered in place
+         * into the new leaves.
+         *
+         * @param node offset of the leaf
+         * @param pool thread pool for the partition
+         */
+        void split_leaf(const uint32_t, putil::ThreadPool&);
+        /**
+         * Rebuild the tree if the wasted rows or the depth of the last
+         * insertion crossed the rebuild thresholds.
+         *
+         * @param depth depth of the last insertion, 0 for none
+         * @param pool  thread pool for the rebuild
+         */
+        void check_rebuild(const size_t, putil::ThreadPool*);
 
     public:
         /** Constructor */
-        KDTree(const size_t, const size_t leaf_size = 30);
+        BasicKDTree(const size_t, const size_t leaf_size = 30);
         /** Destructor */
-        ~KDTree();
+        ~BasicKDTree();
         /**
          * build the kd-tree structure from input features. The order is
          * building the node for indexing first and point the root node
@@ -221,9 +549,95 @@ namespace nnse
          *
          * @param features an array of features
          * @param n        number of features
+         * @param pool     thread pool for the build, NULL for the global
+         *                 pool
+         *
+         */
+        void build(Feature*, const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * build the kd-tree structure from a row-major feature matrix.
+         * The i-th row gets feature index i.
          *
+         * @param data  row-major n x dimension matrix
+         * @param n     number of features
+         * @param copy  if true, the tree builds on its own copy of the
+         *              matrix. Otherwise the rows of data are re-ordered
+         *              in place and data must outlive the tree.
+         * @param pool  thread pool for the build, NULL for the global pool
+         *
+         */
+        void build(T*, const size_t, const bool copy = true,
+                   putil::ThreadPool* pool = NULL);
+        /**
+         * Set how the partition dimension of a node is chosen by the next
+         * build. By default the variance of all features of the node is
+         * computed and the greatest one is taken. A bounded sample cuts
+         * the cost of a node from O(n x dimension) to O(n + sample x
+         * dimension), random candidates make randomized trees.
+         *
+         * @param sample_size  number of features sampled to estimate the
+         *                     variance, 0 for all features
+         * @param n_candidates the dimension is drawn among so many of
+         *                     greatest variance, 1 for the greatest
+         * @param seed         seed of the random sampling and drawing
+         */
+        void set_split_sampling(const size_t, const size_t n_candidates = 5,
+                                const unsigned seed = 0);
+        /** number of features indexed */
+        size_t size() const {return this->n_live_; }
+        /** the feature matrix in leaf order */
+        const T* data() const {return this->data_; }
+        /**
+         * Insert a feature into the built tree. The feature is copied
+         * to the leaf it falls in, which is split once it exceeds the
+         * leaf size. On the
+         * first update a matrix borrowed by build or mapped by load is
+         * copied, and the matrix may move as it grows, so features
+         * returned by earlier searches are invalidated.
+         *
+         * @param feature feature data in array form
+         * @param index   feature index, unique in the tree
+         * @param pool    thread pool for a split or rebuild, NULL for
+         *                the global pool
+         *
+         * @return true on success, false if the index is already in
+         *         the tree
          */
-        void build(Feature*, const size_t);
+        bool insert(const T*, const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * Remove a feature from the tree. Its row is marked as removed
+         * and skipped by all searches until the next rebuild.
+         *
+         * @param index feature index
+         * @param pool  thread pool for a rebuild, NULL for the global pool
+         *
+         * @return true on success, false if the index is not in the tree
+         */
+        bool remove(const size_t, putil::ThreadPool* pool = NULL);
+        /**
+         * Rebuild the tree over its features, dropping removed ones
+         * and wasted rows. Called by insert and remove once a rebuild
+         * threshold is crossed, or by the caller at a quiet time.
+         *
+         * @param pool thread pool for the build, NULL for the global pool
+         */
+        void rebuild(putil::ThreadPool* pool = NULL);
+        /**
+         * Set when insert and remove rebuild the tree. Wasted rows are
+         * those of removed features, of leaves moved by insert and the
+         * free rows reserved by leaves.
+         *
+         * @param waste_ratio rebuild once wasted rows exceed so many
+         *                    times the features
+         * @param depth_ratio rebuild once an insertion goes so many
+         *                    times deeper than a balanced tree
+         */
+        void set_rebuild_threshold(const double waste_ratio = 1.0,
+                                   const double depth_ratio = 2.0)
+        {
+            this->rebuild_waste_ = waste_ratio;
+            this->rebuild_depth_ = depth_ratio;
+        }
         /**
          * Basic k-nearest-neighbour search method use for kd-tree.
          * First, traverse from root node to a leaf node and. Second,
@@ -234,7 +648,7 @@ namespace nnse
          *
          * @return
          */
-        std::vector<Feature> knn_basic(double*, size_t);
+        std::vector<Feature> knn_basic(const dist_type*, size_t);
         /**
          * Basic kd-tree search with optmization on comparison method.
          * The comparison of distance use an early-stop strategy if current
@@ -246,7 +660,7 @@ namespace nnse
          *
          * @return
          */
-        std::vector<Feature> knn_basic_opt(double*, size_t);
+        std::vector<Feature> knn_basic_opt(const dist_type*, size_t);
         /**
          * Search for approximate k nearest neighbours using the
          * Best Bin First approach.
@@ -257,7 +671,7 @@ namespace nnse
          *
          * @return
          */
-        std::vector<Feature> knn_bbf(double*, size_t, size_t);
+        std::vector<Feature> knn_bbf(const dist_type*, size_t, size_t);
         /**
          * Search for approximate k nearest neighbours using the
          * Best Bin First approach. Distance comparison applied an
@@ -269,37 +683,203 @@ namespace nnse
          *
          * @return
          */
-        std::vector<Feature> knn_bbf_opt(double*, size_t, size_t);
+        std::vector<Feature> knn_bbf_opt(const dist_type*, size_t, size_t);
+        /**
+         * Search k nearest neighbours of many queries at once. Queries
+         * are spread over the threads of a pool, each thread re-uses
+         * its search buffers and writes into the caller's arrays, which
+         * are row-major nq x k. Each row is sorted by ascending distance
+         * and padded with NO_INDEX and the max distance, or the lowest
+         * cosine similarity, if the tree has fewer than k features.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output distances, nq x k, may be NULL if not
+         *                   needed
+         * @param max_epoch  maximum of epoch of Best Bin First search,
+         *                   0 for the exact search
+         * @param measure    measure written to out_dists
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const dist_type*, const size_t, const size_t,
+                       size_t*, dist_type*, const size_t max_epoch = 0,
+                       const DistanceMeasure measure = EUCLIDEAN,
+                       const FeatureFilter* filter = NULL,
+                       putil::ThreadPool* pool = NULL) const;
+        /**
+         * Search k nearest neighbours, returned as (index, distance)
+         * pairs sorted by ascending distance, i.e. by descending cosine
+         * similarity. Unlike knn_basic and knn_bbf, no feature is copied
+         * and the distances computed by the search are kept.
+         *
+         * @param feature    query feature data in array form
+         * @param k          number of nearest neighbour returned
+         * @param max_epoch  maximum of epoch of Best Bin First search,
+         *                   0 for the exact search
+         * @param measure    measure of the returned distances
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         *
+         * @return
+         */
+        std::vector<Neighbour> knn_search(const dist_type*, const size_t,
+                                          const size_t max_epoch = 0,
+                                          const DistanceMeasure measure = EUCLIDEAN,
+                                          const FeatureFilter* filter = NULL) const;
+        /**
+         * Search k nearest neighbours with the buffers of a context, the
+         * search allocates nothing once the context has grown. Results
+         * are sorted by ascending distance and padded as knn_batch.
+         *
+         * @param feature    query feature data in array form
+         * @param k          number of nearest neighbour returned
+         * @param context    search buffers of the calling thread
+         * @param out_ids    output feature indices, k entries
+         * @param out_dists  output distances, k entries, may be NULL if
+         *                   not needed
+         * @param max_epoch  maximum of epoch of Best Bin First search,
+         *                   0 for the exact search
+         * @param radius     euclidean distance results are closer than,
+         *                   unbounded by default
+         * @param measure    measure written to out_dists
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         *
+         * @return number of neighbours found
+         */
+        size_t knn(const dist_type*, const size_t, SearchContext&,
+                   size_t*, dist_type*, const size_t max_epoch = 0,
+                   const dist_type radius = numeric_limits<dist_type>::max(),
+                   const DistanceMeasure measure = EUCLIDEAN,
+                   const FeatureFilter* filter = NULL) const;
+        /**
+         * Search all features closer than a radius. The squared radius
+         * is the initial current best, so a branch whose splitting
+         * plane is farther and a row whose partial distance exceeds it
+         * are cut at once. Results are in the same order as
+         * knn_basic_opt.
+         *
+         * @param feature     query feature data in array form
+         * @param radius      euclidean distance results are closer than
+         * @param max_results if not 0, only so many nearest features
+         *                    are returned, i.e. k nearest within radius
+         *
+         * @return
+         */
+        std::vector<Feature> knn_radius(const dist_type*, const dist_type,
+                                        const size_t max_results = 0) const;
+        /**
+         * Search the k nearest neighbours within a radius of many
+         * queries at once, the batch form of knn_radius. Output is as
+         * knn_batch, rows with fewer than k features within the radius
+         * are padded with NO_INDEX and the max distance.
+         *
+         * @param queries    row-major nq x dimension query matrix
+         * @param nq         number of queries
+         * @param k          number of nearest neighbour returned
+         * @param radius     euclidean distance results are closer than
+         * @param out_ids    output feature indices, nq x k
+         * @param out_dists  output distances, nq x k, may be NULL if not
+         *                   needed
+         * @param max_epoch  maximum of epoch of Best Bin First search,
+         *                   0 for the exact search
+         * @param measure    measure written to out_dists
+         * @param filter     features a result must be accepted by, NULL
+         *                   for all
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_within(const dist_type*, const size_t, const size_t,
+                        const dist_type, size_t*, dist_type*,
+                        const size_t max_epoch = 0,
+                        const DistanceMeasure measure = EUCLIDEAN,
+                        const FeatureFilter* filter = NULL,
+                        putil::ThreadPool* pool = NULL) const;
+        /**
+         * Save the tree and its features to a binary file: a header,
+         * the node array, the feature indices, then the feature matrix
+         * in leaf order at an offset aligned to the cache line. Numbers
+         * are stored in the byte order of the machine.
+         *
+         * @param path file path
+         *
+         * @return true on success
+         */
+        bool save(const string&) const;
+        /**
+         * Load a tree saved by save. The feature type and dimension
+         * must match. The nodes and indices are read, the feature
+         * matrix is either mapped read-only and used in place, or read
+         * into a matrix owned by the tree.
+         *
+         * @param path file path
+         * @param map  if true, the feature matrix is mapped from the
+         *             file, so its pages are shared by all processes
+         *             loading it and read on first access
+         *
+         * @return true on success, false if the file is not a valid tree
+         *         of this type and dimension
+         */
+        bool load(const string&, const bool map = true);
+        /** index returned for missing neighbours */
+        static const size_t NO_INDEX = static_cast<size_t>(-1);
+        /**
+         * Write the results of a search as knn_batch does, so every
+         * index pads and converts its results the same way: sorted by
+         * ascending distance, converted to the measure, and padded
+         * with NO_INDEX and the max distance, or the lowest cosine
+         * similarity, past the neighbours found.
+         *
+         * @param heap     max-heap of rows with their squared
+         *                 distances, sorted in place
+         * @param index    feature index of each row, NULL if the rows
+         *                 are feature indices already
+         * @param k        number of results written
+         * @param measure  measure written to out_dists
+         * @param out_ids  output feature indices, k entries
+         * @param out_dists output distances, k entries, may be NULL if
+         *                 not needed
+         */
+        static void write_results(vector<KeyValue<uint32_t, dist_type> >&,
+                                  const size_t*, const size_t,
+                                  const DistanceMeasure, size_t*, dist_type*);
 
         // DEBUG
         // pre-order to print the tree node
         void print_tree()
         {
-            this->print_node(this->root_);
+            if(!this->nodes_.empty())
+                this->print_node(0);
         };
-        void print_node(NodePtr node,int indent=0)
+        void print_node(const uint32_t offset,int indent=0)
         {
-            if(node != NULL)
-            {
-                if(node->left)
-                    print_node(node->left,indent+8);
-
-                if(indent)
-                {
-                    cout << setw(indent) << ' ';
-                }
-                cout <<"(" << node->pivot_dim << ","
-                     << node->pivot_val <<","
-                     << node->n << ")\n";
-
-                if(node->right)
-                    print_node(node->right,indent+8);
-
+            const Node& node = this->nodes_[offset];
+            if(!node.is_leaf())
+                print_node(node.left,indent+8);
 
+            if(indent)
+            {
+                cout << setw(indent) << ' ';
             }
+            cout <<"(" << node.pivot_dim << ","
+                 << node.pivot_val <<","
+                 << node.n << ")\n";
+
+            if(!node.is_leaf())
+                print_node(node.right,indent+8);
         }
 
     };
 
+    typedef BasicKDTree<double> KDTree;
+    typedef BasicKDTree<float> KDTreeF;
+    typedef BasicKDTree<spat::float16> KDTreeH;
+
+    extern template class BasicKDTree<double>;
+    extern template class BasicKDTree<float>;
+    extern template class BasicKDTree<spat::float16>;
 }
 #endif //SIREEN_NEAREST_NEIGHBOUR_H_
@@ -0,0 +1,275 @@
+// Compressed sparse features and an inverted index over codebook
+// entries, for LLC codes whose non-zeros are a small part of the
+// codebook. This implementation has following features:
+//
+// 1. Features are kept row-compressed (CSR) as the indices and values
+//    of their non-zeros, as lib/nenese reads them, values are floats
+//    or 8-bit codes with one scale per feature.
+// 2. Inner products of a sparse feature with a dense or another sparse
+//    feature cost its non-zeros, see spat::sparse_inner_product.
+// 3. The inverted index keeps, for each codebook entry, the features
+//    using it. A query only visits the lists of its own non-zeros and
+//    accumulates the inner products of all features at once, then
+//    selects the k best by cosine similarity, i.e. inner product of
+//    normalized codes, or by euclidean distance from stored norms.
+// 4. Queries of a batch are spread over a thread pool.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_SPARSE_FEATURE_H_
+#define SIREEN_SPARSE_FEATURE_H_
+
+#include <vector>
+
+#include "sireen/nearest_neighbour.hpp"
+
+using namespace std;
+
+// nnse is short for "nearest neighbour search"
+namespace nnse
+{
+    ///
+    /// Row-compressed sparse feature matrix. V is the type of stored
+    /// values, float (SparseMatrix) or int8_t (SparseMatrixQ8), whose
+    /// value is the code times the scale of its row.
+    ///
+    /// Usage:
+    ///     SparseMatrix codes(500);
+    ///     // the non-zeros of a dense llc code
+    ///     codes.append(llc.data());
+    ///     // inner product with a dense query
+    ///     codes.dot(0, query);
+    template <class V>
+    class BasicSparseMatrix
+    {
+    public:
+        /** type of stored values */
+        typedef V value_type;
+    private:
+        /** feature dimension, i.e. codebook size */
+        size_t dimension_;
+        /** row i owns the non-zeros [offsets_[i], offsets_[i+1]) */
+        vector<size_t> offsets_;
+        /** ascending indices of the non-zeros of each row */
+        vector<uint32_t> indices_;
+        /** stored values of the non-zeros */
+        vector<V> values_;
+        /** scale of the stored values of each row */
+        vector<float> scales_;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param d feature dimension
+         */
+        explicit BasicSparseMatrix(const size_t);
+        /**
+         * reserve memory for rows and non-zeros
+         *
+         * @param n   number of rows
+         * @param nnz number of non-zeros
+         */
+        void reserve(const size_t, const size_t);
+        /**
+         * append the non-zeros of a dense feature as a row
+         *
+         * @param feature   dense feature of dimension elements
+         * @param threshold only elements of greater magnitude are kept
+         */
+        void append(const float*, const float threshold = 0);
+        /**
+         * append a row from its non-zeros
+         *
+         * @param indices ascending indices of the non-zeros
+         * @param values  values of the non-zeros
+         * @param nnz     number of non-zeros
+         */
+        void append(const uint32_t*, const float*, const size_t);
+        /** feature dimension */
+        size_t dimension() const {return this->dimension_; }
+        /** number of rows */
+        size_t rows() const {return this->offsets_.size() - 1; }
+        /** number of non-zeros of all rows */
+        size_t nnz() const {return this->indices_.size(); }
+        /** number of non-zeros of a row */
+        size_t row_nnz(const size_t i) const
+        {return this->offsets_[i + 1] - this->offsets_[i]; }
+        /** indices of the non-zeros of a row */
+        const uint32_t* row_indices(const size_t i) const
+        {return this->indices_.data() + this->offsets_[i]; }
+        /** stored values of the non-zeros of a row */
+        const V* row_values(const size_t i) const
+        {return this->values_.data() + this->offsets_[i]; }
+        /** scale of the stored values of a row */
+        float row_scale(const size_t i) const {return this->scales_[i]; }
+        /** bytes of the indices, values and offsets */
+        size_t memory() const;
+        /**
+         * Inner product of a row with a dense feature
+         *
+         * @param i       row
+         * @param feature dense feature of dimension elements
+         *
+         * @return inner product
+         */
+        float dot(const size_t, const float*) const;
+        /**
+         * Inner product of a row with a row of another sparse matrix
+         *
+         * @param i     row of this matrix
+         * @param other sparse matrix of the same dimension
+         * @param j     row of other
+         *
+         * @return inner product
+         */
+        template <class W>
+        float dot(const size_t i, const BasicSparseMatrix<W>& other,
+                  const size_t j) const
+        {
+            return this->scales_[i] * other.row_scale(j)
+                * spat::sparse_inner_product(this->row_indices(i),
+                      this->row_values(i), this->row_nnz(i),
+                      other.row_indices(j), other.row_values(j),
+                      other.row_nnz(j));
+        }
+    };
+
+    typedef BasicSparseMatrix<float> SparseMatrix;
+    typedef BasicSparseMatrix<int8_t> SparseMatrixQ8;
+
+    ///
+    /// Inverted index of sparse features by codebook entry, an exact
+    /// search whose cost follows the non-zeros of the query and of the
+    /// features sharing its entries. V is the type of stored values as
+    /// for BasicSparseMatrix.
+    ///
+    /// Usage:
+    ///     SparseIndex index(COSINE);
+    ///     index.build(codes);
+    ///     // top 5 features of the first query
+    ///     index.knn(queries, 0, 5);
+    template <class V>
+    class BasicSparseIndex
+    {
+    public:
+        /** feature index bound with its distance or similarity */
+        typedef KeyValue<size_t, float> Neighbour;
+    private:
+        // feature bound with its ranking key, smaller is better
+        typedef KeyValue<uint32_t, float> RowBind;
+        /// Buffers of a search kept between queries
+        struct SearchScratch
+        {
+            /** unscaled inner product of each feature with the query */
+            vector<float> products;
+            /** products[i] is valid only if marks[i] == tag */
+            vector<uint32_t> marks;
+            uint32_t tag;
+            /** features sharing an entry with the query */
+            vector<uint32_t> touched;
+            /** bounded max-heap of keys */
+            vector<RowBind> heap;
+            SearchScratch() : tag(0){}
+        };
+        /** measure ranked and reported */
+        DistanceMeasure measure_;
+        /** feature dimension */
+        size_t dimension_;
+        /** number of features */
+        size_t n_rows_;
+        /** list of entry j is [list_offsets_[j], list_offsets_[j+1])
+         *  of rows_ and values_ */
+        vector<size_t> list_offsets_;
+        /** feature of each posting, ascending in a list */
+        vector<uint32_t> rows_;
+        /** stored value of each posting */
+        vector<V> values_;
+        /** scale of the stored values of each feature */
+        vector<float> scales_;
+        /** squared norm of each feature, for euclidean distances */
+        vector<float> norms_;
+
+        /**
+         * k-nearest-neighbour search core
+         *
+         * @param queries sparse queries
+         * @param q       query row
+         * @param k       number of nearest neighbour searched
+         * @param scratch search buffers, scratch.heap takes the result
+         *                as a max-heap of keys
+         */
+        void search(const SparseMatrix&, const size_t, const size_t,
+                    SearchScratch&) const;
+        /**
+         * convert a ranking key to the measure
+         *
+         * @param key     ranking key
+         * @param q_norm  squared norm of the query
+         *
+         * @return distance or similarity
+         */
+        float measure_key(const float, const float) const;
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param measure COSINE ranks by descending inner product, the
+         *                cosine of normalized codes, EUCLIDEAN and
+         *                SQUARED_EUCLIDEAN by ascending distance
+         */
+        explicit BasicSparseIndex(const DistanceMeasure measure = COSINE);
+        /**
+         * build the index from sparse features, the i-th row gets
+         * feature index i. The features are copied.
+         *
+         * @param features sparse features
+         */
+        void build(const BasicSparseMatrix<V>&);
+        /** number of features indexed */
+        size_t size() const {return this->n_rows_; }
+        /**
+         * Exact k nearest neighbours of a sparse query, sorted from the
+         * best, i.e. by descending cosine similarity or ascending
+         * distance.
+         *
+         * @param queries sparse queries
+         * @param q       query row
+         * @param k       number of nearest neighbour returned
+         *
+         * @return
+         */
+        std::vector<Neighbour> knn(const SparseMatrix&, const size_t,
+                                   const size_t) const;
+        /**
+         * Search k nearest neighbours of many queries at once, see
+         * BasicKDTree::knn_batch. Rows are padded with NO_INDEX and the
+         * worst distance or similarity.
+         *
+         * @param queries    sparse queries
+         * @param k          number of nearest neighbour returned
+         * @param out_ids    output feature indices, rows x k
+         * @param out_dists  output distances or similarities, rows x k,
+         *                   may be NULL if not needed
+         * @param pool       thread pool, NULL for the global pool
+         */
+        void knn_batch(const SparseMatrix&, const size_t, size_t*, float*,
+                       putil::ThreadPool* pool = NULL) const;
+        /** padding id of missing neighbours */
+        static const size_t NO_INDEX = static_cast<size_t>(-1);
+    };
+
+    typedef BasicSparseIndex<float> SparseIndex;
+    typedef BasicSparseIndex<int8_t> SparseIndexQ8;
+
+    extern template class BasicSparseMatrix<float>;
+    extern template class BasicSparseMatrix<int8_t>;
+    extern template class BasicSparseIndex<float>;
+    extern template class BasicSparseIndex<int8_t>;
+}
+#endif //SIREEN_SPARSE_FEATURE_H_
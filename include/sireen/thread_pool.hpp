@@ -0,0 +1,234 @@
+// A light-weight thread pool for data parallel loops and recursive
+// tasks.
+//
+// Tasks are queued in one FIFO shared by the worker threads. A thread
+// waiting for a TaskGroup keeps executing queued tasks until its group
+// is done, so nested groups (e.g. recursive tree construction) never
+// dead-lock and no thread idles while there is work left.
+//
+// Stages of a pipeline running on their own threads are linked by
+// bounded queues, which block a producer running ahead of its
+// consumer.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#ifndef SIREEN_THREAD_POOL_H_
+#define SIREEN_THREAD_POOL_H_
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+using namespace std;
+
+// putil is short for "parallel utility"
+namespace putil
+{
+    class TaskGroup;
+
+    ///
+    /// Fixed size pool of worker threads.
+    ///
+    /// Usage:
+    ///     putil::ThreadPool pool(8);
+    ///     // chunk [0,n) by 64, worker < pool.concurrency()
+    ///     pool.parallel_for(n, 64,
+    ///         [&](size_t begin, size_t end, size_t worker){...});
+    class ThreadPool
+    {
+    private:
+        friend class TaskGroup;
+        /** worker threads */
+        vector<thread> workers_;
+        /** pending tasks */
+        deque<function<void()> > tasks_;
+        /** guards tasks_, stop_ and the TaskGroup counters */
+        mutex mutex_;
+        /** signaled on new task, task group completion and stop */
+        condition_variable cond_;
+        /** stop flag for workers */
+        bool stop_;
+
+        // non-copyable
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+        /** worker thread main loop */
+        void worker_loop();
+        /**
+         * execute queued tasks until the group has no pending task
+         *
+         * @param group task group to wait
+         */
+        void help_until_done(TaskGroup&);
+        /** queue a task and wake a thread */
+        void enqueue(const function<void()>&);
+
+    public:
+        /**
+         * Constructor
+         *
+         * @param n_threads number of worker threads, 0 for one less than
+         *                  the hardware threads since the waiting thread
+         *                  always works as well
+         */
+        explicit ThreadPool(size_t n_threads = 0);
+        /** Destructor, finishes the queued tasks and joins workers */
+        ~ThreadPool();
+        /** number of worker threads */
+        size_t size() const {return this->workers_.size(); }
+        /** number of threads working on a loop: workers and the caller */
+        size_t concurrency() const {return this->workers_.size() + 1; }
+        /**
+         * Parallel loop over [0,n) by chunks of at most grain items.
+         * fn(begin, end, worker) is called for each chunk, where
+         * worker < concurrency() identifies the calling thread for the
+         * duration of the loop, i.e. a worker never runs two chunks at
+         * the same time. So per-worker scratch indexed by worker needs
+         * no lock. Blocks until all chunks are done.
+         *
+         * @param n     number of items
+         * @param grain maximum chunk size
+         * @param fn    chunk function
+         */
+        void parallel_for(const size_t, const size_t,
+                          const function<void(size_t, size_t, size_t)>&);
+        /** shared pool sized by the hardware */
+        static ThreadPool& global();
+    };
+
+    ///
+    /// Group of tasks run by a ThreadPool and waited together. The
+    /// first exception thrown by a task is re-thrown by wait.
+    ///
+    /// Usage:
+    ///     putil::TaskGroup group(pool);
+    ///     group.run([&]{ left(); });
+    ///     right();
+    ///     group.wait();
+    class TaskGroup
+    {
+    private:
+        friend class ThreadPool;
+        ThreadPool& pool_;
+        /** number of unfinished tasks, guarded by the pool mutex */
+        size_t pending_;
+        /** first exception thrown by a task */
+        exception_ptr error_;
+
+        // non-copyable
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+
+    public:
+        explicit TaskGroup(ThreadPool& pool) : pool_(pool), pending_(0) {}
+        /** Destructor, waits for the pending tasks */
+        ~TaskGroup();
+        /**
+         * run a task asynchronously in the pool
+         *
+         * @param task task function
+         */
+        void run(const function<void()>&);
+        /**
+         * wait for all tasks of the group, the calling thread executes
+         * queued tasks meanwhile
+         */
+        void wait();
+    };
+
+    ///
+    /// Bounded blocking FIFO between the stages of a pipeline. push
+    /// blocks while the queue is full and pop while it is empty, so a
+    /// fast stage waits for a slow one instead of piling up items.
+    /// After close, push fails and pop drains the remaining items.
+    ///
+    /// Usage:
+    ///     putil::BoundedQueue<Job> jobs(64);
+    ///     // producer
+    ///     jobs.push(job);
+    ///     jobs.close();
+    ///     // consumer
+    ///     while(jobs.pop(job)) {...}
+    template <class T>
+    class BoundedQueue
+    {
+    private:
+        deque<T> items_;
+        /** maximum number of queued items */
+        size_t capacity_;
+        /** no more pushes accepted */
+        bool closed_;
+        mutex mutex_;
+        condition_variable not_full_;
+        condition_variable not_empty_;
+        // non-copyable
+        BoundedQueue(const BoundedQueue&);
+        BoundedQueue& operator=(const BoundedQueue&);
+    public:
+        /**
+         * Constructor
+         *
+         * @param capacity maximum number of queued items
+         */
+        explicit BoundedQueue(const size_t capacity) :
+            capacity_(capacity > 0 ? capacity : 1), closed_(false) {}
+        /**
+         * queue an item, wait while the queue is full
+         *
+         * @param item item moved into the queue
+         *
+         * @return false if the queue is closed
+         */
+        bool push(T item)
+        {
+            unique_lock<mutex> lock(this->mutex_);
+            this->not_full_.wait(lock, [this]
+                {return this->closed_ || this->items_.size() < this->capacity_; });
+            if(this->closed_)
+                return false;
+            this->items_.push_back(std::move(item));
+            lock.unlock();
+            this->not_empty_.notify_one();
+            return true;
+        }
+        /**
+         * take the oldest item, wait while the queue is empty
+         *
+         * @param item output item
+         *
+         * @return false if the queue is closed and empty
+         */
+        bool pop(T& item)
+        {
+            unique_lock<mutex> lock(this->mutex_);
+            this->not_empty_.wait(lock, [this]
+                {return this->closed_ || !this->items_.empty(); });
+            if(this->items_.empty())
+                return false;
+            item = std::move(this->items_.front());
+            this->items_.pop_front();
+            lock.unlock();
+            this->not_full_.notify_one();
+            return true;
+        }
+        /** refuse further pushes and wake all waiting threads */
+        void close()
+        {
+            {
+                lock_guard<mutex> lock(this->mutex_);
+                this->closed_ = true;
+            }
+            this->not_full_.notify_all();
+            this->not_empty_.notify_all();
+        }
+    };
+}
+#endif //SIREEN_THREAD_POOL_H_
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+# encoding: utf-8
+'''
+setup.py -- builds the nenese library with its compiled module
+            nenese._sireen, the kd-tree search and LLC image coder of
+            sireen for NumPy arrays
+
+To build in place:
+
+> python setup.py build_ext --inplace
+
+The library roots are read from the environment as for make:
+
+> VLROOT=PATH_TO_VLFEAT EIGENROOT=PATH_TO_EIGEN python setup.py build_ext
+
+NENESE_NO_CODER=1 builds the search only, without OpenCV and vlfeat.
+
+@author: bingqingqu
+
+@license: GPLv3
+
+@contact: sylar.qu@gmail.com
+'''
+import os
+import glob
+import platform
+from setuptools import setup, Extension
+
+VLROOT = os.environ.get('VLROOT',
+                        '/home/bingqingqu/user-libs/vlfeat/vlfeat-0.9.19')
+EIGENROOT = os.environ.get('EIGENROOT',
+                           '/home/bingqingqu/user-libs/eigen-3.2.4')
+NO_CODER = os.environ.get('NENESE_NO_CODER', '') not in ('', '0')
+
+sources = ['src/python/sireen_module.cpp'] + sorted(glob.glob('src/cpp/*.cpp'))
+include_dirs = ['include', EIGENROOT]
+define_macros = []
+libraries = []
+library_dirs = []
+if NO_CODER:
+    for coder_source in ('src/cpp/image_feature_extract.cpp',
+                         'src/cpp/batch_encoder.cpp'):
+        sources.remove(coder_source)
+    define_macros.append(('NENESE_NO_CODER', None))
+else:
+    # vlfeat names its binary directory by architecture as the makefile
+    arch = {'Darwin': 'maci64', 'Linux': 'glnxa64'}.get(platform.system(), '')
+    include_dirs.append(VLROOT)
+    library_dirs.append(os.path.join(VLROOT, 'bin', arch))
+    libraries += ['opencv_core', 'opencv_imgproc', 'opencv_highgui', 'vl']
+if platform.system() == 'Linux':
+    define_macros.append(('OS_LINUX', None))
+
+sireen = Extension('nenese._sireen',
+                   sources=sources,
+                   include_dirs=include_dirs,
+                   define_macros=define_macros,
+                   libraries=libraries,
+                   library_dirs=library_dirs,
+                   extra_compile_args=['-std=c++0x', '-O3', '-pthread'],
+                   extra_link_args=['-pthread'],
+                   language='c++')
+
+setup(name='nenese',
+      version='2.2.0',
+      description='Nearest neighbour search of the SiReen image features',
+      author='Bingqing Qu',
+      author_email='sylar.qu@gmail.com',
+      license='GPLv3',
+      package_dir={'nenese': 'lib/nenese'},
+      packages=['nenese'],
+      ext_modules=[sireen])
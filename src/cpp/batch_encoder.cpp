@@ -0,0 +1,308 @@
+// Multi-threaded batch encoding of image files into LLC features
+//
+// An ImageCoder owns the buffers of its sift filters and cannot be
+// shared by threads, so the encoder runs a pipeline of its own:
+//
+// 1. decode threads read an image file, convert it to gray levels and
+//    resize it to the standard frame of the coder;
+// 2. encode threads, each with its own ImageCoder, compute the sift
+//    descriptors and their LLC code;
+// 3. the calling thread hands the results to a sink, either in the
+//    order of the input files or as soon as they are done.
+//
+// Stages are linked by bounded queues, so decoded images never pile
+// up ahead of slow encoders, and in ordered mode the number of images
+// in flight is bounded as well.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+
+#include "sireen/batch_encoder.hpp"
+
+#include <iostream>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "sireen/thread_pool.hpp"
+
+namespace
+{
+    // decoded image waiting for an encoder
+    struct DecodedImage
+    {
+        size_t index;
+        bool ok;
+        vector<float> pixels;
+    };
+}
+
+/**
+ * Constructor
+ *
+ * @param codebook   codebook from sift-kmeans, copied
+ * @param ncb        dimension of codebook
+ * @param k          get top k nearest codes
+ * @param descriptor descriptors the code is computed from
+ */
+BatchEncoder::BatchEncoder(const float* codebook, const int ncb, const int k,
+                           const Descriptor descriptor):
+    codebook_(codebook, ncb),k_(k),descriptor_(descriptor),
+    n_decoders_(0),n_encoders_(0),queue_capacity_(64),ordered_(true)
+{
+    /* default setting of ImageCoder */
+    this->set_image_params(128,128,8,16);
+}
+
+/**
+ * Constructor Overloading
+ *
+ * @param codebook   codebook from sift-kmeans, copied
+ * @param k          get top k nearest codes
+ * @param descriptor descriptors the code is computed from
+ */
+BatchEncoder::BatchEncoder(const Codebook& codebook, const int k,
+                           const Descriptor descriptor):
+    codebook_(codebook),k_(k),descriptor_(descriptor),
+    n_decoders_(0),n_encoders_(0),queue_capacity_(64),ordered_(true)
+{
+    /* default setting of ImageCoder */
+    this->set_image_params(128,128,8,16);
+}
+
+/**
+ * set parameters of the ImageCoder of each thread
+ *
+ * @param std_width  standard image resize frame width
+ * @param std_height standard image resize frame height
+ * @param step       VlDsiftFilter step parameter
+ * @param bin_size   VlDsiftFilter binSize parameter
+ */
+void
+BatchEncoder::set_image_params(const int std_width, const int std_height,
+                               const int step, const int bin_size)
+{
+    this->std_width_ = std_width;
+    this->std_height_ = std_height;
+    this->step_ = step;
+    this->bin_size_ = bin_size;
+}
+
+/**
+ * set the number of threads of the stages
+ *
+ * @param n_decoders threads reading images, 0 for a quarter of
+ *                   the hardware threads
+ * @param n_encoders threads encoding images, 0 for all the
+ *                   hardware threads
+ */
+void
+BatchEncoder::set_threads(const size_t n_decoders, const size_t n_encoders)
+{
+    this->n_decoders_ = n_decoders;
+    this->n_encoders_ = n_encoders;
+}
+
+/**
+ * set the capacity of the queues between stages
+ *
+ * @param capacity maximum number of images waiting for a stage
+ */
+void
+BatchEncoder::set_queue_capacity(const size_t capacity)
+{
+    this->queue_capacity_ = capacity > 0 ? capacity : 1;
+}
+
+/**
+ * read an image file as gray levels in the standard frame, as
+ * ImageCoder::decode_image does
+ *
+ * @param path   image file path
+ * @param pixels output pixel values in row-major order
+ *
+ * @return false if the image cannot be read
+ */
+bool
+BatchEncoder::decode(const string& path, vector<float>& pixels) const
+{
+    pixels.resize(this->std_width_ * this->std_height_);
+    return ImageCoder::decode_image(imread(path, 0), this->std_width_,
+                                    this->std_height_, &pixels[0]);
+}
+
+/**
+ * Encode image files. The sink is called by the calling thread
+ * for each image, including images that could not be read or
+ * encoded. An exception thrown by the sink stops the pipeline
+ * and is re-thrown.
+ *
+ * @param paths image file paths
+ * @param sink  receiver of the encoded images
+ *
+ * @return number of images encoded
+ */
+size_t
+BatchEncoder::encode(const vector<string>& paths, const Sink& sink) const
+{
+    const size_t n = paths.size();
+    const int ncb = this->codebook_.size();
+    if(this->codebook_.empty() || this->k_ <= 0 || this->k_ > ncb)
+    {
+        cerr << " BatchEncoder::encode : invalid codebook or k!"
+             <<__FILE__<<","<<__LINE__ <<endl;
+        return 0;
+    }
+    const size_t hardware = max(1u, thread::hardware_concurrency());
+    const size_t n_decoders = this->n_decoders_ ? this->n_decoders_
+                                                : max(size_t(1), hardware / 4);
+    const size_t n_encoders = this->n_encoders_ ? this->n_encoders_ : hardware;
+    // in ordered mode an image is only read once it is at most so many
+    // images ahead of the next one due, which bounds the images kept
+    // for reordering
+    const size_t window = 2 * this->queue_capacity_ + n_decoders + n_encoders;
+
+    putil::BoundedQueue<DecodedImage> decoded(this->queue_capacity_);
+    putil::BoundedQueue<EncodedImage> encoded(this->queue_capacity_);
+    // next image to read and number of images handed to the sink,
+    // guarded by mutex
+    mutex progress_mutex;
+    condition_variable progress_cond;
+    size_t next = 0;
+    size_t emitted = 0;
+    bool stop = false;
+    // running threads of a stage, the last one closes its output queue
+    size_t decoders_left = n_decoders;
+    size_t encoders_left = n_encoders;
+
+    auto decode_loop = [&]()
+    {
+        for(;;)
+        {
+            size_t i;
+            {
+                unique_lock<mutex> lock(progress_mutex);
+                progress_cond.wait(lock, [&]
+                    {return stop || next >= n || !this->ordered_
+                         || next < emitted + window; });
+                if(stop || next >= n)
+                    break;
+                i = next++;
+            }
+            DecodedImage image;
+            image.index = i;
+            try
+            {
+                image.ok = this->decode(paths[i], image.pixels);
+            }
+            catch(...)
+            {
+                image.ok = false;
+            }
+            if(!decoded.push(std::move(image)))
+                break;
+        }
+        lock_guard<mutex> lock(progress_mutex);
+        if(--decoders_left == 0)
+            decoded.close();
+    };
+
+    auto encode_loop = [&]()
+    {
+        ImageCoder coder(this->std_width_, this->std_height_, this->step_,
+                         this->bin_size_);
+        DecodedImage image;
+        while(decoded.pop(image))
+        {
+            EncodedImage result;
+            result.index = image.index;
+            result.path = paths[image.index];
+            result.ok = image.ok;
+            if(image.ok)
+            {
+                result.llc.resize(ncb);
+                try
+                {
+                    if(this->descriptor_ == DENSE_SIFT)
+                        coder.llc_dense_sift(&image.pixels[0], this->codebook_,
+                                             this->k_, &result.llc[0]);
+                    else
+                        coder.llc_sift(&image.pixels[0], this->codebook_,
+                                       this->k_, &result.llc[0]);
+                }
+                catch(...)
+                {
+                    result.ok = false;
+                    result.llc.clear();
+                }
+            }
+            if(!encoded.push(std::move(result)))
+                break;
+        }
+        lock_guard<mutex> lock(progress_mutex);
+        if(--encoders_left == 0)
+            encoded.close();
+    };
+
+    vector<thread> threads;
+    for(size_t t = 0; t < n_decoders; ++t)
+        threads.push_back(thread(decode_loop));
+    for(size_t t = 0; t < n_encoders; ++t)
+        threads.push_back(thread(encode_loop));
+
+    size_t n_ok = 0;
+    try
+    {
+        // images done ahead of the next one due in ordered mode
+        map<size_t, EncodedImage> pending;
+        EncodedImage result;
+        while(encoded.pop(result))
+        {
+            if(!this->ordered_)
+            {
+                n_ok += result.ok;
+                sink(result);
+                continue;
+            }
+            pending.insert(make_pair(result.index, std::move(result)));
+            size_t due;
+            {
+                lock_guard<mutex> lock(progress_mutex);
+                due = emitted;
+            }
+            map<size_t, EncodedImage>::iterator it;
+            while((it = pending.find(due)) != pending.end())
+            {
+                n_ok += it->second.ok;
+                sink(it->second);
+                pending.erase(it);
+                ++due;
+            }
+            {
+                lock_guard<mutex> lock(progress_mutex);
+                emitted = due;
+            }
+            progress_cond.notify_all();
+        }
+    }
+    catch(...)
+    {
+        {
+            lock_guard<mutex> lock(progress_mutex);
+            stop = true;
+        }
+        progress_cond.notify_all();
+        decoded.close();
+        encoded.close();
+        for(size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        throw;
+    }
+    for(size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    return n_ok;
+}
@@ -0,0 +1,112 @@
+// Codebook of sift words for the LLC coding of ImageCoder
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+
+#include "sireen/codebook.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+
+/**
+ * Default Constructor, an empty codebook
+ */
+Codebook::Codebook(void){}
+
+/**
+ * Constructor Overloading, copies the codes
+ *
+ * @param codes      codes in a row, descr_size values each, as
+ *                   written by the codebook training
+ * @param ncb        number of codes
+ * @param descr_size descriptor size
+ */
+Codebook::Codebook(const float* codes, const int ncb, const int descr_size)
+{
+    this->assign(codes, ncb, descr_size);
+}
+
+/**
+ * recompute the squared norms of the codes
+ */
+void
+Codebook::update_norms()
+{
+    this->norms_ = this->words_.colwise().squaredNorm().transpose();
+}
+
+/**
+ * copy codes into the codebook
+ *
+ * @param codes      codes in a row, descr_size values each
+ * @param ncb        number of codes
+ * @param descr_size descriptor size
+ */
+void
+Codebook::assign(const float* codes, const int ncb, const int descr_size)
+{
+    if(!codes || ncb <= 0 || descr_size <= 0)
+    {
+        cerr << " Codebook::assign : invalid input!"
+             <<__FILE__<<","<<__LINE__ <<endl;
+        return;
+    }
+    this->words_ = Eigen::Map<const Eigen::MatrixXf>(codes, descr_size, ncb);
+    this->update_norms();
+}
+
+/**
+ * read a codebook file of delimited values, codes in a row
+ *
+ * @param filename   codebook file
+ * @param ncb        number of codes
+ * @param descr_size descriptor size
+ * @param delim      delimiter between values, besides white spaces
+ *
+ * @return false if the file cannot be read or holds too few values
+ */
+bool
+Codebook::load(const string& filename, const int ncb, const int descr_size,
+               const char delim)
+{
+    ifstream file(filename.c_str());
+    if(!file.is_open() || ncb <= 0 || descr_size <= 0)
+    {
+        cerr << " Codebook::load : cannot read " << filename << "!"
+             <<__FILE__<<","<<__LINE__ <<endl;
+        return false;
+    }
+    stringstream buffer;
+    buffer << file.rdbuf();
+    string content = buffer.str();
+    for(size_t i = 0; i < content.size(); ++i)
+        if(content[i] == delim)
+            content[i] = ' ';
+
+    Eigen::MatrixXf words(descr_size, ncb);
+    const size_t n = words.size();
+    const char* p = content.c_str();
+    size_t read = 0;
+    for(char* end; read < n; ++read)
+    {
+        words.data()[read] = strtof(p, &end);
+        if(end == p)
+            break;
+        p = end;
+    }
+    if(read < n)
+    {
+        cerr << " Codebook::load : " << filename << " holds " << read
+             << " values instead of " << n << "!"
+             <<__FILE__<<","<<__LINE__ <<endl;
+        return false;
+    }
+    this->words_.swap(words);
+    this->update_norms();
+    return true;
+}
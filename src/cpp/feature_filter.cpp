@@ -0,0 +1,170 @@
+// Filters of features by per-item attributes, evaluated by the nearest
+// neighbour indexes on every candidate before its distance is computed.
+//
+// A filtered-out feature never costs a distance computation, and an
+// index keeps searching until k accepted features are found, instead
+// of the caller scoring everything and dropping rows afterwards as
+// lib/nenese does for its constraint and category columns.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/feature_filter.hpp"
+
+#include <iostream>
+
+namespace nnse
+{
+    /**
+     * Constructor
+     *
+     * @param n     number of feature indices covered
+     * @param value initial bit of all indices
+     */
+    BitmapFilter::BitmapFilter(const size_t n, const bool value):
+        bits_((n + 63) / 64, value ? ~uint64_t(0) : 0), size_(n)
+    {
+        // bits past the last index stay clear for count
+        if(value && (n & 63))
+            this->bits_.back() = (uint64_t(1) << (n & 63)) - 1;
+    }
+
+    /**
+     * set the bit of a feature index, the bitmap grows if needed
+     *
+     * @param index feature index
+     * @param value true to accept the feature
+     */
+    void
+    BitmapFilter::set(const size_t index, const bool value)
+    {
+        if(index >= this->size_)
+        {
+            this->size_ = index + 1;
+            this->bits_.resize((this->size_ + 63) / 64, 0);
+        }
+        if(value)
+            this->bits_[index >> 6] |= uint64_t(1) << (index & 63);
+        else
+            this->bits_[index >> 6] &= ~(uint64_t(1) << (index & 63));
+    }
+
+    /** number of accepted features */
+    size_t
+    BitmapFilter::count() const
+    {
+        size_t n = 0;
+        for(size_t i = 0; i < this->bits_.size(); ++i)
+            n += __builtin_popcountll(this->bits_[i]);
+        return n;
+    }
+
+    /**
+     * add an attribute column
+     *
+     * @param codes attribute code of features 0 to n - 1
+     * @param n     number of features
+     *
+     * @return column id
+     */
+    size_t
+    AttributeFilter::add_column(const uint32_t* codes, const size_t n)
+    {
+        this->columns_.push_back(vector<uint32_t>());
+        this->allowed_.push_back(vector<uint64_t>());
+        if(codes)
+            this->columns_.back().assign(codes, codes + n);
+        else if(n > 0)
+            cerr << " AttributeFilter::add_column : no codes given!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+        return this->columns_.size() - 1;
+    }
+
+    /**
+     * set the code of a feature in a column, the column grows if
+     * needed and new features get code 0
+     *
+     * @param column column id
+     * @param index  feature index
+     * @param code   attribute code
+     */
+    void
+    AttributeFilter::set_code(const size_t column, const size_t index,
+                              const uint32_t code)
+    {
+        if(column >= this->columns_.size())
+        {
+            cerr << " AttributeFilter::set_code : no such column!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        vector<uint32_t>& codes = this->columns_[column];
+        if(index >= codes.size())
+            codes.resize(index + 1, 0);
+        codes[index] = code;
+    }
+
+    /**
+     * accept features with a code in a column
+     *
+     * @param column column id
+     * @param code   attribute code
+     */
+    void
+    AttributeFilter::allow(const size_t column, const uint32_t code)
+    {
+        if(column >= this->columns_.size())
+        {
+            cerr << " AttributeFilter::allow : no such column!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        vector<uint64_t>& allowed = this->allowed_[column];
+        if(code / 64 >= allowed.size())
+            allowed.resize(code / 64 + 1, 0);
+        allowed[code >> 6] |= uint64_t(1) << (code & 63);
+    }
+
+    /**
+     * remove all allowed codes of a column, so it does not
+     * constrain any more
+     *
+     * @param column column id
+     */
+    void
+    AttributeFilter::clear_allowed(const size_t column)
+    {
+        if(column < this->allowed_.size())
+            this->allowed_[column].clear();
+    }
+
+    /**
+     * Whether the code of a feature is allowed in every constrained
+     * column. A feature without a code in a constrained column is
+     * rejected.
+     *
+     * @param index feature index
+     *
+     * @return true to keep the feature
+     */
+    bool
+    AttributeFilter::accept(const size_t index) const
+    {
+        for(size_t c = 0; c < this->columns_.size(); ++c)
+        {
+            const vector<uint64_t>& allowed = this->allowed_[c];
+            if(allowed.empty())
+                continue;
+            const vector<uint32_t>& codes = this->columns_[c];
+            if(index >= codes.size())
+                return false;
+            const uint32_t code = codes[index];
+            if(code / 64 >= allowed.size()
+               || !((allowed[code >> 6] >> (code & 63)) & 1))
+                return false;
+        }
+        return true;
+    }
+}
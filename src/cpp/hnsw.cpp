@@ -0,0 +1,791 @@
+// Hierarchical Navigable Small World graph for approximate nearest
+// neighbour search of high dimensional features. This implementation
+// has following features:
+//
+// 1. Features are linked on layers of proximity graphs, the upper
+//    layers hold exponentially fewer features and long links, so a
+//    search descends greedily from the top layer and only explores a
+//    bounded candidate list on the bottom layer.
+// 2. M, efConstruction and efSearch are configurable, links are chosen
+//    by the neighbour selection heuristic of Malkov and Yashunin.
+// 3. Features are inserted by all threads of a pool, each feature is
+//    guarded by its own lock while the graph is built. Searching a
+//    built graph takes no lock.
+// 4. Save and load in a versioned binary format.
+// 5. Searches may be filtered by a predicate on feature indices. The
+//    bottom layer still walks through rejected features, which keeps
+//    the graph connected, but only accepted ones enter the candidate
+//    list of ef results, so the search goes on until it finds them.
+//
+// For details, refer to:
+//
+// Malkov, Y. A.; Yashunin, D. A., "Efficient and robust approximate
+// nearest neighbor search using Hierarchical Navigable Small World
+// graphs, " IEEE Transactions on Pattern Analysis and Machine
+// Intelligence, 2018
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/hnsw.hpp"
+
+#include <fstream>
+
+namespace nnse
+{
+    namespace
+    {
+        // file layout: magic, version, element size, then the
+        // parameters, features, indices, layers and links
+        const char HNSW_MAGIC[4] = {'S', 'H', 'N', 'W'};
+        const uint32_t HNSW_VERSION = 1;
+
+        template <class V>
+        inline void write_array(ofstream& out, const V* values, const size_t n)
+        {
+            out.write(reinterpret_cast<const char*>(values), sizeof(V) * n);
+        }
+        template <class V>
+        inline void read_array(ifstream& in, V* values, const size_t n)
+        {
+            in.read(reinterpret_cast<char*>(values), sizeof(V) * n);
+        }
+
+        /**
+         * check the links of a row read from a file, they must point
+         * to rows reaching the layer
+         *
+         * @param links     links, the first slot is the count
+         * @param max_links number of link slots
+         * @param levels    top layer of each row
+         * @param level     layer of the links
+         *
+         * @return false if a count or link is out of range
+         */
+        inline bool valid_links(const uint32_t* links, const size_t max_links,
+                                const vector<uint32_t>& levels,
+                                const uint32_t level)
+        {
+            if(links[0] > max_links)
+                return false;
+            for(uint32_t j = 1; j <= links[0]; ++j)
+                if(links[j] >= levels.size() || levels[links[j]] < level)
+                    return false;
+            return true;
+        }
+    }
+
+    /**
+     * Constructor
+     *
+     * @param d               feature dimension
+     * @param m               number of links of a feature on the
+     *                        upper layers, 2M on the bottom layer
+     * @param ef_construction candidate list size of insertion
+     */
+    template <class T>
+    BasicHNSW<T>::BasicHNSW(const size_t d, const size_t m,
+                            const size_t ef_construction):
+        data_(NULL),owns_data_(false),dimension_(d),
+        m_(m > 2 ? m : 2),m0_(2 * (m > 2 ? m : 2)),
+        ef_construction_(ef_construction),ef_search_(10),
+        entry_point_(0),max_level_(0){}
+    template <class T>
+    BasicHNSW<T>::~BasicHNSW()
+    {
+        this->release_data();
+    }
+
+    /**
+     * Release the feature matrix if it is owned by the graph
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::release_data()
+    {
+        if(this->owns_data_)
+            aligned_free(this->data_);
+        this->data_ = NULL;
+        this->owns_data_ = false;
+    }
+
+    /**
+     * build the graph from input features, the features are copied
+     * into one matrix.
+     *
+     * @param features an array of features
+     * @param n        number of features
+     * @param pool     thread pool for the insertion, NULL for the
+     *                 global pool
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::build(Feature* features, const size_t n,
+                        putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!features || n <= 0)
+        {
+            cerr << " HNSW::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->release_data();
+        this->data_ = aligned_malloc<T>(n * this->dimension_);
+        this->owns_data_ = true;
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+        {
+            memcpy(this->data_ + i * this->dimension_, features[i].data,
+                   sizeof(T) * this->dimension_);
+            this->index_[i] = features[i].index;
+        }
+        this->build_graph(n, pool);
+    }
+
+    /**
+     * build the graph from a row-major feature matrix. The i-th row
+     * gets feature index i.
+     *
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param copy  if true, the graph builds on its own copy of the
+     *              matrix. Otherwise data is used as is, it is never
+     *              modified but must outlive the graph.
+     * @param pool  thread pool for the insertion, NULL for the global
+     *              pool
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::build(T* data, const size_t n, const bool copy,
+                        putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!data || n <= 0)
+        {
+            cerr << " HNSW::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->release_data();
+        if(copy)
+        {
+            this->data_ = aligned_malloc<T>(n * this->dimension_);
+            this->owns_data_ = true;
+            memcpy(this->data_, data, sizeof(T) * n * this->dimension_);
+        }
+        else
+        {
+            this->data_ = data;
+        }
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = i;
+        this->build_graph(n, pool);
+    }
+
+    /**
+     * Draw the layers of the rows and insert them into the graph
+     *
+     * @param n    number of features
+     * @param pool thread pool for the insertion, NULL for the global
+     *             pool
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::build_graph(const size_t n, putil::ThreadPool* pool)
+    {
+        // draw the top layer of each row from an exponential
+        // distribution, so that a layer holds 1/M of the one below.
+        // All links are allocated before inserting, nothing moves
+        // while the threads insert.
+        const double level_mult = 1.0 / log(double(this->m_));
+        mt19937 rng(n);
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        this->levels_.resize(n);
+        this->links0_.assign(n * (this->m0_ + 1), 0);
+        this->links_.assign(n, vector<uint32_t>());
+        for(size_t i = 0; i < n; ++i)
+        {
+            this->levels_[i] = uint32_t(-log(1.0 - uniform(rng)) * level_mult);
+            this->links_[i].assign(this->levels_[i] * (this->m_ + 1), 0);
+        }
+        vector<mutex>(n).swap(this->row_locks_);
+
+        // the first row is the entry point, the others are inserted
+        // by all threads
+        this->entry_point_ = 0;
+        this->max_level_ = this->levels_[0];
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        vector<SearchScratch> scratches(workers.concurrency());
+        workers.parallel_for(n - 1, 64,
+            [this, &scratches](size_t begin, size_t end, size_t worker)
+        {
+            for(size_t i = begin; i < end; ++i)
+                this->insert(i + 1, scratches[worker]);
+        });
+        vector<mutex>().swap(this->row_locks_);
+    }
+
+    /**
+     * Links of a row on a layer. While building, they are copied
+     * into the scratch under the row lock.
+     *
+     * @param row     row of the links
+     * @param level   layer of the links
+     * @param locked  whether links are read under row locks
+     * @param scratch search buffers
+     *
+     * @return links, the first one is the number of links
+     */
+    template <class T>
+    const uint32_t*
+    BasicHNSW<T>::read_links(const uint32_t row, const uint32_t level,
+                             const bool locked, SearchScratch& scratch) const
+    {
+        const uint32_t* row_links = this->links(row, level);
+        if(!locked)
+            return row_links;
+        lock_guard<mutex> lock(this->row_locks_[row]);
+        scratch.links.assign(row_links, row_links + row_links[0] + 1);
+        return &scratch.links[0];
+    }
+
+    /**
+     * Insert a row into the graph, the row must have its layer
+     * drawn and its links allocated.
+     *
+     * @param row     row to insert
+     * @param scratch search buffers
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::insert(const uint32_t row, SearchScratch& scratch)
+    {
+        const dist_type* feature = this->data_ + row * this->dimension_;
+        const uint32_t level = this->levels_[row];
+
+        // a row above the top layer becomes the entry point, no other
+        // such row is inserted meanwhile
+        unique_lock<mutex> entry(this->entry_lock_);
+        const uint32_t max_level = this->max_level_;
+        const uint32_t entry_point = this->entry_point_;
+        if(level <= max_level)
+            entry.unlock();
+
+        // descend greedily to the top layer of the row
+        RowBind cur(entry_point, this->distance(feature, entry_point));
+        for(uint32_t l = max_level; l > level; --l)
+            cur = this->search_greedy(feature, cur, l, true, scratch);
+
+        vector<RowBind> neighbours;
+        for(uint32_t l = min(level, max_level) + 1; l-- > 0; )
+        {
+            this->search_layer(feature, cur, this->ef_construction_, l,
+                               true, scratch);
+            neighbours = scratch.results;
+            // the closest row found is the entry of the layer below
+            cur = *min_element(neighbours.begin(), neighbours.end());
+            this->select_neighbours(neighbours, this->m_);
+
+            {
+                lock_guard<mutex> lock(this->row_locks_[row]);
+                uint32_t* row_links = this->links(row, l);
+                row_links[0] = neighbours.size();
+                for(size_t i = 0; i < neighbours.size(); ++i)
+                    row_links[i + 1] = neighbours[i].key;
+            }
+            // link back, a full neighbour drops its worst link
+            for(size_t i = 0; i < neighbours.size(); ++i)
+            {
+                lock_guard<mutex> lock(this->row_locks_[neighbours[i].key]);
+                this->add_link(neighbours[i].key, row, l);
+            }
+        }
+
+        if(level > max_level)
+        {
+            this->entry_point_ = row;
+            this->max_level_ = level;
+        }
+    }
+
+    /**
+     * Greedy search of the closest row on a layer
+     *
+     * @param feature query feature data in array form
+     * @param entry   row to start from
+     * @param level   layer to search
+     * @param locked  whether links are read under row locks
+     * @param scratch search buffers
+     *
+     * @return the closest row found bound with its distance
+     */
+    template <class T>
+    typename BasicHNSW<T>::RowBind
+    BasicHNSW<T>::search_greedy(const dist_type* feature, RowBind entry,
+                                const uint32_t level, const bool locked,
+                                SearchScratch& scratch) const
+    {
+        bool changed = true;
+        dist_type dist;
+        while(changed)
+        {
+            changed = false;
+            const uint32_t* row_links = this->read_links(entry.key, level,
+                                                         locked, scratch);
+            const uint32_t n_links = row_links[0];
+            for(uint32_t i = 1; i <= n_links; ++i)
+            {
+                dist = this->distance(feature, row_links[i]);
+                if(dist < entry.value)
+                {
+                    entry = RowBind(row_links[i], dist);
+                    changed = true;
+                }
+            }
+        }
+        return entry;
+    }
+
+    /**
+     * Best first search of a layer with a candidate list of ef rows,
+     * the result is a max-heap of the ef closest rows found.
+     *
+     * @param feature query feature data in array form
+     * @param entry   row to start from
+     * @param ef      size of the candidate list
+     * @param level   layer to search
+     * @param locked  whether links are read under row locks
+     * @param scratch search buffers, scratch.results takes the result
+     * @param filter  features a result must be accepted by, NULL for
+     *                all. Rejected rows are expanded but never results.
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::search_layer(const dist_type* feature, const RowBind entry,
+                               const size_t ef, const uint32_t level,
+                               const bool locked, SearchScratch& scratch,
+                               const FeatureFilter* filter) const
+    {
+        vector<RowBind>& candidates = scratch.candidates;
+        vector<RowBind>& results = scratch.results;
+        vector<uint32_t>& visited = scratch.visited;
+        // a new tag clears the visited set, the tags are only reset
+        // when they wrap around
+        if(visited.size() != this->size() || ++scratch.tag == 0)
+        {
+            visited.assign(this->size(), 0);
+            scratch.tag = 1;
+        }
+        const uint32_t tag = scratch.tag;
+
+        candidates.clear();
+        results.clear();
+        candidates.push_back(entry);
+        if(!filter || filter->accept(this->index_[entry.key]))
+            results.push_back(entry);
+        visited[entry.key] = tag;
+        dist_type dist;
+        while(!candidates.empty())
+        {
+            // expand the closest candidate, unless it is farther than
+            // the farthest of a full result list
+            pop_heap(candidates.begin(), candidates.end(), greater<RowBind>());
+            const RowBind cur = candidates.back();
+            candidates.pop_back();
+            if(results.size() >= ef && cur.value > results.front().value)
+                break;
+
+            const uint32_t* row_links = this->read_links(cur.key, level,
+                                                         locked, scratch);
+            const uint32_t n_links = row_links[0];
+            for(uint32_t i = 1; i <= n_links; ++i)
+            {
+                const uint32_t next = row_links[i];
+                if(visited[next] == tag)
+                    continue;
+                visited[next] = tag;
+                dist = this->distance(feature, next);
+                if(results.size() < ef || dist < results.front().value)
+                {
+                    candidates.push_back(RowBind(next, dist));
+                    push_heap(candidates.begin(), candidates.end(),
+                              greater<RowBind>());
+                    // a rejected row only leads to other rows
+                    if(filter && !filter->accept(this->index_[next]))
+                        continue;
+                    results.push_back(RowBind(next, dist));
+                    push_heap(results.begin(), results.end());
+                    if(results.size() > ef)
+                    {
+                        pop_heap(results.begin(), results.end());
+                        results.pop_back();
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Select at most max_links neighbours among candidates by the
+     * heuristic of Malkov and Yashunin: a candidate is kept only if
+     * it is closer to the base than to every kept one, so links
+     * spread over directions instead of one dense cluster.
+     *
+     * @param candidates candidates bound with their distances to the
+     *                   base, re-ordered and truncated to the result
+     * @param max_links  greatest number of neighbours
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::select_neighbours(vector<RowBind>& candidates,
+                                    const size_t max_links) const
+    {
+        if(candidates.size() <= max_links)
+            return;
+        std::sort(candidates.begin(), candidates.end());
+        vector<RowBind> kept;
+        kept.reserve(max_links);
+        for(size_t i = 0; i < candidates.size() && kept.size() < max_links; ++i)
+        {
+            const dist_type* cand = this->data_ + candidates[i].key * this->dimension_;
+            bool closer = true;
+            for(size_t j = 0; j < kept.size(); ++j)
+            {
+                if(this->distance(cand, kept[j].key) < candidates[i].value)
+                {
+                    closer = false;
+                    break;
+                }
+            }
+            if(closer)
+                kept.push_back(candidates[i]);
+        }
+        candidates.swap(kept);
+    }
+
+    /**
+     * Add a link from row to neighbour on a layer, the links of the
+     * row are shrunk by the heuristic if it is full. The row must
+     * be locked by the caller.
+     *
+     * @param row       row to link from
+     * @param neighbour row to link to
+     * @param level     layer of the link
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::add_link(const uint32_t row, const uint32_t neighbour,
+                           const uint32_t level)
+    {
+        uint32_t* row_links = this->links(row, level);
+        const size_t max_links = level == 0 ? this->m0_ : this->m_;
+        if(row_links[0] < max_links)
+        {
+            row_links[++row_links[0]] = neighbour;
+            return;
+        }
+
+        // full, keep the best spread links among the old and new ones
+        const dist_type* base = this->data_ + row * this->dimension_;
+        vector<RowBind> candidates;
+        candidates.reserve(max_links + 1);
+        candidates.push_back(RowBind(neighbour, this->distance(base, neighbour)));
+        for(uint32_t i = 1; i <= row_links[0]; ++i)
+            candidates.push_back(RowBind(row_links[i],
+                                         this->distance(base, row_links[i])));
+        this->select_neighbours(candidates, max_links);
+        row_links[0] = candidates.size();
+        for(size_t i = 0; i < candidates.size(); ++i)
+            row_links[i + 1] = candidates[i].key;
+    }
+
+    /**
+     * k-nearest-neighbour search core
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour searched
+     * @param scratch search buffers, scratch.results takes the
+     *                result as a max-heap of squared distances
+     * @param filter  features a result must be accepted by, NULL for
+     *                all
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::search(const dist_type* feature, const size_t k,
+                         SearchScratch& scratch,
+                         const FeatureFilter* filter) const
+    {
+        scratch.results.clear();
+        if(k == 0 || this->size() == 0)
+            return;
+
+        RowBind cur(this->entry_point_,
+                    this->distance(feature, this->entry_point_));
+        for(uint32_t l = this->max_level_; l > 0; --l)
+            cur = this->search_greedy(feature, cur, l, false, scratch);
+        this->search_layer(feature, cur, max(this->ef_search_, k), 0,
+                           false, scratch, filter);
+
+        vector<RowBind>& results = scratch.results;
+        while(results.size() > k)
+        {
+            pop_heap(results.begin(), results.end());
+            results.pop_back();
+        }
+    }
+
+    /**
+     * Search for approximate k nearest neighbours. Results are in
+     * the same order as BasicKDTree::knn_bbf_opt.
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour returned
+     * @param filter  features a result must be accepted by, NULL for
+     *                all
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicHNSW<T>::Feature>
+    BasicHNSW<T>::knn(const dist_type* feature, size_t k,
+                      const FeatureFilter* filter) const
+    {
+        // best result buffer
+        vector<Feature> nbrs;
+        if(this->size() == 0 || !feature)
+        {
+            cerr << " HNSW::knn : graph not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchScratch scratch;
+        this->search(feature, k, scratch, filter);
+
+        // greatest distance first, as popped from a max-priority queue
+        vector<RowBind>& heap = scratch.results;
+        nbrs.reserve(heap.size());
+        while(!heap.empty())
+        {
+            const size_t row = heap.front().key;
+            nbrs.push_back(Feature(this->data_ + row * this->dimension_,
+                                   this->dimension_, this->index_[row]));
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once, see
+     * BasicKDTree::knn_batch.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output euclidean distances, nq x k, may be
+     *                   NULL if not needed
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicHNSW<T>::knn_batch(const dist_type* queries, const size_t nq,
+                            const size_t k, size_t* out_ids,
+                            dist_type* out_dists,
+                            const FeatureFilter* filter,
+                            putil::ThreadPool* pool) const
+    {
+        if(this->size() == 0 || !queries || !out_ids)
+        {
+            cerr << " HNSW::knn_batch : graph not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one scratch per worker, reused by all its queries
+        vector<SearchScratch> scratches(workers.concurrency());
+        const size_t dim = this->dimension_;
+
+        workers.parallel_for(nq, 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            SearchScratch& scratch = scratches[worker];
+            for(size_t q = begin; q < end; ++q)
+            {
+                this->search(queries + q * dim, k, scratch, filter);
+                BasicKDTree<T>::write_results(scratch.results,
+                    &this->index_[0], k, EUCLIDEAN, out_ids + q * k,
+                    out_dists ? out_dists + q * k : NULL);
+            }
+        });
+    }
+
+    /**
+     * Save the graph and its features to a binary file. Numbers are
+     * stored in the byte order of the machine.
+     *
+     * @param path file path
+     *
+     * @return true on success, false if the graph is not built
+     */
+    template <class T>
+    bool
+    BasicHNSW<T>::save(const string& path) const
+    {
+        if(this->size() == 0)
+        {
+            cerr << " HNSW::save : graph not built!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        ofstream out(path.c_str(), ios::binary);
+        if(!out.is_open())
+        {
+            cerr << " HNSW::save : can not open " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        const uint64_t n = this->size();
+        const uint32_t elem_size = sizeof(T);
+        const uint64_t params[6] = {this->dimension_, n, this->m_,
+                                    this->ef_construction_, this->entry_point_,
+                                    this->max_level_};
+        write_array(out, HNSW_MAGIC, 4);
+        write_array(out, &HNSW_VERSION, 1);
+        write_array(out, &elem_size, 1);
+        write_array(out, params, 6);
+        write_array(out, this->data_, n * this->dimension_);
+        vector<uint64_t> index(this->index_.begin(), this->index_.end());
+        write_array(out, &index[0], n);
+        write_array(out, &this->levels_[0], n);
+        write_array(out, &this->links0_[0], this->links0_.size());
+        for(size_t i = 0; i < n; ++i)
+            if(!this->links_[i].empty())
+                write_array(out, &this->links_[i][0], this->links_[i].size());
+        if(!out.good())
+        {
+            cerr << " HNSW::save : failed to write " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Load a graph saved by save, the graph owns the loaded
+     * features. The feature type and dimension must match.
+     *
+     * @param path file path
+     *
+     * @return true on success, false if the file is not a valid graph
+     *         of this type and dimension
+     */
+    template <class T>
+    bool
+    BasicHNSW<T>::load(const string& path)
+    {
+        ifstream in(path.c_str(), ios::binary);
+        if(!in.is_open())
+        {
+            cerr << " HNSW::load : can not open " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        in.seekg(0, ios::end);
+        const size_t file_size = in.tellg();
+        in.seekg(0);
+        char magic[4];
+        uint32_t version, elem_size;
+        uint64_t params[6];
+        read_array(in, magic, 4);
+        read_array(in, &version, 1);
+        read_array(in, &elem_size, 1);
+        read_array(in, params, 6);
+        if(!in.good() || memcmp(magic, HNSW_MAGIC, 4) != 0
+           || version != HNSW_VERSION || elem_size != sizeof(T)
+           || params[0] != this->dimension_ || params[1] == 0)
+        {
+            cerr << " HNSW::load : not a graph of this type or dimension "
+                 << path <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        // the counts must fit the file before anything is allocated,
+        // a row takes at least its features, index, layer and bottom
+        // layer links
+        const size_t m = params[2];
+        if(m < 2 || m > file_size / sizeof(uint32_t)
+           || params[1] > file_size / (this->dimension_ * sizeof(T)
+                                       + sizeof(uint64_t) + sizeof(uint32_t)
+                                       + (2 * m + 1) * sizeof(uint32_t)))
+        {
+            cerr << " HNSW::load : truncated file " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        const size_t n = params[1];
+        this->release_data();
+        this->data_ = aligned_malloc<T>(n * this->dimension_);
+        this->owns_data_ = true;
+        this->m_ = m;
+        this->m0_ = 2 * this->m_;
+        this->ef_construction_ = params[3];
+        this->entry_point_ = params[4];
+        this->max_level_ = params[5];
+
+        read_array(in, this->data_, n * this->dimension_);
+        vector<uint64_t> index(n);
+        read_array(in, &index[0], n);
+        this->index_.assign(index.begin(), index.end());
+        this->levels_.resize(n);
+        read_array(in, &this->levels_[0], n);
+        this->links0_.resize(n * (this->m0_ + 1));
+        read_array(in, &this->links0_[0], this->links0_.size());
+        bool valid = in.good() && this->entry_point_ < n
+            && this->max_level_ == this->levels_[this->entry_point_];
+        // the upper layer links of a row must fit the rest of the file
+        size_t remaining = valid ? file_size - size_t(in.tellg()) : 0;
+        this->links_.assign(n, vector<uint32_t>());
+        for(size_t i = 0; i < n && valid; ++i)
+        {
+            const size_t level = this->levels_[i];
+            const size_t size = level * (this->m_ + 1);
+            valid = level <= this->max_level_
+                && size <= remaining / sizeof(uint32_t);
+            if(!valid || size == 0)
+                continue;
+            remaining -= size * sizeof(uint32_t);
+            this->links_[i].resize(size);
+            read_array(in, &this->links_[i][0], size);
+        }
+        valid = valid && in.good();
+        for(uint32_t i = 0; i < n && valid; ++i)
+        {
+            valid = valid_links(this->links(i, 0), this->m0_, this->levels_, 0);
+            for(uint32_t l = 1; l <= this->levels_[i] && valid; ++l)
+                valid = valid_links(this->links(i, l), this->m_,
+                                    this->levels_, l);
+        }
+        if(!valid)
+        {
+            cerr << " HNSW::load : truncated or corrupted file " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            this->release_data();
+            this->index_.clear();
+            this->levels_.clear();
+            this->links0_.clear();
+            this->links_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    template class BasicHNSW<double>;
+    template class BasicHNSW<float>;
+}
@@ -14,6 +14,213 @@
 // @license: See LICENSE at root directory
 
 #include "sireen/image_feature_extract.hpp"
+
+#include <chrono>
+#include <limits>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * seconds elapsed since a time point, which is moved to now so
+     * that consecutive stages are timed one after another
+     *
+     * @param since start of the stage
+     *
+     * @return elapsed seconds
+     */
+    double lap(Clock::time_point& since)
+    {
+        const Clock::time_point now = Clock::now();
+        const double seconds = std::chrono::duration<double>(now - since).count();
+        since = now;
+        return seconds;
+    }
+
+    /**
+     * indices of the k smallest distances, ascending, ties broken by
+     * the lower index as a min-heap of (distance, index) pairs would.
+     * A distance not below the current k-th costs one comparison, so
+     * the scan of a row is mostly a linear pass.
+     *
+     * @param dist  contiguous distances to all codes
+     * @param n     number of codes
+     * @param k     number of codes selected, k <= n
+     * @param best  buffer of k distances
+     * @param out   output k indices
+     */
+    inline void select_k_nearest(const float* dist, const int n, const int k,
+                                 float* best, int* out)
+    {
+        int size = 0;
+        for(int j = 0; j < n; ++j)
+        {
+            const float d = dist[j];
+            if(size == k && !(d < best[k - 1]))
+                continue;
+            // insert into the sorted k best, after equal distances
+            int pos = size < k ? size++ : k - 1;
+            while(pos > 0 && d < best[pos - 1])
+            {
+                best[pos] = best[pos - 1];
+                out[pos] = out[pos - 1];
+                --pos;
+            }
+            best[pos] = d;
+            out[pos] = j;
+        }
+    }
+
+    /** position of entry (a, b), b <= a, in a packed lower triangle */
+    inline int lower_index(const int a, const int b)
+    {
+        return a * (a + 1) / 2 + b;
+    }
+
+    /**
+     * lower triangle of the covariance of the differences between a
+     * descriptor and its K nearest codes, regularized by 1e-4 of its
+     * trace. The dot products of a triangle are cheaper than the
+     * general product for a K this small.
+     *
+     * @param codebook   codes, one per column
+     * @param descr      descriptor
+     * @param idx        K nearest codes
+     * @param U          buffer of descriptor size x K differences
+     * @param covariance output K x K covariance, lower triangle only
+     */
+    template <int K>
+    inline void llc_covariance(const Map<const MatrixXf>& codebook,
+                               const float* descr, const int* idx,
+                               Matrix<float,Dynamic,K>& U,
+                               Matrix<float,K,K>& covariance)
+    {
+        Map<const VectorXf> x(descr, codebook.rows());
+        for(int j = 0; j < K; ++j)
+            U.col(j) = (codebook.col(idx[j]) - x).cwiseAbs();
+        for(int a = 0; a < K; ++a)
+            for(int b = 0; b <= a; ++b)
+                covariance(a,b) = U.col(a).dot(U.col(b));
+        covariance.diagonal().array() += 1e-4f * covariance.trace();
+    }
+
+    /**
+     * llc weights of the descriptors for a K fixed at compile time,
+     * solving each fixed-size covariance by LDLT
+     *
+     * @param codebook codes, one per column
+     * @param descr    descriptors, one per column
+     * @param knn_idx  K nearest codes of each descriptor
+     * @param weights  output weights, descriptors x K
+     */
+    template <int K>
+    void solve_llc(const Map<const MatrixXf>& codebook,
+                   const Map<MatrixXf>& descr, const MatrixXi& knn_idx,
+                   ArrayXXf& weights)
+    {
+        Matrix<float,Dynamic,K> U(codebook.rows(), K);
+        Matrix<float,K,K> covariance;
+        LDLT<Matrix<float,K,K> > ldlt;
+        Matrix<float,K,1> c_hat;
+        for(int i = 0; i < descr.cols(); ++i)
+        {
+            llc_covariance<K>(codebook, &descr(0,i), &knn_idx(0,i), U,
+                              covariance);
+            c_hat = ldlt.compute(covariance)
+                .solve(Matrix<float,K,1>::Ones());
+            weights.row(i) = c_hat.transpose() / c_hat.sum();
+        }
+    }
+
+    /**
+     * llc weights of the descriptors for a K fixed at compile time,
+     * all covariances factorized together. An entry of the packed
+     * triangles of all descriptors is a contiguous column, so every
+     * step of the LDLT without pivoting, which the regularized
+     * covariances do not need, is one vector operation across the
+     * descriptors.
+     *
+     * @param codebook codes, one per column
+     * @param descr    descriptors, one per column
+     * @param knn_idx  K nearest codes of each descriptor
+     * @param lower    buffer of the packed triangles, descriptors x
+     *                 K(K+1)/2
+     * @param weights  output weights, descriptors x K
+     */
+    template <int K>
+    void solve_llc_batch(const Map<const MatrixXf>& codebook,
+                         const Map<MatrixXf>& descr, const MatrixXi& knn_idx,
+                         ArrayXXf& lower, ArrayXXf& weights)
+    {
+        const int n = descr.cols();
+        lower.resize(n, K * (K + 1) / 2);
+        Matrix<float,Dynamic,K> U(codebook.rows(), K);
+        Matrix<float,K,K> covariance;
+        for(int i = 0; i < n; ++i)
+        {
+            llc_covariance<K>(codebook, &descr(0,i), &knn_idx(0,i), U,
+                              covariance);
+            for(int a = 0; a < K; ++a)
+                for(int b = 0; b <= a; ++b)
+                    lower(i, lower_index(a,b)) = covariance(a,b);
+        }
+
+        // C = L D L^T, D over the diagonal and L below it
+        for(int j = 0; j < K; ++j)
+        {
+            for(int m = 0; m < j; ++m)
+                lower.col(lower_index(j,j)) -=
+                    lower.col(lower_index(j,m)).square()
+                    * lower.col(lower_index(m,m));
+            for(int a = j + 1; a < K; ++a)
+            {
+                for(int m = 0; m < j; ++m)
+                    lower.col(lower_index(a,j)) -=
+                        lower.col(lower_index(a,m))
+                        * lower.col(lower_index(j,m))
+                        * lower.col(lower_index(m,m));
+                lower.col(lower_index(a,j)) /= lower.col(lower_index(j,j));
+            }
+        }
+        // solve L D L^T c = 1, then weights sum to 1
+        for(int a = 0; a < K; ++a)
+        {
+            weights.col(a).setOnes();
+            for(int m = 0; m < a; ++m)
+                weights.col(a) -= lower.col(lower_index(a,m))
+                    * weights.col(m);
+        }
+        for(int a = 0; a < K; ++a)
+            weights.col(a) /= lower.col(lower_index(a,a));
+        for(int a = K - 1; a >= 0; --a)
+            for(int m = a + 1; m < K; ++m)
+                weights.col(a) -= lower.col(lower_index(m,a))
+                    * weights.col(m);
+        weights.colwise() /= weights.rowwise().sum();
+    }
+
+    /**
+     * llc weights of the descriptors, by the solver fixed for K
+     *
+     * @param codebook codes, one per column
+     * @param descr    descriptors, one per column
+     * @param knn_idx  K nearest codes of each descriptor
+     * @param lower    buffer of the batched solver
+     * @param weights  output weights, descriptors x K
+     */
+    template <int K>
+    void solve_llc_fixed(const Map<const MatrixXf>& codebook,
+                         const Map<MatrixXf>& descr, const MatrixXi& knn_idx,
+                         ArrayXXf& lower, ArrayXXf& weights)
+    {
+        // below a few packets of descriptors the batch does not pay
+        if(descr.cols() < 16)
+            solve_llc<K>(codebook, descr, knn_idx, weights);
+        else
+            solve_llc_batch<K>(codebook, descr, knn_idx, lower, weights);
+    }
+}
 /**
  * Default constuctor
  */
@@ -21,6 +228,7 @@ ImageCoder::ImageCoder(void)
 {
     this->dsift_filter_ = NULL;
     this->sift_filter_ = NULL;
+    this->pooling_ = MAX_POOLING;
     /* default setting */
     this->set_params(128,128,8,16);
 }
@@ -31,6 +239,7 @@ ImageCoder::ImageCoder(int std_width, int std_height, int step, int bin_size)
 {
     this->dsift_filter_ = NULL;
     this->sift_filter_ = NULL;
+    this->pooling_ = MAX_POOLING;
     this->set_params(std_width,std_height,step,bin_size);
 }
 /**
@@ -39,6 +248,8 @@ ImageCoder::ImageCoder(int std_width, int std_height, int step, int bin_size)
 ImageCoder::ImageCoder(VlDsiftFilter* filter)
 {
     this->dsift_filter_ = filter;
+    this->sift_filter_ = NULL;
+    this->pooling_ = MAX_POOLING;
     // switch off gaussian windowing
     vl_dsift_set_flat_window(dsift_filter_,true);
 
@@ -117,34 +328,51 @@ ImageCoder::set_params(int std_width, int std_height, int step, int bin_size)
 float*
 ImageCoder::decode_image(Mat src_image)
 {
+    if(!decode_image(src_image, this->std_width_, this->std_height_,
+                     this->image_data_))
+        return NULL;
+    return this->image_data_;
+}
+
+/**
+ * decode image to graylevel values resized to a frame by
+ * row-order, shared by decode_image and the BatchEncoder
+ * decoders.
+ *
+ * @param src_image opencv Mat image
+ * @param width     frame width
+ * @param height    frame height
+ * @param pixels    output array of width x height values
+ *
+ * @return false if the image has no data
+ */
+bool
+ImageCoder::decode_image(Mat src_image, const int width, const int height,
+                         float* pixels)
+{
+    // validate
+    if(!src_image.data)
+        return false;
+
     // check if source image is graylevel
     if (src_image.channels() != 1)
         cvtColor(src_image,src_image,CV_BGR2GRAY);
 
     // resize image
-    if(src_image.rows != 0 || !(src_image.cols==this->std_width_
-                               && src_image.rows==this->std_height_))
-        resize(src_image, src_image, Size(this->std_width_,this->std_height_),
-               0, 0, INTER_LINEAR);
-
-    // validate
-    if(!src_image.data)
-        return NULL;
+    if(!(src_image.cols==width && src_image.rows==height))
+        resize(src_image, src_image, Size(width,height), 0, 0, INTER_LINEAR);
 
     // get valid input for dsift process
-    // memset here to prevent memory leak
-    memset(this->image_data_, 0, sizeof(vl_sift_pix)
-           * this->std_width_*this->std_height_);
     uchar * row_ptr;
     for (int i=0; i<src_image.rows; ++i)
     {
         row_ptr = src_image.ptr<uchar>(i);
         for (int j=0; j<src_image.cols; ++j)
         {
-            this->image_data_[i*src_image.cols+j] = row_ptr[j];
+            pixels[i*src_image.cols+j] = row_ptr[j];
         }
     }
-    return this->image_data_;
+    return true;
 }
 
 /**
@@ -156,8 +384,10 @@ ImageCoder::decode_image(Mat src_image)
 float*
 ImageCoder::dsift_descriptor(float* image_data)
 {
+    Clock::time_point stage = Clock::now();
     // process an image data
     vl_dsift_process(this->dsift_filter_,image_data);
+    this->times_.descriptor += lap(stage);
     // return the (unnormalized) sift descriptors
     // by default, the vlfeat library has normalized the descriptors
     // our following  normalization eliminates those peaks (big value gradients)
@@ -174,6 +404,7 @@ ImageCoder::dsift_descriptor(float* image_data)
 void
 ImageCoder::sift_descriptor(float* image_data, int& n_keypoints, vector<float>& sift_descr)
 {
+    Clock::time_point stage = Clock::now();
     // reset n_keypoints
     n_keypoints = 0;
     int first = 1;
@@ -227,6 +458,7 @@ ImageCoder::sift_descriptor(float* image_data, int& n_keypoints, vector<float>&
             }
         }
     }
+    this->times_.descriptor += lap(stage);
     // cout << sift_descr.size() << endl;
     // cout << "sift_descr"<< endl;
     // for(vector<float>::iterator it(sift_descr.begin()); it!=sift_descr.end();++it)
@@ -236,130 +468,153 @@ ImageCoder::sift_descriptor(float* image_data, int& n_keypoints, vector<float>&
 
 /**
  * compute linear local constraint coding descriptor from dsift
- * descriptors
+ * descriptors, in the buffers of the workspace
  *
- * @param dsift_descr dsift descriptors
+ * @param dsift_descr dsift descriptors, normalized in place
  * @param codebook    codebook from sift-kmeans
+ * @param cb_norms    squared norms of the codes, NULL to compute them
  * @param ncb         dimension of codebook
  * @param k           get top k nearest codes
- * @param out         output vector will take the llc result
+ * @param descr_size  descriptor size
+ * @param n_keypoints number of descriptors
  *
- * @return Eigen vector take the llc valuex
+ * @return Eigen vector take the llc value, valid until the next call
  */
-Eigen::VectorXf
-ImageCoder::llc_process(float* dsift_descr, float *codebook, const int ncb,
-                        const int k, const int descr_size, const int n_keypoints)
+const Eigen::VectorXf&
+ImageCoder::llc_process(float* dsift_descr, const float *codebook,
+                        const float* cb_norms, const int ncb, const int k,
+                        const int descr_size, const int n_keypoints)
 {
+    LLCWorkspace& ws = this->workspace_;
     if(!dsift_descr)
         throw runtime_error("image not loaded or resized properly");
     if(n_keypoints == 0)
     {
-        return VectorXf::Zero(ncb);
+        ws.llc.setZero(ncb);
+        return ws.llc;
     }
-    // cout << "image_data" << endl;
-    // for(int i=0;i<descr_size*n_keypoints;++i)
-    //     cout << "," << dsift_descr[i];
-    // cout << endl;
 
-    // cout << "matrix" << endl;
     // eliminate peak gradients and normalize
     // initialize dsift descriptors and codebook Eigen matrix
-    MatrixXf mat_dsift= this->norm_sift(dsift_descr,descr_size,n_keypoints,true);
-    Map<MatrixXf> mat_cb(codebook,descr_size,ncb);
+    Clock::time_point stage = Clock::now();
+    this->normalize_sift(dsift_descr,descr_size,n_keypoints,true);
+    Map<MatrixXf> mat_dsift(dsift_descr,descr_size,n_keypoints);
+    Map<const MatrixXf> mat_cb(codebook,descr_size,ncb);
+    if(!cb_norms)
+    {
+        ws.cb_norms = mat_cb.colwise().squaredNorm().transpose();
+        cb_norms = ws.cb_norms.data();
+    }
 
     // Step 1 - compute eucliean distance and sort
     // only in the case if all the sift features are not sure to
     // be nomalized to sum square 1, we arrange the distance as following
-    MatrixXi knn_idx(n_keypoints, k);
-    MatrixXf cdist(n_keypoints,ncb);
+    // buffers only reallocate when the shapes change
+    ws.knn_idx.resize(k, n_keypoints);
+    ws.cdist.resize(ncb,n_keypoints);
+    ws.best.resize(k);
 
     // get euclidean distance of pairwise column features
-    // use the trick of (u-v)^2 = u^2 + v^2 - 2uv
-    // with assumption of Eigen column-wise manipulcation
-    // is quite fast
-    cdist = ( (mat_dsift.transpose() * mat_cb * -2).colwise()
-              + mat_dsift.colwise().squaredNorm().transpose()).rowwise()
-              + mat_cb.colwise().squaredNorm();
+    // use the trick of (u-v)^2 = u^2 + v^2 - 2uv, one column per
+    // descriptor so that its distances are contiguous. u^2 is the
+    // same for all codes of a descriptor and left out of the ranking
+    ws.cdist.noalias() = mat_cb.transpose() * mat_dsift * -2;
+    ws.cdist.colwise() += Map<const VectorXf>(cb_norms, ncb);
+    this->times_.distance += lap(stage);
 
     // The idea behand this is according to Jinjun Wang et al.(2010)
     // section 3, an approximate fast encoding llc can be achieved by
     // keeping only the significant top k values and set others to 0.
-    typedef std::pair<double,int> ValueAndIndex;
     for (int i = 0; i< n_keypoints; ++i)
-    {
-        std::priority_queue<ValueAndIndex,
-                            std::vector<ValueAndIndex>,
-                            std::greater<ValueAndIndex>
-                            > q;
-        // use a priority queue to implement the pop top k
-        for (int j = 0; j < ncb; ++j)
-            q.push(std::pair<double, int>(cdist(i,j),j));
-
-        for (int n = 0; n < k; ++n )
-        {
-            knn_idx(i,n) = q.top().second;
-            q.pop();
-        }
-
-    }
+        select_k_nearest(&ws.cdist(0,i), ncb, k, ws.best.data(),
+                         &ws.knn_idx(0,i));
+    this->times_.selection += lap(stage);
 
     // Step 2 - compute the covariance and solve the analytic solution
-    // put the results into llc cache
-
-    // declare temp variables
-    // identity matrix
-    MatrixXf I = MatrixXf::Identity(k,k) * (1e-4);
-    // llc caches
-    MatrixXf caches = MatrixXf::Zero(n_keypoints,ncb);
-    // subtraction between vectors
-    MatrixXf U(descr_size,k);
-    // covariance matrix
-    MatrixXf covariance(k,k);
-
     // c^hat in the formular:
     // c^hat_i = (C_i + lambda * diag(d)) \ 1
     // c_i = c^hat_i /1^T *c^hat_i
-    // where C_i is the covariance matrix
-    VectorXf c_hat(k);
-
-    for(int i=0;i<n_keypoints;++i)
+    // where C_i is the covariance matrix. The usual k have solvers
+    // of fixed size, others solve one descriptor at a time
+    ws.weights.resize(n_keypoints,k);
+    switch(k)
     {
-        for(int j=0;j<k;j++)
-            U.col(j) = (mat_cb.col(knn_idx(i,j)) - mat_dsift.col(i))
-                .cwiseAbs();
-        // compute covariance
-        covariance = U.transpose()*U;
-        c_hat = (covariance + I*covariance.trace())
-            .fullPivLu().solve(VectorXf::Ones(k));
-
-        c_hat = c_hat / c_hat.sum();
-        for(int j = 0 ; j < k ; ++j)
-            caches(i,knn_idx(i,j)) = c_hat(j);
+    case 3:
+        solve_llc_fixed<3>(mat_cb, mat_dsift, ws.knn_idx, ws.lower, ws.weights);
+        break;
+    case 5:
+        solve_llc_fixed<5>(mat_cb, mat_dsift, ws.knn_idx, ws.lower, ws.weights);
+        break;
+    case 10:
+        solve_llc_fixed<10>(mat_cb, mat_dsift, ws.knn_idx, ws.lower, ws.weights);
+        break;
+    default:
+        // subtraction between vectors
+        ws.U.resize(descr_size,k);
+        // covariance matrix
+        ws.covariance.resize(k,k);
+        for(int i=0;i<n_keypoints;++i)
+        {
+            for(int j=0;j<k;j++)
+                ws.U.col(j) = (mat_cb.col(ws.knn_idx(j,i)) - mat_dsift.col(i))
+                    .cwiseAbs();
+            // compute covariance, regularized by 1e-4 of its trace
+            ws.covariance.noalias() = ws.U.transpose()*ws.U;
+            ws.covariance.diagonal().array() += 1e-4f * ws.covariance.trace();
+            ws.c_hat = ws.ldlt.compute(ws.covariance).solve(VectorXf::Ones(k));
+            ws.weights.row(i) = ws.c_hat.transpose() / ws.c_hat.sum();
+        }
     }
+    this->times_.solve += lap(stage);
 
-    // Step 3 - get the llc descriptor and normalize
-    // get max coofficient for each column
-    VectorXf llc = caches.colwise().maxCoeff();
-    // VectorXf llc = caches.colwise().sum();
+    // Step 3 - pool the weights into the llc descriptor and normalize
+    // a descriptor only weights its k nearest codes
+    if(this->pooling_ == MAX_POOLING)
+    {
+        ws.llc.setConstant(ncb, -numeric_limits<float>::infinity());
+        ws.hits.setZero(ncb);
+        for(int i = 0; i < n_keypoints; ++i)
+            for(int j = 0; j < k; ++j)
+            {
+                const int idx = ws.knn_idx(j,i);
+                ws.llc(idx) = max(ws.llc(idx), ws.weights(i,j));
+                ++ws.hits(idx);
+            }
+        // the codes a descriptor does not weight are 0 for it, which
+        // only matters to the max when a code misses some descriptor
+        for(int j = 0; j < ncb; ++j)
+            if(ws.hits(j) < n_keypoints)
+                ws.llc(j) = max(ws.llc(j), 0.f);
+    }
+    else
+    {
+        ws.llc.setZero(ncb);
+        for(int i = 0; i < n_keypoints; ++i)
+            for(int j = 0; j < k; ++j)
+                ws.llc(ws.knn_idx(j,i)) += ws.weights(i,j);
+    }
 
     // normalization
-    llc.normalize();
-    return llc;
+    ws.llc.normalize();
+    this->times_.pooling += lap(stage);
+    ++this->times_.images;
+    return ws.llc;
 }
 /**
- * compute linear local constraint coding descriptor
+ * llc code of the dense sift of an image
  *
- * @param dsift_descr dsift descriptors
- * @param codebook    codebook from sift-kmeans
- * @param ncb         dimension of codebook
- * @param k           get top k nearest codes
- * @param out         output vector will take the llc result
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param cb_norms   squared norms of the codes, NULL to compute them
+ * @param ncb        dimension of codebook
+ * @param k          get top k nearest codes
  *
- * @return a conversion from llc feature to string
+ * @return llc code, valid until the next call
  */
-string
-ImageCoder::llc_dense_sift(float* image_data, float *codebook, const int ncb,
-                           const int k, vector<float> &out)
+const Eigen::VectorXf&
+ImageCoder::dense_llc(float* image_data, const float* codebook,
+                      const float* cb_norms, const int ncb, const int k)
 {
     float* dsift_descr = dsift_descriptor(image_data);
 
@@ -367,24 +622,107 @@ ImageCoder::llc_dense_sift(float* image_data, float *codebook, const int ncb,
     int descr_size = vl_dsift_get_descriptor_size(dsift_filter_);
     int n_keypoints = vl_dsift_get_keypoint_num(dsift_filter_);
 
-    VectorXf llc = llc_process(dsift_descr,codebook,ncb,k, descr_size, n_keypoints);
-    if(!out.empty())
-    {
-        out.clear();
-    }
-    // output the result in squeezed form
-    // (i.e. bis after floating points are omitted)
+    return llc_process(dsift_descr, codebook, cb_norms, ncb, k, descr_size,
+                       n_keypoints);
+}
+/**
+ * llc code of the sift keypoints of an image
+ *
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param cb_norms   squared norms of the codes, NULL to compute them
+ * @param ncb        dimension of codebook
+ * @param k          get top k nearest codes
+ *
+ * @return llc code, valid until the next call
+ */
+const Eigen::VectorXf&
+ImageCoder::sift_llc(float* image_data, const float* codebook,
+                     const float* cb_norms, const int ncb, const int k)
+{
+    int n_keypoints = 0;
+    const int descr_size = 128;
+    vector<float>& sift_descr = this->workspace_.sift_descr;
+    sift_descr.clear();
+    this->sift_descriptor(image_data,n_keypoints,sift_descr);
+    return llc_process(sift_descr.data(), codebook, cb_norms, ncb, k,
+                       descr_size, n_keypoints);
+}
+/**
+ * output the llc code in squeezed form
+ * (i.e. bis after floating points are omitted)
+ *
+ * @param llc llc code
+ *
+ * @return comma separated values
+ */
+string
+ImageCoder::llc_to_string(const VectorXf& llc)
+{
     ostringstream s;
     s << llc(0);
-    out.push_back(llc(0));
-    for(int i=1; i<ncb; ++i)
+    for(int i=1; i<llc.size(); ++i)
     {
         s << ",";
         s << llc(i);
-        out.push_back(llc(i));
     }
     return s.str();
 }
+/**
+ * compute linear local constraint coding descriptor
+ *
+ * @param dsift_descr dsift descriptors
+ * @param codebook    codebook from sift-kmeans
+ * @param ncb         dimension of codebook
+ * @param k           get top k nearest codes
+ * @param out         output vector will take the llc result
+ *
+ * @return a conversion from llc feature to string
+ */
+string
+ImageCoder::llc_dense_sift(float* image_data, float *codebook, const int ncb,
+                           const int k, vector<float> &out)
+{
+    const VectorXf& llc = dense_llc(image_data, codebook, NULL, ncb, k);
+    out.assign(llc.data(), llc.data() + ncb);
+    return llc_to_string(llc);
+}
+/**
+ * compute linear local constraint coding descriptor into a
+ * caller's array, without the string conversion
+ *
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param ncb        dimension of codebook
+ * @param k          get top k nearest codes
+ * @param out        output array of ncb elements
+ */
+void
+ImageCoder::llc_dense_sift(float* image_data, float *codebook, const int ncb,
+                           const int k, float* out)
+{
+    Map<VectorXf>(out, ncb) = dense_llc(image_data, codebook, NULL, ncb, k);
+}
+/**
+ * compute linear local constraint coding descriptor into a
+ * caller's array, with the precomputed norms of a codebook
+ *
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param k          get top k nearest codes
+ * @param out        output array of codebook size elements
+ */
+void
+ImageCoder::llc_dense_sift(float* image_data, const Codebook& codebook,
+                           const int k, float* out)
+{
+    Map<VectorXf>(out, codebook.size()) =
+        dense_llc(image_data, codebook.data(), codebook.squared_norms().data(),
+                  codebook.size(), k);
+}
 /**
  * compute linear local constraint coding descriptor
  *
@@ -399,65 +737,102 @@ string
 ImageCoder::llc_dense_sift(Mat src_image, float *codebook, const int ncb, const int k)
 {
     float* image_data = decode_image(src_image);
-    float* dsift_descr = dsift_descriptor(image_data);
-    // get sift descriptor size and number of keypoints
-    int descr_size = vl_dsift_get_descriptor_size(dsift_filter_);
-    int n_keypoints = vl_dsift_get_keypoint_num(dsift_filter_);
-
-    VectorXf llc = llc_process(dsift_descr,codebook,ncb,k,descr_size,n_keypoints);
-    // output the result in squeezed form
-    // (i.e. bis after floating points are omitted)
-    ostringstream s;
-    s << llc(0);
-    for(int i=1; i<ncb; ++i)
-    {
-        s << ",";
-        s << llc(i);
-    }
-    return s.str();
-
+    return llc_to_string(dense_llc(image_data, codebook, NULL, ncb, k));
+}
+/**
+ * compute linear local constraint coding descriptor, with the
+ * precomputed norms of a codebook
+ *
+ * @param src_image source image in opencv mat format
+ * @param codebook  codebook from sift-kmeans
+ * @param k         get top k nearest codes
+ *
+ * @return a conversion from llc feature to string
+ */
+string
+ImageCoder::llc_dense_sift(Mat src_image, const Codebook& codebook, const int k)
+{
+    float* image_data = decode_image(src_image);
+    return llc_to_string(dense_llc(image_data, codebook.data(),
+                                   codebook.squared_norms().data(),
+                                   codebook.size(), k));
 }
 
 string
 ImageCoder::llc_sift(Mat src_image, float *codebook, const int ncb, const int k)
 {
-    int n_keypoints = 0;
-    const int descr_size = 128;
     float* image_data = this->decode_image(src_image);
-    vector<float> sift_descr;
-    this->sift_descriptor(image_data,n_keypoints,sift_descr);
-    VectorXf llc = llc_process(&sift_descr[0],codebook,ncb,k,descr_size,n_keypoints);
-
-    ostringstream s;
-    s << llc(0);
-    for(int i=1; i<ncb; ++i)
-    {
-        s << ",";
-        s << llc(i);
-    }
-    return s.str();
-
+    return llc_to_string(sift_llc(image_data, codebook, NULL, ncb, k));
 }
 /**
- * Optimized sift feature improvement and normalization
+ * compute linear local constraint coding descriptor of sift
+ * keypoints, with the precomputed norms of a codebook
+ *
+ * @param src_image source image in opencv mat format
+ * @param codebook  codebook from sift-kmeans
+ * @param k         get top k nearest codes
+ *
+ * @return a conversion from llc feature to string
+ */
+string
+ImageCoder::llc_sift(Mat src_image, const Codebook& codebook, const int k)
+{
+    float* image_data = this->decode_image(src_image);
+    return llc_to_string(sift_llc(image_data, codebook.data(),
+                                  codebook.squared_norms().data(),
+                                  codebook.size(), k));
+}
+/**
+ * compute linear local constraint coding descriptor of sift
+ * keypoints into a caller's array
+ *
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param ncb        dimension of codebook
+ * @param k          get top k nearest codes
+ * @param out        output array of ncb elements
+ */
+void
+ImageCoder::llc_sift(float* image_data, float *codebook, const int ncb,
+                     const int k, float* out)
+{
+    Map<VectorXf>(out, ncb) = sift_llc(image_data, codebook, NULL, ncb, k);
+}
+/**
+ * compute linear local constraint coding descriptor of sift
+ * keypoints into a caller's array, with the precomputed norms of
+ * a codebook
+ *
+ * @param image_data pixel values of a std_width x std_height image
+ *                   in row-major order
+ * @param codebook   codebook from sift-kmeans
+ * @param k          get top k nearest codes
+ * @param out        output array of codebook size elements
+ */
+void
+ImageCoder::llc_sift(float* image_data, const Codebook& codebook, const int k,
+                     float* out)
+{
+    Map<VectorXf>(out, codebook.size()) =
+        sift_llc(image_data, codebook.data(), codebook.squared_norms().data(),
+                 codebook.size(), k);
+}
+/**
+ * sift feature improvement and normalization in place
  *
  * @param descriptors sift descriptors
  * @param row         number of rows
  * @param col         number of column
  * @param normalized  flag for normalized input
- *
- * @return MatrixXf normalized dsift descripters in Eigen::MatrixXf form
  */
-Eigen::MatrixXf
-ImageCoder::norm_sift(float *descriptors, int row, int col,
-                     const bool normalized=false)
+void
+ImageCoder::normalize_sift(float *descriptors, int row, int col,
+                           const bool normalized)
 {
     // use Eigen Map to pass float* to MatrixXf
     Map<MatrixXf> mat_dsift(descriptors,row,col);
-    // cout << "mat_dsift " << endl;
-    // cout << mat_dsift.col(col-1)<< endl;
 
-    // clock_t s = clock();
     // check flag if the input is already normalized
     if(normalized)
     {
@@ -491,6 +866,21 @@ ImageCoder::norm_sift(float *descriptors, int row, int col,
 
         }
     }
-
-    return mat_dsift;
+}
+/**
+ * Optimized sift feature improvement and normalization
+ *
+ * @param descriptors sift descriptors
+ * @param row         number of rows
+ * @param col         number of column
+ * @param normalized  flag for normalized input
+ *
+ * @return MatrixXf normalized dsift descripters in Eigen::MatrixXf form
+ */
+Eigen::MatrixXf
+ImageCoder::norm_sift(float *descriptors, int row, int col,
+                     const bool normalized=false)
+{
+    this->normalize_sift(descriptors, row, col, normalized);
+    return Map<MatrixXf>(descriptors,row,col);
 }
@@ -0,0 +1,481 @@
+// Inverted file index with product quantization (IVF-PQ) for
+// approximate nearest neighbour search of large feature collections
+// kept compressed in memory. This implementation has following
+// features:
+//
+// 1. A coarse quantizer trained by k-means splits the features into
+//    inverted lists, the residual of a feature to its list center is
+//    product quantized into m bytes, one 8-bit code per subspace, e.g.
+//    32 to 64 bytes instead of 2KB for a 500 dimension double feature.
+// 2. The lists are kept in contiguous arrays of rows and codes, the
+//    codes of a list are scanned linearly.
+// 3. Asymmetric distance computation: a query builds one lookup table
+//    of the squared distances from its residual to every sub-codeword
+//    per probed list, so the distance to a code is m table lookups.
+// 4. Optional exact re-ranking of the best candidates against the
+//    original features, if they are kept by the caller.
+// 5. Quantizers are trained and features encoded on a thread pool.
+// 6. Searches may be filtered by a predicate on feature indices, a
+//    rejected code is never looked up and lists without accepted
+//    features do not count as probes.
+//
+// For details, refer to:
+//
+// Jegou, H.; Douze, M.; Schmid, C., "Product Quantization for Nearest
+// Neighbor Search, " IEEE Transactions on Pattern Analysis and Machine
+// Intelligence, vol.33, no.1, pp.117-128, Jan. 2011
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/ivf_pq.hpp"
+#include "sireen/kmeans.hpp"
+
+namespace nnse
+{
+    namespace
+    {
+        // training features sampled per center of a quantizer
+        const size_t SAMPLES_PER_CENTER = 64;
+        // greatest number of k-means iterations of the quantizers
+        const size_t KMEANS_ITERATIONS = 11;
+        // features assigned and encoded at once, bounds the copies of
+        // the assignment step
+        const size_t ENCODE_BLOCK = 1 << 16;
+    }
+
+    /**
+     * Constructor
+     *
+     * @param d       feature dimension
+     * @param n_lists number of inverted lists
+     * @param m       number of subspaces, i.e. bytes per feature.
+     *                Subspaces differ by at most one dimension if d
+     *                is not a multiple of m.
+     */
+    template <class T>
+    BasicIVFPQ<T>::BasicIVFPQ(const size_t d, const size_t n_lists,
+                              const size_t m):
+        data_(NULL),dimension_(d),n_lists_(n_lists > 0 ? n_lists : 1),
+        m_(m > 0 ? min(m, d) : 1),n_probe_(8),rerank_(0)
+    {
+        // spread the remainder over the first subspaces
+        this->sub_offsets_.resize(this->m_ + 1);
+        for(size_t s = 0; s <= this->m_; ++s)
+            this->sub_offsets_[s] = s * d / this->m_;
+    }
+
+    /**
+     * Train the coarse quantizer and the sub-quantizers on a random
+     * sample of the features.
+     *
+     * @param data row-major n x dimension matrix
+     * @param n    number of features
+     * @param pool thread pool for k-means
+     */
+    template <class T>
+    void
+    BasicIVFPQ<T>::train(const T* data, const size_t n, putil::ThreadPool& pool)
+    {
+        const size_t dim = this->dimension_;
+        const size_t n_lists = min(this->n_lists_, n);
+        // random sample, the coarse one is a prefix of the one for the
+        // sub-quantizers if it is smaller
+        const size_t n_coarse = min(n, SAMPLES_PER_CENTER * n_lists);
+        const size_t n_fine = min(n, SAMPLES_PER_CENTER * N_CODES);
+        const size_t n_sample = max(n_coarse, n_fine);
+        minstd_rand rng(1);
+        vector<size_t> sample(n);
+        for(size_t i = 0; i < n; ++i)
+            sample[i] = i;
+        for(size_t i = 0; i < n_sample; ++i)
+        {
+            uniform_int_distribution<size_t> pick(i, n - 1);
+            std::swap(sample[i], sample[pick(rng)]);
+        }
+
+        vector<uint32_t> labels;
+        kmeans(data, &sample[0], n_coarse, dim, n_lists, KMEANS_ITERATIONS,
+               this->coarse_, labels, pool, 1);
+
+        // residuals of the sample to their list centers
+        assign_clusters(data, &sample[0], n_fine, dim, &this->coarse_[0],
+                        n_lists, labels, pool);
+        vector<T> residuals(n_fine * dim);
+        for(size_t i = 0; i < n_fine; ++i)
+        {
+            const T* row = data + sample[i] * dim;
+            const T* center = &this->coarse_[labels[i] * dim];
+            for(size_t j = 0; j < dim; ++j)
+                residuals[i * dim + j] = row[j] - center[j];
+        }
+
+        // one quantizer of N_CODES codewords per subspace. With fewer
+        // samples than codewords, the codewords are repeated so every
+        // code stays valid.
+        const size_t n_codes = min(N_CODES, n_fine);
+        this->codebooks_.resize(N_CODES * dim);
+        vector<T> sub, centers;
+        for(size_t s = 0; s < this->m_; ++s)
+        {
+            const size_t offset = this->sub_offsets_[s];
+            const size_t width = this->sub_offsets_[s + 1] - offset;
+            sub.resize(n_fine * width);
+            for(size_t i = 0; i < n_fine; ++i)
+                memcpy(&sub[i * width], &residuals[i * dim + offset],
+                       sizeof(T) * width);
+            kmeans(&sub[0], (const size_t*)NULL, n_fine, width, n_codes,
+                   KMEANS_ITERATIONS, centers, labels, pool, s + 1);
+
+            T* codebook = &this->codebooks_[N_CODES * offset];
+            for(size_t c = 0; c < N_CODES; ++c)
+                memcpy(codebook + c * width, &centers[(c % n_codes) * width],
+                       sizeof(T) * width);
+        }
+    }
+
+    /**
+     * Encode the residuals of features to their list centers
+     *
+     * @param data   row-major n x dimension matrix
+     * @param labels list of each feature
+     * @param n      number of features
+     * @param codes  output m bytes per feature
+     * @param pool   thread pool for the encoding
+     */
+    template <class T>
+    void
+    BasicIVFPQ<T>::encode(const T* data, const vector<uint32_t>& labels,
+                          const size_t n, vector<uint8_t>& codes,
+                          putil::ThreadPool& pool) const
+    {
+        const size_t dim = this->dimension_;
+        const size_t m = this->m_;
+        codes.resize(n * m);
+        pool.parallel_for(n, 64, [&](size_t begin, size_t end, size_t)
+        {
+            vector<T> residual(dim);
+            dist_type dist, best;
+            for(size_t i = begin; i < end; ++i)
+            {
+                const T* row = data + i * dim;
+                const T* center = &this->coarse_[labels[i] * dim];
+                for(size_t j = 0; j < dim; ++j)
+                    residual[j] = row[j] - center[j];
+                // closest codeword of each subspace
+                for(size_t s = 0; s < m; ++s)
+                {
+                    const size_t offset = this->sub_offsets_[s];
+                    const size_t width = this->sub_offsets_[s + 1] - offset;
+                    const T* codeword = &this->codebooks_[N_CODES * offset];
+                    size_t code = 0;
+                    best = numeric_limits<dist_type>::max();
+                    for(size_t c = 0; c < N_CODES; ++c, codeword += width)
+                    {
+                        dist = spat::squared_euclidean(codeword,
+                                                       &residual[offset], width);
+                        if(dist < best)
+                        {
+                            best = dist;
+                            code = c;
+                        }
+                    }
+                    codes[i * m + s] = code;
+                }
+            }
+        });
+    }
+
+    /**
+     * build the index from a row-major feature matrix. The i-th row
+     * gets feature index i.
+     *
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param keep  if true, data is kept for exact re-ranking, it
+     *              is never modified but must outlive the index.
+     *              Otherwise only the codes are kept.
+     * @param pool  thread pool for training and encoding, NULL for
+     *              the global pool
+     */
+    template <class T>
+    void
+    BasicIVFPQ<T>::build(T* data, const size_t n, const bool keep,
+                         putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!data || n <= 0)
+        {
+            cerr << " IVFPQ::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        const size_t dim = this->dimension_;
+        const size_t m = this->m_;
+        this->data_ = keep ? data : NULL;
+        this->train(data, n, workers);
+        const size_t n_lists = this->coarse_.size() / dim;
+
+        // assign and encode block by block
+        vector<uint32_t> labels(n), block_labels;
+        vector<uint8_t> codes(n * m), block_codes;
+        for(size_t begin = 0; begin < n; begin += ENCODE_BLOCK)
+        {
+            const size_t count = min(ENCODE_BLOCK, n - begin);
+            assign_clusters(data + begin * dim, (const size_t*)NULL, count,
+                            dim, &this->coarse_[0], n_lists, block_labels,
+                            workers);
+            this->encode(data + begin * dim, block_labels, count,
+                         block_codes, workers);
+            memcpy(&labels[begin], &block_labels[0], sizeof(uint32_t) * count);
+            memcpy(&codes[begin * m], &block_codes[0], count * m);
+        }
+
+        // group the entries by list with a counting sort
+        this->list_offsets_.assign(n_lists + 1, 0);
+        for(size_t i = 0; i < n; ++i)
+            ++this->list_offsets_[labels[i] + 1];
+        for(size_t l = 0; l < n_lists; ++l)
+            this->list_offsets_[l + 1] += this->list_offsets_[l];
+        vector<size_t> next(this->list_offsets_.begin(),
+                            this->list_offsets_.end() - 1);
+        this->rows_.resize(n);
+        this->codes_.resize(n * m);
+        for(size_t i = 0; i < n; ++i)
+        {
+            const size_t e = next[labels[i]]++;
+            this->rows_[e] = i;
+            memcpy(&this->codes_[e * m], &codes[i * m], m);
+        }
+    }
+
+    /**
+     * k-nearest-neighbour search core
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour searched
+     * @param scratch search buffers, scratch.heap takes the result
+     *                as a max-heap of squared distances
+     * @param filter  features a result must be accepted by, NULL for
+     *                all
+     */
+    template <class T>
+    void
+    BasicIVFPQ<T>::search(const dist_type* feature, const size_t k,
+                          SearchScratch& scratch,
+                          const FeatureFilter* filter) const
+    {
+        vector<RowBind>& heap = scratch.heap;
+        vector<RowBind>& candidates = scratch.candidates;
+        heap.clear();
+        candidates.clear();
+        if(k == 0 || this->rows_.empty())
+            return;
+
+        const size_t dim = this->dimension_;
+        const size_t m = this->m_;
+        const size_t n_lists = this->coarse_.size() / dim;
+        const size_t n_probe = min(this->n_probe_, n_lists);
+        const bool rerank = this->data_ && this->rerank_ > 0;
+        const size_t n_candidates = rerank ? max(k, this->rerank_) : k;
+
+        // the n_probe lists of closest centers, a filtered search may
+        // go through all lists in order
+        vector<RowBind>& lists = scratch.lists;
+        lists.clear();
+        for(size_t l = 0; l < n_lists; ++l)
+            lists.push_back(RowBind(l, spat::squared_euclidean(
+                &this->coarse_[l * dim], feature, dim)));
+        if(filter)
+            std::sort(lists.begin(), lists.end());
+        else
+            partial_sort(lists.begin(), lists.begin() + n_probe, lists.end());
+
+        vector<dist_type>& residual = scratch.residual;
+        vector<dist_type>& table = scratch.table;
+        residual.resize(dim);
+        table.resize(m * N_CODES);
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        dist_type dist;
+        size_t n_probed = 0;
+        for(size_t p = 0; p < n_lists && n_probed < n_probe; ++p)
+        {
+            const uint32_t l = lists[p].key;
+            // scan the codes of the list by table lookups, the table is
+            // built for the first accepted code
+            const size_t end = this->list_offsets_[l + 1];
+            const uint8_t* code = &this->codes_[0] + this->list_offsets_[l] * m;
+            bool probed = false;
+            for(size_t e = this->list_offsets_[l]; e < end; ++e, code += m)
+            {
+                if(filter && !filter->accept(this->rows_[e]))
+                    continue;
+                if(!probed)
+                {
+                    const T* center = &this->coarse_[l * dim];
+                    for(size_t j = 0; j < dim; ++j)
+                        residual[j] = feature[j] - center[j];
+                    // squared distances from the residual to every codeword
+                    dist_type* entry = &table[0];
+                    for(size_t s = 0; s < m; ++s)
+                    {
+                        const size_t offset = this->sub_offsets_[s];
+                        const size_t width = this->sub_offsets_[s + 1] - offset;
+                        const T* codeword = &this->codebooks_[N_CODES * offset];
+                        for(size_t c = 0; c < N_CODES; ++c, codeword += width)
+                            *entry++ = spat::squared_euclidean(
+                                codeword, &residual[offset], width);
+                    }
+                    probed = true;
+                }
+                dist = 0;
+                for(size_t s = 0; s < m; ++s)
+                    dist += table[s * N_CODES + code[s]];
+                if(!(dist < cur_best))
+                    continue;
+                if(candidates.size() == n_candidates)
+                {
+                    pop_heap(candidates.begin(), candidates.end());
+                    candidates.back() = RowBind(this->rows_[e], dist);
+                }
+                else
+                {
+                    candidates.push_back(RowBind(this->rows_[e], dist));
+                }
+                push_heap(candidates.begin(), candidates.end());
+                if(candidates.size() == n_candidates)
+                    cur_best = candidates.front().value;
+            }
+            // a list without accepted features is not a probe
+            if(probed)
+                ++n_probed;
+        }
+
+        if(!rerank)
+        {
+            heap.swap(candidates);
+            return;
+        }
+        // exact distances of the candidates
+        cur_best = numeric_limits<dist_type>::max();
+        for(size_t i = 0; i < candidates.size(); ++i)
+        {
+            const uint32_t row = candidates[i].key;
+            if(!spat::optimize_compare(this->data_ + row * dim, feature,
+                                       cur_best, dim, dist))
+                continue;
+            if(heap.size() == k)
+            {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = RowBind(row, dist);
+            }
+            else
+            {
+                heap.push_back(RowBind(row, dist));
+            }
+            push_heap(heap.begin(), heap.end());
+            if(heap.size() == k)
+                cur_best = heap.front().value;
+        }
+    }
+
+    /**
+     * Search for approximate k nearest neighbours. Results are in
+     * the same order as BasicKDTree::knn_bbf_opt, features point
+     * into the kept matrix or have no data if it is not kept.
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour returned
+     * @param filter  features a result must be accepted by, NULL for
+     *                all
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicIVFPQ<T>::Feature>
+    BasicIVFPQ<T>::knn(const dist_type* feature, size_t k,
+                       const FeatureFilter* filter) const
+    {
+        // best result buffer
+        vector<Feature> nbrs;
+        if(this->rows_.empty() || !feature)
+        {
+            cerr << " IVFPQ::knn : index not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchScratch scratch;
+        this->search(feature, k, scratch, filter);
+
+        // greatest distance first, as popped from a max-priority queue
+        vector<RowBind>& heap = scratch.heap;
+        nbrs.reserve(heap.size());
+        while(!heap.empty())
+        {
+            const size_t row = heap.front().key;
+            nbrs.push_back(Feature(this->data_ ? this->data_ + row * this->dimension_
+                                   : NULL, this->dimension_, row));
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once, see
+     * BasicKDTree::knn_batch. Distances are approximate unless
+     * re-ranked.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output euclidean distances, nq x k, may be
+     *                   NULL if not needed
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicIVFPQ<T>::knn_batch(const dist_type* queries, const size_t nq,
+                             const size_t k, size_t* out_ids,
+                             dist_type* out_dists,
+                             const FeatureFilter* filter,
+                             putil::ThreadPool* pool) const
+    {
+        if(this->rows_.empty() || !queries || !out_ids)
+        {
+            cerr << " IVFPQ::knn_batch : index not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one scratch per worker, reused by all its queries
+        vector<SearchScratch> scratches(workers.concurrency());
+        const size_t dim = this->dimension_;
+
+        workers.parallel_for(nq, 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            SearchScratch& scratch = scratches[worker];
+            for(size_t q = begin; q < end; ++q)
+            {
+                this->search(queries + q * dim, k, scratch, filter);
+                BasicKDTree<T>::write_results(scratch.heap,
+                    NULL, k, EUCLIDEAN, out_ids + q * k,
+                    out_dists ? out_dists + q * k : NULL);
+            }
+        });
+    }
+
+    template <class T>
+    const size_t BasicIVFPQ<T>::N_CODES;
+
+    template class BasicIVFPQ<double>;
+    template class BasicIVFPQ<float>;
+}
@@ -0,0 +1,441 @@
+// Randomized KD-Forest for approximate nearest neighbour search of
+// high dimensional features. This implementation has following
+// features:
+//
+// 1. Several randomized kd-trees, each splits a node on a dimension
+//    drawn among the few of greatest variance, so the trees partition
+//    the space differently and a query close to a splitting plane of
+//    one tree is likely far from those of the others.
+// 2. All trees are searched together by Best-Bin-First with one
+//    priority queue of branches, the max-epoch parameter bounds the
+//    number of leaves checked over all trees.
+// 3. The trees share one feature matrix in the original order, a
+//    visited set keeps a feature found by several trees from being
+//    compared twice.
+// 4. The trees are built in parallel on a thread pool.
+// 5. Searches may be filtered by a predicate on feature indices, a
+//    rejected feature costs no distance and leaves without accepted
+//    features do not count as epochs.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/kd_forest.hpp"
+
+namespace nnse
+{
+    /**
+     * Constructor
+     *
+     * @param d          feature dimension
+     * @param n_trees    number of randomized trees
+     * @param leaf_size  number of features in a leaf
+     */
+    template <class T>
+    BasicKDForest<T>::BasicKDForest(const size_t d, const size_t n_trees,
+                                    const size_t leaf_size):
+        data_(NULL),owns_data_(false),dimension_(d),
+        n_trees_(n_trees > 0 ? n_trees : 1),leaf_size_(leaf_size),
+        split_sample_(100),split_candidates_(5),seed_(0){}
+    template <class T>
+    BasicKDForest<T>::~BasicKDForest()
+    {
+        this->release();
+    }
+
+    /**
+     * Release the trees and the feature matrix if owned
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::release()
+    {
+        for(size_t i = 0; i < this->trees_.size(); ++i)
+            delete this->trees_[i];
+        this->trees_.clear();
+        if(this->owns_data_)
+            aligned_free(this->data_);
+        this->data_ = NULL;
+        this->owns_data_ = false;
+    }
+
+    /**
+     * Set how the trees choose split dimensions, see
+     * BasicKDTree::set_split_sampling. The default samples 100
+     * features and draws among the 5 dimensions of greatest variance.
+     *
+     * @param sample_size  number of features sampled to estimate the
+     *                     variance, 0 for all features
+     * @param n_candidates the dimension is drawn among so many of
+     *                     greatest variance
+     * @param seed         seed of the first tree
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::set_split_sampling(const size_t sample_size,
+                                         const size_t n_candidates,
+                                         const unsigned seed)
+    {
+        this->split_sample_ = sample_size;
+        this->split_candidates_ = n_candidates;
+        this->seed_ = seed;
+    }
+
+    /**
+     * build the forest from input features, the features are
+     * copied into one matrix.
+     *
+     * @param features an array of features
+     * @param n        number of features
+     * @param pool     thread pool for the build, NULL for the global
+     *                 pool
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::build(Feature* features, const size_t n,
+                            putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!features || n <= 0)
+        {
+            cerr << " KDForest::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->release();
+        this->data_ = aligned_malloc<T>(n * this->dimension_);
+        this->owns_data_ = true;
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+        {
+            memcpy(this->data_ + i * this->dimension_, features[i].data,
+                   sizeof(T) * this->dimension_);
+            this->index_[i] = features[i].index;
+        }
+        this->build_trees(n, pool);
+    }
+
+    /**
+     * build the forest from a row-major feature matrix. The i-th row
+     * gets feature index i.
+     *
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param copy  if true, the forest builds on its own copy of the
+     *              matrix. Otherwise data is used as is, it is never
+     *              modified but must outlive the forest.
+     * @param pool  thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::build(T* data, const size_t n, const bool copy,
+                            putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!data || n <= 0)
+        {
+            cerr << " KDForest::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->release();
+        if(copy)
+        {
+            this->data_ = aligned_malloc<T>(n * this->dimension_);
+            this->owns_data_ = true;
+            memcpy(this->data_, data, sizeof(T) * n * this->dimension_);
+        }
+        else
+        {
+            this->data_ = data;
+        }
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = i;
+        this->build_trees(n, pool);
+    }
+
+    /**
+     * Build the trees in parallel over data_
+     *
+     * @param n    number of features
+     * @param pool thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::build_trees(const size_t n, putil::ThreadPool* pool)
+    {
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        for(size_t t = 0; t < this->n_trees_; ++t)
+        {
+            this->trees_.push_back(new Tree(this->dimension_, this->leaf_size_));
+            this->trees_[t]->set_split_sampling(this->split_sample_,
+                                                this->split_candidates_,
+                                                this->seed_ + t);
+        }
+        // a tree spreads its own subtrees over the pool as well
+        putil::TaskGroup group(workers);
+        for(size_t t = 0; t < this->n_trees_; ++t)
+        {
+            Tree* tree = this->trees_[t];
+            T* data = this->data_;
+            group.run([tree, data, n, &workers]()
+            {
+                tree->build_shared(data, n, &workers);
+            });
+        }
+        group.wait();
+    }
+
+    /**
+     * Traverse a tree to a leaf node and compare the query with the
+     * unvisited features of the leaf. Skipped children are pushed
+     * to the shared branch heap.
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour searched
+     * @param tree    tree to traverse
+     * @param node    offset of a start node in the tree
+     * @param scratch search buffers
+     * @param cur_best greatest-smallest squared distance, updated
+     * @param filter  features a result must be accepted by, NULL for
+     *                all
+     *
+     * @return whether the leaf holds an unvisited accepted feature
+     */
+    template <class T>
+    bool
+    BasicKDForest<T>::check_branch(const dist_type* feature, const size_t k,
+                                   const uint32_t tree, uint32_t node,
+                                   SearchScratch& scratch,
+                                   dist_type& cur_best,
+                                   const FeatureFilter* filter) const
+    {
+        const Node* nodes = &this->trees_[tree]->nodes_[0];
+        const size_t* rows = &this->trees_[tree]->index_[0];
+        vector<Branch>& branches = scratch.branches;
+        vector<RowBind>& heap = scratch.heap;
+        const size_t dim = this->dimension_;
+        dist_type dist, diff;
+
+        // find leaf and push unprocessed branches
+        while(!nodes[node].is_leaf())
+        {
+            const Node& cur_node = nodes[node];
+            diff = feature[cur_node.pivot_dim] - cur_node.pivot_val;
+            if(diff <= 0)
+            {
+                branches.push_back(Branch(tree, cur_node.right, -diff));
+                node = cur_node.left;
+            }
+            else
+            {
+                branches.push_back(Branch(tree, cur_node.left, diff));
+                node = cur_node.right;
+            }
+            push_heap(branches.begin(), branches.end());
+        }
+
+        // scan the features of the leaf not found by other trees yet,
+        // a filtered feature costs no distance
+        const size_t end = nodes[node].begin + nodes[node].n;
+        bool scanned = false;
+        for(size_t i = nodes[node].begin; i < end; ++i)
+        {
+            const size_t row = rows[i];
+            if(scratch.visited[row] == scratch.tag)
+                continue;
+            scratch.visited[row] = scratch.tag;
+            if(filter && !filter->accept(this->index_[row]))
+                continue;
+            scanned = true;
+            if(!spat::optimize_compare(this->data_ + row * dim, feature,
+                                       cur_best, dim, dist))
+                continue;
+            // maintain the bounded max-heap, the best distance is
+            // the greatest-smallest once k are found
+            if(heap.size() == k)
+            {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = RowBind(row, dist);
+            }
+            else
+            {
+                heap.push_back(RowBind(row, dist));
+            }
+            push_heap(heap.begin(), heap.end());
+            if(heap.size() == k)
+                cur_best = heap.front().value;
+        }
+        return scanned;
+    }
+
+    /**
+     * Best Bin First search over all trees. First, each tree is
+     * traversed from its root. Then, the closest branch of all trees
+     * is checked until max_epoch leaves are checked or no branch
+     * can be closer than the current k-th best.
+     *
+     * @param feature    query feature data in array form
+     * @param k          number of nearest neighbour searched
+     * @param max_epoch  maximum of epoch of search, 0 for the exact
+     *                   search
+     * @param scratch    search buffers, scratch.heap takes the
+     *                   result as a max-heap of squared distances
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::search(const dist_type* feature, const size_t k,
+                             const size_t max_epoch,
+                             SearchScratch& scratch,
+                             const FeatureFilter* filter) const
+    {
+        vector<Branch>& branches = scratch.branches;
+        branches.clear();
+        scratch.heap.clear();
+        if(k == 0)
+            return;
+        // a new tag clears the visited set, the tags are only reset
+        // when they wrap around or the forest size changed
+        if(scratch.visited.size() != this->size() || ++scratch.tag == 0)
+        {
+            scratch.visited.assign(this->size(), 0);
+            scratch.tag = 1;
+        }
+
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        // without a bound, the search ends once no branch can be
+        // closer than the current k-th best
+        const size_t epochs = max_epoch > 0 ? max_epoch
+            : numeric_limits<size_t>::max();
+        size_t epoch = 0;
+        // every tree is descended once, which also fills the heap of
+        // branches over all trees. Leaves without accepted features
+        // are not epochs, so a filtered search goes on until it finds
+        // some.
+        for(uint32_t t = 0; t < this->trees_.size() && epoch < epochs; ++t)
+            if(this->check_branch(feature, k, t, 0, scratch, cur_best, filter))
+                ++epoch;
+
+        while(!branches.empty() && epoch < epochs)
+        {
+            // pop the closest branch of all trees
+            pop_heap(branches.begin(), branches.end());
+            const Branch branch = branches.back();
+            branches.pop_back();
+            // no other branch can be closer either
+            if(!(branch.bound * branch.bound < cur_best))
+                break;
+            if(this->check_branch(feature, k, branch.tree, branch.node,
+                                  scratch, cur_best, filter))
+                ++epoch;
+        }
+    }
+
+    /**
+     * Search for approximate k nearest neighbours using the
+     * Best Bin First approach over all trees. Distance comparison
+     * applied an early-stop strategy. Results are in the same order
+     * as BasicKDTree::knn_bbf_opt.
+     *
+     * @param feature    query feture data in array form
+     * @param k          number of nearest neighbour returned
+     * @param max_epoch  maximum of epoch of search, i.e. number of
+     *                   leaves checked over all trees, 0 for the
+     *                   exact search
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicKDForest<T>::Feature>
+    BasicKDForest<T>::knn_bbf_opt(const dist_type* feature, size_t k,
+                                  size_t max_epoch,
+                                  const FeatureFilter* filter) const
+    {
+        // best result buffer
+        vector<Feature> nbrs;
+        if(this->trees_.empty() || !feature)
+        {
+            cerr << " KDForest::knn_bbf_opt : forest not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchScratch scratch;
+        this->search(feature, k, max_epoch, scratch, filter);
+
+        // greatest distance first, as popped from a max-priority queue
+        vector<RowBind>& heap = scratch.heap;
+        nbrs.reserve(heap.size());
+        while(!heap.empty())
+        {
+            const size_t row = heap.front().key;
+            nbrs.push_back(Feature(this->data_ + row * this->dimension_,
+                                   this->dimension_, this->index_[row]));
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once, see
+     * BasicKDTree::knn_batch.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output distances, nq x k, may be NULL if not
+     *                   needed
+     * @param max_epoch  maximum of epoch of search, 0 for the exact
+     *                   search
+     * @param measure    measure written to out_dists
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDForest<T>::knn_batch(const dist_type* queries, const size_t nq,
+                                const size_t k, size_t* out_ids,
+                                dist_type* out_dists, const size_t max_epoch,
+                                const DistanceMeasure measure,
+                                const FeatureFilter* filter,
+                                putil::ThreadPool* pool) const
+    {
+        if(this->trees_.empty() || !queries || !out_ids)
+        {
+            cerr << " KDForest::knn_batch : forest not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one scratch per worker, reused by all its queries
+        vector<SearchScratch> scratches(workers.concurrency());
+        const size_t dim = this->dimension_;
+
+        workers.parallel_for(nq, 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            SearchScratch& scratch = scratches[worker];
+            for(size_t q = begin; q < end; ++q)
+            {
+                this->search(queries + q * dim, k, max_epoch, scratch, filter);
+                Tree::write_results(scratch.heap,
+                    &this->index_[0], k, measure, out_ids + q * k,
+                    out_dists ? out_dists + q * k : NULL);
+            }
+        });
+    }
+
+    template class BasicKDForest<double>;
+    template class BasicKDForest<float>;
+    template class BasicKDForest<spat::float16>;
+}
@@ -0,0 +1,203 @@
+// K-means clustering of row-major feature matrices, used to build the
+// k-means tree and to train quantizers.
+//
+// The assignment of features to centers uses the squared euclidean
+// expansion |u-v|^2 = |u|^2 + |v|^2 - 2uv with an Eigen matrix
+// product, as the LLC coding against a codebook does, and is spread
+// over a thread pool for large inputs.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/kmeans.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <random>
+#include <algorithm>
+
+// Eigen Linear Algebra
+#include <Eigen/Dense>
+
+namespace nnse
+{
+    namespace
+    {
+        // inputs of at least so many features x centers x dimension
+        // are assigned in parallel
+        const size_t PARALLEL_ASSIGN_MIN = 1 << 22;
+        // features assigned by one matrix product
+        const size_t ASSIGN_BLOCK = 256;
+
+        /**
+         * gather rows of a row-major matrix as the columns of an Eigen
+         * matrix, as the dsift descriptors against the codebook of llc
+         */
+        template <class T>
+        Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+        gather_columns(const T* data, const size_t* rows, const size_t n,
+                       const size_t dim)
+        {
+            typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VectorT;
+            Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> features(dim, n);
+            for(size_t i = 0; i < n; ++i)
+                features.col(i) = Eigen::Map<const VectorT>(
+                    data + (rows ? rows[i] : i) * dim, dim);
+            return features;
+        }
+
+        /**
+         * assign each column of features to its closest center column
+         *
+         * @return number of labels changed
+         */
+        template <class T>
+        size_t assign_columns(
+            const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& features,
+            const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& centers,
+            vector<uint32_t>& labels, putil::ThreadPool& pool)
+        {
+            typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> MatrixT;
+            typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VectorT;
+            const size_t n = features.cols();
+            // Using the trick of (u-v)^2 = u^2 + v^2 - 2uv, u^2 is the
+            // same for all centers and dropped.
+            const VectorT center_norms = centers.colwise().squaredNorm().transpose();
+            atomic<size_t> changed(0);
+            auto assign = [&](size_t first, size_t last, size_t)
+            {
+                MatrixT cdist = (centers.transpose()
+                                 * features.middleCols(first, last - first)
+                                 * -2).colwise() + center_norms;
+                size_t n_changed = 0;
+                typename MatrixT::Index label;
+                for(size_t i = first; i < last; ++i)
+                {
+                    cdist.col(i - first).minCoeff(&label);
+                    if(labels[i] != (uint32_t)label)
+                    {
+                        labels[i] = label;
+                        ++n_changed;
+                    }
+                }
+                changed += n_changed;
+            };
+            if(n * centers.cols() * features.rows() >= PARALLEL_ASSIGN_MIN)
+                pool.parallel_for(n, ASSIGN_BLOCK, assign);
+            else
+                for(size_t first = 0; first < n; first += ASSIGN_BLOCK)
+                    assign(first, min(first + ASSIGN_BLOCK, n), 0);
+            return changed;
+        }
+    }
+
+    /**
+     * Cluster features by Lloyd's k-means from random distinct
+     * features as initial centers. A center losing all its features
+     * stays where it is.
+     *
+     * @param data           row-major feature matrix
+     * @param rows           rows of data to cluster, NULL for the first
+     *                       n rows
+     * @param n              number of features
+     * @param dim            feature dimension
+     * @param n_clusters     number of clusters, at most n
+     * @param max_iterations greatest number of iterations
+     * @param centers        output row-major n_clusters x dim centers
+     * @param labels         output cluster of each feature
+     * @param pool           thread pool for the assignment step
+     * @param seed           seed of the initial centers
+     */
+    template <class T>
+    void kmeans(const T* data, const size_t* rows, const size_t n,
+                const size_t dim, const size_t n_clusters,
+                const size_t max_iterations, vector<T>& centers,
+                vector<uint32_t>& labels, putil::ThreadPool& pool,
+                const unsigned seed)
+    {
+        typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> MatrixT;
+        assert(n_clusters > 0 && n_clusters <= n);
+        const MatrixT features = gather_columns(data, rows, n, dim);
+
+        // random distinct features as initial centers
+        minstd_rand rng(seed);
+        vector<size_t> order(n);
+        for(size_t i = 0; i < n; ++i)
+            order[i] = i;
+        MatrixT mat_centers(dim, n_clusters);
+        for(size_t c = 0; c < n_clusters; ++c)
+        {
+            uniform_int_distribution<size_t> pick(c, n - 1);
+            std::swap(order[c], order[pick(rng)]);
+            mat_centers.col(c) = features.col(order[c]);
+        }
+
+        // n_clusters is never a label, so the first assignment changes
+        labels.assign(n, n_clusters);
+        MatrixT sums(dim, n_clusters);
+        vector<size_t> counts(n_clusters);
+        for(size_t iter = 0; iter < max_iterations; ++iter)
+        {
+            if(assign_columns(features, mat_centers, labels, pool) == 0)
+                break;
+
+            // move each center to the mean of its features
+            sums.setZero();
+            std::fill(counts.begin(), counts.end(), 0);
+            for(size_t i = 0; i < n; ++i)
+            {
+                sums.col(labels[i]) += features.col(i);
+                ++counts[labels[i]];
+            }
+            for(size_t c = 0; c < n_clusters; ++c)
+                if(counts[c] > 0)
+                    mat_centers.col(c) = sums.col(c) / T(counts[c]);
+        }
+
+        // row-major centers, i.e. column-major dim x n_clusters
+        centers.resize(n_clusters * dim);
+        Eigen::Map<MatrixT>(&centers[0], dim, n_clusters) = mat_centers;
+    }
+
+    /**
+     * Assign each feature to its closest center
+     *
+     * @param data       row-major feature matrix
+     * @param rows       rows of data to assign, NULL for the first n rows
+     * @param n          number of features
+     * @param dim        feature dimension
+     * @param centers    row-major n_clusters x dim centers
+     * @param n_clusters number of centers
+     * @param labels     output closest center of each feature
+     * @param pool       thread pool for large inputs
+     */
+    template <class T>
+    void assign_clusters(const T* data, const size_t* rows, const size_t n,
+                         const size_t dim, const T* centers,
+                         const size_t n_clusters, vector<uint32_t>& labels,
+                         putil::ThreadPool& pool)
+    {
+        typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> MatrixT;
+        labels.assign(n, n_clusters);
+        if(n == 0)
+            return;
+        const MatrixT mat_centers = Eigen::Map<const MatrixT>(centers, dim, n_clusters);
+        assign_columns(gather_columns(data, rows, n, dim), mat_centers,
+                       labels, pool);
+    }
+
+    template void kmeans<double>(const double*, const size_t*,
+        const size_t, const size_t, const size_t, const size_t,
+        vector<double>&, vector<uint32_t>&, putil::ThreadPool&, const unsigned);
+    template void kmeans<float>(const float*, const size_t*,
+        const size_t, const size_t, const size_t, const size_t,
+        vector<float>&, vector<uint32_t>&, putil::ThreadPool&, const unsigned);
+    template void assign_clusters<double>(const double*, const size_t*,
+        const size_t, const size_t, const double*, const size_t,
+        vector<uint32_t>&, putil::ThreadPool&);
+    template void assign_clusters<float>(const float*, const size_t*,
+        const size_t, const size_t, const float*, const size_t,
+        vector<uint32_t>&, putil::ThreadPool&);
+}
@@ -0,0 +1,510 @@
+// Hierarchical k-means tree (vocabulary tree) for nearest neighbour
+// search of high dimensional features. This implementation has
+// following features:
+//
+// 1. Each node is clustered into a configurable number of children by
+//    k-means. The assignment step uses the same squared euclidean
+//    expansion |u-v|^2 = |u|^2 + |v|^2 - 2uv with an Eigen matrix
+//    product as the LLC coding against a codebook, spread over a
+//    thread pool for large nodes.
+// 2. Best-Bin-First search over the cluster centers, the max-epoch
+//    parameter controls the number of leaves checked as for KDTree.
+//    Each node keeps the radius of its cluster, so a branch that can
+//    not hold a closer feature is skipped and max-epoch = 0 gives the
+//    exact search.
+// 3. Nodes and centers are kept in contiguous arrays, features in one
+//    aligned row-major matrix whose rows are permuted into leaf order.
+// 4. Searches may be filtered by a predicate on feature indices, a
+//    rejected feature costs no distance and leaves without accepted
+//    features do not count as epochs.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/kmeans_tree.hpp"
+#include "sireen/kmeans.hpp"
+
+namespace nnse
+{
+    /**
+     * Constructor
+     *
+     * @param d              feature dimension
+     * @param branching      number of children of a node
+     * @param leaf_size      greatest number of features in a leaf
+     * @param max_iterations greatest number of k-means iterations
+     */
+    template <class T>
+    BasicKMeansTree<T>::BasicKMeansTree(const size_t d, const size_t branching,
+                                        const size_t leaf_size,
+                                        const size_t max_iterations):
+        data_(NULL),owns_data_(false),dimension_(d),
+        branching_(branching > 2 ? branching : 2),leaf_size_(leaf_size),
+        max_iterations_(max_iterations > 0 ? max_iterations : 1){}
+    template <class T>
+    BasicKMeansTree<T>::~BasicKMeansTree()
+    {
+        this->release_data();
+    }
+
+    /**
+     * Release the feature matrix if it is owned by the tree
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::release_data()
+    {
+        if(this->owns_data_)
+            aligned_free(this->data_);
+        this->data_ = NULL;
+        this->owns_data_ = false;
+    }
+
+    /**
+     * build the tree from input features, the features are copied
+     * into one matrix.
+     *
+     * @param features an array of features
+     * @param n        number of features
+     * @param pool     thread pool for the build, NULL for the global
+     *                 pool
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::build(Feature* features, const size_t n,
+                              putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!features || n <= 0)
+        {
+            cerr << " KMeansTree::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        // gather the scattered features into one matrix owned by tree
+        this->release_data();
+        this->data_ = aligned_malloc<T>(n * this->dimension_);
+        this->owns_data_ = true;
+        for(size_t i = 0; i < n; ++i)
+            memcpy(this->data_ + i * this->dimension_, features[i].data,
+                   sizeof(T) * this->dimension_);
+
+        this->build_nodes(n, pool);
+
+        // translate rows to the feature indices
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = features[this->index_[i]].index;
+    }
+
+    /**
+     * build the tree from a row-major feature matrix. The i-th row
+     * gets feature index i.
+     *
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param copy  if true, the tree builds on its own copy of the
+     *              matrix. Otherwise the rows of data are re-ordered
+     *              in place and data must outlive the tree.
+     * @param pool  thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::build(T* data, const size_t n, const bool copy,
+                              putil::ThreadPool* pool)
+    {
+        // check inputs
+        if(!data || n <= 0)
+        {
+            cerr << " KMeansTree::build : Error input, no features or n <= 0"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->release_data();
+        if(copy)
+        {
+            this->data_ = aligned_malloc<T>(n * this->dimension_);
+            this->owns_data_ = true;
+            memcpy(this->data_, data, sizeof(T) * n * this->dimension_);
+        }
+        else
+        {
+            this->data_ = data;
+        }
+
+        this->build_nodes(n, pool);
+    }
+
+    /**
+     * Build the nodes over the current feature matrix, then permute
+     * its rows into leaf order.
+     *
+     * @param n    number of features
+     * @param pool thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::build_nodes(const size_t n, putil::ThreadPool* pool)
+    {
+        const size_t dim = this->dimension_;
+        // identity order before clustering
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = i;
+
+        // the root center is the mean of all features
+        vector<double> mean(dim, 0);
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = 0; j < dim; ++j)
+                mean[j] += this->data_[i * dim + j];
+        vector<T> center(dim);
+        for(size_t j = 0; j < dim; ++j)
+            center[j] = mean[j] / n;
+
+        // flush the previous tree
+        this->nodes_.clear();
+        this->centers_.clear();
+        const uint32_t root = this->init_node(0, n, &center[0]);
+        // sanity check for initialized root
+        assert(root == 0);
+        this->expand_subtree(root, pool ? *pool : putil::ThreadPool::global());
+
+        // move rows into leaf order
+        permute_rows(this->data_, this->index_, dim);
+    }
+
+    /**
+     * Append a node to the node array and its center to the center
+     * matrix. The radius is computed from the features of the node.
+     *
+     * @param begin  offset of the first feature
+     * @param n      number of features
+     * @param center center of the features
+     *
+     * @return offset of the initialized node
+     */
+    template <class T>
+    uint32_t
+    BasicKMeansTree<T>::init_node(const size_t begin, const size_t n,
+                                  const T* center)
+    {
+        const size_t dim = this->dimension_;
+        const size_t* ids = &this->index_[0] + begin;
+        dist_type dist, radius = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            dist = spat::squared_euclidean(center, this->data_ + ids[i] * dim, dim);
+            if(dist > radius)
+                radius = dist;
+        }
+
+        Node node;
+        node.radius = sqrt(radius);
+        node.first_child = 0;
+        node.n_children = 0;
+        node.begin = begin;
+        node.n = n;
+        this->nodes_.push_back(node);
+        this->centers_.insert(this->centers_.end(), center, center + dim);
+        return this->nodes_.size() - 1;
+    }
+
+    /**
+     * Expand the subtree. The features of the node are clustered by
+     * k-means and grouped by cluster, each non-empty cluster becomes
+     * a child which is expanded recursively. A node of at most
+     * leaf size features, or whose features fall in one cluster,
+     * stays a leaf.
+     *
+     * @param node offset of the current node
+     * @param pool thread pool for the assignment step
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::expand_subtree(const uint32_t node,
+                                       putil::ThreadPool& pool)
+    {
+        const size_t n = this->nodes_[node].n;
+        if(n <= this->leaf_size_ || n < 2)
+            return;
+        const size_t dim = this->dimension_;
+        const size_t begin = this->nodes_[node].begin;
+
+        vector<T> centers;
+        vector<uint32_t> labels;
+        // the generator is seeded by the node, so the tree is
+        // reproducible
+        const size_t n_clusters = min(this->branching_, n);
+        kmeans(this->data_, &this->index_[0] + begin, n, dim, n_clusters,
+               this->max_iterations_, centers, labels, pool, begin + 1);
+
+        // group the features by cluster with a counting sort
+        vector<size_t> offsets(n_clusters + 1, 0);
+        for(size_t i = 0; i < n; ++i)
+            ++offsets[labels[i] + 1];
+        size_t n_children = 0;
+        for(size_t c = 0; c < n_clusters; ++c)
+        {
+            if(offsets[c + 1] > 0)
+                ++n_children;
+            offsets[c + 1] += offsets[c];
+        }
+        // all features fall in one cluster, e.g. duplicates
+        if(n_children < 2)
+            return;
+        size_t* ids = &this->index_[0] + begin;
+        vector<size_t> grouped(n);
+        vector<size_t> next(offsets.begin(), offsets.end() - 1);
+        for(size_t i = 0; i < n; ++i)
+            grouped[next[labels[i]]++] = ids[i];
+        memcpy(ids, &grouped[0], sizeof(size_t) * n);
+
+        // children are consecutive, then expanded in depth-first order
+        const uint32_t first_child = this->nodes_.size();
+        for(size_t c = 0; c < n_clusters; ++c)
+        {
+            if(offsets[c + 1] > offsets[c])
+                this->init_node(begin + offsets[c], offsets[c + 1] - offsets[c],
+                                &centers[c * dim]);
+        }
+        this->nodes_[node].first_child = first_child;
+        this->nodes_[node].n_children = n_children;
+        for(size_t c = 0; c < n_children; ++c)
+            this->expand_subtree(first_child + c, pool);
+    }
+
+    /**
+     * Best Bin First search over the cluster centers. A branch whose
+     * lower bound is not closer than the current k-th best is
+     * skipped.
+     *
+     * @param feature    query feature data in array form
+     * @param k          number of nearest neighbour searched
+     * @param max_epoch  maximum of epoch of search, 0 for exact
+     * @param scratch    search buffers, scratch.heap takes the
+     *                   result as a max-heap of squared distances
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::search(const dist_type* feature, const size_t k,
+                               const size_t max_epoch,
+                               SearchScratch& scratch,
+                               const FeatureFilter* filter) const
+    {
+        vector<Branch>& branches = scratch.branches;
+        vector<RowBind>& heap = scratch.heap;
+        branches.clear();
+        heap.clear();
+        if(k == 0 || this->nodes_.empty())
+            return;
+
+        const Node* nodes = &this->nodes_[0];
+        const T* centers = &this->centers_[0];
+        const size_t dim = this->dimension_;
+        const bool bbf = max_epoch > 0;
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        dist_type dist, bound;
+        size_t epoch = 0;
+        uint32_t node;
+        bool reached, scanned;
+        const T* row;
+
+        // root for handle
+        branches.push_back(Branch(0, 0, 0));
+        while(!branches.empty() && (!bbf || epoch < max_epoch))
+        {
+            // pop the branch of closest center
+            pop_heap(branches.begin(), branches.end());
+            node = branches.back().node;
+            bound = branches.back().bound;
+            branches.pop_back();
+            // the order is not by bounds, so other branches may still
+            // hold closer features
+            if(!(bound < cur_best))
+                continue;
+
+            // descend to the closest child and push the others
+            reached = true;
+            while(!nodes[node].is_leaf())
+            {
+                const uint32_t first = nodes[node].first_child;
+                const uint32_t last = first + nodes[node].n_children;
+                Branch best(first, numeric_limits<dist_type>::max(), 0);
+                for(uint32_t c = first; c < last; ++c)
+                {
+                    dist = spat::squared_euclidean(centers + c * dim, feature, dim);
+                    // no feature of c is closer than its ball allows
+                    bound = sqrt(dist) - nodes[c].radius;
+                    bound = bound > 0 ? bound * bound : 0;
+                    Branch cand(c, dist, bound);
+                    if(c == first || cand.dist < best.dist)
+                        std::swap(cand, best);
+                    if(c != first && cand.bound < cur_best)
+                    {
+                        branches.push_back(cand);
+                        push_heap(branches.begin(), branches.end());
+                    }
+                }
+                if(!(best.bound < cur_best))
+                {
+                    reached = false;
+                    break;
+                }
+                node = best.node;
+            }
+            if(!reached)
+                continue;
+
+            // scan the leaf rows, a filtered row costs no distance
+            row = this->data_ + nodes[node].begin * dim;
+            const size_t end = nodes[node].begin + nodes[node].n;
+            scanned = !filter;
+            for(size_t i = nodes[node].begin; i < end; ++i, row += dim)
+            {
+                if(filter)
+                {
+                    if(!filter->accept(this->index_[i]))
+                        continue;
+                    scanned = true;
+                }
+                if(!spat::optimize_compare(row, feature, cur_best, dim, dist))
+                    continue;
+                // maintain the bounded max-heap, the best distance is
+                // the greatest-smallest once k are found
+                if(heap.size() == k)
+                {
+                    pop_heap(heap.begin(), heap.end());
+                    heap.back() = RowBind(i, dist);
+                }
+                else
+                {
+                    heap.push_back(RowBind(i, dist));
+                }
+                push_heap(heap.begin(), heap.end());
+                if(heap.size() == k)
+                    cur_best = heap.front().value;
+            }
+            // a leaf without accepted features is not an epoch, so
+            // the search goes on until it finds some
+            if(scanned)
+                ++epoch;
+        }
+    }
+
+    /**
+     * Exact k-nearest-neighbour search. Results are in the same
+     * order as BasicKDTree::knn_basic_opt.
+     *
+     * @param feature query feature data in array form
+     * @param k       number of nearest neighbour returned
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicKMeansTree<T>::Feature>
+    BasicKMeansTree<T>::knn_basic_opt(const dist_type* feature, size_t k) const
+    {
+        // max epoch of 0 searches until no branch can be closer
+        return this->knn_bbf_opt(feature, k, 0);
+    }
+
+    /**
+     * Search for approximate k nearest neighbours using the Best
+     * Bin First approach over the cluster centers. Results are in
+     * the same order as BasicKDTree::knn_bbf_opt.
+     *
+     * @param feature    query feture data in array form
+     * @param k          number of nearest neighbour returned
+     * @param max_epoch  maximum of epoch of search
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicKMeansTree<T>::Feature>
+    BasicKMeansTree<T>::knn_bbf_opt(const dist_type* feature, size_t k,
+                                    size_t max_epoch,
+                                    const FeatureFilter* filter) const
+    {
+        // best result buffer
+        vector<Feature> nbrs;
+        if(this->nodes_.empty() || !feature)
+        {
+            cerr << " KMeansTree::knn_bbf_opt : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchScratch scratch;
+        this->search(feature, k, max_epoch, scratch, filter);
+
+        // greatest distance first, as popped from a max-priority queue
+        vector<RowBind>& heap = scratch.heap;
+        nbrs.reserve(heap.size());
+        while(!heap.empty())
+        {
+            const size_t i = heap.front().key;
+            nbrs.push_back(Feature(this->data_ + i * this->dimension_,
+                                   this->dimension_, this->index_[i]));
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once, see
+     * BasicKDTree::knn_batch.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output euclidean distances, nq x k, may be
+     *                   NULL if not needed
+     * @param max_epoch  maximum of epoch of Best Bin First search,
+     *                   0 for the exact search
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKMeansTree<T>::knn_batch(const dist_type* queries, const size_t nq,
+                                  const size_t k, size_t* out_ids,
+                                  dist_type* out_dists, const size_t max_epoch,
+                                  const FeatureFilter* filter,
+                                  putil::ThreadPool* pool) const
+    {
+        if(this->nodes_.empty() || !queries || !out_ids)
+        {
+            cerr << " KMeansTree::knn_batch : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one scratch per worker, reused by all its queries
+        vector<SearchScratch> scratches(workers.concurrency());
+        const size_t dim = this->dimension_;
+
+        workers.parallel_for(nq, 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            SearchScratch& scratch = scratches[worker];
+            for(size_t q = begin; q < end; ++q)
+            {
+                this->search(queries + q * dim, k, max_epoch, scratch, filter);
+                BasicKDTree<T>::write_results(scratch.heap,
+                    &this->index_[0], k, EUCLIDEAN, out_ids + q * k,
+                    out_dists ? out_dists + q * k : NULL);
+            }
+        });
+    }
+
+    template class BasicKMeansTree<double>;
+    template class BasicKMeansTree<float>;
+}
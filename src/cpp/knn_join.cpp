@@ -0,0 +1,326 @@
+// Exact all-pairs k-nearest-neighbour join of a query matrix against a
+// catalog matrix, the batch job of lib/nenese (X * A.T followed by a
+// top k per row) without the pairwise matrix in memory. This
+// implementation has following features:
+//
+// 1. Queries and catalog are tiled into blocks, the inner products of
+//    a query block and a catalog block are one Eigen matrix product
+//    into a score buffer reused for all blocks.
+// 2. Euclidean distances use the expansion |u-v|^2 = |u|^2 + |v|^2 -
+//    2uv with the catalog norms computed once, cosine similarities are
+//    the inner products of unit length features as nenese computes.
+// 3. Each query keeps a bounded heap of its k best catalog rows, a
+//    score worse than the current k-th best costs one comparison.
+// 4. Query blocks are spread over a thread pool, finished blocks are
+//    either written to the caller's arrays or streamed to a callback,
+//    so results of any number of queries need O(threads) memory.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/knn_join.hpp"
+
+#include <mutex>
+
+// Eigen Linear Algebra
+#include <Eigen/Dense>
+
+namespace nnse
+{
+    namespace
+    {
+        // default number of queries of a block
+        const size_t QUERY_BLOCK = 128;
+        // default number of catalog rows of a block, with the query
+        // block the scores of a worker fit in the L2 cache for floats
+        const size_t CATALOG_BLOCK = 512;
+        // catalog rows whose norms a task computes
+        const size_t NORM_GRAIN = 4096;
+    }
+
+    /**
+     * Constructor
+     *
+     * @param d       feature dimension
+     * @param k       number of neighbours of each query
+     * @param measure EUCLIDEAN or SQUARED_EUCLIDEAN ranks by
+     *                ascending distance, COSINE by descending inner
+     *                product, the cosine of unit length features
+     */
+    template <class T>
+    BasicKNNJoin<T>::BasicKNNJoin(const size_t d, const size_t k,
+                                  const DistanceMeasure measure):
+        dimension_(d),k_(k),measure_(measure),query_block_(QUERY_BLOCK),
+        catalog_block_(CATALOG_BLOCK),exclude_self_(false){}
+
+    /**
+     * set the block sizes. The score buffer of a worker holds
+     * query_block x catalog_block elements and a catalog block is
+     * read once per query block.
+     *
+     * @param query_block   number of queries of a block
+     * @param catalog_block number of catalog rows of a block
+     */
+    template <class T>
+    void
+    BasicKNNJoin<T>::set_block_size(const size_t query_block,
+                                    const size_t catalog_block)
+    {
+        this->query_block_ = query_block > 0 ? query_block : 1;
+        this->catalog_block_ = catalog_block > 0 ? catalog_block : 1;
+    }
+
+    /**
+     * Join a block of queries against the whole catalog
+     *
+     * @param queries   row-major query matrix
+     * @param first     first query of the block
+     * @param nq        number of queries of the block
+     * @param catalog   row-major catalog matrix
+     * @param n         number of catalog rows
+     * @param norms     squared norms of the catalog rows, empty for
+     *                  cosine similarity
+     * @param scratch   buffers of the worker
+     * @param out_ids   output ids of the block, nq x k
+     * @param out_dists output distances of the block, nq x k, may
+     *                  be NULL
+     */
+    template <class T>
+    void
+    BasicKNNJoin<T>::join_block(const T* queries, const size_t first,
+                                const size_t nq, const T* catalog,
+                                const size_t n, const vector<T>& norms,
+                                JoinScratch& scratch, size_t* out_ids,
+                                dist_type* out_dists) const
+    {
+        typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> MatrixT;
+        typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic,
+                              Eigen::RowMajor> RowMatrixT;
+        const size_t dim = this->dimension_;
+        const size_t k = this->k_;
+        const bool cosine = this->measure_ == COSINE;
+        const Eigen::Map<const RowMatrixT> mat_queries(queries + first * dim,
+                                                       nq, dim);
+        scratch.scores.resize(this->catalog_block_ * nq);
+        scratch.heaps.resize(k * nq, RowBind(0, 0));
+        scratch.heap_sizes.assign(nq, 0);
+
+        for(size_t c0 = 0; c0 < n; c0 += this->catalog_block_)
+        {
+            const size_t nc = min(this->catalog_block_, n - c0);
+            // inner products of the blocks, one column per query so
+            // that a query scans its scores contiguously
+            Eigen::Map<MatrixT> scores(&scratch.scores[0], nc, nq);
+            scores.noalias() = Eigen::Map<const RowMatrixT>(
+                catalog + c0 * dim, nc, dim) * mat_queries.transpose();
+
+            for(size_t j = 0; j < nq; ++j)
+            {
+                const T* column = &scratch.scores[j * nc];
+                RowBind* heap = &scratch.heaps[j * k];
+                size_t& size = scratch.heap_sizes[j];
+                // catalog row of the query itself in this block
+                const size_t self = this->exclude_self_ ? first + j - c0 : nc;
+                dist_type worst = size == k ? heap[0].value
+                                            : numeric_limits<dist_type>::max();
+                for(size_t c = 0; c < nc; ++c)
+                {
+                    // ranking key, |q|^2 is the same for all rows of a
+                    // query and added back for the output
+                    const dist_type key = cosine ? -column[c]
+                                                 : norms[c0 + c] - 2 * column[c];
+                    if(!(key < worst) || c == self)
+                        continue;
+                    // maintain the bounded max-heap of keys
+                    if(size == k)
+                    {
+                        pop_heap(heap, heap + k);
+                        heap[k - 1] = RowBind(c0 + c, key);
+                    }
+                    else
+                    {
+                        heap[size++] = RowBind(c0 + c, key);
+                    }
+                    push_heap(heap, heap + size);
+                    if(size == k)
+                        worst = heap[0].value;
+                }
+            }
+        }
+
+        // best first, keys converted to the measure
+        for(size_t j = 0; j < nq; ++j)
+        {
+            RowBind* heap = &scratch.heaps[j * k];
+            const size_t size = scratch.heap_sizes[j];
+            sort_heap(heap, heap + size);
+            const T q_norm = cosine ? 0 : mat_queries.row(j).squaredNorm();
+            size_t* ids = out_ids + j * k;
+            dist_type* dists = out_dists ? out_dists + j * k : NULL;
+            for(size_t i = 0; i < k; ++i)
+            {
+                if(i < size)
+                {
+                    ids[i] = heap[i].key;
+                    if(!dists)
+                        continue;
+                    if(cosine)
+                    {
+                        dists[i] = -heap[i].value;
+                        continue;
+                    }
+                    // rounding may leave a tiny negative distance
+                    const dist_type squared = max(dist_type(0), q_norm + heap[i].value);
+                    dists[i] = this->measure_ == SQUARED_EUCLIDEAN
+                        ? squared : sqrt(squared);
+                }
+                else
+                {
+                    ids[i] = NO_INDEX;
+                    if(dists)
+                        dists[i] = cosine ? -numeric_limits<dist_type>::max()
+                                          : numeric_limits<dist_type>::max();
+                }
+            }
+        }
+    }
+
+    /**
+     * Join all queries block by block, the results of a block are
+     * written to the output arrays or, without them, streamed to
+     * the sink.
+     *
+     * @param queries   row-major nq x dimension query matrix
+     * @param nq        number of queries
+     * @param catalog   row-major n x dimension catalog matrix
+     * @param n         number of catalog rows
+     * @param out_ids   output catalog ids, nq x k, NULL to stream
+     * @param out_dists output distances, nq x k, may be NULL
+     * @param sink      receiver of the results if out_ids is NULL
+     * @param pool      thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKNNJoin<T>::run(const T* queries, const size_t nq,
+                         const T* catalog, const size_t n,
+                         size_t* out_ids, dist_type* out_dists,
+                         const ResultSink& sink,
+                         putil::ThreadPool* pool) const
+    {
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        const size_t dim = this->dimension_;
+        const size_t k = this->k_;
+        // squared norms of the catalog rows, only for distances
+        vector<T> norms;
+        if(this->measure_ != COSINE)
+        {
+            norms.resize(n);
+            workers.parallel_for(n, NORM_GRAIN,
+                [&](size_t begin, size_t end, size_t)
+            {
+                typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VectorT;
+                for(size_t i = begin; i < end; ++i)
+                    norms[i] = Eigen::Map<const VectorT>(
+                        catalog + i * dim, dim).squaredNorm();
+            });
+        }
+
+        // one scratch per worker, reused by all its query blocks
+        vector<JoinScratch> scratches(workers.concurrency());
+        // the sink is called by one worker at a time
+        mutex sink_mutex;
+        const size_t block = this->query_block_;
+        const size_t n_blocks = (nq + block - 1) / block;
+        workers.parallel_for(n_blocks, 1,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            JoinScratch& scratch = scratches[worker];
+            for(size_t b = begin; b < end; ++b)
+            {
+                const size_t first = b * block;
+                const size_t count = min(block, nq - first);
+                if(out_ids)
+                {
+                    this->join_block(queries, first, count, catalog, n, norms,
+                                     scratch, out_ids + first * k,
+                                     out_dists ? out_dists + first * k : NULL);
+                    continue;
+                }
+                scratch.ids.resize(count * k);
+                scratch.dists.resize(count * k);
+                this->join_block(queries, first, count, catalog, n, norms,
+                                 scratch, &scratch.ids[0], &scratch.dists[0]);
+                lock_guard<mutex> lock(sink_mutex);
+                sink(first, count, &scratch.ids[0], &scratch.dists[0]);
+            }
+        });
+    }
+
+    /**
+     * Join queries against a catalog. Each row of the output is
+     * sorted from the best, i.e. by ascending distance or
+     * descending cosine similarity, and padded with NO_INDEX and
+     * the worst distance if the catalog has fewer than k rows.
+     *
+     * @param queries   row-major nq x dimension query matrix
+     * @param nq        number of queries
+     * @param catalog   row-major n x dimension catalog matrix, the
+     *                  i-th row gets id i
+     * @param n         number of catalog rows
+     * @param out_ids   output catalog ids, nq x k
+     * @param out_dists output distances, nq x k, may be NULL if not
+     *                  needed
+     * @param pool      thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKNNJoin<T>::join(const T* queries, const size_t nq,
+                          const T* catalog, const size_t n,
+                          size_t* out_ids, dist_type* out_dists,
+                          putil::ThreadPool* pool) const
+    {
+        if(!queries || !catalog || !out_ids || this->k_ == 0)
+        {
+            cerr << " KNNJoin::join : invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->run(queries, nq, catalog, n, out_ids, out_dists, ResultSink(),
+                  pool);
+    }
+
+    /**
+     * Join queries against a catalog and stream the results of
+     * each finished query block to a callback, e.g. to write them
+     * out without keeping them.
+     *
+     * @param queries row-major nq x dimension query matrix
+     * @param nq      number of queries
+     * @param catalog row-major n x dimension catalog matrix, the
+     *                i-th row gets id i
+     * @param n       number of catalog rows
+     * @param sink    receiver of the results of a query block
+     * @param pool    thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKNNJoin<T>::join(const T* queries, const size_t nq,
+                          const T* catalog, const size_t n,
+                          const ResultSink& sink,
+                          putil::ThreadPool* pool) const
+    {
+        if(!queries || !catalog || !sink || this->k_ == 0)
+        {
+            cerr << " KNNJoin::join : invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        this->run(queries, nq, catalog, n, NULL, NULL, sink, pool);
+    }
+
+    template class BasicKNNJoin<double>;
+    template class BasicKNNJoin<float>;
+}
@@ -0,0 +1,878 @@
+// Optimized spatial distance metrics
+//
+// SIMD kernels of the distance metrics for float, double and half
+// precision features. The kernels for SSE2, AVX2 (with FMA and F16C)
+// and AVX-512 are compiled into one binary by the function target
+// attribute and selected at runtime by the CPU features, so the same
+// binary runs on every x86-64 host. The early-abandon comparison
+// checks the bound once per block of 32 (float) or 16 (double)
+// dimensions instead of every dimension, which keeps the inner loop
+// vectorized. Other architectures use the scalar kernels.
+//
+// The selection can be forced by the environment variable SIREEN_SIMD
+// with one of "scalar", "sse2", "avx2" and "avx512", it never goes
+// above what the CPU supports.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/metrics.hpp"
+
+#include <stdlib.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SPAT_X86_SIMD
+// the AVX-512 intrinsics of gcc 12 headers pass a self-initialized
+// register as the unused merge source, which -Wall reports inside them
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define SPAT_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define SPAT_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,f16c")))
+#endif
+
+namespace spat
+{
+    namespace
+    {
+        // block sizes of the early-abandon check in dimensions
+        const size_t FLOAT_BLOCK = 32;
+        const size_t DOUBLE_BLOCK = 16;
+
+        // *** SCALAR KERNELS ***
+
+        template <class T, class U> typename accumulator<T>::type
+        l2_scalar(const T* x, const U* y, const size_t dim)
+        {
+            typedef typename accumulator<T>::type A;
+            A dist = 0, tmp;
+            for(size_t i = 0; i < dim; ++i)
+            {
+                tmp = A(x[i]) - A(y[i]);
+                dist += tmp * tmp;
+            }
+            return dist;
+        }
+
+        template <class T, class U> typename accumulator<T>::type
+        dot_scalar(const T* x, const U* y, const size_t dim)
+        {
+            typedef typename accumulator<T>::type A;
+            A dot = 0;
+            for(size_t i = 0; i < dim; ++i)
+                dot += A(x[i]) * A(y[i]);
+            return dot;
+        }
+
+        template <class T, class U> bool
+        bounded_scalar(const T* x, const U* y,
+                       const typename accumulator<T>::type target,
+                       const size_t dim, typename accumulator<T>::type& dist)
+        {
+            // explicit template arguments, not the dispatched overload
+            return optimize_compare<T, U>(x, y, target, dim, dist);
+        }
+
+        // out = {x.y, x.x, y.y}
+        template <class T, class U> void
+        cosine_sums_scalar(const T* x, const U* y, const size_t dim,
+                           typename accumulator<T>::type* out)
+        {
+            typedef typename accumulator<T>::type A;
+            A xy = 0, xx = 0, yy = 0, xi, yi;
+            for(size_t i = 0; i < dim; ++i)
+            {
+                xi = x[i];
+                yi = y[i];
+                xy += xi * yi;
+                xx += xi * xi;
+                yy += yi * yi;
+            }
+            out[0] = xy;
+            out[1] = xx;
+            out[2] = yy;
+        }
+
+#ifdef SPAT_X86_SIMD
+        // *** SSE2 KERNELS ***
+        // SSE2 is the x86-64 baseline, no target attribute required.
+        // There is no half precision conversion before F16C, so half
+        // features fall back to the scalar kernels at this level.
+
+        inline float hsum_sse2(const __m128 v)
+        {
+            __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+            s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+            return _mm_cvtss_f32(s);
+        }
+        inline double hsum_sse2(const __m128d v)
+        {
+            return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+        }
+
+        float l2_sse2(const float* x, const float* y, const size_t dim)
+        {
+            __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps(), d0, d1;
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                d0 = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+                d1 = _mm_sub_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4));
+                s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+                s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+            }
+            float dist = hsum_sse2(_mm_add_ps(s0, s1));
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist;
+        }
+        double l2_sse2(const double* x, const double* y, const size_t dim)
+        {
+            __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd(), d0, d1;
+            size_t i = 0;
+            for(; i + 4 <= dim; i += 4)
+            {
+                d0 = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+                d1 = _mm_sub_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2));
+                s0 = _mm_add_pd(s0, _mm_mul_pd(d0, d0));
+                s1 = _mm_add_pd(s1, _mm_mul_pd(d1, d1));
+            }
+            double dist = hsum_sse2(_mm_add_pd(s0, s1));
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist;
+        }
+
+        float dot_sse2(const float* x, const float* y, const size_t dim)
+        {
+            __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(x + i),
+                                               _mm_loadu_ps(y + i)));
+                s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(x + i + 4),
+                                               _mm_loadu_ps(y + i + 4)));
+            }
+            float dot = hsum_sse2(_mm_add_ps(s0, s1));
+            for(; i < dim; ++i)
+                dot += x[i] * y[i];
+            return dot;
+        }
+        double dot_sse2(const double* x, const double* y, const size_t dim)
+        {
+            __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+            size_t i = 0;
+            for(; i + 4 <= dim; i += 4)
+            {
+                s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x + i),
+                                               _mm_loadu_pd(y + i)));
+                s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x + i + 2),
+                                               _mm_loadu_pd(y + i + 2)));
+            }
+            double dot = hsum_sse2(_mm_add_pd(s0, s1));
+            for(; i < dim; ++i)
+                dot += x[i] * y[i];
+            return dot;
+        }
+
+        bool bounded_sse2(const float* x, const float* y, const float target,
+                          const size_t dim, float& dist)
+        {
+            __m128 s = _mm_setzero_ps(), d;
+            size_t i = 0;
+            for(; i + FLOAT_BLOCK <= dim; )
+            {
+                for(const size_t end = i + FLOAT_BLOCK; i < end; i += 4)
+                {
+                    d = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+                    s = _mm_add_ps(s, _mm_mul_ps(d, d));
+                }
+                dist = hsum_sse2(s);
+                if(dist >= target)
+                    return false;
+            }
+            for(; i + 4 <= dim; i += 4)
+            {
+                d = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+                s = _mm_add_ps(s, _mm_mul_ps(d, d));
+            }
+            dist = hsum_sse2(s);
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist < target;
+        }
+        bool bounded_sse2(const double* x, const double* y, const double target,
+                          const size_t dim, double& dist)
+        {
+            __m128d s = _mm_setzero_pd(), d;
+            size_t i = 0;
+            for(; i + DOUBLE_BLOCK <= dim; )
+            {
+                for(const size_t end = i + DOUBLE_BLOCK; i < end; i += 2)
+                {
+                    d = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+                    s = _mm_add_pd(s, _mm_mul_pd(d, d));
+                }
+                dist = hsum_sse2(s);
+                if(dist >= target)
+                    return false;
+            }
+            for(; i + 2 <= dim; i += 2)
+            {
+                d = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+                s = _mm_add_pd(s, _mm_mul_pd(d, d));
+            }
+            dist = hsum_sse2(s);
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist < target;
+        }
+
+        void cosine_sums_sse2(const float* x, const float* y, const size_t dim,
+                              float* out)
+        {
+            __m128 xy = _mm_setzero_ps(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 4 <= dim; i += 4)
+            {
+                xi = _mm_loadu_ps(x + i);
+                yi = _mm_loadu_ps(y + i);
+                xy = _mm_add_ps(xy, _mm_mul_ps(xi, yi));
+                xx = _mm_add_ps(xx, _mm_mul_ps(xi, xi));
+                yy = _mm_add_ps(yy, _mm_mul_ps(yi, yi));
+            }
+            out[0] = hsum_sse2(xy);
+            out[1] = hsum_sse2(xx);
+            out[2] = hsum_sse2(yy);
+            for(; i < dim; ++i)
+            {
+                out[0] += x[i] * y[i];
+                out[1] += x[i] * x[i];
+                out[2] += y[i] * y[i];
+            }
+        }
+        void cosine_sums_sse2(const double* x, const double* y, const size_t dim,
+                              double* out)
+        {
+            __m128d xy = _mm_setzero_pd(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 2 <= dim; i += 2)
+            {
+                xi = _mm_loadu_pd(x + i);
+                yi = _mm_loadu_pd(y + i);
+                xy = _mm_add_pd(xy, _mm_mul_pd(xi, yi));
+                xx = _mm_add_pd(xx, _mm_mul_pd(xi, xi));
+                yy = _mm_add_pd(yy, _mm_mul_pd(yi, yi));
+            }
+            out[0] = hsum_sse2(xy);
+            out[1] = hsum_sse2(xx);
+            out[2] = hsum_sse2(yy);
+            for(; i < dim; ++i)
+            {
+                out[0] += x[i] * y[i];
+                out[1] += x[i] * x[i];
+                out[2] += y[i] * y[i];
+            }
+        }
+
+        // *** AVX2 KERNELS ***
+        // float and half features share the kernels, only the load of
+        // feature x differs.
+
+        SPAT_TARGET_AVX2 inline __m256 load_avx2(const float* p)
+        {return _mm256_loadu_ps(p); }
+        SPAT_TARGET_AVX2 inline __m256 load_avx2(const float16* p)
+        {return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p)); }
+        SPAT_TARGET_AVX2 inline float hsum_avx2(const __m256 v)
+        {
+            return hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(v),
+                                        _mm256_extractf128_ps(v, 1)));
+        }
+        SPAT_TARGET_AVX2 inline double hsum_avx2(const __m256d v)
+        {
+            return hsum_sse2(_mm_add_pd(_mm256_castpd256_pd128(v),
+                                        _mm256_extractf128_pd(v, 1)));
+        }
+
+        template <class T> SPAT_TARGET_AVX2 float
+        l2_avx2(const T* x, const float* y, const size_t dim)
+        {
+            __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), d0, d1;
+            size_t i = 0;
+            for(; i + 16 <= dim; i += 16)
+            {
+                d0 = _mm256_sub_ps(load_avx2(x + i), _mm256_loadu_ps(y + i));
+                d1 = _mm256_sub_ps(load_avx2(x + i + 8), _mm256_loadu_ps(y + i + 8));
+                s0 = _mm256_fmadd_ps(d0, d0, s0);
+                s1 = _mm256_fmadd_ps(d1, d1, s1);
+            }
+            for(; i + 8 <= dim; i += 8)
+            {
+                d0 = _mm256_sub_ps(load_avx2(x + i), _mm256_loadu_ps(y + i));
+                s0 = _mm256_fmadd_ps(d0, d0, s0);
+            }
+            float dist = hsum_avx2(_mm256_add_ps(s0, s1)), tmp;
+            for(; i < dim; ++i)
+            {
+                tmp = float(x[i]) - y[i];
+                dist += tmp * tmp;
+            }
+            return dist;
+        }
+        SPAT_TARGET_AVX2 double
+        l2_avx2(const double* x, const double* y, const size_t dim)
+        {
+            __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd(), d0, d1;
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                d0 = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+                d1 = _mm256_sub_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4));
+                s0 = _mm256_fmadd_pd(d0, d0, s0);
+                s1 = _mm256_fmadd_pd(d1, d1, s1);
+            }
+            for(; i + 4 <= dim; i += 4)
+            {
+                d0 = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+                s0 = _mm256_fmadd_pd(d0, d0, s0);
+            }
+            double dist = hsum_avx2(_mm256_add_pd(s0, s1));
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist;
+        }
+
+        template <class T> SPAT_TARGET_AVX2 float
+        dot_avx2(const T* x, const float* y, const size_t dim)
+        {
+            __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for(; i + 16 <= dim; i += 16)
+            {
+                s0 = _mm256_fmadd_ps(load_avx2(x + i), _mm256_loadu_ps(y + i), s0);
+                s1 = _mm256_fmadd_ps(load_avx2(x + i + 8), _mm256_loadu_ps(y + i + 8), s1);
+            }
+            for(; i + 8 <= dim; i += 8)
+                s0 = _mm256_fmadd_ps(load_avx2(x + i), _mm256_loadu_ps(y + i), s0);
+            float dot = hsum_avx2(_mm256_add_ps(s0, s1));
+            for(; i < dim; ++i)
+                dot += float(x[i]) * y[i];
+            return dot;
+        }
+        SPAT_TARGET_AVX2 double
+        dot_avx2(const double* x, const double* y, const size_t dim)
+        {
+            __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), s0);
+                s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), s1);
+            }
+            for(; i + 4 <= dim; i += 4)
+                s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), s0);
+            double dot = hsum_avx2(_mm256_add_pd(s0, s1));
+            for(; i < dim; ++i)
+                dot += x[i] * y[i];
+            return dot;
+        }
+
+        template <class T> SPAT_TARGET_AVX2 bool
+        bounded_avx2(const T* x, const float* y, const float target,
+                     const size_t dim, float& dist)
+        {
+            __m256 s = _mm256_setzero_ps(), d;
+            size_t i = 0;
+            for(; i + FLOAT_BLOCK <= dim; )
+            {
+                for(const size_t end = i + FLOAT_BLOCK; i < end; i += 8)
+                {
+                    d = _mm256_sub_ps(load_avx2(x + i), _mm256_loadu_ps(y + i));
+                    s = _mm256_fmadd_ps(d, d, s);
+                }
+                dist = hsum_avx2(s);
+                if(dist >= target)
+                    return false;
+            }
+            for(; i + 8 <= dim; i += 8)
+            {
+                d = _mm256_sub_ps(load_avx2(x + i), _mm256_loadu_ps(y + i));
+                s = _mm256_fmadd_ps(d, d, s);
+            }
+            dist = hsum_avx2(s);
+            float tmp;
+            for(; i < dim; ++i)
+            {
+                tmp = float(x[i]) - y[i];
+                dist += tmp * tmp;
+            }
+            return dist < target;
+        }
+        SPAT_TARGET_AVX2 bool
+        bounded_avx2(const double* x, const double* y, const double target,
+                     const size_t dim, double& dist)
+        {
+            __m256d s = _mm256_setzero_pd(), d;
+            size_t i = 0;
+            for(; i + DOUBLE_BLOCK <= dim; )
+            {
+                for(const size_t end = i + DOUBLE_BLOCK; i < end; i += 4)
+                {
+                    d = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+                    s = _mm256_fmadd_pd(d, d, s);
+                }
+                dist = hsum_avx2(s);
+                if(dist >= target)
+                    return false;
+            }
+            for(; i + 4 <= dim; i += 4)
+            {
+                d = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+                s = _mm256_fmadd_pd(d, d, s);
+            }
+            dist = hsum_avx2(s);
+            for(; i < dim; ++i)
+                dist += (x[i] - y[i]) * (x[i] - y[i]);
+            return dist < target;
+        }
+
+        template <class T> SPAT_TARGET_AVX2 void
+        cosine_sums_avx2(const T* x, const float* y, const size_t dim,
+                         float* out)
+        {
+            __m256 xy = _mm256_setzero_ps(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                xi = load_avx2(x + i);
+                yi = _mm256_loadu_ps(y + i);
+                xy = _mm256_fmadd_ps(xi, yi, xy);
+                xx = _mm256_fmadd_ps(xi, xi, xx);
+                yy = _mm256_fmadd_ps(yi, yi, yy);
+            }
+            out[0] = hsum_avx2(xy);
+            out[1] = hsum_avx2(xx);
+            out[2] = hsum_avx2(yy);
+            float xs;
+            for(; i < dim; ++i)
+            {
+                xs = x[i];
+                out[0] += xs * y[i];
+                out[1] += xs * xs;
+                out[2] += y[i] * y[i];
+            }
+        }
+        SPAT_TARGET_AVX2 void
+        cosine_sums_avx2(const double* x, const double* y, const size_t dim,
+                         double* out)
+        {
+            __m256d xy = _mm256_setzero_pd(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 4 <= dim; i += 4)
+            {
+                xi = _mm256_loadu_pd(x + i);
+                yi = _mm256_loadu_pd(y + i);
+                xy = _mm256_fmadd_pd(xi, yi, xy);
+                xx = _mm256_fmadd_pd(xi, xi, xx);
+                yy = _mm256_fmadd_pd(yi, yi, yy);
+            }
+            out[0] = hsum_avx2(xy);
+            out[1] = hsum_avx2(xx);
+            out[2] = hsum_avx2(yy);
+            for(; i < dim; ++i)
+            {
+                out[0] += x[i] * y[i];
+                out[1] += x[i] * x[i];
+                out[2] += y[i] * y[i];
+            }
+        }
+
+        // *** AVX-512 KERNELS ***
+
+        SPAT_TARGET_AVX512 inline __m512 load_avx512(const float* p)
+        {return _mm512_loadu_ps(p); }
+        SPAT_TARGET_AVX512 inline __m512 load_avx512(const float16* p)
+        {return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p)); }
+        // fold the 128-bit lanes, then sum the lowest one
+        SPAT_TARGET_AVX512 inline float hsum_avx512(const __m512 v)
+        {
+            __m512 s = _mm512_add_ps(v, _mm512_shuffle_f32x4(v, v, 0x4e));
+            s = _mm512_add_ps(s, _mm512_shuffle_f32x4(s, s, 0xb1));
+            return hsum_sse2(_mm512_castps512_ps128(s));
+        }
+        SPAT_TARGET_AVX512 inline double hsum_avx512(const __m512d v)
+        {
+            __m512d s = _mm512_add_pd(v, _mm512_shuffle_f64x2(v, v, 0x4e));
+            s = _mm512_add_pd(s, _mm512_shuffle_f64x2(s, s, 0xb1));
+            return hsum_sse2(_mm512_castpd512_pd128(s));
+        }
+
+        template <class T> SPAT_TARGET_AVX512 float
+        l2_avx512(const T* x, const float* y, const size_t dim)
+        {
+            __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), d0, d1;
+            size_t i = 0;
+            for(; i + 32 <= dim; i += 32)
+            {
+                d0 = _mm512_sub_ps(load_avx512(x + i), _mm512_loadu_ps(y + i));
+                d1 = _mm512_sub_ps(load_avx512(x + i + 16), _mm512_loadu_ps(y + i + 16));
+                s0 = _mm512_fmadd_ps(d0, d0, s0);
+                s1 = _mm512_fmadd_ps(d1, d1, s1);
+            }
+            for(; i + 16 <= dim; i += 16)
+            {
+                d0 = _mm512_sub_ps(load_avx512(x + i), _mm512_loadu_ps(y + i));
+                s0 = _mm512_fmadd_ps(d0, d0, s0);
+            }
+            float dist = hsum_avx512(_mm512_add_ps(s0, s1));
+            // the rest is done by avx2 kernel
+            if(i < dim)
+                dist += l2_avx2(x + i, y + i, dim - i);
+            return dist;
+        }
+        SPAT_TARGET_AVX512 double
+        l2_avx512(const double* x, const double* y, const size_t dim)
+        {
+            __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd(), d0, d1;
+            size_t i = 0;
+            for(; i + 16 <= dim; i += 16)
+            {
+                d0 = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+                d1 = _mm512_sub_pd(_mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8));
+                s0 = _mm512_fmadd_pd(d0, d0, s0);
+                s1 = _mm512_fmadd_pd(d1, d1, s1);
+            }
+            for(; i + 8 <= dim; i += 8)
+            {
+                d0 = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+                s0 = _mm512_fmadd_pd(d0, d0, s0);
+            }
+            double dist = hsum_avx512(_mm512_add_pd(s0, s1));
+            if(i < dim)
+                dist += l2_avx2(x + i, y + i, dim - i);
+            return dist;
+        }
+
+        template <class T> SPAT_TARGET_AVX512 float
+        dot_avx512(const T* x, const float* y, const size_t dim)
+        {
+            __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for(; i + 32 <= dim; i += 32)
+            {
+                s0 = _mm512_fmadd_ps(load_avx512(x + i), _mm512_loadu_ps(y + i), s0);
+                s1 = _mm512_fmadd_ps(load_avx512(x + i + 16), _mm512_loadu_ps(y + i + 16), s1);
+            }
+            for(; i + 16 <= dim; i += 16)
+                s0 = _mm512_fmadd_ps(load_avx512(x + i), _mm512_loadu_ps(y + i), s0);
+            float dot = hsum_avx512(_mm512_add_ps(s0, s1));
+            if(i < dim)
+                dot += dot_avx2(x + i, y + i, dim - i);
+            return dot;
+        }
+        SPAT_TARGET_AVX512 double
+        dot_avx512(const double* x, const double* y, const size_t dim)
+        {
+            __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+            size_t i = 0;
+            for(; i + 16 <= dim; i += 16)
+            {
+                s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), s0);
+                s1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8), s1);
+            }
+            for(; i + 8 <= dim; i += 8)
+                s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), s0);
+            double dot = hsum_avx512(_mm512_add_pd(s0, s1));
+            if(i < dim)
+                dot += dot_avx2(x + i, y + i, dim - i);
+            return dot;
+        }
+
+        template <class T> SPAT_TARGET_AVX512 bool
+        bounded_avx512(const T* x, const float* y, const float target,
+                       const size_t dim, float& dist)
+        {
+            __m512 s = _mm512_setzero_ps(), d;
+            size_t i = 0;
+            for(; i + FLOAT_BLOCK <= dim; )
+            {
+                for(const size_t end = i + FLOAT_BLOCK; i < end; i += 16)
+                {
+                    d = _mm512_sub_ps(load_avx512(x + i), _mm512_loadu_ps(y + i));
+                    s = _mm512_fmadd_ps(d, d, s);
+                }
+                dist = hsum_avx512(s);
+                if(dist >= target)
+                    return false;
+            }
+            dist = hsum_avx512(s);
+            if(i < dim)
+                dist += l2_avx2(x + i, y + i, dim - i);
+            return dist < target;
+        }
+        SPAT_TARGET_AVX512 bool
+        bounded_avx512(const double* x, const double* y, const double target,
+                       const size_t dim, double& dist)
+        {
+            __m512d s = _mm512_setzero_pd(), d;
+            size_t i = 0;
+            for(; i + DOUBLE_BLOCK <= dim; )
+            {
+                for(const size_t end = i + DOUBLE_BLOCK; i < end; i += 8)
+                {
+                    d = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+                    s = _mm512_fmadd_pd(d, d, s);
+                }
+                dist = hsum_avx512(s);
+                if(dist >= target)
+                    return false;
+            }
+            dist = hsum_avx512(s);
+            if(i < dim)
+                dist += l2_avx2(x + i, y + i, dim - i);
+            return dist < target;
+        }
+
+        template <class T> SPAT_TARGET_AVX512 void
+        cosine_sums_avx512(const T* x, const float* y, const size_t dim,
+                           float* out)
+        {
+            __m512 xy = _mm512_setzero_ps(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 16 <= dim; i += 16)
+            {
+                xi = load_avx512(x + i);
+                yi = _mm512_loadu_ps(y + i);
+                xy = _mm512_fmadd_ps(xi, yi, xy);
+                xx = _mm512_fmadd_ps(xi, xi, xx);
+                yy = _mm512_fmadd_ps(yi, yi, yy);
+            }
+            float rest[3] = {0, 0, 0};
+            if(i < dim)
+                cosine_sums_avx2(x + i, y + i, dim - i, rest);
+            out[0] = hsum_avx512(xy) + rest[0];
+            out[1] = hsum_avx512(xx) + rest[1];
+            out[2] = hsum_avx512(yy) + rest[2];
+        }
+        SPAT_TARGET_AVX512 void
+        cosine_sums_avx512(const double* x, const double* y, const size_t dim,
+                           double* out)
+        {
+            __m512d xy = _mm512_setzero_pd(), xx = xy, yy = xy, xi, yi;
+            size_t i = 0;
+            for(; i + 8 <= dim; i += 8)
+            {
+                xi = _mm512_loadu_pd(x + i);
+                yi = _mm512_loadu_pd(y + i);
+                xy = _mm512_fmadd_pd(xi, yi, xy);
+                xx = _mm512_fmadd_pd(xi, xi, xx);
+                yy = _mm512_fmadd_pd(yi, yi, yy);
+            }
+            double rest[3] = {0, 0, 0};
+            if(i < dim)
+                cosine_sums_avx2(x + i, y + i, dim - i, rest);
+            out[0] = hsum_avx512(xy) + rest[0];
+            out[1] = hsum_avx512(xx) + rest[1];
+            out[2] = hsum_avx512(yy) + rest[2];
+        }
+#endif //SPAT_X86_SIMD
+
+        /// Kernel table of one instruction set
+        struct Kernels
+        {
+            const char* name;
+            float (*l2_f)(const float*, const float*, size_t);
+            double (*l2_d)(const double*, const double*, size_t);
+            float (*l2_h)(const float16*, const float*, size_t);
+            float (*dot_f)(const float*, const float*, size_t);
+            double (*dot_d)(const double*, const double*, size_t);
+            float (*dot_h)(const float16*, const float*, size_t);
+            bool (*bounded_f)(const float*, const float*, float, size_t, float&);
+            bool (*bounded_d)(const double*, const double*, double, size_t, double&);
+            bool (*bounded_h)(const float16*, const float*, float, size_t, float&);
+            void (*cosine_f)(const float*, const float*, size_t, float*);
+            void (*cosine_d)(const double*, const double*, size_t, double*);
+            void (*cosine_h)(const float16*, const float*, size_t, float*);
+        };
+
+        Kernels scalar_kernels()
+        {
+            Kernels k;
+            k.name = "scalar";
+            k.l2_f = &l2_scalar<float, float>;
+            k.l2_d = &l2_scalar<double, double>;
+            k.l2_h = &l2_scalar<float16, float>;
+            k.dot_f = &dot_scalar<float, float>;
+            k.dot_d = &dot_scalar<double, double>;
+            k.dot_h = &dot_scalar<float16, float>;
+            k.bounded_f = &bounded_scalar<float, float>;
+            k.bounded_d = &bounded_scalar<double, double>;
+            k.bounded_h = &bounded_scalar<float16, float>;
+            k.cosine_f = &cosine_sums_scalar<float, float>;
+            k.cosine_d = &cosine_sums_scalar<double, double>;
+            k.cosine_h = &cosine_sums_scalar<float16, float>;
+            return k;
+        }
+
+        /**
+         * Select kernels by the CPU features and the SIREEN_SIMD
+         * environment variable
+         */
+        Kernels select_kernels()
+        {
+            Kernels k = scalar_kernels();
+#ifdef SPAT_X86_SIMD
+            const char* env = getenv("SIREEN_SIMD");
+            const string wanted = env ? env : "";
+            if(wanted == "scalar")
+                return k;
+
+            k.name = "sse2";
+            k.l2_f = &l2_sse2;
+            k.l2_d = &l2_sse2;
+            k.dot_f = &dot_sse2;
+            k.dot_d = &dot_sse2;
+            k.bounded_f = &bounded_sse2;
+            k.bounded_d = &bounded_sse2;
+            k.cosine_f = &cosine_sums_sse2;
+            k.cosine_d = &cosine_sums_sse2;
+            if(wanted == "sse2")
+                return k;
+
+            __builtin_cpu_init();
+            if(!(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+                 && __builtin_cpu_supports("f16c")))
+                return k;
+            k.name = "avx2";
+            k.l2_f = &l2_avx2<float>;
+            k.l2_d = &l2_avx2;
+            k.l2_h = &l2_avx2<float16>;
+            k.dot_f = &dot_avx2<float>;
+            k.dot_d = &dot_avx2;
+            k.dot_h = &dot_avx2<float16>;
+            k.bounded_f = &bounded_avx2<float>;
+            k.bounded_d = &bounded_avx2;
+            k.bounded_h = &bounded_avx2<float16>;
+            k.cosine_f = &cosine_sums_avx2<float>;
+            k.cosine_d = &cosine_sums_avx2;
+            k.cosine_h = &cosine_sums_avx2<float16>;
+            if(wanted == "avx2" || !__builtin_cpu_supports("avx512f"))
+                return k;
+
+            k.name = "avx512";
+            k.l2_f = &l2_avx512<float>;
+            k.l2_d = &l2_avx512;
+            k.l2_h = &l2_avx512<float16>;
+            k.dot_f = &dot_avx512<float>;
+            k.dot_d = &dot_avx512;
+            k.dot_h = &dot_avx512<float16>;
+            k.bounded_f = &bounded_avx512<float>;
+            k.bounded_d = &bounded_avx512;
+            k.bounded_h = &bounded_avx512<float16>;
+            k.cosine_f = &cosine_sums_avx512<float>;
+            k.cosine_d = &cosine_sums_avx512;
+            k.cosine_h = &cosine_sums_avx512<float16>;
+#endif
+            return k;
+        }
+
+        // selected once, thread-safe since C++11
+        const Kernels& kernels()
+        {
+            static const Kernels k = select_kernels();
+            return k;
+        }
+
+        // 1 - cosine similarity from the fused sums
+        template <class A>
+        inline A cosine_from_sums(const A* sums)
+        {
+            A similarity = sums[0];
+            if(similarity)
+                similarity /= sqrt(sums[1]) * sqrt(sums[2]);
+            return 1 - similarity;
+        }
+    }
+
+    const char* simd_level()
+    {return kernels().name; }
+
+    float squared_euclidean(const float* x, const float* y, const size_t dim)
+    {return kernels().l2_f(x, y, dim); }
+    double squared_euclidean(const double* x, const double* y, const size_t dim)
+    {return kernels().l2_d(x, y, dim); }
+    float squared_euclidean(const float16* x, const float* y, const size_t dim)
+    {return kernels().l2_h(x, y, dim); }
+
+    float inner_product(const float* x, const float* y, const size_t dim)
+    {return kernels().dot_f(x, y, dim); }
+    double inner_product(const double* x, const double* y, const size_t dim)
+    {return kernels().dot_d(x, y, dim); }
+    float inner_product(const float16* x, const float* y, const size_t dim)
+    {return kernels().dot_h(x, y, dim); }
+
+    float cosine(const float* x, const float* y, const size_t dim,
+                 const bool normalized)
+    {
+        if(normalized)
+            return 1 - kernels().dot_f(x, y, dim);
+        float sums[3];
+        kernels().cosine_f(x, y, dim, sums);
+        return cosine_from_sums(sums);
+    }
+    double cosine(const double* x, const double* y, const size_t dim,
+                  const bool normalized)
+    {
+        if(normalized)
+            return 1 - kernels().dot_d(x, y, dim);
+        double sums[3];
+        kernels().cosine_d(x, y, dim, sums);
+        return cosine_from_sums(sums);
+    }
+    float cosine(const float16* x, const float* y, const size_t dim,
+                 const bool normalized)
+    {
+        if(normalized)
+            return 1 - kernels().dot_h(x, y, dim);
+        float sums[3];
+        kernels().cosine_h(x, y, dim, sums);
+        return cosine_from_sums(sums);
+    }
+
+    float euclidean(const float* x, const float* y, const size_t dim,
+                    const bool normalized)
+    {
+        if(normalized)
+            return 2 * cosine(x, y, dim, true);
+        return sqrt(kernels().l2_f(x, y, dim));
+    }
+    double euclidean(const double* x, const double* y, const size_t dim,
+                     const bool normalized)
+    {
+        if(normalized)
+            return 2 * cosine(x, y, dim, true);
+        return sqrt(kernels().l2_d(x, y, dim));
+    }
+    float euclidean(const float16* x, const float* y, const size_t dim,
+                    const bool normalized)
+    {
+        if(normalized)
+            return 2 * cosine(x, y, dim, true);
+        return sqrt(kernels().l2_h(x, y, dim));
+    }
+
+    bool optimize_compare(const float* x, const float* y, const float target,
+                          const size_t dim, float& dist)
+    {return kernels().bounded_f(x, y, target, dim, dist); }
+    bool optimize_compare(const double* x, const double* y, const double target,
+                          const size_t dim, double& dist)
+    {return kernels().bounded_d(x, y, target, dim, dist); }
+    bool optimize_compare(const float16* x, const float* y, const float target,
+                          const size_t dim, float& dist)
+    {return kernels().bounded_h(x, y, target, dim, dist); }
+}
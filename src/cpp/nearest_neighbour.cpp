@@ -7,6 +7,37 @@
 // 3. Best-Bin-Fisrt search method provide an approximate nearest
 //    neighbour search. The max-epoch parameter can control the precision
 //    as well as the time performance.
+// 4. Tree nodes are kept in one contiguous array in depth-first order
+//    and linked by offsets, no per-node allocation while building or
+//    pointer chasing while searching.
+// 5. Features are stored in one aligned row-major matrix whose rows are
+//    permuted into leaf order, a leaf scan is a linear memory stream.
+// 6. Templated on the feature element type, double, float and half
+//    precision (float accumulation) trees are instantiated.
+// 7. Batched search of many queries on a thread pool, results written
+//    into caller's arrays with no allocation per query.
+// 8. Parallel build, the two subtrees of a large node are expanded as
+//    tasks of a thread pool and the variance of the top nodes is
+//    computed over dimensions in parallel.
+// 9. Optional sampled split selection, the variance is estimated on a
+//    bounded random sample and the dimension drawn among the top few.
+// 10. Save to a versioned binary file and load it back by mmap, the
+//    feature matrix is used in place from the page cache, so processes
+//    loading the same file share one copy and start without parsing.
+// 11. Features can be inserted into and removed from a built tree in
+//    O(log n). A full leaf is split, a removed feature is only marked
+//    and skipped by searches, and the tree is rebuilt once too many
+//    rows are wasted or an insertion goes too deep.
+// 12. Radius search, the squared radius is the initial current best so
+//    branches and distance computations are cut from the first leaf.
+// 13. Search contexts kept by the caller per thread, a query then runs
+//    without any allocation and writes into the caller's buffers.
+// 14. Results as sorted (index, distance) pairs without Feature copies,
+//    the distance reported as euclidean, squared euclidean or cosine
+//    similarity converted from the distance already computed.
+// 15. Filtered search: a predicate on feature indices is evaluated in
+//    the leaf scan before any distance, and Best Bin First only counts
+//    the leaves holding accepted features as epochs.
 //
 // @author: Bingqing Qu
 // @version 0.1.0
@@ -16,13 +47,169 @@
 // @license: See LICENSE at root directory
 #include "sireen/nearest_neighbour.hpp"
 
+#include <fstream>
+
+// memory mapped files
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace nnse
 {
-    KDTree::KDTree(const size_t d, const size_t leaf_size):
-        dimension_(d),leaf_size_(leaf_size){}
-    KDTree::~KDTree()
+    namespace
+    {
+        // file layout: magic, version, element size, then the
+        // parameters, nodes, indices, and the feature matrix at an
+        // aligned offset
+        const char KDTREE_MAGIC[4] = {'S', 'K', 'D', 'T'};
+        const uint32_t KDTREE_VERSION = 1;
+        // alignment of the feature matrix in the file, the same as
+        // aligned_malloc, the mapping itself starts on a page
+        const size_t KDTREE_DATA_ALIGN = 64;
+
+        template <class V>
+        inline void write_array(ofstream& out, const V* values, const size_t n)
+        {
+            out.write(reinterpret_cast<const char*>(values), sizeof(V) * n);
+        }
+        template <class V>
+        inline void read_array(ifstream& in, V* values, const size_t n)
+        {
+            in.read(reinterpret_cast<char*>(values), sizeof(V) * n);
+        }
+
+        // squared radius of a search, a radius too large to square
+        // leaves the search unbounded
+        template <class V>
+        inline V squared_radius(const V radius)
+        {
+            if(!(radius < sqrt(numeric_limits<V>::max())))
+                return numeric_limits<V>::max();
+            return radius > 0 ? radius * radius : 0;
+        }
+
+        // a squared euclidean distance in the measure asked for
+        template <class V>
+        inline V measure_distance(const V squared, const DistanceMeasure measure)
+        {
+            switch(measure)
+            {
+            case SQUARED_EUCLIDEAN:
+                return squared;
+            case COSINE:
+                // |u-v|^2 = 2 - 2uv for unit vectors
+                return 1 - squared / 2;
+            default:
+                return sqrt(squared);
+            }
+        }
+
+        // distance padding rows with fewer results than asked for, the
+        // last in the order of results
+        template <class V>
+        inline V missing_distance(const DistanceMeasure measure)
+        {
+            return measure == COSINE ? -numeric_limits<V>::max()
+                                     : numeric_limits<V>::max();
+        }
+
+        /**
+         * check the nodes and indices read from a file before they
+         * address anything. Children follow their parent in the node
+         * array, as build and split_leaf lay them out, so a valid
+         * array has no cycle.
+         *
+         * @param nodes     node array
+         * @param index     feature index of each row
+         * @param dimension feature dimension
+         * @param no_index  index of a removed row
+         *
+         * @return false if a node or index is out of range
+         */
+        template <class V>
+        bool valid_tree(const vector<KDTreeNode<V> >& nodes,
+                        const vector<uint64_t>& index, const size_t dimension,
+                        const uint64_t no_index)
+        {
+            const size_t n_nodes = nodes.size();
+            for(size_t i = 0; i < n_nodes; ++i)
+            {
+                const KDTreeNode<V>& node = nodes[i];
+                if(node.is_leaf())
+                {
+                    if(size_t(node.begin) + node.n > index.size())
+                        return false;
+                }
+                else if(size_t(node.pivot_dim) >= dimension
+                        || node.left <= i || node.left >= n_nodes
+                        || node.right <= i || node.right >= n_nodes)
+                    return false;
+            }
+            vector<uint64_t> live;
+            live.reserve(index.size());
+            for(size_t i = 0; i < index.size(); ++i)
+                if(index[i] != no_index)
+                    live.push_back(index[i]);
+            std::sort(live.begin(), live.end());
+            return std::adjacent_find(live.begin(), live.end()) == live.end();
+        }
+    }
+
+    template <class T>
+    BasicKDTree<T>::BasicKDTree(const size_t d, const size_t leaf_size):
+        data_(NULL),owns_data_(false),mapping_(NULL),mapping_size_(0),
+        capacity_(0),n_live_(0),free_rows_(0),
+        rebuild_waste_(1.0),rebuild_depth_(2.0),
+        dimension_(d),leaf_size_(leaf_size),
+        split_sample_(0),split_candidates_(1),split_seed_(0){}
+    template <class T>
+    BasicKDTree<T>::~BasicKDTree()
     {
-        // this->release(this->root_);
+        this->release_data();
+    }
+
+    /**
+     * Set how the partition dimension of a node is chosen by the next
+     * build. By default the variance of all features of the node is
+     * computed and the greatest one is taken. A bounded sample cuts
+     * the cost of a node from O(n x dimension) to O(n + sample x
+     * dimension), random candidates make randomized trees.
+     *
+     * @param sample_size  number of features sampled to estimate the
+     *                     variance, 0 for all features
+     * @param n_candidates the dimension is drawn among so many of
+     *                     greatest variance, 1 for the greatest
+     * @param seed         seed of the random sampling and drawing
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::set_split_sampling(const size_t sample_size,
+                                       const size_t n_candidates,
+                                       const unsigned seed)
+    {
+        this->split_sample_ = sample_size;
+        this->split_candidates_ = n_candidates;
+        this->split_seed_ = seed;
+    }
+
+    /**
+     * Release the feature matrix if it is owned by the tree, or
+     * unmap it if it is mapped from a file
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::release_data()
+    {
+        if(this->owns_data_)
+            aligned_free(this->data_);
+        if(this->mapping_)
+            munmap(this->mapping_, this->mapping_size_);
+        this->data_ = NULL;
+        this->owns_data_ = false;
+        this->mapping_ = NULL;
+        this->mapping_size_ = 0;
+        this->capacity_ = 0;
     }
 
     /**
@@ -33,10 +220,14 @@ namespace nnse
      *
      * @param features an array of features
      * @param n        number of features
+     * @param pool     thread pool for the build, NULL for the global
+     *                 pool
      *
      */
+    template <class T>
     void
-    KDTree::build(Feature* features, const size_t n)
+    BasicKDTree<T>::build(Feature* features, const size_t n,
+                          putil::ThreadPool* pool)
     {
 
         // check inputs
@@ -46,77 +237,240 @@ namespace nnse
                  <<__FILE__<<","<<__LINE__ <<endl;
             return;
         }
-        // init
-        NodePtr building = this->init_node(features, n);
-        // sanity check for initialized root
-        assert(building);
-        // expand
-        this->expand_subtree(building);
-
-        this->root_ = building;
+        // gather the scattered features into one matrix owned by tree
+        this->release_data();
+        this->data_ = aligned_malloc<T>(n * this->dimension_);
+        this->owns_data_ = true;
+        for(size_t i = 0; i < n; ++i)
+            memcpy(this->data_ + i * this->dimension_, features[i].data,
+                   sizeof(T) * this->dimension_);
+
+        this->build_nodes(n, pool);
+
+        // translate rows to the feature indices
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = features[this->index_[i]].index;
     }
 
     /**
-     * Initialization of a kd-tree node, this will set initial position
-     * of feature pointer, the number of feature should be taken and
-     * a default value for patition dimension
+     * build the kd-tree structure from a row-major feature matrix.
+     * The i-th row gets feature index i.
      *
-     * @param features an array of features
-     * @param n        number of features
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param copy  if true, the tree builds on its own copy of the
+     *              matrix. Otherwise the rows of data are re-ordered
+     *              in place and data must outlive the tree.
+     * @param pool  thread pool for the build, NULL for the global pool
      *
-     * @return initialized kd-tree node, furthor expand should be
-     *         followed
      */
-    KDTree::NodePtr
-    KDTree::init_node(Feature* features, const size_t n)
+    template <class T>
+    void
+    BasicKDTree<T>::build(T* data, const size_t n, const bool copy,
+                          putil::ThreadPool* pool)
     {
-        // dynamic allocate root node
-        NodePtr node = std::make_shared<KDTreeNode>();
-        if(!node)
+        // check inputs
+        if(!data || n <= 0)
         {
-            cerr << " KDTree::init_node : memory allocation to KDTreeNode fail!"
+            cerr << " KDTree::build : Error input, no features or n <= 0"
                  <<__FILE__<<","<<__LINE__ <<endl;
-            return NULL;
+            return;
+        }
+        this->release_data();
+        if(copy)
+        {
+            this->data_ = aligned_malloc<T>(n * this->dimension_);
+            this->owns_data_ = true;
+            memcpy(this->data_, data, sizeof(T) * n * this->dimension_);
+        }
+        else
+        {
+            this->data_ = data;
         }
-        // initialize index, features and n params for root
-        node->pivot_dim = -1;
-        // non-negative feature assumption
-        node->pivot_val = -1.0;
-        node->features = features;
-        node->leaf = false;
-        node->n = n;
-        // initialize to NULL
-        node->left = NULL;
-        node->right = NULL;
 
-        return node;
+        this->build_nodes(n, pool);
+    }
 
+    /**
+     * build the nodes over a matrix shared with other trees, the
+     * matrix is neither copied nor re-ordered. Leaves address their
+     * rows through index_, so only a KDForest searches such a tree.
+     *
+     * @param data  row-major n x dimension matrix
+     * @param n     number of features
+     * @param pool  thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::build_shared(T* data, const size_t n,
+                                 putil::ThreadPool* pool)
+    {
+        this->release_data();
+        this->data_ = data;
+        this->build_nodes(n, pool, false);
+    }
+
+    /**
+     * Build the nodes over the current feature matrix. The matrix is
+     * addressed through index_ while partitioning, then its rows are
+     * permuted into leaf order in one pass, so index_[i] finally
+     * tells the original row of the i-th row.
+     *
+     * @param n            number of features
+     * @param pool         thread pool for the build, NULL for the
+     *                     global pool
+     * @param permute_rows if false, the rows are not moved and the
+     *                     i-th row of a leaf is data_[index_[i]]
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::build_nodes(const size_t n, putil::ThreadPool* pool,
+                                const bool permute_rows)
+    {
+        // identity order before partitioning
+        this->index_.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = i;
+        // a built tree has no wasted rows, the update state is set up
+        // again by the next update
+        this->n_live_ = n;
+        this->capacity_ = this->owns_data_ ? n : 0;
+        this->leaf_capacity_.clear();
+        this->row_of_.clear();
+
+        // flush the previous tree and reserve for the full binary
+        // tree over leaves of at least half leaf size
+        this->nodes_.clear();
+        this->nodes_.reserve(4 * n / (this->leaf_size_ + 1) + 1);
+        // init root, which is always at offset 0
+        const uint32_t root = init_node(this->nodes_, 0, n);
+        // sanity check for initialized root
+        assert(root == 0);
+        // expand
+        this->expand_subtree(this->nodes_, root,
+                             pool ? *pool : putil::ThreadPool::global());
+        if(!permute_rows)
+            return;
+
+        // move rows into leaf order
+        nnse::permute_rows(this->data_, this->index_, this->dimension_);
+    }
+
+    /**
+     * Initialization of a kd-tree node, this will append a node to
+     * the node array with the initial offset of features, the number
+     * of feature should be taken and a default value for patition
+     * dimension
+     *
+     * @param nodes node array to append to
+     * @param begin offset of the first feature
+     * @param n     number of features
+     *
+     * @return offset of the initialized kd-tree node, furthor expand
+     *         should be followed
+     */
+    template <class T>
+    uint32_t
+    BasicKDTree<T>::init_node(vector<Node>& nodes, const size_t begin,
+                              const size_t n)
+    {
+        Node node;
+        // no padding byte left uninitialized, save writes nodes as is
+        memset(&node, 0, sizeof(Node));
+        // initialize index, features and n params for root
+        node.pivot_dim = -1;
+        // non-negative feature assumption
+        node.pivot_val = -1.0;
+        node.begin = begin;
+        node.n = n;
+        // 0 is the root offset, which can not be any child
+        node.left = 0;
+        node.right = 0;
+
+        nodes.push_back(node);
+        return nodes.size() - 1;
     }
 
     /**
      * Expand the subtree. This should be called after a kd-tree
      * node is initialized. If the current node is not a leaf, a
      * partition is applied on features. Then, it expand the two
-     * children recursively.
+     * children recursively. For a large node, the right subtree is
+     * expanded by a task into its own node array meanwhile, which
+     * is appended after the left subtree once both are done. So the
+     * nodes are in the same depth-first order as a serial build.
      *
-     * @param node current kd-tree node
+     * @param nodes node array of the subtree
+     * @param node  offset of current kd-tree node in nodes
+     * @param pool  thread pool for the tasks
      */
+    template <class T>
     void
-    KDTree::expand_subtree(NodePtr node)
+    BasicKDTree<T>::expand_subtree(vector<Node>& nodes, const uint32_t node,
+                                   putil::ThreadPool& pool)
     {
-        // check leaf condition for stoping
-        if( node->n <= this->leaf_size_)
+        // check leaf condition for stoping, a node is leaf until it
+        // gets a partition dimension
+        const size_t n = nodes[node].n;
+        if( n <= this->leaf_size_)
+            return;
+        // the following parts should be very clear
+        const size_t k = this->partition(nodes[node], pool);
+
+        // if all features fall on same side, keep node as a leaf
+        // generally, under this condition, k = 1 and n = 2?
+        // TODO: prove the above assumption
+        if(k + 1 == n)
         {
-            node->leaf = true;
+            nodes[node].pivot_dim = -1;
+            return;
+        }
+
+        // children are appended in depth-first order, i.e. the whole
+        // left subtree is laid out right after the current node. The
+        // node array may grow, so only offsets are kept here.
+        const size_t begin = nodes[node].begin;
+        if(n < PARALLEL_SUBTREE_MIN)
+        {
+            const uint32_t left = init_node(nodes, begin, k + 1);
+            nodes[node].left = left;
+            this->expand_subtree(nodes, left, pool);
+
+            const uint32_t right = init_node(nodes, begin + k + 1, n - k - 1);
+            nodes[node].right = right;
+            this->expand_subtree(nodes, right, pool);
             return;
         }
-        // the following parts should be very clear
-        this->partition(node);
 
-        if(node->left)
-            this->expand_subtree(node->left);
-        if(node->right)
-            this->expand_subtree(node->right);
+        // the two subtrees own disjoint ranges of index_ and the
+        // matrix is only read, so they can be expanded at once
+        vector<Node> right_nodes;
+        right_nodes.reserve(4 * (n - k - 1) / (this->leaf_size_ + 1) + 1);
+        init_node(right_nodes, begin + k + 1, n - k - 1);
+        putil::TaskGroup group(pool);
+        group.run([this, &right_nodes, &pool]()
+        {
+            this->expand_subtree(right_nodes, 0, pool);
+        });
+        const uint32_t left = init_node(nodes, begin, k + 1);
+        nodes[node].left = left;
+        this->expand_subtree(nodes, left, pool);
+        group.wait();
+
+        // append the right subtree, relocating its child offsets. The
+        // offset 0 of a leaf stays as it never refers to a child.
+        const uint32_t right = nodes.size();
+        nodes[node].right = right;
+        for(size_t i = 0; i < right_nodes.size(); ++i)
+        {
+            Node& cur_node = right_nodes[i];
+            if(!cur_node.is_leaf())
+            {
+                cur_node.left += right;
+                cur_node.right += right;
+            }
+            nodes.push_back(cur_node);
+        }
     }
 
     /**
@@ -124,12 +478,12 @@ namespace nnse
      *
      * 1.Determine pivot feature to split to patition the currrent
      * node's features. First, find the dimension with grestest
-     * variance. Second, find the feature with the median of value on
-     * that dimension.
+     * variance, estimated on a sample of features and drawn among the
+     * top candidates if set by set_split_sampling. Second, find the
+     * feature with the median of value on that dimension.
      *
-     * 2.Partition the features by the pivot. This is done by firstly,
-     * get the order vector and secondly, re-order the features by that
-     * order vector.
+     * 2.Partition the features by the pivot. This is done in place by
+     * std::nth_element on the row ids of the node.
      *
      * The result of the partition is the Feature array is re-ordered
      * and a new node contains left child of  features[0:k] and the
@@ -137,226 +491,534 @@ namespace nnse
      * where n is the length of right child. The current root node is
      * features[k]
      *
-     * @param node the current node
+     * @param node current node
+     * @param pool thread pool for the variance of large nodes
      *
+     * @return offset of the median feature inside the node
      */
-    void
-    KDTree::partition(NodePtr node)
+    template <class T>
+    size_t
+    BasicKDTree<T>::partition(Node& node, putil::ThreadPool& pool)
     {
         // ***1 DETERMINE THE PIVOT DIMENSION AND FEATURE***
 
         // variable initialization
-        Feature* features = node->features;
+        size_t* ids = &this->index_[0] + node.begin;
+        const T* data = this->data_;
+        const size_t dim = this->dimension_;
         // sanity check for features
-        assert(features);
+        assert(data);
         size_t pivot_dim = 0;
-        double pivot_val, mean, var, x_diff = 0;
+        double pivot_val;
         double var_max = -1.0;
-        size_t n = node->n;
+        size_t n = node.n;
+
+        // rows the variance is estimated on, all rows of the node or a
+        // random sample of them. The generator is seeded by the node,
+        // so the tree does not depend on the order nodes are built in.
+        const size_t* rows = ids;
+        size_t n_rows = n;
+        minstd_rand rng(this->split_seed_ * 2654435761u + node.begin + 1);
+        vector<size_t> sample;
+        if(this->split_sample_ > 0 && this->split_sample_ < n)
+        {
+            sample.resize(this->split_sample_);
+            uniform_int_distribution<size_t> pick(0, n - 1);
+            for(size_t j = 0; j < sample.size(); ++j)
+                sample[j] = ids[pick(rng)];
+            rows = &sample[0];
+            n_rows = sample.size();
+        }
 
-        // search for the feature dimension with greatest variance
-        for(size_t i = 0; i < this->dimension_; ++i)
+        // variance of the dimensions [dim_begin, dim_end)
+        vector<double> vars(dim);
+        auto variance = [&](size_t dim_begin, size_t dim_end, size_t)
         {
-            // flush mean and varaiance value
-            mean = var = 0;
+            double mean, var, x_diff;
+            for(size_t i = dim_begin; i < dim_end; ++i)
+            {
+                // flush mean and varaiance value
+                mean = var = 0;
 
-            // integral and divide to get mean
-            for(size_t j = 0; j < n; ++j)
-                mean += features[j].data[i];
-            mean /= n;
+                // integral and divide to get mean
+                for(size_t j = 0; j < n_rows; ++j)
+                    mean += data[rows[j] * dim + i];
+                mean /= n_rows;
 
-            // integral and divide to get variance
-            for(size_t j = 0; j < n; ++j)
-            {
-                x_diff = features[j].data[i] - mean;
-                var += x_diff * x_diff;
+                // integral and divide to get variance
+                for(size_t j = 0; j < n_rows; ++j)
+                {
+                    x_diff = data[rows[j] * dim + i] - mean;
+                    var += x_diff * x_diff;
+                }
+                // use trick here for comparison
+                // var /= n;
+                vars[i] = var;
             }
-            // use trick here for comparison
-            // var /= n;
-
-            // update current best dimension
-            if( var > var_max)
+        };
+        // the top nodes are few but cover all features, their
+        // dimensions are split over the pool
+        if(n_rows * dim >= PARALLEL_VARIANCE_MIN)
+            pool.parallel_for(dim, 8, variance);
+        else
+            variance(0, dim, 0);
+
+        if(this->split_candidates_ <= 1)
+        {
+            // search for the feature dimension with greatest variance
+            for(size_t i = 0; i < dim; ++i)
             {
-                pivot_dim = i;
-                var_max = var;
+                // update current best dimension
+                if( vars[i] > var_max)
+                {
+                    pivot_dim = i;
+                    var_max = vars[i];
+                }
             }
-
         }
-
-        // search for the median value for partition
-        // use the user-defined structure KeyValue and std:nth_element
-        // with overloaded operator "<" to fast find median
-        vector<KeyValue<size_t>> order;
-        for( size_t i=0; i < n; ++i)
-            order.push_back(KeyValue<size_t>(i,features[i].data[pivot_dim]));
+        else
+        {
+            // pick randomly among the dimensions of greatest variance
+            // as FLANN does, the estimate of a sample hardly tells the
+            // best one apart from the next few anyway
+            const size_t n_top = min(this->split_candidates_, dim);
+            vector<KeyValue<size_t> > top;
+            top.reserve(dim);
+            for(size_t i = 0; i < dim; ++i)
+                top.push_back(KeyValue<size_t>(i, vars[i]));
+            std::partial_sort(top.begin(), top.begin() + n_top, top.end(),
+                              greater<KeyValue<size_t> >());
+            uniform_int_distribution<size_t> pick(0, n_top - 1);
+            pivot_dim = top[pick(rng)].key;
+        }
 
         // get the median index number
         const size_t k = get_median_index(n);
 
+        // ***2 PARTIOTION THE NODE BY PIVOT***
+
         // the nth_element can do what we want for partition. For given
         // begin and end iterators, and a k iterator, there is no
         // element greater than *k at left and likewise on the right.
-        std::nth_element(order.begin(), order.begin()+k, order.end());
+        // It runs on the row ids of the node directly, so the node is
+        // partitioned in place.
+        const T* column = data + pivot_dim;
+        std::nth_element(ids, ids + k, ids + n,
+            [column, dim](size_t a, size_t b)
+        {
+            return column[a * dim] < column[b * dim];
+        });
 
         // assign pivot dimension and value for current ndoe
-        pivot_val = order[k].value;
-        node->pivot_dim = pivot_dim;
-        node->pivot_val = pivot_val;
-
-        // ***2 PARTIOTION THE NODE BY PIVOT***
-
-        // apply a re-order iterable algorithm(in-place) here.
-        // the algorithm use a "permute-from" mind to do a permute-cycle
-        // at each loop.
-        Feature tmp;
-        size_t from, to;
-        for(size_t cur=0; cur < n; ++cur)
-        {
-            // check if the current element needs to be permuted
-            from = order[cur].key;
-            assert(from < n);
-            // the element is already in the correct place
-            if(from == cur)
-                continue;
-            // initialize to position
-            to = cur;
-            tmp = features[to];
-            do
-            {
-                // assign the value on order
-                features[to] = features[from];
-                // assign the order to show it is done
-                order[to].key = to;
-
-                to = from;
-                from = order[from].key;
-                assert(from!=to);
-            }
-            while(from != cur);
-            // finally, close the permutation cycle
-            features[to] = tmp;
-            order[to].key = to;
-        }
+        pivot_val = column[ids[k] * dim];
+        node.pivot_dim = pivot_dim;
+        node.pivot_val = pivot_val;
 
-        // if all features fall on same side, make node as a leaf
-        // generally, under this condition, k = 1 and n = 2?
-        // TODO: prove the above assumption
-        if(k + 1 == n)
-        {
-            node->leaf = true;
-            return;
-        }
-
-        //
-        node->left = this->init_node(features, k + 1);
-        node->right = this->init_node(features + (k + 1), (n - k - 1) );
+        return k;
     }
     /**
      * Traverse a kd-tree to a leaf node. Path decision are made
      * by comparision of values between the input feature and node
      * on the node's partition dimension. The backtrack path is
-     * recorded by a std::stack
+     * recorded by a std::stack with the distance from the feature
+     * to the splitting plane of each skipped child.
      *
      * @param feature a input feature
-     * @param node a start node
+     * @param node offset of a start node
      *
-     * @return a leaf node with node.leaf=true
+     * @return offset of a leaf node
      */
-    KDTree::NodePtr
-    KDTree::traverse_to_leaf(double* feature,NodePtr node, NodeStack& container)
+    template <class T>
+    uint32_t
+    BasicKDTree<T>::traverse_to_leaf(const dist_type* feature, uint32_t node, NodeStack& container)
     {
-        if(!node)
-        {
-            cerr << " KDTree::traverse_to_leaf : bad node!"
-                 <<__FILE__<<","<<__LINE__ <<endl;
-            return NULL;
+        const Node* nodes = &this->nodes_[0];
+        dist_type diff;
 
-        }
-        NodePtr other;
-        NodePtr cur_node = node;
-        double value;
-        size_t dim;
-
-        while(cur_node && !cur_node->leaf)
+        while(!nodes[node].is_leaf())
         {
-            // partition dimension and value
-            dim = cur_node->pivot_dim;
-            value = cur_node->pivot_val;
-
+            const Node& cur_node = nodes[node];
             // sanity check for dimension
-            assert(dim < this->dimension_);
+            assert((size_t)cur_node.pivot_dim < this->dimension_);
 
             // go to a child and preserve the other
-            if(feature[dim] <= value)
+            diff = feature[cur_node.pivot_dim] - cur_node.pivot_val;
+            if(diff <= 0)
             {
-                other = cur_node->right;
-                cur_node = cur_node->left;
+                container.push(NodeBind(cur_node.right, -diff));
+                node = cur_node.left;
             }
             else
             {
-                other = cur_node->left;
-                cur_node = cur_node->right;
+                container.push(NodeBind(cur_node.left, diff));
+                node = cur_node.right;
             }
-            if(other)
-                container.push(other);
         }
 
-        return cur_node;
+        return node;
     }
     /**
      * Traverse a kd-tree to a leaf node. Path decision are made
      * by comparision of values between the input feature and node
      * on the node's partition dimension. The backtrack path is
-     * recorded by a std::priority_queue
+     * recorded by a std::priority_queue ordered by the distance
+     * from the feature to the splitting plane of each skipped child.
      *
      * @param feature a input feature
-     * @param node a start node
+     * @param node offset of a start node
      *
-     * @return a leaf node with node.leaf=true
+     * @return offset of a leaf node
      */
-    KDTree::NodePtr
-    KDTree::traverse_to_leaf(double* feature,NodePtr node, NodeMinPQ& container)
+    template <class T>
+    uint32_t
+    BasicKDTree<T>::traverse_to_leaf(const dist_type* feature, uint32_t node, NodeMinPQ& container)
     {
-        if(!node)
-        {
-            cerr << " KDTree::traverse_to_leaf : bad node!"
-                 <<__FILE__<<","<<__LINE__ <<endl;
-            return NULL;
+        const Node* nodes = &this->nodes_[0];
+        dist_type diff;
 
-        }
-        NodePtr other;
-        NodePtr cur_node = node;
-        double value;
-        size_t dim;
-
-        while(cur_node && !cur_node->leaf)
+        while(!nodes[node].is_leaf())
         {
-            // partition dimension and value
-            dim = cur_node->pivot_dim;
-            value = cur_node->pivot_val;
-
+            const Node& cur_node = nodes[node];
             // sanity check for dimension
-            assert(dim < this->dimension_);
+            assert((size_t)cur_node.pivot_dim < this->dimension_);
 
             // go to a child and preserve the other
-            if(feature[dim] <= value)
+            diff = feature[cur_node.pivot_dim] - cur_node.pivot_val;
+            if(diff <= 0)
             {
-                other = cur_node->right;
-                cur_node = cur_node->left;
+                container.push(NodeBind(cur_node.right, -diff));
+                node = cur_node.left;
             }
             else
             {
-                other = cur_node->left;
-                cur_node = cur_node->right;
+                container.push(NodeBind(cur_node.left, diff));
+                node = cur_node.right;
+            }
+        }
+
+        return node;
+    }
+    /**
+     * Prepare the tree for insert and remove on the first update:
+     * the feature matrix is copied if it is not owned, each leaf
+     * reserves its own rows and feature indices are mapped to rows.
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::init_updates()
+    {
+        if(!this->leaf_capacity_.empty())
+            return;
+        const size_t n_rows = this->index_.size();
+        if(!this->owns_data_)
+        {
+            // a borrowed or mapped matrix is never written
+            T* data = aligned_malloc<T>(n_rows * this->dimension_);
+            memcpy(data, this->data_, sizeof(T) * n_rows * this->dimension_);
+            this->release_data();
+            this->data_ = data;
+            this->owns_data_ = true;
+            this->capacity_ = n_rows;
+        }
+        // a leaf of a built tree has no free row
+        this->free_rows_ = 0;
+        this->leaf_capacity_.resize(this->nodes_.size());
+        for(size_t i = 0; i < this->nodes_.size(); ++i)
+            this->leaf_capacity_[i] = this->nodes_[i].n;
+        this->row_of_.reserve(this->n_live_);
+        for(size_t i = 0; i < n_rows; ++i)
+            if(this->index_[i] != NO_INDEX)
+                this->row_of_[this->index_[i]] = i;
+    }
+
+    /**
+     * Append free rows to the feature matrix, the matrix grows
+     * geometrically when it is full.
+     *
+     * @param n number of rows
+     *
+     * @return the first appended row
+     */
+    template <class T>
+    size_t
+    BasicKDTree<T>::append_rows(const size_t n)
+    {
+        const size_t first = this->index_.size();
+        if(first + n > this->capacity_)
+        {
+            const size_t capacity = max(first + n, this->capacity_ * 3 / 2);
+            T* data = aligned_malloc<T>(capacity * this->dimension_);
+            memcpy(data, this->data_, sizeof(T) * first * this->dimension_);
+            aligned_free(this->data_);
+            this->data_ = data;
+            this->capacity_ = capacity;
+        }
+        this->index_.resize(first + n, NO_INDEX);
+        return first;
+    }
+
+    /**
+     * Move a leaf to the end of the feature matrix with room for
+     * more rows. Its former rows, free ones included, are wasted
+     * until the next rebuild.
+     *
+     * @param node     offset of the leaf
+     * @param capacity number of rows reserved by the leaf
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::relocate_leaf(const uint32_t node, const size_t capacity)
+    {
+        const size_t dim = this->dimension_;
+        const size_t begin = this->nodes_[node].begin;
+        const size_t n = this->nodes_[node].n;
+        const size_t reserved = this->leaf_capacity_[node];
+        // the last leaf of the matrix grows in place
+        if(begin + reserved == this->index_.size())
+        {
+            this->append_rows(capacity - reserved);
+            this->leaf_capacity_[node] = capacity;
+            this->free_rows_ += capacity - reserved;
+            return;
+        }
+        const size_t first = this->append_rows(capacity);
+        memcpy(this->data_ + first * dim, this->data_ + begin * dim,
+               sizeof(T) * n * dim);
+        for(size_t i = 0; i < n; ++i)
+        {
+            const size_t index = this->index_[begin + i];
+            this->index_[first + i] = index;
+            this->index_[begin + i] = NO_INDEX;
+            if(index != NO_INDEX)
+                this->row_of_[index] = first + i;
+        }
+        this->nodes_[node].begin = first;
+        this->leaf_capacity_[node] = capacity;
+        this->free_rows_ += capacity - reserved;
+    }
+
+    /**
+     * Split a leaf as build does, its rows are re-ordered in place
+     * into the new leaves.
+     *
+     * @param node offset of the leaf
+     * @param pool thread pool for the partition
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::split_leaf(const uint32_t node, putil::ThreadPool& pool)
+    {
+        const size_t dim = this->dimension_;
+        const size_t begin = this->nodes_[node].begin;
+        const size_t n = this->nodes_[node].n;
+        const size_t reserved = this->leaf_capacity_[node];
+
+        // the leaf is expanded over row ids as build does, the new
+        // nodes are appended to the node array
+        vector<size_t> indices(this->index_.begin() + begin,
+                               this->index_.begin() + begin + n);
+        for(size_t i = 0; i < n; ++i)
+            this->index_[begin + i] = begin + i;
+        const size_t first_node = this->nodes_.size();
+        this->expand_subtree(this->nodes_, node, pool);
+
+        // move the rows into the order of the new leaves
+        vector<T> rows(n * dim);
+        memcpy(&rows[0], this->data_ + begin * dim, sizeof(T) * n * dim);
+        for(size_t i = 0; i < n; ++i)
+        {
+            const size_t from = this->index_[begin + i] - begin;
+            memcpy(this->data_ + (begin + i) * dim, &rows[from * dim],
+                   sizeof(T) * dim);
+            this->index_[begin + i] = indices[from];
+            if(indices[from] != NO_INDEX)
+                this->row_of_[indices[from]] = begin + i;
+        }
+        // the free rows of the leaf go to the new leaf ending at its
+        // last row, the other new leaves have no free row
+        this->leaf_capacity_.resize(this->nodes_.size());
+        bool slack = false;
+        for(size_t i = first_node; i < this->nodes_.size(); ++i)
+        {
+            const Node& leaf = this->nodes_[i];
+            this->leaf_capacity_[i] = leaf.n;
+            if(!slack && leaf.is_leaf() && leaf.begin + leaf.n == begin + n)
+            {
+                this->leaf_capacity_[i] += reserved - n;
+                slack = true;
             }
-            if(other)
-                container.push(NodeBind(other,
-                  abs(other->pivot_val - feature[other->pivot_dim])
-                               ));
         }
+    }
+
+    /**
+     * Rebuild the tree if the wasted rows or the depth of the last
+     * insertion crossed the rebuild thresholds.
+     *
+     * @param depth depth of the last insertion, 0 for none
+     * @param pool  thread pool for the rebuild
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::check_rebuild(const size_t depth, putil::ThreadPool* pool)
+    {
+        if(this->n_live_ == 0)
+            return;
+        const double wasted = this->index_.size() - this->n_live_
+            - this->free_rows_;
+        // depth of a balanced tree over the features
+        const double balanced = ceil(log2(double(this->n_live_)
+                                          / (this->leaf_size_ + 1) + 1)) + 1;
+        if(wasted > this->rebuild_waste_ * this->n_live_
+           || depth > this->rebuild_depth_ * balanced)
+            this->rebuild(pool);
+    }
+
+    /**
+     * Insert a feature into the built tree. The feature is copied
+     * to the leaf it falls in, which is split once it exceeds the
+     * leaf size. On the
+     * first update a matrix borrowed by build or mapped by load is
+     * copied, and the matrix may move as it grows, so features
+     * returned by earlier searches are invalidated.
+     *
+     * @param feature feature data in array form
+     * @param index   feature index, unique in the tree
+     * @param pool    thread pool for a split or rebuild, NULL for
+     *                the global pool
+     *
+     * @return true on success, false if the index is already in
+     *         the tree
+     */
+    template <class T>
+    bool
+    BasicKDTree<T>::insert(const T* feature, const size_t index,
+                           putil::ThreadPool* pool)
+    {
+        if(this->nodes_.empty() || !feature)
+        {
+            cerr << " KDTree::insert : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        this->init_updates();
+        if(this->row_of_.count(index))
+        {
+            cerr << " KDTree::insert : feature index " << index
+                 << " already in the tree" <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        const size_t dim = this->dimension_;
+
+        // go down to the leaf as a search does
+        uint32_t node = 0;
+        size_t depth = 1;
+        while(!this->nodes_[node].is_leaf())
+        {
+            Node& cur_node = this->nodes_[node];
+            ++cur_node.n;
+            node = dist_type(feature[cur_node.pivot_dim]) <= cur_node.pivot_val
+                ? cur_node.left : cur_node.right;
+            ++depth;
+        }
+
+        // make room in the leaf for one row over the leaf size, so it
+        // is split in place, and for half a leaf more, which the half
+        // split off at its end keeps to fill up without moving again.
+        // A leaf only holds more rows than the leaf size when
+        // expand_subtree keeps it (k + 1 == n), i.e. a single row
+        // under a leaf size of 0.
+        const size_t n = this->nodes_[node].n;
+        if(n == this->leaf_capacity_[node])
+            this->relocate_leaf(node, max(n, this->leaf_size_) + 1
+                                + (this->leaf_size_ + 2) / 2);
+        const size_t row = this->nodes_[node].begin + n;
+        memcpy(this->data_ + row * dim, feature, sizeof(T) * dim);
+        this->index_[row] = index;
+        this->row_of_[index] = row;
+        ++this->nodes_[node].n;
+        ++this->n_live_;
+        --this->free_rows_;
+        if(n + 1 > this->leaf_size_)
+            this->split_leaf(node, pool ? *pool : putil::ThreadPool::global());
+
+        this->check_rebuild(depth, pool);
+        return true;
+    }
+
+    /**
+     * Remove a feature from the tree. Its row is marked as removed
+     * and skipped by all searches until the next rebuild.
+     *
+     * @param index feature index
+     * @param pool  thread pool for a rebuild, NULL for the global pool
+     *
+     * @return true on success, false if the index is not in the tree
+     */
+    template <class T>
+    bool
+    BasicKDTree<T>::remove(const size_t index, putil::ThreadPool* pool)
+    {
+        if(this->nodes_.empty())
+        {
+            cerr << " KDTree::remove : tree not built!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        this->init_updates();
+        unordered_map<size_t, uint32_t>::iterator it = this->row_of_.find(index);
+        if(it == this->row_of_.end())
+        {
+            cerr << " KDTree::remove : feature index " << index
+                 << " not in the tree" <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        // the row stays in its leaf until the next rebuild
+        this->index_[it->second] = NO_INDEX;
+        this->row_of_.erase(it);
+        --this->n_live_;
 
-        return cur_node;
+        this->check_rebuild(0, pool);
+        return true;
     }
+
+    /**
+     * Rebuild the tree over its features, dropping removed ones
+     * and wasted rows. Called by insert and remove once a rebuild
+     * threshold is crossed, or by the caller at a quiet time.
+     *
+     * @param pool thread pool for the build, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::rebuild(putil::ThreadPool* pool)
+    {
+        const size_t n = this->n_live_;
+        if(this->nodes_.empty() || n == 0)
+            return;
+        const size_t dim = this->dimension_;
+        // gather the features, rows in leaf order stay close
+        T* data = aligned_malloc<T>(n * dim);
+        vector<size_t> indices;
+        indices.reserve(n);
+        for(size_t i = 0; i < this->index_.size(); ++i)
+        {
+            if(this->index_[i] == NO_INDEX)
+                continue;
+            memcpy(data + indices.size() * dim, this->data_ + i * dim,
+                   sizeof(T) * dim);
+            indices.push_back(this->index_[i]);
+        }
+        this->release_data();
+        this->data_ = data;
+        this->owns_data_ = true;
+
+        this->build_nodes(n, pool);
+
+        // translate rows to the feature indices
+        for(size_t i = 0; i < n; ++i)
+            this->index_[i] = indices[this->index_[i]];
+    }
+
     /**
      * Basic k-nearest-neighbour search method use for kd-tree.
      * First, traverse from root node to a leaf node and. Second,
@@ -367,50 +1029,65 @@ namespace nnse
      *
      * @return
      */
-    std::vector<Feature>
-    KDTree::knn_basic(double* feature, size_t k)
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Feature>
+    BasicKDTree<T>::knn_basic(const dist_type* feature, size_t k)
     {
 
         // best result buffer
         vector<Feature> nbrs;
         nbrs.reserve(k);
-        if(!this->root_ || !feature)
+        if(this->nodes_.empty() || !feature)
         {
             cerr << " KDTree::knn_basic_opt : tree not built or invalid input!"
                  <<__FILE__<<","<<__LINE__ <<endl;
             return nbrs;
         }
-        NodePtr node;
+        uint32_t node;
+        // current row in the feature matrix and end of current leaf
+        T* row;
+        size_t end;
         // checklist for backtrack use
         NodeStack check_list;
         // min-priority queue to keep top k lagrest(reversed order
         // of distances). The features with largest distances will be
         // passed to returnd vector.
         FeatureMaxPQ max_pq;
-        double cur_best = numeric_limits<double>::max();
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        // whether some rows of leaves are removed features
+        const bool holes = this->n_live_ < this->index_.size();
 
         // distance butter
-        double dist = 0;
+        dist_type dist = 0;
+        // lower bound of distance to the node on backtrack
+        dist_type bound = 0;
 
         // root for handle
-        check_list.push(this->root_);
+        check_list.push(NodeBind(0,0));
         while(!check_list.empty())
         {
             // pop the element
-            node = check_list.top();
+            node = check_list.top().key;
+            bound = check_list.top().value;
             check_list.pop();
 
-            // check if pitvot dimension comparison can possibly
+            // check if the splitting plane of the node can possibly
             // beat current best distance
-            if(!(abs(node->pivot_val - feature[node->pivot_dim]) < cur_best))
+            if(!(bound < cur_best))
                 continue;
 
             // find leaf and push unprocessed to stack
             node = this->traverse_to_leaf(feature,node,check_list);
-            for(size_t i = 0; i < node->n; ++i)
+            row = this->data_ + this->nodes_[node].begin * this->dimension_;
+            end = this->nodes_[node].begin + this->nodes_[node].n;
+            for(size_t i = this->nodes_[node].begin; i < end;
+                ++i, row += this->dimension_)
             {
+                // skip removed features
+                if(holes && this->index_[i] == NO_INDEX)
+                    continue;
 
-                dist = spat::euclidean(node->features[i].data,feature,
+                dist = spat::euclidean(row,feature,
                                        this->dimension_,false);
                 if(dist < cur_best)
                 {
@@ -420,7 +1097,7 @@ namespace nnse
                         // update current best
                         // pop the old greatest-smallest
                         max_pq.pop();
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     // the special point here is that we need to set best
@@ -428,12 +1105,12 @@ namespace nnse
                     // feature
                     else if(max_pq.size() == k-1)
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     else
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                     }
                 }
             }
@@ -459,20 +1136,24 @@ namespace nnse
      *
      * @return
      */
-    std::vector<Feature>
-    KDTree::knn_basic_opt(double* feature, size_t k)
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Feature>
+    BasicKDTree<T>::knn_basic_opt(const dist_type* feature, size_t k)
     {
 
         // best result buffer
         vector<Feature> nbrs;
         nbrs.reserve(k);
-        if(!this->root_ || !feature)
+        if(this->nodes_.empty() || !feature)
         {
             cerr << " KDTree::knn_basic_opt : tree not built or invalid input!"
                  <<__FILE__<<","<<__LINE__ <<endl;
             return nbrs;
         }
-        NodePtr node;
+        uint32_t node;
+        // current row in the feature matrix and end of current leaf
+        T* row;
+        size_t end;
         // checklist for backtrack use
         NodeStack check_list;
         // min-priority queue to keep top k lagrest(reversed order
@@ -480,30 +1161,41 @@ namespace nnse
         // passed to returnd vector.
         FeatureMaxPQ max_pq;
 
-        double cur_best = numeric_limits<double>::max();
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        // whether some rows of leaves are removed features
+        const bool holes = this->n_live_ < this->index_.size();
 
         // distance butter
-        double dist = 0;
+        dist_type dist = 0;
+        // lower bound of distance to the node on backtrack
+        dist_type bound = 0;
 
         // root for handle
-        check_list.push(this->root_);
+        check_list.push(NodeBind(0,0));
         while(!check_list.empty())
         {
             // pop the element
-            node = check_list.top();
+            node = check_list.top().key;
+            bound = check_list.top().value;
             check_list.pop();
 
-            // check if pitvot dimension comparison can possibly
+            // check if the splitting plane of the node can possibly
             // beat current best distance
-            if(!(abs(node->pivot_val - feature[node->pivot_dim]) < cur_best))
+            if(!(bound * bound < cur_best))
                 continue;
 
             // find leaf and push unprocessed to stack
             node = this->traverse_to_leaf(feature,node,check_list);
-            for(size_t i = 0; i < node->n; ++i)
+            row = this->data_ + this->nodes_[node].begin * this->dimension_;
+            end = this->nodes_[node].begin + this->nodes_[node].n;
+            for(size_t i = this->nodes_[node].begin; i < end;
+                ++i, row += this->dimension_)
             {
+                // skip removed features
+                if(holes && this->index_[i] == NO_INDEX)
+                    continue;
 
-                if(spat::optimize_compare(node->features[i].data,feature,
+                if(spat::optimize_compare(row,feature,
                                           cur_best,this->dimension_,dist))
                 {
                     // maintain the bounded min priority queue
@@ -512,7 +1204,7 @@ namespace nnse
 
                         // pop the old greatest-smallest
                         max_pq.pop();
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     // the special point here is that we need to set best
@@ -520,12 +1212,12 @@ namespace nnse
                     // feature
                     else if(max_pq.size() == k-1)
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     else
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                     }
                 }
             }
@@ -550,34 +1242,40 @@ namespace nnse
      *
      * @return
      */
-    std::vector<Feature>
-    KDTree::knn_bbf(double* feature, size_t k, size_t max_epoch)
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Feature>
+    BasicKDTree<T>::knn_bbf(const dist_type* feature, size_t k, size_t max_epoch)
     {
 
         // best result buffer
         vector<Feature> nbrs;
         nbrs.reserve(k);
-        if(!this->root_ || !feature)
+        if(this->nodes_.empty() || !feature)
         {
             cerr << " KDTree::knn_basic_opt : tree not built or invalid input!"
                  <<__FILE__<<","<<__LINE__ <<endl;
             return nbrs;
         }
         size_t epoch = 0;
-        NodePtr node;
+        uint32_t node;
+        // current row in the feature matrix and end of current leaf
+        T* row;
+        size_t end;
         // checklist for backtrack use
         NodeMinPQ check_list;
         // min-priority queue to keep top k lagrest(reversed order
         // of distances). The features with largest distances will be
         // passed to returnd vector.
         FeatureMaxPQ max_pq;
-        double cur_best = numeric_limits<double>::max();
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        // whether some rows of leaves are removed features
+        const bool holes = this->n_live_ < this->index_.size();
 
         // distance butter
-        double dist = 0;
+        dist_type dist = 0;
 
         // root for handle
-        check_list.push(NodeBind(this->root_,0));
+        check_list.push(NodeBind(0,0));
         while(!check_list.empty() && epoch < max_epoch)
         {
             // pop the element
@@ -586,10 +1284,16 @@ namespace nnse
 
             // find leaf and push unprocessed to stack
             node = this->traverse_to_leaf(feature,node,check_list);
-            for(size_t i = 0; i < node->n; ++i)
+            row = this->data_ + this->nodes_[node].begin * this->dimension_;
+            end = this->nodes_[node].begin + this->nodes_[node].n;
+            for(size_t i = this->nodes_[node].begin; i < end;
+                ++i, row += this->dimension_)
             {
+                // skip removed features
+                if(holes && this->index_[i] == NO_INDEX)
+                    continue;
 
-                dist = spat::euclidean(node->features[i].data,feature,
+                dist = spat::euclidean(row,feature,
                                        this->dimension_,false);
                 if(dist < cur_best)
                 {
@@ -599,7 +1303,7 @@ namespace nnse
                         // update current best
                         // pop the old greatest-smallest
                         max_pq.pop();
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     // the special point here is that we need to set best
@@ -607,12 +1311,12 @@ namespace nnse
                     // feature
                     else if(max_pq.size() == k-1)
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     else
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                     }
                 }
             }
@@ -639,21 +1343,25 @@ namespace nnse
      *
      * @return
      */
-    std::vector<Feature>
-    KDTree::knn_bbf_opt(double* feature, size_t k, size_t max_epoch)
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Feature>
+    BasicKDTree<T>::knn_bbf_opt(const dist_type* feature, size_t k, size_t max_epoch)
     {
 
         // best result buffer
         vector<Feature> nbrs;
         nbrs.reserve(k);
-        if(!this->root_ || !feature)
+        if(this->nodes_.empty() || !feature)
         {
             cerr << " KDTree::knn_basic_opt : tree not built or invalid input!"
                  <<__FILE__<<","<<__LINE__ <<endl;
             return nbrs;
         }
         size_t epoch = 0;
-        NodePtr node;
+        uint32_t node;
+        // current row in the feature matrix and end of current leaf
+        T* row;
+        size_t end;
         // checklist for backtrack use
         NodeMinPQ check_list;
         // min-priority queue to keep top k lagrest(reversed order
@@ -661,13 +1369,15 @@ namespace nnse
         // passed to returnd vector.
         FeatureMaxPQ max_pq;
 
-        double cur_best = numeric_limits<double>::max();
+        dist_type cur_best = numeric_limits<dist_type>::max();
+        // whether some rows of leaves are removed features
+        const bool holes = this->n_live_ < this->index_.size();
 
         // distance butter
-        double dist = 0;
+        dist_type dist = 0;
 
         // root for handle
-        check_list.push(NodeBind(this->root_,0));
+        check_list.push(NodeBind(0,0));
         while(!check_list.empty() && epoch < max_epoch)
         {
             // pop the element
@@ -676,10 +1386,16 @@ namespace nnse
 
             // find leaf and push unprocessed to stack
             node = this->traverse_to_leaf(feature,node,check_list);
-            for(size_t i = 0; i < node->n; ++i)
+            row = this->data_ + this->nodes_[node].begin * this->dimension_;
+            end = this->nodes_[node].begin + this->nodes_[node].n;
+            for(size_t i = this->nodes_[node].begin; i < end;
+                ++i, row += this->dimension_)
             {
+                // skip removed features
+                if(holes && this->index_[i] == NO_INDEX)
+                    continue;
 
-                if(spat::optimize_compare(node->features[i].data,feature,
+                if(spat::optimize_compare(row,feature,
                                           cur_best,this->dimension_,dist))
                 {
                     // maintain the bounded min priority queue
@@ -688,7 +1404,7 @@ namespace nnse
 
                         // pop the old greatest-smallest
                         max_pq.pop();
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     // the special point here is that we need to set best
@@ -696,12 +1412,12 @@ namespace nnse
                     // feature
                     else if(max_pq.size() == k-1)
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                         cur_best = max_pq.top().value;
                     }
                     else
                     {
-                        max_pq.push(KeyValue<Feature>(node->features[i], dist));
+                        max_pq.push(FeatureBind(Feature(row, this->dimension_, this->index_[i]), dist));
                     }
                 }
             }
@@ -718,6 +1434,587 @@ namespace nnse
         return nbrs;
     }
 
+    /**
+     * k-nearest-neighbour search core used by the batch search.
+     * Squared distances are compared with the early-stop strategy
+     * and a branch is skipped if its splitting plane is already
+     * farther than the current best. With max_epoch = 0 the search
+     * is exact and backtracks depth-first, otherwise it is the
+     * Best Bin First search over at most max_epoch leaves.
+     *
+     * @param feature    query feature data in array form
+     * @param k          number of nearest neighbour searched
+     * @param max_epoch  maximum of epoch of search, 0 for exact
+     * @param scratch    search buffers, scratch.heap takes the
+     *                   result as a max-heap of squared distances
+     * @param bound      squared distance results are closer than,
+     *                   the initial current best
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::search(const dist_type* feature, const size_t k,
+                           const size_t max_epoch, SearchContext& scratch,
+                           const dist_type bound,
+                           const FeatureFilter* filter) const
+    {
+        vector<NodeBind>& branches = scratch.branches;
+        vector<RowBind>& heap = scratch.heap;
+        branches.clear();
+        heap.clear();
+        if(k == 0 || this->nodes_.empty())
+            return;
+
+        const Node* nodes = &this->nodes_[0];
+        const size_t dim = this->dimension_;
+        const bool bbf = max_epoch > 0;
+        // whether some rows of leaves are removed features
+        const bool holes = this->n_live_ < this->index_.size();
+        dist_type cur_best = bound;
+        dist_type dist, diff;
+        size_t epoch = 0;
+        uint32_t node;
+        const T* row;
+        size_t end;
+        bool scanned;
+
+        // root for handle
+        branches.push_back(NodeBind(0,0));
+        while(!branches.empty() && (!bbf || epoch < max_epoch))
+        {
+            // pop the closest branch for bbf, the latest one otherwise
+            if(bbf)
+                pop_heap(branches.begin(), branches.end(), greater<NodeBind>());
+            node = branches.back().key;
+            diff = branches.back().value;
+            branches.pop_back();
+
+            // check if the splitting plane of the node can possibly
+            // beat current best distance. For bbf, no other branch
+            // can do either.
+            if(!(diff * diff < cur_best))
+            {
+                if(bbf)
+                    break;
+                continue;
+            }
+
+            // find leaf and push unprocessed branches
+            while(!nodes[node].is_leaf())
+            {
+                const Node& cur_node = nodes[node];
+                diff = feature[cur_node.pivot_dim] - cur_node.pivot_val;
+                if(diff <= 0)
+                {
+                    branches.push_back(NodeBind(cur_node.right, -diff));
+                    node = cur_node.left;
+                }
+                else
+                {
+                    branches.push_back(NodeBind(cur_node.left, diff));
+                    node = cur_node.right;
+                }
+                if(bbf)
+                    push_heap(branches.begin(), branches.end(), greater<NodeBind>());
+            }
+
+            // scan the leaf rows, a filtered row costs no distance
+            row = this->data_ + nodes[node].begin * dim;
+            end = nodes[node].begin + nodes[node].n;
+            scanned = !filter;
+            for(size_t i = nodes[node].begin; i < end; ++i, row += dim)
+            {
+                if(holes && this->index_[i] == NO_INDEX)
+                    continue;
+                if(filter)
+                {
+                    if(!filter->accept(this->index_[i]))
+                        continue;
+                    scanned = true;
+                }
+                if(!spat::optimize_compare(row, feature, cur_best, dim, dist))
+                    continue;
+                // maintain the bounded max-heap, the best distance is
+                // the greatest-smallest once k are found
+                if(heap.size() == k)
+                {
+                    pop_heap(heap.begin(), heap.end());
+                    heap.back() = RowBind(i, dist);
+                }
+                else
+                {
+                    heap.push_back(RowBind(i, dist));
+                }
+                push_heap(heap.begin(), heap.end());
+                if(heap.size() == k)
+                    cur_best = heap.front().value;
+            }
+            // a leaf without accepted features is not an epoch, so
+            // the search goes on until it finds some
+            if(scanned)
+                ++epoch;
+        }
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once. Queries
+     * are spread over the threads of a pool, each thread re-uses
+     * its search buffers and writes into the caller's arrays, which
+     * are row-major nq x k. Each row is sorted by ascending distance
+     * and padded with NO_INDEX and the max distance, or the lowest
+     * cosine similarity, if the tree has fewer than k features.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output distances, nq x k, may be NULL if not
+     *                   needed
+     * @param max_epoch  maximum of epoch of Best Bin First search,
+     *                   0 for the exact search
+     * @param measure    measure written to out_dists
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::knn_batch(const dist_type* queries, const size_t nq,
+                              const size_t k, size_t* out_ids,
+                              dist_type* out_dists, const size_t max_epoch,
+                              const DistanceMeasure measure,
+                              const FeatureFilter* filter,
+                              putil::ThreadPool* pool) const
+    {
+        // no radius bound
+        this->knn_within(queries, nq, k, numeric_limits<dist_type>::max(),
+                         out_ids, out_dists, max_epoch, measure, filter,
+                         pool);
+    }
+
+    /**
+     * Search k nearest neighbours, returned as (index, distance)
+     * pairs sorted by ascending distance, i.e. by descending cosine
+     * similarity. Unlike knn_basic and knn_bbf, no feature is copied
+     * and the distances computed by the search are kept.
+     *
+     * @param feature    query feature data in array form
+     * @param k          number of nearest neighbour returned
+     * @param max_epoch  maximum of epoch of Best Bin First search,
+     *                   0 for the exact search
+     * @param measure    measure of the returned distances
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Neighbour>
+    BasicKDTree<T>::knn_search(const dist_type* feature, const size_t k,
+                               const size_t max_epoch,
+                               const DistanceMeasure measure,
+                               const FeatureFilter* filter) const
+    {
+        vector<Neighbour> nbrs;
+        if(this->nodes_.empty() || !feature)
+        {
+            cerr << " KDTree::knn_search : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchContext context;
+        this->search(feature, k, max_epoch, context,
+                     numeric_limits<dist_type>::max(), filter);
+        // ascending order of distances
+        vector<RowBind>& heap = context.heap;
+        sort_heap(heap.begin(), heap.end());
+        nbrs.reserve(heap.size());
+        for(size_t i = 0; i < heap.size(); ++i)
+            nbrs.push_back(Neighbour(this->index_[heap[i].key],
+                measure_distance(heap[i].value, measure)));
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours with the buffers of a context, the
+     * search allocates nothing once the context has grown. Results
+     * are sorted by ascending distance and padded as knn_batch.
+     *
+     * @param feature    query feature data in array form
+     * @param k          number of nearest neighbour returned
+     * @param context    search buffers of the calling thread
+     * @param out_ids    output feature indices, k entries
+     * @param out_dists  output distances, k entries, may be NULL if
+     *                   not needed
+     * @param max_epoch  maximum of epoch of Best Bin First search,
+     *                   0 for the exact search
+     * @param radius     euclidean distance results are closer than,
+     *                   unbounded by default
+     * @param measure    measure written to out_dists
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     *
+     * @return number of neighbours found
+     */
+    template <class T>
+    size_t
+    BasicKDTree<T>::knn(const dist_type* feature, const size_t k,
+                        SearchContext& context, size_t* out_ids,
+                        dist_type* out_dists, const size_t max_epoch,
+                        const dist_type radius,
+                        const DistanceMeasure measure,
+                        const FeatureFilter* filter) const
+    {
+        if(this->nodes_.empty() || !feature || !out_ids)
+        {
+            cerr << " KDTree::knn : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return 0;
+        }
+        this->search(feature, k, max_epoch, context, squared_radius(radius),
+                     filter);
+        write_results(context.heap, &this->index_[0], k, measure, out_ids,
+                      out_dists);
+        return context.heap.size();
+    }
+
+    /**
+     * Write the results of a search as knn_batch does, so every
+     * index pads and converts its results the same way: sorted by
+     * ascending distance, converted to the measure, and padded with
+     * NO_INDEX and the max distance, or the lowest cosine
+     * similarity, past the neighbours found.
+     *
+     * @param heap      max-heap of rows with their squared distances,
+     *                  sorted in place
+     * @param index     feature index of each row, NULL if the rows are
+     *                  feature indices already
+     * @param k         number of results written
+     * @param measure   measure written to out_dists
+     * @param out_ids   output feature indices, k entries
+     * @param out_dists output distances, k entries, may be NULL if not
+     *                  needed
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::write_results(vector<KeyValue<uint32_t, dist_type> >& heap,
+                                  const size_t* index, const size_t k,
+                                  const DistanceMeasure measure,
+                                  size_t* out_ids, dist_type* out_dists)
+    {
+        // ascending order of distances
+        sort_heap(heap.begin(), heap.end());
+        for(size_t i = 0; i < k; ++i)
+        {
+            if(i < heap.size())
+            {
+                out_ids[i] = index ? index[heap[i].key] : heap[i].key;
+                if(out_dists)
+                    out_dists[i] = measure_distance(heap[i].value, measure);
+            }
+            else
+            {
+                out_ids[i] = NO_INDEX;
+                if(out_dists)
+                    out_dists[i] = missing_distance<dist_type>(measure);
+            }
+        }
+    }
+
+    /**
+     * Search all features closer than a radius. The squared radius
+     * is the initial current best, so a branch whose splitting
+     * plane is farther and a row whose partial distance exceeds it
+     * are cut at once. Results are in the same order as
+     * knn_basic_opt.
+     *
+     * @param feature     query feature data in array form
+     * @param radius      euclidean distance results are closer than
+     * @param max_results if not 0, only so many nearest features
+     *                    are returned, i.e. k nearest within radius
+     *
+     * @return
+     */
+    template <class T>
+    std::vector<typename BasicKDTree<T>::Feature>
+    BasicKDTree<T>::knn_radius(const dist_type* feature, const dist_type radius,
+                               const size_t max_results) const
+    {
+        // best result buffer
+        vector<Feature> nbrs;
+        if(this->nodes_.empty() || !feature)
+        {
+            cerr << " KDTree::knn_radius : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchContext scratch;
+        // without a limit the heap is never full, the radius stays the
+        // bound of the whole search
+        this->search(feature, max_results > 0 ? max_results : this->index_.size(),
+                     0, scratch, squared_radius(radius));
+
+        // greatest distance first, as popped from a max-priority queue
+        vector<RowBind>& heap = scratch.heap;
+        nbrs.reserve(heap.size());
+        while(!heap.empty())
+        {
+            const size_t i = heap.front().key;
+            nbrs.push_back(Feature(this->data_ + i * this->dimension_,
+                                   this->dimension_, this->index_[i]));
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        return nbrs;
+    }
+
+    /**
+     * Search the k nearest neighbours within a radius of many
+     * queries at once, the batch form of knn_radius. Output is as
+     * knn_batch, rows with fewer than k features within the radius
+     * are padded with NO_INDEX and the max distance.
+     *
+     * @param queries    row-major nq x dimension query matrix
+     * @param nq         number of queries
+     * @param k          number of nearest neighbour returned
+     * @param radius     euclidean distance results are closer than
+     * @param out_ids    output feature indices, nq x k
+     * @param out_dists  output distances, nq x k, may be NULL if not
+     *                   needed
+     * @param max_epoch  maximum of epoch of Best Bin First search,
+     *                   0 for the exact search
+     * @param measure    measure written to out_dists
+     * @param filter     features a result must be accepted by, NULL
+     *                   for all
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class T>
+    void
+    BasicKDTree<T>::knn_within(const dist_type* queries, const size_t nq,
+                               const size_t k, const dist_type radius,
+                               size_t* out_ids, dist_type* out_dists,
+                               const size_t max_epoch,
+                               const DistanceMeasure measure,
+                               const FeatureFilter* filter,
+                               putil::ThreadPool* pool) const
+    {
+        if(this->nodes_.empty() || !queries || !out_ids)
+        {
+            cerr << " KDTree::knn_within : tree not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one context per worker, reused by all its queries
+        vector<SearchContext> contexts(workers.concurrency());
+        const size_t dim = this->dimension_;
+
+        workers.parallel_for(nq, 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            for(size_t q = begin; q < end; ++q)
+                this->knn(queries + q * dim, k, contexts[worker],
+                          out_ids + q * k, out_dists ? out_dists + q * k : NULL,
+                          max_epoch, radius, measure, filter);
+        });
+    }
+
+    /**
+     * Save the tree and its features to a binary file: a header,
+     * the node array, the feature indices, then the feature matrix
+     * in leaf order at an offset aligned to the cache line. Numbers
+     * are stored in the byte order of the machine.
+     *
+     * @param path file path
+     *
+     * @return true on success
+     */
+    template <class T>
+    bool
+    BasicKDTree<T>::save(const string& path) const
+    {
+        if(this->nodes_.empty())
+        {
+            cerr << " KDTree::save : tree not built!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        ofstream out(path.c_str(), ios::binary);
+        if(!out.is_open())
+        {
+            cerr << " KDTree::save : can not open " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        // all rows, the wasted ones keep NO_INDEX
+        const uint64_t n = this->index_.size();
+        const uint64_t n_nodes = this->nodes_.size();
+        const uint32_t elem_size = sizeof(T);
+        // the matrix follows the header, nodes and indices
+        size_t offset = 4 + 2 * sizeof(uint32_t) + 6 * sizeof(uint64_t)
+            + n_nodes * sizeof(Node) + n * sizeof(uint64_t);
+        const size_t padding = (KDTREE_DATA_ALIGN - offset % KDTREE_DATA_ALIGN)
+            % KDTREE_DATA_ALIGN;
+        offset += padding;
+        const uint64_t params[6] = {this->dimension_, n, n_nodes,
+                                    this->leaf_size_, sizeof(Node), offset};
+        write_array(out, KDTREE_MAGIC, 4);
+        write_array(out, &KDTREE_VERSION, 1);
+        write_array(out, &elem_size, 1);
+        write_array(out, params, 6);
+        write_array(out, &this->nodes_[0], n_nodes);
+        vector<uint64_t> index(this->index_.begin(), this->index_.end());
+        write_array(out, &index[0], n);
+        const char zeros[KDTREE_DATA_ALIGN] = {0};
+        write_array(out, zeros, padding);
+        write_array(out, this->data_, n * this->dimension_);
+        if(!out.good())
+        {
+            cerr << " KDTree::save : failed to write " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Load a tree saved by save. The feature type and dimension
+     * must match. The nodes and indices are read, the feature
+     * matrix is either mapped read-only and used in place, or read
+     * into a matrix owned by the tree.
+     *
+     * @param path file path
+     * @param map  if true, the feature matrix is mapped from the
+     *             file, so its pages are shared by all processes
+     *             loading it and read on first access
+     *
+     * @return true on success, false if the file is not a valid tree
+     *         of this type and dimension
+     */
+    template <class T>
+    bool
+    BasicKDTree<T>::load(const string& path, const bool map)
+    {
+        ifstream in(path.c_str(), ios::binary);
+        if(!in.is_open())
+        {
+            cerr << " KDTree::load : can not open " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        in.seekg(0, ios::end);
+        const size_t file_size = in.tellg();
+        in.seekg(0);
+        char magic[4];
+        uint32_t version, elem_size;
+        uint64_t params[6];
+        read_array(in, magic, 4);
+        read_array(in, &version, 1);
+        read_array(in, &elem_size, 1);
+        read_array(in, params, 6);
+        if(!in.good() || memcmp(magic, KDTREE_MAGIC, 4) != 0
+           || version != KDTREE_VERSION || elem_size != sizeof(T)
+           || params[0] != this->dimension_ || params[1] == 0
+           || params[2] == 0 || params[4] != sizeof(Node))
+        {
+            cerr << " KDTree::load : not a tree of this type or dimension "
+                 << path <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        // the counts must fit the file before anything is allocated
+        const size_t row_size = sizeof(uint64_t) + this->dimension_ * sizeof(T);
+        if(params[1] > file_size / row_size
+           || params[2] > file_size / sizeof(Node)
+           || params[1] * row_size + params[2] * sizeof(Node) > file_size)
+        {
+            cerr << " KDTree::load : truncated file " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        const size_t n = params[1];
+        const size_t offset = params[5];
+        const size_t data_size = n * this->dimension_ * sizeof(T);
+
+        // nodes and indices are small, they are read
+        vector<Node> nodes(params[2]);
+        read_array(in, &nodes[0], nodes.size());
+        vector<uint64_t> index(n);
+        read_array(in, &index[0], n);
+        if(!in.good() || size_t(in.tellg()) > offset
+           || offset % KDTREE_DATA_ALIGN != 0 || offset > file_size
+           || data_size > file_size - offset)
+        {
+            cerr << " KDTree::load : truncated file " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+        if(!valid_tree(nodes, index, this->dimension_, uint64_t(NO_INDEX)))
+        {
+            cerr << " KDTree::load : corrupted nodes or indices in " << path
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return false;
+        }
+
+        this->release_data();
+        if(map)
+        {
+            struct stat st;
+            const int fd = open(path.c_str(), O_RDONLY);
+            void* mapping = MAP_FAILED;
+            if(fd >= 0 && fstat(fd, &st) == 0
+               && size_t(st.st_size) >= offset + data_size)
+                mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(fd >= 0)
+                close(fd);
+            if(mapping == MAP_FAILED)
+            {
+                cerr << " KDTree::load : can not map " << path
+                     <<__FILE__<<","<<__LINE__ <<endl;
+                this->nodes_.clear();
+                this->index_.clear();
+                return false;
+            }
+            this->mapping_ = mapping;
+            this->mapping_size_ = st.st_size;
+            this->data_ = reinterpret_cast<T*>(
+                static_cast<char*>(mapping) + offset);
+        }
+        else
+        {
+            this->data_ = aligned_malloc<T>(n * this->dimension_);
+            this->owns_data_ = true;
+            in.seekg(offset);
+            read_array(in, this->data_, n * this->dimension_);
+            if(!in.good())
+            {
+                cerr << " KDTree::load : truncated file " << path
+                     <<__FILE__<<","<<__LINE__ <<endl;
+                this->release_data();
+                this->nodes_.clear();
+                this->index_.clear();
+                return false;
+            }
+        }
+        this->leaf_size_ = params[3];
+        this->nodes_.swap(nodes);
+        this->index_.assign(index.begin(), index.end());
+        this->n_live_ = n - std::count(this->index_.begin(), this->index_.end(),
+                                       NO_INDEX);
+        this->capacity_ = map ? 0 : n;
+        this->leaf_capacity_.clear();
+        this->row_of_.clear();
+        return true;
+    }
 
+    template <class T>
+    const size_t BasicKDTree<T>::NO_INDEX;
+    template <class T>
+    const size_t BasicKDTree<T>::PARALLEL_SUBTREE_MIN;
+    template <class T>
+    const size_t BasicKDTree<T>::PARALLEL_VARIANCE_MIN;
 
+    template class BasicKDTree<double>;
+    template class BasicKDTree<float>;
+    template class BasicKDTree<spat::float16>;
 }
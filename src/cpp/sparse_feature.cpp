@@ -0,0 +1,447 @@
+// Compressed sparse features and an inverted index over codebook
+// entries, for LLC codes whose non-zeros are a small part of the
+// codebook. This implementation has following features:
+//
+// 1. Features are kept row-compressed (CSR) as the indices and values
+//    of their non-zeros, as lib/nenese reads them, values are floats
+//    or 8-bit codes with one scale per feature.
+// 2. Inner products of a sparse feature with a dense or another sparse
+//    feature cost its non-zeros, see spat::sparse_inner_product.
+// 3. The inverted index keeps, for each codebook entry, the features
+//    using it. A query only visits the lists of its own non-zeros and
+//    accumulates the inner products of all features at once, then
+//    selects the k best by cosine similarity, i.e. inner product of
+//    normalized codes, or by euclidean distance from stored norms.
+// 4. Queries of a batch are spread over a thread pool.
+//
+// @author: Bingqing Qu
+// @version 0.1.0
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/sparse_feature.hpp"
+
+namespace nnse
+{
+    namespace
+    {
+        /**
+         * store values as they are
+         *
+         * @return scale of the stored values
+         */
+        inline float quantize(const float* values, const size_t n, float* out)
+        {
+            std::copy(values, values + n, out);
+            return 1;
+        }
+
+        /**
+         * store values as 8-bit codes of a symmetric scale, so that the
+         * greatest magnitude is 127
+         *
+         * @return scale of the stored values
+         */
+        inline float quantize(const float* values, const size_t n, int8_t* out)
+        {
+            float magnitude = 0;
+            for(size_t i = 0; i < n; ++i)
+                magnitude = max(magnitude, fabsf(values[i]));
+            if(magnitude == 0)
+            {
+                std::fill(out, out + n, 0);
+                return 1;
+            }
+            const float scale = magnitude / 127;
+            for(size_t i = 0; i < n; ++i)
+                out[i] = static_cast<int8_t>(lrintf(values[i] / scale));
+            return scale;
+        }
+    }
+
+    /**
+     * Constructor
+     *
+     * @param d feature dimension
+     */
+    template <class V>
+    BasicSparseMatrix<V>::BasicSparseMatrix(const size_t d):
+        dimension_(d),offsets_(1, 0){}
+
+    /**
+     * reserve memory for rows and non-zeros
+     *
+     * @param n   number of rows
+     * @param nnz number of non-zeros
+     */
+    template <class V>
+    void
+    BasicSparseMatrix<V>::reserve(const size_t n, const size_t nnz)
+    {
+        this->offsets_.reserve(n + 1);
+        this->scales_.reserve(n);
+        this->indices_.reserve(nnz);
+        this->values_.reserve(nnz);
+    }
+
+    /**
+     * append the non-zeros of a dense feature as a row
+     *
+     * @param feature   dense feature of dimension elements
+     * @param threshold only elements of greater magnitude are kept
+     */
+    template <class V>
+    void
+    BasicSparseMatrix<V>::append(const float* feature, const float threshold)
+    {
+        if(!feature)
+        {
+            cerr << " SparseMatrix::append : invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        vector<uint32_t> indices;
+        vector<float> values;
+        for(size_t j = 0; j < this->dimension_; ++j)
+        {
+            if(fabsf(feature[j]) > threshold)
+            {
+                indices.push_back(j);
+                values.push_back(feature[j]);
+            }
+        }
+        this->append(indices.data(), values.data(), indices.size());
+    }
+
+    /**
+     * append a row from its non-zeros
+     *
+     * @param indices ascending indices of the non-zeros
+     * @param values  values of the non-zeros
+     * @param nnz     number of non-zeros
+     */
+    template <class V>
+    void
+    BasicSparseMatrix<V>::append(const uint32_t* indices, const float* values,
+                                 const size_t nnz)
+    {
+        for(size_t i = 0; i < nnz; ++i)
+        {
+            if(indices[i] >= this->dimension_ || (i > 0 && indices[i] <= indices[i - 1]))
+            {
+                cerr << " SparseMatrix::append : indices not ascending or out of range!"
+                     <<__FILE__<<","<<__LINE__ <<endl;
+                return;
+            }
+        }
+        const size_t begin = this->indices_.size();
+        this->indices_.insert(this->indices_.end(), indices, indices + nnz);
+        this->values_.resize(begin + nnz);
+        this->scales_.push_back(quantize(values, nnz, this->values_.data() + begin));
+        this->offsets_.push_back(begin + nnz);
+    }
+
+    /** bytes of the indices, values and offsets */
+    template <class V>
+    size_t
+    BasicSparseMatrix<V>::memory() const
+    {
+        return this->indices_.size() * sizeof(uint32_t)
+            + this->values_.size() * sizeof(V)
+            + this->offsets_.size() * sizeof(size_t)
+            + this->scales_.size() * sizeof(float);
+    }
+
+    /**
+     * Inner product of a row with a dense feature
+     *
+     * @param i       row
+     * @param feature dense feature of dimension elements
+     *
+     * @return inner product
+     */
+    template <class V>
+    float
+    BasicSparseMatrix<V>::dot(const size_t i, const float* feature) const
+    {
+        return this->scales_[i] * spat::sparse_inner_product(
+            this->row_indices(i), this->row_values(i), this->row_nnz(i), feature);
+    }
+
+    /**
+     * Constructor
+     *
+     * @param measure COSINE ranks by descending inner product, the
+     *                cosine of normalized codes, EUCLIDEAN and
+     *                SQUARED_EUCLIDEAN by ascending distance
+     */
+    template <class V>
+    BasicSparseIndex<V>::BasicSparseIndex(const DistanceMeasure measure):
+        measure_(measure),dimension_(0),n_rows_(0){}
+
+    /**
+     * build the index from sparse features, the i-th row gets
+     * feature index i. The features are copied.
+     *
+     * @param features sparse features
+     */
+    template <class V>
+    void
+    BasicSparseIndex<V>::build(const BasicSparseMatrix<V>& features)
+    {
+        const size_t d = features.dimension();
+        const size_t n = features.rows();
+        this->dimension_ = d;
+        this->n_rows_ = n;
+        this->scales_.resize(n);
+        this->norms_.resize(n);
+
+        // count the postings of each entry, then fill the lists in
+        // row order, so rows are ascending in every list
+        this->list_offsets_.assign(d + 1, 0);
+        for(size_t i = 0; i < n; ++i)
+        {
+            const uint32_t* indices = features.row_indices(i);
+            for(size_t e = 0; e < features.row_nnz(i); ++e)
+                ++this->list_offsets_[indices[e] + 1];
+        }
+        for(size_t j = 0; j < d; ++j)
+            this->list_offsets_[j + 1] += this->list_offsets_[j];
+        this->rows_.resize(features.nnz());
+        this->values_.resize(features.nnz());
+        vector<size_t> next(this->list_offsets_.begin(), this->list_offsets_.end() - 1);
+        for(size_t i = 0; i < n; ++i)
+        {
+            const uint32_t* indices = features.row_indices(i);
+            const V* values = features.row_values(i);
+            const float scale = features.row_scale(i);
+            float norm = 0;
+            for(size_t e = 0; e < features.row_nnz(i); ++e)
+            {
+                const size_t p = next[indices[e]]++;
+                this->rows_[p] = i;
+                this->values_[p] = values[e];
+                norm += float(values[e]) * float(values[e]);
+            }
+            this->scales_[i] = scale;
+            this->norms_[i] = norm * scale * scale;
+        }
+    }
+
+    /**
+     * convert a ranking key to the measure
+     *
+     * @param key     ranking key
+     * @param q_norm  squared norm of the query
+     *
+     * @return distance or similarity
+     */
+    template <class V>
+    float
+    BasicSparseIndex<V>::measure_key(const float key, const float q_norm) const
+    {
+        if(this->measure_ == COSINE)
+            return -key;
+        // rounding may leave a tiny negative distance
+        const float squared = max(0.f, q_norm + key);
+        return this->measure_ == SQUARED_EUCLIDEAN ? squared : sqrt(squared);
+    }
+
+    /**
+     * k-nearest-neighbour search core
+     *
+     * @param queries sparse queries
+     * @param q       query row
+     * @param k       number of nearest neighbour searched
+     * @param scratch search buffers, scratch.heap takes the result
+     *                as a max-heap of keys
+     */
+    template <class V>
+    void
+    BasicSparseIndex<V>::search(const SparseMatrix& queries, const size_t q,
+                                const size_t k, SearchScratch& scratch) const
+    {
+        vector<float>& products = scratch.products;
+        vector<uint32_t>& marks = scratch.marks;
+        vector<uint32_t>& touched = scratch.touched;
+        vector<RowBind>& heap = scratch.heap;
+        heap.clear();
+        touched.clear();
+        if(k == 0)
+            return;
+        // a new tag clears the products, the marks are only reset
+        // when the tags wrap around
+        if(marks.size() != this->n_rows_ || ++scratch.tag == 0)
+        {
+            marks.assign(this->n_rows_, 0);
+            products.resize(this->n_rows_);
+            scratch.tag = 1;
+        }
+        const uint32_t tag = scratch.tag;
+
+        // accumulate the inner products over the lists of the entries
+        // of the query
+        const uint32_t* q_indices = queries.row_indices(q);
+        const float* q_values = queries.row_values(q);
+        for(size_t e = 0; e < queries.row_nnz(q); ++e)
+        {
+            const float value = q_values[e] * queries.row_scale(q);
+            const size_t end = this->list_offsets_[q_indices[e] + 1];
+            for(size_t p = this->list_offsets_[q_indices[e]]; p < end; ++p)
+            {
+                const uint32_t row = this->rows_[p];
+                if(marks[row] != tag)
+                {
+                    marks[row] = tag;
+                    products[row] = 0;
+                    touched.push_back(row);
+                }
+                products[row] += value * float(this->values_[p]);
+            }
+        }
+
+        // bounded max-heap of keys, smaller is better
+        float worst = numeric_limits<float>::max();
+        auto push = [&](const uint32_t row, const float key)
+        {
+            if(!(key < worst))
+                return;
+            if(heap.size() == k)
+            {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = RowBind(row, key);
+            }
+            else
+            {
+                heap.push_back(RowBind(row, key));
+            }
+            push_heap(heap.begin(), heap.end());
+            if(heap.size() == k)
+                worst = heap.front().value;
+        };
+        if(this->measure_ == COSINE)
+        {
+            // a feature sharing no entry has a similarity of 0, only
+            // needed if fewer than k features share one
+            for(size_t i = 0; i < touched.size(); ++i)
+                push(touched[i], -products[touched[i]] * this->scales_[touched[i]]);
+            for(uint32_t row = 0; row < this->n_rows_ && heap.size() < k; ++row)
+                if(marks[row] != tag)
+                    push(row, 0);
+        }
+        else
+        {
+            // |q-x|^2 - |q|^2 = |x|^2 - 2qx, every feature is a
+            // candidate since a small one is close without sharing
+            // any entry
+            for(uint32_t row = 0; row < this->n_rows_; ++row)
+                push(row, this->norms_[row] - (marks[row] == tag
+                    ? 2 * products[row] * this->scales_[row] : 0));
+        }
+    }
+
+    /**
+     * Exact k nearest neighbours of a sparse query, sorted from the
+     * best, i.e. by descending cosine similarity or ascending
+     * distance.
+     *
+     * @param queries sparse queries
+     * @param q       query row
+     * @param k       number of nearest neighbour returned
+     *
+     * @return
+     */
+    template <class V>
+    std::vector<typename BasicSparseIndex<V>::Neighbour>
+    BasicSparseIndex<V>::knn(const SparseMatrix& queries, const size_t q,
+                             const size_t k) const
+    {
+        vector<Neighbour> nbrs;
+        if(this->n_rows_ == 0 || q >= queries.rows()
+           || queries.dimension() != this->dimension_)
+        {
+            cerr << " SparseIndex::knn : index not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return nbrs;
+        }
+        SearchScratch scratch;
+        this->search(queries, q, k, scratch);
+        vector<RowBind>& heap = scratch.heap;
+        sort_heap(heap.begin(), heap.end());
+        const float q_norm = queries.dot(q, queries, q);
+        nbrs.reserve(heap.size());
+        for(size_t i = 0; i < heap.size(); ++i)
+            nbrs.push_back(Neighbour(heap[i].key,
+                                     this->measure_key(heap[i].value, q_norm)));
+        return nbrs;
+    }
+
+    /**
+     * Search k nearest neighbours of many queries at once, see
+     * BasicKDTree::knn_batch. Rows are padded with NO_INDEX and the
+     * worst distance or similarity.
+     *
+     * @param queries    sparse queries
+     * @param k          number of nearest neighbour returned
+     * @param out_ids    output feature indices, rows x k
+     * @param out_dists  output distances or similarities, rows x k,
+     *                   may be NULL if not needed
+     * @param pool       thread pool, NULL for the global pool
+     */
+    template <class V>
+    void
+    BasicSparseIndex<V>::knn_batch(const SparseMatrix& queries, const size_t k,
+                                   size_t* out_ids, float* out_dists,
+                                   putil::ThreadPool* pool) const
+    {
+        if(this->n_rows_ == 0 || !out_ids
+           || queries.dimension() != this->dimension_)
+        {
+            cerr << " SparseIndex::knn_batch : index not built or invalid input!"
+                 <<__FILE__<<","<<__LINE__ <<endl;
+            return;
+        }
+        putil::ThreadPool& workers = pool ? *pool : putil::ThreadPool::global();
+        // one scratch per worker, reused by all its queries
+        vector<SearchScratch> scratches(workers.concurrency());
+
+        workers.parallel_for(queries.rows(), 16,
+            [&](size_t begin, size_t end, size_t worker)
+        {
+            SearchScratch& scratch = scratches[worker];
+            vector<RowBind>& heap = scratch.heap;
+            for(size_t q = begin; q < end; ++q)
+            {
+                this->search(queries, q, k, scratch);
+                sort_heap(heap.begin(), heap.end());
+                const float q_norm = queries.dot(q, queries, q);
+
+                size_t* ids = out_ids + q * k;
+                float* dists = out_dists ? out_dists + q * k : NULL;
+                for(size_t i = 0; i < k; ++i)
+                {
+                    if(i < heap.size())
+                    {
+                        ids[i] = heap[i].key;
+                        if(dists)
+                            dists[i] = this->measure_key(heap[i].value, q_norm);
+                    }
+                    else
+                    {
+                        ids[i] = NO_INDEX;
+                        if(dists)
+                            dists[i] = this->measure_ == COSINE
+                                ? -numeric_limits<float>::max()
+                                : numeric_limits<float>::max();
+                    }
+                }
+            }
+        });
+    }
+
+    template class BasicSparseMatrix<float>;
+    template class BasicSparseMatrix<int8_t>;
+    template class BasicSparseIndex<float>;
+    template class BasicSparseIndex<int8_t>;
+}
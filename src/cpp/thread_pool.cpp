@@ -0,0 +1,224 @@
+// A light-weight thread pool for data parallel loops and recursive
+// tasks.
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include "sireen/thread_pool.hpp"
+
+#include <atomic>
+
+namespace putil
+{
+    /**
+     * Constructor
+     *
+     * @param n_threads number of worker threads, 0 for one less than
+     *                  the hardware threads since the waiting thread
+     *                  always works as well
+     */
+    ThreadPool::ThreadPool(size_t n_threads) : stop_(false)
+    {
+        if(n_threads == 0)
+        {
+            const size_t hw = thread::hardware_concurrency();
+            n_threads = hw > 1 ? hw - 1 : 1;
+        }
+        this->workers_.reserve(n_threads);
+        for(size_t i = 0; i < n_threads; ++i)
+            this->workers_.push_back(thread(&ThreadPool::worker_loop, this));
+    }
+
+    /**
+     * Destructor, finishes the queued tasks and joins workers
+     */
+    ThreadPool::~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(this->mutex_);
+            this->stop_ = true;
+        }
+        this->cond_.notify_all();
+        for(size_t i = 0; i < this->workers_.size(); ++i)
+            this->workers_[i].join();
+    }
+
+    /**
+     * worker thread main loop
+     */
+    void
+    ThreadPool::worker_loop()
+    {
+        function<void()> task;
+        while(true)
+        {
+            {
+                unique_lock<mutex> lock(this->mutex_);
+                while(!this->stop_ && this->tasks_.empty())
+                    this->cond_.wait(lock);
+                if(this->tasks_.empty())
+                    return;
+                task.swap(this->tasks_.front());
+                this->tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    /**
+     * queue a task and wake a thread
+     */
+    void
+    ThreadPool::enqueue(const function<void()>& task)
+    {
+        {
+            lock_guard<mutex> lock(this->mutex_);
+            this->tasks_.push_back(task);
+        }
+        // waiters of task groups share the condition, wake all of them
+        // so a helper is not starved by a sleeping worker
+        this->cond_.notify_all();
+    }
+
+    /**
+     * execute queued tasks until the group has no pending task
+     *
+     * @param group task group to wait
+     */
+    void
+    ThreadPool::help_until_done(TaskGroup& group)
+    {
+        function<void()> task;
+        unique_lock<mutex> lock(this->mutex_);
+        while(group.pending_ > 0)
+        {
+            if(this->tasks_.empty())
+            {
+                this->cond_.wait(lock);
+                continue;
+            }
+            task.swap(this->tasks_.front());
+            this->tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    /**
+     * Parallel loop over [0,n) by chunks of at most grain items.
+     * fn(begin, end, worker) is called for each chunk, where
+     * worker < concurrency() identifies the calling thread for the
+     * duration of the loop. Blocks until all chunks are done.
+     *
+     * @param n     number of items
+     * @param grain maximum chunk size
+     * @param fn    chunk function
+     */
+    void
+    ThreadPool::parallel_for(const size_t n, const size_t grain,
+                             const function<void(size_t, size_t, size_t)>& fn)
+    {
+        if(n == 0)
+            return;
+        const size_t step = grain > 0 ? grain : 1;
+        const size_t n_chunks = (n + step - 1) / step;
+        const size_t n_workers = min(n_chunks, this->concurrency());
+
+        // every worker pulls chunks from the shared counter
+        atomic<size_t> next(0);
+        const function<void(size_t)> work = [&](size_t worker)
+        {
+            size_t begin;
+            while((begin = next.fetch_add(step)) < n)
+                fn(begin, min(begin + step, n), worker);
+        };
+
+        TaskGroup group(*this);
+        for(size_t w = 1; w < n_workers; ++w)
+            group.run(bind(work, w));
+        // the caller is worker 0
+        work(0);
+        group.wait();
+    }
+
+    /**
+     * shared pool sized by the hardware
+     */
+    ThreadPool&
+    ThreadPool::global()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    /**
+     * Destructor, waits for the pending tasks
+     */
+    TaskGroup::~TaskGroup()
+    {
+        try
+        {
+            this->wait();
+        }
+        catch(...)
+        {
+            // a destructor must not throw, call wait to get errors
+        }
+    }
+
+    /**
+     * run a task asynchronously in the pool
+     *
+     * @param task task function
+     */
+    void
+    TaskGroup::run(const function<void()>& task)
+    {
+        {
+            lock_guard<mutex> lock(this->pool_.mutex_);
+            ++this->pending_;
+        }
+        // the group may be gone once pending_ drops, so only the pool
+        // is touched after that
+        TaskGroup* group = this;
+        ThreadPool* pool = &this->pool_;
+        this->pool_.enqueue([group, pool, task]()
+        {
+            exception_ptr error;
+            try
+            {
+                task();
+            }
+            catch(...)
+            {
+                error = current_exception();
+            }
+            {
+                lock_guard<mutex> lock(pool->mutex_);
+                if(error && !group->error_)
+                    group->error_ = error;
+                --group->pending_;
+            }
+            pool->cond_.notify_all();
+        });
+    }
+
+    /**
+     * wait for all tasks of the group, the calling thread executes
+     * queued tasks meanwhile
+     */
+    void
+    TaskGroup::wait()
+    {
+        this->pool_.help_until_done(*this);
+        if(this->error_)
+        {
+            exception_ptr error = this->error_;
+            this->error_ = exception_ptr();
+            rethrow_exception(error);
+        }
+    }
+}
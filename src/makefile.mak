@@ -13,9 +13,9 @@ VLROOT ?= /home/bingqingqu/user-libs/vlfeat/vlfeat-0.9.19
 VLLIB := $(VLROOT)/bin/$(ARCH)
 EIGENROOT ?= /home/bingqingqu/user-libs/eigen-3.2.4
 
-BIN_CFLAGS := $(CFLAGS) -g -Wall -std=c++0x -O3 \
+BIN_CFLAGS := $(CFLAGS) -g -Wall -std=c++0x -O3 -pthread \
 				-I$(VLROOT) -I$(EIGENROOT) -I$(SIREENROOT)/include
-BIN_LDFLAGS := $(LDFLAGS) -L$(LIBDIR) -L$(VLLIB) -lopencv_core \
+BIN_LDFLAGS := $(LDFLAGS) -pthread -L$(LIBDIR) -L$(VLLIB) -lopencv_core \
 				-lopencv_imgproc -lopencv_highgui -lopencv_contrib -lvl
 
 # Mac OS X Intel 32
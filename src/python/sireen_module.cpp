@@ -0,0 +1,807 @@
+// Python extension module nenese._sireen, exposing the kd-tree search
+// and the LLC image coder of sireen to the nenese library. This
+// implementation has following features:
+//
+// 1. Arrays are passed by the buffer protocol, so NumPy arrays (or any
+//    C-contiguous buffer of the right item type) are read in place and
+//    results are written straight into NumPy arrays allocated by the
+//    module, no feature is copied on either way.
+// 2. A tree may be built on its own copy of the features or, with
+//    copy=False, on the caller's array which it keeps alive and
+//    re-orders in place.
+// 3. The GIL is released during builds, searches and batch encoding,
+//    which run on the thread pool of sireen, so other Python threads
+//    keep running meanwhile.
+// 4. Batch encoding keeps one ImageCoder per worker thread, since a
+//    coder owns the buffers of its dsift filter.
+//
+// Usage:
+//     from nenese import _sireen
+//     tree = _sireen.KDTree(500)
+//     tree.build(features)
+//     ids, dists = tree.knn(queries, 10, measure="cosine")
+//     coder = _sireen.ImageCoder()
+//     llc = coder.encode(images, codebook, 5)
+//
+// @author: Bingqing Qu
+//
+// Copyright (C) 2014-2015  Bingqing Qu <sylar.qu@gmail.com>
+//
+// @license: See LICENSE at root directory
+#include <Python.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <new>
+
+#include "sireen/nearest_neighbour.hpp"
+#include "sireen/thread_pool.hpp"
+#ifndef NENESE_NO_CODER
+#include "sireen/image_feature_extract.hpp"
+#endif
+
+namespace
+{
+    // buffer of a Python object, released with the view
+    struct BufferView
+    {
+        Py_buffer view;
+        bool valid;
+        BufferView() : valid(false){}
+        ~BufferView()
+        {
+            if(this->valid)
+                PyBuffer_Release(&this->view);
+        }
+        /**
+         * get a C-contiguous buffer of an object
+         *
+         * @param obj      object exporting the buffer protocol
+         * @param writable true if the buffer is written
+         *
+         * @return false with a Python exception set on failure
+         */
+        bool get(PyObject* obj, const bool writable)
+        {
+            int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+            if(writable)
+                flags |= PyBUF_WRITABLE;
+            if(PyObject_GetBuffer(obj, &this->view, flags) < 0)
+                return false;
+            this->valid = true;
+            return true;
+        }
+    };
+
+    // item format of the buffer protocol for an element type
+    template <class T> char format_of();
+    template <> char format_of<double>() {return 'd'; }
+    template <> char format_of<float>() {return 'f'; }
+
+    /**
+     * check the item type of a buffer, native byte order only
+     *
+     * @param view   buffer
+     * @param format expected format character
+     *
+     * @return false with a Python exception set on mismatch
+     */
+    bool check_format(const Py_buffer& view, const char format)
+    {
+        const char* f = view.format ? view.format : "B";
+        if(*f == '@' || *f == '=')
+            ++f;
+        if(f[0] != format || f[1] != '\0')
+        {
+            PyErr_Format(PyExc_TypeError, "expected an array of format '%c', "
+                         "got '%s'", format, view.format ? view.format : "B");
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * get the rows of a 1-d (one row) or 2-d matrix buffer
+     *
+     * @param view      buffer
+     * @param dimension expected number of columns
+     * @param rows      output number of rows
+     *
+     * @return false with a Python exception set on mismatch
+     */
+    bool matrix_rows(const Py_buffer& view, const size_t dimension,
+                     size_t& rows)
+    {
+        if(view.ndim == 1 && size_t(view.shape[0]) == dimension)
+        {
+            rows = 1;
+            return true;
+        }
+        if(view.ndim == 2 && size_t(view.shape[1]) == dimension)
+        {
+            rows = view.shape[0];
+            return true;
+        }
+        PyErr_Format(PyExc_ValueError, "expected an array of %zu columns",
+                     dimension);
+        return false;
+    }
+
+    /**
+     * allocate a NumPy array, so that results are written in place
+     *
+     * @param rows  number of rows
+     * @param cols  number of columns, 0 for a 1-d array of rows
+     * @param dtype NumPy dtype name
+     * @param out   buffer of the new array
+     *
+     * @return new reference, NULL with a Python exception set on failure
+     */
+    PyObject* new_array(const size_t rows, const size_t cols,
+                        const char* dtype, BufferView& out)
+    {
+        static PyObject* numpy_empty = NULL;
+        if(!numpy_empty)
+        {
+            PyObject* numpy = PyImport_ImportModule("numpy");
+            if(!numpy)
+                return NULL;
+            numpy_empty = PyObject_GetAttrString(numpy, "empty");
+            Py_DECREF(numpy);
+            if(!numpy_empty)
+                return NULL;
+        }
+        PyObject* shape = cols ? Py_BuildValue("(nn)", Py_ssize_t(rows),
+                                               Py_ssize_t(cols))
+                               : Py_BuildValue("(n)", Py_ssize_t(rows));
+        if(!shape)
+            return NULL;
+        PyObject* array = PyObject_CallFunction(numpy_empty, "Os", shape, dtype);
+        Py_DECREF(shape);
+        if(array && !out.get(array, true))
+        {
+            Py_DECREF(array);
+            return NULL;
+        }
+        return array;
+    }
+
+    /**
+     * parse a measure by its scipy.spatial.distance name
+     *
+     * @param name    "euclidean", "sqeuclidean" or "cosine"
+     * @param measure output measure
+     *
+     * @return false with a Python exception set on an unknown name
+     */
+    bool parse_measure(const char* name, nnse::DistanceMeasure& measure)
+    {
+        const string s(name);
+        if(s == "euclidean")
+            measure = nnse::EUCLIDEAN;
+        else if(s == "sqeuclidean")
+            measure = nnse::SQUARED_EUCLIDEAN;
+        else if(s == "cosine")
+            measure = nnse::COSINE;
+        else
+        {
+            PyErr_Format(PyExc_ValueError, "unknown measure '%s'", name);
+            return false;
+        }
+        return true;
+    }
+
+    // C++ exception caught while the GIL is released, raised as a
+    // Python exception once the GIL is held again
+    struct CppError
+    {
+        PyObject* type;
+        string message;
+        CppError() : type(NULL){}
+        /** keep the exception being handled, call in a catch block */
+        void set_current()
+        {
+            try
+            {
+                throw;
+            }
+            catch(const bad_alloc&)
+            {
+                this->type = PyExc_MemoryError;
+                this->message = "out of memory";
+            }
+            catch(const exception& e)
+            {
+                this->type = PyExc_RuntimeError;
+                this->message = e.what();
+            }
+            catch(...)
+            {
+                this->type = PyExc_RuntimeError;
+                this->message = "unknown error";
+            }
+        }
+        /**
+         * raise the kept exception, if any
+         *
+         * @return true with a Python exception set if one was kept
+         */
+        bool raise() const
+        {
+            if(!this->type)
+                return false;
+            PyErr_SetString(this->type, this->message.c_str());
+            return true;
+        }
+    };
+
+    ///
+    /// Python object of a kd-tree. Searches run without the GIL, so
+    /// the object counts them and refuses to rebuild or reload the
+    /// tree meanwhile; the counters are only touched with the GIL.
+    ///
+    template <class T>
+    struct TreeObject
+    {
+        PyObject_HEAD
+        nnse::BasicKDTree<T>* tree;
+        size_t dimension;
+        /** the caller's array of a tree built without copy */
+        Py_buffer data;
+        bool has_data;
+        /** number of running searches */
+        int n_searches;
+        /** true while the tree is built or loaded */
+        bool busy;
+    };
+
+    template <class T>
+    bool
+    tree_check(TreeObject<T>* self, const bool modify)
+    {
+        if(!self->tree)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "tree not initialized");
+            return false;
+        }
+        if(self->busy || (modify && self->n_searches > 0))
+        {
+            PyErr_SetString(PyExc_RuntimeError, "tree in use by another thread");
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * check that the tree holds features to search or save
+     *
+     * @return false with a Python exception set on an empty tree
+     */
+    template <class T>
+    bool
+    tree_built(TreeObject<T>* self)
+    {
+        if(self->tree->size() == 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "tree not built");
+            return false;
+        }
+        return true;
+    }
+
+    template <class T>
+    void
+    tree_release_data(TreeObject<T>* self)
+    {
+        if(self->has_data)
+        {
+            PyBuffer_Release(&self->data);
+            self->has_data = false;
+        }
+    }
+
+    template <class T>
+    int
+    tree_init(TreeObject<T>* self, PyObject* args, PyObject* kwds)
+    {
+        static const char* kwlist[] = {"dimension", "leaf_size", NULL};
+        Py_ssize_t dimension = 0;
+        Py_ssize_t leaf_size = 30;
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "n|n",
+                                        const_cast<char**>(kwlist),
+                                        &dimension, &leaf_size))
+            return -1;
+        if(dimension <= 0 || leaf_size <= 0)
+        {
+            PyErr_SetString(PyExc_ValueError,
+                            "dimension and leaf_size must be positive");
+            return -1;
+        }
+        if(self->tree && !tree_check(self, true))
+            return -1;
+        delete self->tree;
+        tree_release_data(self);
+        self->tree = new nnse::BasicKDTree<T>(dimension, leaf_size);
+        self->dimension = dimension;
+        return 0;
+    }
+
+    template <class T>
+    void
+    tree_dealloc(TreeObject<T>* self)
+    {
+        PyTypeObject* type = Py_TYPE(self);
+        delete self->tree;
+        tree_release_data(self);
+        type->tp_free(reinterpret_cast<PyObject*>(self));
+        Py_DECREF(type);
+    }
+
+    template <class T>
+    PyObject*
+    tree_build(TreeObject<T>* self, PyObject* args, PyObject* kwds)
+    {
+        static const char* kwlist[] = {"data", "copy", NULL};
+        PyObject* obj = NULL;
+        int copy = 1;
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|p",
+                                        const_cast<char**>(kwlist),
+                                        &obj, &copy))
+            return NULL;
+        if(!tree_check(self, true))
+            return NULL;
+        BufferView data;
+        size_t n = 0;
+        if(!data.get(obj, !copy) || !check_format(data.view, format_of<T>())
+           || !matrix_rows(data.view, self->dimension, n))
+            return NULL;
+        if(n == 0)
+        {
+            PyErr_SetString(PyExc_ValueError, "no feature to build");
+            return NULL;
+        }
+
+        T* rows = static_cast<T*>(data.view.buf);
+        CppError error;
+        self->busy = true;
+        Py_BEGIN_ALLOW_THREADS
+        try
+        {
+            self->tree->build(rows, n, copy != 0);
+        }
+        catch(...)
+        {
+            error.set_current();
+        }
+        Py_END_ALLOW_THREADS
+        self->busy = false;
+        if(error.raise())
+            return NULL;
+
+        // the tree borrows the array, keep it alive with the tree
+        tree_release_data(self);
+        if(!copy)
+        {
+            self->data = data.view;
+            self->has_data = true;
+            data.valid = false;
+        }
+        Py_RETURN_NONE;
+    }
+
+    template <class T>
+    PyObject*
+    tree_knn(TreeObject<T>* self, PyObject* args, PyObject* kwds)
+    {
+        typedef typename nnse::BasicKDTree<T>::dist_type dist_type;
+        static const char* kwlist[] = {"queries", "k", "max_epoch", "measure",
+                                       NULL};
+        PyObject* obj = NULL;
+        Py_ssize_t k = 0;
+        Py_ssize_t max_epoch = 0;
+        const char* measure_name = "euclidean";
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "On|ns",
+                                        const_cast<char**>(kwlist), &obj, &k,
+                                        &max_epoch, &measure_name))
+            return NULL;
+        nnse::DistanceMeasure measure;
+        if(!tree_check(self, false) || !parse_measure(measure_name, measure))
+            return NULL;
+        if(k <= 0 || max_epoch < 0)
+        {
+            PyErr_SetString(PyExc_ValueError,
+                            "k must be positive and max_epoch not negative");
+            return NULL;
+        }
+        if(!tree_built(self))
+            return NULL;
+        BufferView queries;
+        size_t nq = 0;
+        if(!queries.get(obj, false)
+           || !check_format(queries.view, format_of<dist_type>())
+           || !matrix_rows(queries.view, self->dimension, nq))
+            return NULL;
+
+        BufferView ids_view, dists_view;
+        PyObject* ids = new_array(nq, k, "uintp", ids_view);
+        if(!ids)
+            return NULL;
+        PyObject* dists = new_array(nq, k, format_of<dist_type>() == 'd'
+                                    ? "float64" : "float32", dists_view);
+        if(!dists)
+        {
+            Py_DECREF(ids);
+            return NULL;
+        }
+
+        const dist_type* rows = static_cast<const dist_type*>(queries.view.buf);
+        size_t* out_ids = static_cast<size_t*>(ids_view.view.buf);
+        dist_type* out_dists = static_cast<dist_type*>(dists_view.view.buf);
+        CppError error;
+        ++self->n_searches;
+        Py_BEGIN_ALLOW_THREADS
+        try
+        {
+            self->tree->knn_batch(rows, nq, k, out_ids, out_dists, max_epoch,
+                                  measure);
+        }
+        catch(...)
+        {
+            error.set_current();
+        }
+        Py_END_ALLOW_THREADS
+        --self->n_searches;
+        if(error.raise())
+        {
+            Py_DECREF(ids);
+            Py_DECREF(dists);
+            return NULL;
+        }
+        return Py_BuildValue("(NN)", ids, dists);
+    }
+
+    template <class T>
+    PyObject*
+    tree_save(TreeObject<T>* self, PyObject* args)
+    {
+        const char* path = NULL;
+        if(!PyArg_ParseTuple(args, "s", &path) || !tree_check(self, false)
+           || !tree_built(self))
+            return NULL;
+        bool ok;
+        ++self->n_searches;
+        Py_BEGIN_ALLOW_THREADS
+        ok = self->tree->save(path);
+        Py_END_ALLOW_THREADS
+        --self->n_searches;
+        return PyBool_FromLong(ok);
+    }
+
+    template <class T>
+    PyObject*
+    tree_load(TreeObject<T>* self, PyObject* args, PyObject* kwds)
+    {
+        static const char* kwlist[] = {"path", "map", NULL};
+        const char* path = NULL;
+        int map = 1;
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|p",
+                                        const_cast<char**>(kwlist),
+                                        &path, &map)
+           || !tree_check(self, true))
+            return NULL;
+        bool ok;
+        self->busy = true;
+        Py_BEGIN_ALLOW_THREADS
+        ok = self->tree->load(path, map != 0);
+        Py_END_ALLOW_THREADS
+        self->busy = false;
+        if(ok)
+            tree_release_data(self);
+        return PyBool_FromLong(ok);
+    }
+
+    template <class T>
+    PyObject*
+    tree_size(TreeObject<T>* self, void*)
+    {
+        return PyLong_FromSize_t(self->tree ? self->tree->size() : 0);
+    }
+
+    template <class T>
+    PyObject*
+    tree_dimension(TreeObject<T>* self, void*)
+    {
+        return PyLong_FromSize_t(self->dimension);
+    }
+
+    // Python type of a kd-tree of element type T
+    template <class T>
+    PyObject*
+    tree_type(const char* name)
+    {
+        static PyMethodDef methods[] = {
+            {"build", (PyCFunction)(void(*)(void))tree_build<T>,
+             METH_VARARGS | METH_KEYWORDS,
+             "build(data, copy=True)\n\n"
+             "Build the tree from a C-contiguous n x dimension array, the "
+             "i-th row gets index i. With copy=False the rows of data are "
+             "re-ordered in place and the array is kept by the tree."},
+            {"knn", (PyCFunction)(void(*)(void))tree_knn<T>,
+             METH_VARARGS | METH_KEYWORDS,
+             "knn(queries, k, max_epoch=0, measure='euclidean')\n\n"
+             "k nearest neighbours of each row of queries, returned as "
+             "(ids, dists) arrays of nq x k sorted from the nearest. "
+             "max_epoch bounds the best bin first search, 0 is exact. "
+             "measure is 'euclidean', 'sqeuclidean' or 'cosine', the "
+             "similarity of unit length features. Missing neighbours "
+             "get the greatest uintp id. Raises RuntimeError if the "
+             "tree is not built."},
+            {"save", (PyCFunction)tree_save<T>, METH_VARARGS,
+             "save(path)\n\nSave the built tree to a file."},
+            {"load", (PyCFunction)(void(*)(void))tree_load<T>,
+             METH_VARARGS | METH_KEYWORDS,
+             "load(path, map=True)\n\nLoad a saved tree, memory-mapped "
+             "unless map is False."},
+            {NULL, NULL, 0, NULL}
+        };
+        static PyGetSetDef getset[] = {
+            {const_cast<char*>("size"), (getter)tree_size<T>, NULL,
+             const_cast<char*>("number of features indexed"), NULL},
+            {const_cast<char*>("dimension"), (getter)tree_dimension<T>, NULL,
+             const_cast<char*>("feature dimension"), NULL},
+            {NULL, NULL, NULL, NULL, NULL}
+        };
+        static PyType_Slot slots[] = {
+            {Py_tp_doc, const_cast<char*>(
+                "KDTree(dimension, leaf_size=30)\n\nkd-tree over a feature "
+                "matrix for exact and best bin first k nearest neighbour "
+                "search.")},
+            {Py_tp_init, (void*)tree_init<T>},
+            {Py_tp_new, (void*)PyType_GenericNew},
+            {Py_tp_dealloc, (void*)tree_dealloc<T>},
+            {Py_tp_methods, methods},
+            {Py_tp_getset, getset},
+            {0, NULL}
+        };
+        static PyType_Spec spec = {name, sizeof(TreeObject<T>), 0,
+                                   Py_TPFLAGS_DEFAULT, slots};
+        return PyType_FromSpec(&spec);
+    }
+
+#ifndef NENESE_NO_CODER
+    ///
+    /// Python object of an image coder, holding the coders of the
+    /// worker threads, created by the first encode
+    ///
+    struct CoderObject
+    {
+        PyObject_HEAD
+        int width;
+        int height;
+        int step;
+        int bin_size;
+        vector<ImageCoder*>* coders;
+        /** true while encoding */
+        bool busy;
+    };
+
+    void
+    coder_release(CoderObject* self)
+    {
+        if(!self->coders)
+            return;
+        for(size_t i = 0; i < self->coders->size(); ++i)
+            delete (*self->coders)[i];
+        delete self->coders;
+        self->coders = NULL;
+    }
+
+    int
+    coder_init(CoderObject* self, PyObject* args, PyObject* kwds)
+    {
+        static const char* kwlist[] = {"width", "height", "step", "bin_size",
+                                       NULL};
+        int width = 128, height = 128, step = 8, bin_size = 16;
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "|iiii",
+                                        const_cast<char**>(kwlist), &width,
+                                        &height, &step, &bin_size))
+            return -1;
+        if(width <= 0 || height <= 0 || step <= 0 || bin_size <= 0)
+        {
+            PyErr_SetString(PyExc_ValueError, "parameters must be positive");
+            return -1;
+        }
+        if(self->busy)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "coder in use by another thread");
+            return -1;
+        }
+        coder_release(self);
+        self->width = width;
+        self->height = height;
+        self->step = step;
+        self->bin_size = bin_size;
+        return 0;
+    }
+
+    void
+    coder_dealloc(CoderObject* self)
+    {
+        PyTypeObject* type = Py_TYPE(self);
+        coder_release(self);
+        type->tp_free(reinterpret_cast<PyObject*>(self));
+        Py_DECREF(type);
+    }
+
+    PyObject*
+    coder_encode(CoderObject* self, PyObject* args, PyObject* kwds)
+    {
+        static const char* kwlist[] = {"images", "codebook", "k", NULL};
+        PyObject* images_obj = NULL;
+        PyObject* codebook_obj = NULL;
+        int k = 5;
+        if(!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i",
+                                        const_cast<char**>(kwlist),
+                                        &images_obj, &codebook_obj, &k))
+            return NULL;
+        if(self->width <= 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "coder not initialized");
+            return NULL;
+        }
+        if(self->busy)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "coder in use by another thread");
+            return NULL;
+        }
+        // images are height x width gray levels, one or a stack
+        BufferView images;
+        if(!images.get(images_obj, false) || !check_format(images.view, 'f'))
+            return NULL;
+        const Py_buffer& iv = images.view;
+        const bool single = iv.ndim == 2;
+        if(!(iv.ndim == 2 || iv.ndim == 3)
+           || iv.shape[iv.ndim - 2] != self->height
+           || iv.shape[iv.ndim - 1] != self->width)
+        {
+            PyErr_Format(PyExc_ValueError, "expected images of %d x %d",
+                         self->height, self->width);
+            return NULL;
+        }
+        const size_t n = single ? 1 : iv.shape[0];
+        // codebook is ncb x 128, i.e. one sift word per row
+        BufferView codebook;
+        if(!codebook.get(codebook_obj, false) || !check_format(codebook.view, 'f'))
+            return NULL;
+        if(codebook.view.ndim != 2 || codebook.view.shape[1] != 128)
+        {
+            PyErr_SetString(PyExc_ValueError, "expected a codebook of 128 columns");
+            return NULL;
+        }
+        const int ncb = codebook.view.shape[0];
+        if(k <= 0 || k > ncb)
+        {
+            PyErr_SetString(PyExc_ValueError, "k must be in [1, codebook size]");
+            return NULL;
+        }
+
+        BufferView out_view;
+        PyObject* out = new_array(single ? ncb : n, single ? 0 : ncb,
+                                  "float32", out_view);
+        if(!out)
+            return NULL;
+
+        putil::ThreadPool& workers = putil::ThreadPool::global();
+        if(!self->coders)
+            self->coders = new vector<ImageCoder*>(workers.concurrency(),
+                                                   (ImageCoder*)NULL);
+        float* pixels = static_cast<float*>(iv.buf);
+        // norms of the codes computed once for all images
+        const Codebook words(static_cast<const float*>(codebook.view.buf), ncb);
+        float* llc = static_cast<float*>(out_view.view.buf);
+        vector<ImageCoder*>& coders = *self->coders;
+        const size_t image_size = size_t(self->width) * self->height;
+        CppError error;
+        self->busy = true;
+        Py_BEGIN_ALLOW_THREADS
+        try
+        {
+            workers.parallel_for(n, 1,
+                [&](size_t begin, size_t end, size_t worker)
+            {
+                if(!coders[worker])
+                    coders[worker] = new ImageCoder(self->width, self->height,
+                                                    self->step, self->bin_size);
+                for(size_t i = begin; i < end; ++i)
+                    coders[worker]->llc_dense_sift(pixels + i * image_size,
+                                                   words, k, llc + i * ncb);
+            });
+        }
+        catch(...)
+        {
+            error.set_current();
+        }
+        Py_END_ALLOW_THREADS
+        self->busy = false;
+        if(error.raise())
+        {
+            Py_DECREF(out);
+            return NULL;
+        }
+        return out;
+    }
+
+    PyObject*
+    coder_type()
+    {
+        static PyMethodDef methods[] = {
+            {"encode", (PyCFunction)(void(*)(void))coder_encode,
+             METH_VARARGS | METH_KEYWORDS,
+             "encode(images, codebook, k=5)\n\n"
+             "LLC codes of dense sift of float32 gray level images of "
+             "height x width, one image or a stack of n. codebook is a "
+             "float32 ncb x 128 array. Returns the float32 codes, ncb or "
+             "n x ncb. Images of a stack are encoded in parallel."},
+            {NULL, NULL, 0, NULL}
+        };
+        static PyType_Slot slots[] = {
+            {Py_tp_doc, const_cast<char*>(
+                "ImageCoder(width=128, height=128, step=8, bin_size=16)\n\n"
+                "Locality-constrained linear coding of dense sift.")},
+            {Py_tp_init, (void*)coder_init},
+            {Py_tp_new, (void*)PyType_GenericNew},
+            {Py_tp_dealloc, (void*)coder_dealloc},
+            {Py_tp_methods, methods},
+            {0, NULL}
+        };
+        static PyType_Spec spec = {"nenese._sireen.ImageCoder",
+                                   sizeof(CoderObject), 0,
+                                   Py_TPFLAGS_DEFAULT, slots};
+        return PyType_FromSpec(&spec);
+    }
+#endif
+
+    PyModuleDef module_def = {
+        PyModuleDef_HEAD_INIT, "_sireen",
+        "Nearest neighbour search and image coding of sireen.",
+        -1, NULL, NULL, NULL, NULL, NULL
+    };
+
+    /**
+     * add a type to the module
+     *
+     * @return false with a Python exception set on failure
+     */
+    bool add_type(PyObject* module, const char* name, PyObject* type)
+    {
+        if(!type)
+            return false;
+        if(PyModule_AddObject(module, name, type) < 0)
+        {
+            Py_DECREF(type);
+            return false;
+        }
+        return true;
+    }
+}
+
+PyMODINIT_FUNC
+PyInit__sireen(void)
+{
+    PyObject* module = PyModule_Create(&module_def);
+    if(!module)
+        return NULL;
+    if(!add_type(module, "KDTree", tree_type<double>("nenese._sireen.KDTree"))
+       || !add_type(module, "KDTreeF", tree_type<float>("nenese._sireen.KDTreeF"))
+#ifndef NENESE_NO_CODER
+       || !add_type(module, "ImageCoder", coder_type())
+#endif
+       || PyModule_AddObject(module, "NO_INDEX",
+                             PyLong_FromSize_t(nnse::KDTree::NO_INDEX)) < 0)
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -1,7 +1,15 @@
 #include "sireen/nearest_neighbour.hpp"
+#include "sireen/kd_forest.hpp"
+#include "sireen/kmeans_tree.hpp"
+#include "sireen/hnsw.hpp"
+#include "sireen/ivf_pq.hpp"
+#include "sireen/knn_join.hpp"
+#include "sireen/sparse_feature.hpp"
 #include "sireen/metrics.hpp"
 #include "sireen/file_utility.hpp"
+#include <cmath>
 #include <ctime>
+#include <chrono>
 using namespace std;
 using namespace nnse;
 
@@ -18,8 +26,10 @@ int main()
     if(!myfile.is_open())
         cerr << "break file" << endl;
     size_t n_data = 400000;
-    Feature* feats = new Feature[n_data];
-    double* qu = NULL;
+    const size_t dim = 500;
+    // all features in one row-major matrix
+    double* feats = new double[n_data * dim];
+    double* qu = feats;
 
     cout << "Reading File... " << endl;
     start = clock();
@@ -32,18 +42,12 @@ int main()
         result.clear();
 
         futil::spliter_c(data_buf.c_str(),',',result);
-        double* temp = new double[500];
-        for(size_t i=0; i<500; ++i)
+        double* temp = feats + cnt * dim;
+        for(size_t i=0; i<dim; ++i)
         {
 
             temp[i] = atof(result[i].c_str());
         }
-        Feature f(temp,500,cnt);
-        if( cnt == 0)
-        {
-            qu = temp;
-        }
-        feats[cnt] = f;
         result.clear();
         // cout << "temp" << feats[0].data[150]  << endl;
 
@@ -59,14 +63,15 @@ int main()
 
 
     // initialize tree with 500 feature dimension
-    KDTree t(500);
+    KDTree t(dim);
 
     // 1. Build Tree
+    // the build runs on all threads, so the wall time is measured
     cout << "Building KD-Tree... " << endl;
-    start = clock();
+    chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
     t.build(feats,n_data);
-    cout << "Tree Built (Elasped Time:" << double(clock() -start)/CLOCKS_PER_SEC
-         << "s)"<< endl;
+    cout << "Tree Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
 
     // 2.1 basic search
     start = clock();
@@ -116,18 +121,356 @@ int main()
     }
     cout << "--------------------" << endl;
 
+    // 2.5 batched bbf search on all threads, compared with a loop of
+    // single queries. clock() adds up cpu time of all threads, so the
+    // wall time is measured here
+    const size_t n_query = 1000;
+    const size_t k = 10;
+    vector<size_t> batch_ids(n_query * k);
+    vector<double> batch_dists(n_query * k);
+    chrono::steady_clock::time_point wall = chrono::steady_clock::now();
+    for(size_t i = 0; i < n_query; ++i)
+        search_result = t.knn_bbf_opt(qu + i * dim, k, 5000);
+    double loop_time = chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count();
+    cout << "time for " << n_query << " knn_bbf_opt:" << loop_time
+         << " (" << n_query / loop_time << " queries/s)" << endl;
+
+    wall = chrono::steady_clock::now();
+    t.knn_batch(qu, n_query, k, &batch_ids[0], &batch_dists[0], 5000);
+    double batch_time = chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count();
+    cout << "time for knn_batch of " << n_query << ":" << batch_time
+         << " (" << n_query / batch_time << " queries/s, "
+         << putil::ThreadPool::global().concurrency() << " threads)" << endl;
+    // print result of the last query
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < k; ++i)
+    {
+        cout << batch_ids[(n_query - 1) * k + i] << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 2.6 k nearest within distance 0.7, the filter applied by
+    // search_nearest.py after its search
+    wall = chrono::steady_clock::now();
+    t.knn_within(qu, n_query, k, 0.7, &batch_ids[0], &batch_dists[0]);
+    cout << "time for knn_within of " << n_query << ":" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() << endl;
+    search_result = t.knn_radius(qu, 0.7, k);
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 2.7 one query after another with a context kept by this thread,
+    // no allocation after the first queries
+    KDTree::SearchContext context;
+    context.reserve(k);
+    wall = chrono::steady_clock::now();
+    for(size_t i = 0; i < n_query; ++i)
+        t.knn(qu + i * dim, k, context, &batch_ids[i * k], &batch_dists[i * k],
+              5000);
+    cout << "time per query with a context:" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() / n_query << endl;
+
+    // 2.8 sorted indices with their scores, as written by the nenese
+    // formatter, without recomputing any distance
+    vector<KDTree::Neighbour> scored = t.knn_search(qu, k, 5000, COSINE);
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < scored.size(); ++i)
+    {
+        cout << scored[i].key << ":" << scored[i].value << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 2.9 only among the active features, here one in ten, filtered
+    // in the leaf scan instead of after the search
+    BitmapFilter active(n_data);
+    for(size_t i = 0; i < n_data; i += 10)
+        active.set(i);
+    wall = chrono::steady_clock::now();
+    t.knn_batch(qu, n_query, k, &batch_ids[0], &batch_dists[0], 5000,
+                EUCLIDEAN, &active);
+    cout << "time for filtered knn_batch of " << n_query << ":"
+         << chrono::duration<double>(chrono::steady_clock::now() - wall).count()
+         << endl;
+
     // 3 Rebuild the tree
-    start = clock();
+    build_start = chrono::steady_clock::now();
     cout << "Rebuilding KD-Tree... " << endl;
     t.build(feats,n_data);
-    cout << "Tree Built (Elasped Time:" << double(clock() -start)/CLOCKS_PER_SEC
-         << "s)"<< endl;
+    cout << "Tree Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
 
-    // Finally, delete resources
+    // 4 Rebuild with split dimensions estimated on 100 features
+    build_start = chrono::steady_clock::now();
+    cout << "Rebuilding KD-Tree with sampled splits... " << endl;
+    t.set_split_sampling(100);
+    t.build(feats,n_data);
+    cout << "Tree Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    start = clock();
+    search_result = t.knn_bbf_opt(qu,10,5000);
+    cout << "time for knn_bbf_opt:" << double(clock() -start)/CLOCKS_PER_SEC << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 4.1 Save the tree, then load it by mmap as a worker process
+    // would instead of parsing and building
+    build_start = chrono::steady_clock::now();
+    t.save("test40w.kdt");
+    cout << "Tree Saved (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    KDTree loaded(dim);
+    build_start = chrono::steady_clock::now();
+    loaded.load("test40w.kdt");
+    cout << "Tree Loaded (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    start = clock();
+    search_result = loaded.knn_bbf_opt(qu,10,5000);
+    cout << "time for loaded knn_bbf_opt:" << double(clock() -start)/CLOCKS_PER_SEC << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 4.2 Update the loaded tree: the last 10000 features are removed
+    // and inserted again, as a day of catalog changes, every 100th
+    // feature is removed for good and 10000 new features between two
+    // neighbouring rows are inserted, which splits leaves
+    const size_t n_update = 10000;
+    vector<double> added(n_update * dim);
+    for(size_t i = 0; i < n_update; ++i)
+        for(size_t j = 0; j < dim; ++j)
+            added[i * dim + j] = 0.5 * (feats[i * dim + j]
+                                        + feats[(i + 1) * dim + j]);
+    wall = chrono::steady_clock::now();
+    for(size_t i = n_data - n_update; i < n_data; ++i)
+        loaded.remove(i);
+    for(size_t i = n_data - n_update; i < n_data; ++i)
+        loaded.insert(feats + i * dim, i);
+    for(size_t i = 0; i < n_data - n_update; i += 100)
+        loaded.remove(i);
+    for(size_t i = 0; i < n_update; ++i)
+        loaded.insert(&added[i * dim], n_data + i);
+    cout << "time per update:" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count()
+        / (3 * n_update + (n_data - n_update + 99) / 100) << endl;
+    search_result = loaded.knn_bbf_opt(qu,10,5000);
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // the updated tree, and the same tree saved and loaded again with
+    // its removed rows, must find the neighbours of an exact search
+    // in a tree built over the live features only
+    {
+        vector<size_t> live_ids;
+        vector<bool> live(n_data + n_update, false);
+        for(size_t i = 0; i < n_data; ++i)
+            if(i % 100 != 0 || i >= n_data - n_update)
+                live_ids.push_back(i);
+        for(size_t i = 0; i < n_update; ++i)
+            live_ids.push_back(n_data + i);
+        double* live_feats = new double[live_ids.size() * dim];
+        for(size_t i = 0; i < live_ids.size(); ++i)
+        {
+            const size_t id = live_ids[i];
+            const double* src = id < n_data ? feats + id * dim
+                : &added[(id - n_data) * dim];
+            copy(src, src + dim, live_feats + i * dim);
+            live[id] = true;
+        }
+        KDTree fresh(dim);
+        fresh.build(live_feats, live_ids.size(), false);
+
+        loaded.save("test40w_updated.kdt");
+        KDTree reloaded(dim);
+        reloaded.load("test40w_updated.kdt");
+
+        vector<size_t> fresh_ids(n_query * k);
+        vector<double> fresh_dists(n_query * k);
+        fresh.knn_batch(qu, n_query, k, &fresh_ids[0], &fresh_dists[0], 0);
+        size_t mismatches = 0;
+        if(loaded.size() != live_ids.size()
+           || reloaded.size() != live_ids.size())
+        {
+            cerr << "updated tree holds " << loaded.size()
+                 << " features, reloaded " << reloaded.size()
+                 << ", expected " << live_ids.size() << endl;
+            ++mismatches;
+        }
+        KDTree* updated[] = {&loaded, &reloaded};
+        for(size_t u = 0; u < 2; ++u)
+        {
+            updated[u]->knn_batch(qu, n_query, k, &batch_ids[0],
+                                    &batch_dists[0], 0);
+            // ties may come in any order, so the distances are
+            // compared and the ids only checked to be live
+            for(size_t i = 0; i < n_query * k; ++i)
+            {
+                if(fabs(batch_dists[i] - fresh_dists[i])
+                   > 1e-9 * max(1.0, fresh_dists[i])
+                   || batch_ids[i] >= live.size() || !live[batch_ids[i]])
+                    ++mismatches;
+            }
+        }
+        delete [] live_feats;
+        cout << "updated knn_batch against a fresh tree: " << mismatches
+             << " mismatches" << endl;
+        if(mismatches > 0)
+        {
+            cerr << "updated tree differs from a fresh tree over the "
+                 << "live features" << endl;
+            delete [] feats;
+            return 1;
+        }
+    }
+
+    // 5 Forest of 4 randomized trees sharing the feature matrix, the
+    // forest never re-orders it so it is not copied
+    KDForest forest(dim, 4);
+    build_start = chrono::steady_clock::now();
+    cout << "Building KD-Forest... " << endl;
+    forest.build(feats, n_data, false);
+    cout << "Forest Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    start = clock();
+    search_result = forest.knn_bbf_opt(qu,10,5000);
+    cout << "time for forest knn_bbf_opt:" << double(clock() -start)/CLOCKS_PER_SEC << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 6 Hierarchical k-means tree of 32 branches, built on a copy
+    KMeansTree kmeans_tree(dim, 32);
+    build_start = chrono::steady_clock::now();
+    cout << "Building K-Means Tree... " << endl;
+    kmeans_tree.build(feats, n_data);
+    cout << "Tree Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    start = clock();
+    search_result = kmeans_tree.knn_bbf_opt(qu,10,5000);
+    cout << "time for k-means tree knn_bbf_opt:" << double(clock() -start)/CLOCKS_PER_SEC << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 7 HNSW graph with M = 16 and efConstruction = 200, top 60 as
+    // the similar image lookup
+    HNSW graph(dim, 16, 200);
+    build_start = chrono::steady_clock::now();
+    cout << "Building HNSW... " << endl;
+    graph.build(feats, n_data, false);
+    cout << "Graph Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    graph.set_ef_search(100);
+    wall = chrono::steady_clock::now();
+    for(size_t i = 0; i < n_query; ++i)
+        search_result = graph.knn(qu + i * dim, 60);
+    cout << "time per query for hnsw knn of top 60:" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() / n_query << endl;
+    search_result = graph.knn(qu,10);
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 8 IVF-PQ of 1024 lists and 32 bytes per feature, the features
+    // are kept to re-rank the best 100 candidates
+    IVFPQ ivf_pq(dim, 1024, 32);
+    build_start = chrono::steady_clock::now();
+    cout << "Building IVF-PQ... " << endl;
+    ivf_pq.build(feats, n_data, true);
+    cout << "Index Built (Elasped Time:" << chrono::duration<double>(
+        chrono::steady_clock::now() - build_start).count() << "s)"<< endl;
+    ivf_pq.set_n_probe(16);
+    ivf_pq.set_rerank(100);
+    wall = chrono::steady_clock::now();
+    ivf_pq.knn_batch(qu, n_query, k, &batch_ids[0], &batch_dists[0]);
+    cout << "time for ivf-pq knn_batch:" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() << endl;
+    search_result = ivf_pq.knn(qu,10);
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < search_result.size(); ++i)
+    {
+        cout << search_result[i].index << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 9 exact kNN join of the queries against all features, the batch
+    // job of nenese without the pairwise matrix
+    KNNJoin knn_join(dim, k);
+    wall = chrono::steady_clock::now();
+    knn_join.join(qu, n_query, feats, n_data, &batch_ids[0], &batch_dists[0]);
+    cout << "time for knn join of " << n_query << ":" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < k; ++i)
+    {
+        cout << batch_ids[i] << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // 10 the llc codes kept sparse, 8-bit values, and searched by
+    // cosine similarity through the inverted index of codebook entries
+    SparseMatrixQ8 codes(dim);
+    SparseMatrix sparse_qu(dim);
+    vector<float> row(dim);
     for(size_t i = 0; i < n_data; ++i)
     {
-        delete [] feats[i].data;
+        copy(feats + i * dim, feats + (i + 1) * dim, row.begin());
+        codes.append(&row[0]);
+        if(i < n_query)
+            sparse_qu.append(&row[0]);
     }
+    cout << "non-zeros per feature:" << double(codes.nnz()) / n_data
+         << ", bytes:" << codes.memory() << endl;
+    SparseIndexQ8 sparse_index(COSINE);
+    sparse_index.build(codes);
+    vector<float> sparse_scores(n_query * k);
+    wall = chrono::steady_clock::now();
+    sparse_index.knn_batch(sparse_qu, k, &batch_ids[0], &sparse_scores[0]);
+    cout << "time for sparse knn_batch:" << chrono::duration<double>(
+        chrono::steady_clock::now() - wall).count() << endl;
+    // print result
+    cout << "--------------------\n" << "Results:"<< endl;
+    for(size_t i = 0; i < k; ++i)
+    {
+        cout << batch_ids[i] << ":" << sparse_scores[i] << endl;
+    }
+    cout << "--------------------" << endl;
+
+    // Finally, delete resources
     delete [] feats;
 
 
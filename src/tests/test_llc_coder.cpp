@@ -79,6 +79,51 @@ int main(int argc, char * argv[])
         cout << "time test:" << float(clock() -start)/CLOCKS_PER_SEC << endl;
         // cout << llc_test<<endl;
     }
+
+    // time of each encoding stage, dense sift of the test images
+    const int n_rounds = 50;
+    ImageCoder stage_coder;
+    for(int r = 0; r < n_rounds; ++r)
+    {
+        for(int i = 0; i < 6; ++i)
+        {
+            Mat src_new = imread(prefix+images[i],0);
+            if(!src_new.data)
+                continue;
+            stage_coder.llc_dense_sift(src_new, codebook, 500, 5);
+        }
+    }
+    const EncodeTimes& times = stage_coder.encode_times();
+    if(times.images > 0)
+    {
+        const double ms = 1000.0 / times.images;
+        cout << "stage times per image (ms) over " << times.images
+             << " images:" << endl;
+        cout << "\tdescriptor:" << times.descriptor * ms << endl;
+        cout << "\tdistance:" << times.distance * ms << endl;
+        cout << "\tselection:" << times.selection * ms << endl;
+        cout << "\tsolve:" << times.solve * ms << endl;
+        cout << "\tpooling:" << times.pooling * ms << endl;
+    }
+
+    // time of the llc solve for the k with fixed-size solvers, and a
+    // k solved by the general decomposition
+    const int solve_k[] = {3, 5, 10, 7};
+    for(int t = 0; t < 4; ++t)
+    {
+        ImageCoder k_coder;
+        for(int i = 0; i < 6; ++i)
+        {
+            Mat src_new = imread(prefix+images[i],0);
+            if(!src_new.data)
+                continue;
+            k_coder.llc_dense_sift(src_new, codebook, 500, solve_k[t]);
+        }
+        const EncodeTimes& k_times = k_coder.encode_times();
+        if(k_times.images > 0)
+            cout << "solve time per image (ms), k = " << solve_k[t] << ":"
+                 << k_times.solve * 1000.0 / k_times.images << endl;
+    }
     delete [] codebook;
     string directory = "/home/bingqingqu/TAOCP/Datasets/test/";
     vector<string> files_in_dir;